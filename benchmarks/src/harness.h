@@ -0,0 +1,215 @@
+// A small benchmark harness.
+//
+// A benchmark is a named function that reports one or more metrics. Micro
+// benchmarks time an operation with `time_op`, which repeats it in growing
+// batches until enough time has passed to trust the mean. Macro benchmarks
+// measure whatever they need and report it the same way, and
+// `allocations_per_op` counts what an operation allocates. Results print as
+// a table, and as JSON for tracking over time.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <initializer_list>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "cpu_features.h"
+
+namespace bench
+{
+    struct Result
+    {
+        std::string name;
+        /// @brief Metric name and value, in the order reported
+        std::vector<std::pair<std::string, double>> metrics {};
+
+        Result& add(std::string metric, double value)
+        {
+            metrics.emplace_back(std::move(metric), value);
+            return *this;
+        }
+    };
+
+    struct Options
+    {
+        /// @brief Only run benchmarks whose name contains this, or report
+        /// results whose name contains it from the benchmark it starts with
+        /// (e.g. "echo/reply" from "echo")
+        std::string filter;
+        /// @brief Least time to spend timing each micro benchmark
+        std::chrono::milliseconds min_time {300};
+        /// @brief Stream counts for the macro benchmarks
+        std::vector<size_t> stream_counts {1, 16, 64, 256};
+        /// @brief How long each macro benchmark runs for
+        std::chrono::seconds stream_duration {3};
+    };
+
+    inline volatile uint64_t kept = 0;
+
+    /// @brief Fold `value` into a volatile, so the compiler can't discard the work that made it
+    inline void keep(uint64_t value) { kept = kept + value; }
+
+    /// @brief Heap allocations made so far, counted by the replacement
+    /// `operator new` in main.cpp
+    inline std::atomic<uint64_t> allocations {0};
+
+    /// @brief Mean heap allocations made by one call of `op`, over `iterations` calls
+    template <typename Op>
+    double allocations_per_op(Op&& op, uint64_t iterations = 1000)
+    {
+        // Warm up first, like `time_op`, so lazily built state isn't counted
+        op();
+
+        auto before = allocations.load(std::memory_order_relaxed);
+        for (uint64_t i = 0; i < iterations; i++)
+            op();
+        return (double)(allocations.load(std::memory_order_relaxed) - before) / (double)iterations;
+    }
+
+    struct OpTiming
+    {
+        uint64_t iterations = 0;
+        double ns_per_op = 0;
+    };
+
+    /// @brief Time `op`, repeated until `min_time` has passed
+    template <typename Op>
+    OpTiming time_op(std::chrono::nanoseconds min_time, Op&& op)
+    {
+        // Warm caches and any lazily built state first
+        op();
+
+        uint64_t batch = 1;
+        while (true)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for (uint64_t i = 0; i < batch; i++)
+                op();
+            auto elapsed = std::chrono::steady_clock::now() - start;
+
+            if (elapsed >= min_time)
+                return OpTiming {batch, (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / (double)batch};
+
+            // Aim straight for the target once there's a usable estimate
+            auto ns = std::max<int64_t>(1, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+            batch = std::max(batch * 2, (uint64_t)((double)batch * (double)min_time.count() * 1.2 / (double)ns));
+        }
+    }
+
+    class Suite
+    {
+    public:
+        using Run = std::function<void(const Options&, std::vector<Result>& results)>;
+
+        /// @param name Prefix of every result the benchmark reports; what `filter` matches first
+        void add(std::string name, Run run) { benchmarks.push_back({std::move(name), std::move(run)}); }
+
+        /// @return Every result reported; none if nothing matched `filter`
+        std::vector<Result> run(const Options& options)
+        {
+            std::vector<Result> results;
+            for (auto& [name, benchmark] : benchmarks)
+            {
+                auto& filter = options.filter;
+                auto whole = filter.empty() || name.find(filter) != std::string::npos;
+                auto narrowed = !whole && filter.compare(0, name.size() + 1, name + "/") == 0;
+                if (!whole && !narrowed)
+                    continue;
+
+                auto first = results.size();
+                benchmark(options, results);
+                if (narrowed)
+                {
+                    auto unmatched = [&](const Result& result) { return result.name.find(filter) == std::string::npos; };
+                    results.erase(std::remove_if(results.begin() + (ptrdiff_t)first, results.end(), unmatched), results.end());
+                }
+                for (auto i = first; i < results.size(); i++)
+                    print(results[i]);
+                fflush(stdout);
+            }
+            return results;
+        }
+
+    private:
+        static void print(const Result& result)
+        {
+            printf("%-48s", result.name.c_str());
+            for (auto& [metric, value] : result.metrics)
+                printf(" %s=%.4g", metric.c_str(), value);
+            printf("\n");
+        }
+
+        std::vector<std::pair<std::string, Run>> benchmarks;
+    };
+
+    /// @brief Escape `text` for a JSON string
+    inline std::string json_string(const std::string& text)
+    {
+        std::string out = "\"";
+        for (auto c : text)
+        {
+            if (c == '"' || c == '\\')
+                out += '\\';
+            out += c;
+        }
+        return out + "\"";
+    }
+
+    /// @brief Write `results` as JSON, with the CPU features they ran with
+    inline bool write_json(FILE* file, const std::vector<Result>& results)
+    {
+        const auto& features = cpu::features();
+        fprintf(
+            file,
+            "{\n  \"cpu\": {\"sse2\": %s, \"sse41\": %s, \"avx2\": %s, \"neon\": %s},\n  \"results\": [",
+            features.sse2 ? "true" : "false",
+            features.sse41 ? "true" : "false",
+            features.avx2 ? "true" : "false",
+            features.neon ? "true" : "false");
+
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            fprintf(file, "%s\n    {\"name\": %s, \"metrics\": {", i ? "," : "", json_string(results[i].name).c_str());
+            for (size_t m = 0; m < results[i].metrics.size(); m++)
+            {
+                fprintf(
+                    file,
+                    "%s%s: %.9g",
+                    m ? ", " : "",
+                    json_string(results[i].metrics[m].first).c_str(),
+                    results[i].metrics[m].second);
+            }
+            fprintf(file, "}}");
+        }
+
+        fprintf(file, "\n  ]\n}\n");
+        return ferror(file) == 0;
+    }
+
+    /// @brief Of the instruction set levels a module has kernels for
+    /// ("scalar", "sse2", "sse41", "avx2", "neon"), those this CPU can run,
+    /// each with the features capped to it
+    inline std::vector<std::pair<std::string, cpu::Features>> feature_levels(std::initializer_list<const char*> levels)
+    {
+        auto detected = cpu::detect_features();
+        std::vector<std::pair<std::string, cpu::Features>> runnable;
+        for (auto level : levels)
+        {
+            auto name = std::string(level);
+            if (name == "scalar")
+                runnable.emplace_back(name, cpu::Features {});
+            else if ((name == "sse2" && detected.sse2) || (name == "sse41" && detected.sse41))
+                runnable.emplace_back(name, cpu::cap_features(detected, level));
+            else if ((name == "avx2" && detected.avx2) || (name == "neon" && detected.neon))
+                runnable.emplace_back(name, detected);
+        }
+        return runnable;
+    }
+} // namespace bench
@@ -0,0 +1,117 @@
+// Benchmarks for both examples that run anywhere: no Rainway SDK and no GPU,
+// with stand-ins for OutboundStream and DataChannel. Use it as:
+//
+//     benchmarks [--filter text] [--json path] [--min-time ms]
+//                [--streams 1,16,64,256] [--seconds 3]
+//
+// `--filter` runs only the benchmarks whose name contains the text (e.g.
+// "frame/convert", "streams", "sessions"), or narrows one down to the results
+// whose name contains it (e.g. "echo/reply/64"); it's an error for nothing to match. `--json` also writes the results, with the
+// CPU features they ran with, to `path` ("-" for stdout) so they can be
+// tracked from run to run.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+
+#include "harness.h"
+#include "micro.h"
+#include "sessions.h"
+#include "streams.h"
+
+// Count every allocation, for `bench::allocations_per_op`; the nothrow and
+// array forms call this one
+void* operator new(size_t size)
+{
+    bench::allocations.fetch_add(1, std::memory_order_relaxed);
+    if (auto p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc {};
+}
+
+void operator delete(void* p) noexcept { free(p); }
+
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+int main(int argc, const char* argv[])
+{
+    auto options = bench::Options {};
+    std::string json_path;
+
+    for (int i = 1; i < argc; i++)
+    {
+        auto arg = std::string(argv[i]);
+        auto value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (value == nullptr)
+        {
+            printf("Usage: %s [--filter text] [--json path] [--min-time ms] [--streams 1,16,64,256] [--seconds 3]\n", argv[0]);
+            return 1;
+        }
+        i++;
+
+        if (arg == "--filter")
+        {
+            options.filter = value;
+        }
+        else if (arg == "--json")
+        {
+            json_path = value;
+        }
+        else if (arg == "--min-time")
+        {
+            options.min_time = std::chrono::milliseconds(std::max(1, atoi(value)));
+        }
+        else if (arg == "--seconds")
+        {
+            options.stream_duration = std::chrono::seconds(std::max(1, atoi(value)));
+        }
+        else if (arg == "--streams")
+        {
+            options.stream_counts.clear();
+            for (auto count = strtok(const_cast<char*>(value), ","); count; count = strtok(nullptr, ","))
+                options.stream_counts.push_back((size_t)std::max(1, atoi(count)));
+        }
+        else
+        {
+            printf("Error. Unknown option %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    auto suite = bench::Suite {};
+    bench::add_micro_benchmarks(suite);
+    bench::add_stream_benchmarks(suite);
+    bench::add_session_benchmarks(suite);
+
+    auto results = suite.run(options);
+    if (results.empty())
+    {
+        printf("Error. No benchmark matches --filter %s\n", options.filter.c_str());
+        return 1;
+    }
+
+    if (!json_path.empty())
+    {
+        auto file = json_path == "-" ? stdout : fopen(json_path.c_str(), "w");
+        if (!file)
+        {
+            printf("Error. Failed to open %s\n", json_path.c_str());
+            return 1;
+        }
+
+        auto written = bench::write_json(file, results);
+        if (file != stdout)
+            written = fclose(file) == 0 && written;
+        if (!written)
+        {
+            printf("Error. Failed to write %s\n", json_path.c_str());
+            return 1;
+        }
+    }
+
+    return 0;
+}
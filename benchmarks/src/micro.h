@@ -0,0 +1,470 @@
+// Micro benchmarks for the hot paths of both examples: the echo reply, the
+// audio resample and packetize path, frame conversion, change detection,
+// scaling and copies, the pacer's own overhead, the log call and the metric
+// record.
+//
+// Kernels with SIMD variants run once per instruction set this CPU has, so
+// a regression in one shows up against the others.
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "async_log.h"
+#include "audio_packetizer.h"
+#include "batch_sender.h"
+#include "color_convert.h"
+#include "echo.h"
+#include "frame_changes.h"
+#include "harness.h"
+#include "metrics.h"
+#include "pacer.h"
+#include "resampler.h"
+#include "scaler.h"
+#include "stand_ins.h"
+
+namespace bench
+{
+    /// @brief `size` bytes of a non-constant pattern
+    inline std::vector<uint8_t> pattern(size_t size)
+    {
+        std::vector<uint8_t> bytes(size);
+        for (size_t i = 0; i < size; i++)
+            bytes[i] = (uint8_t)(i * 31 + (i >> 8));
+        return bytes;
+    }
+
+    inline void echo_benchmarks(const Options& options, std::vector<Result>& results)
+    {
+        using Kernel = std::pair<const char*, echo::ReverseCopyFn>;
+        std::vector<Kernel> kernels {{"scalar", echo::reverse_copy_scalar}};
+        auto detected = cpu::detect_features();
+#if defined(CPU_X86)
+        if (detected.sse2)
+            kernels.emplace_back("sse2", echo::reverse_copy_sse2);
+        if (detected.avx2)
+            kernels.emplace_back("avx2", echo::reverse_copy_avx2);
+#elif defined(CPU_NEON)
+        if (detected.neon)
+            kernels.emplace_back("neon", echo::reverse_copy_neon);
+#endif
+        (void)detected;
+
+        // A short command, a typical MTU-sized message and a bulk transfer
+        for (size_t size : {64, 1500, 65536})
+        {
+            auto src = pattern(size);
+            std::vector<uint8_t> dst(size);
+            for (auto& [name, kernel] : kernels)
+            {
+                auto timing = time_op(options.min_time, [&]() {
+                    kernel(src.data(), dst.data(), size);
+                    keep(dst[0]);
+                });
+                results.push_back(Result {"echo/reverse_copy/" + std::to_string(size) + "/" + name}
+                                      .add("ns_per_op", timing.ns_per_op)
+                                      .add("gb_per_s", (double)size / timing.ns_per_op));
+            }
+        }
+
+        // The whole reply, for each message size: the original handler's
+        // copy into a new vector, std::reverse and Send, against the handler's
+        // `EchoChannel`, the SIMD reverse into a pooled buffer sent through
+        // the channel's `BatchSender` (straight away, and with coalescing on)
+        auto flusher = batch::Flusher {};
+        for (size_t size : {64, 1500, 65536})
+        {
+            auto message = pattern(size);
+            auto channel = standin::DataChannel {};
+            auto original = [&]() {
+                std::vector<uint8_t> input(message.data(), message.data() + size);
+                std::reverse(input.begin(), input.end());
+                channel.Send(input);
+            };
+            auto baseline = time_op(options.min_time, original);
+            results.push_back(Result {"echo/reply/" + std::to_string(size) + "/baseline"}
+                                  .add("ns_per_op", baseline.ns_per_op)
+                                  .add("allocations_per_op", allocations_per_op(original)));
+
+            for (auto coalesce : {false, true})
+            {
+                auto config = batch::SenderConfig {};
+                config.coalesce = coalesce;
+                auto sent = standin::DataChannel {};
+                auto replies = std::make_shared<batch::BatchSender<standin::DataChannelHandle>>(standin::DataChannelHandle {&sent}, flusher, config);
+                auto echoes = echo::EchoChannel {};
+
+                uint64_t calls = 0;
+                auto reply = [&]() {
+                    echoes.reply(*replies, message.data(), size);
+                    calls++;
+                };
+                auto timing = time_op(options.min_time, reply);
+                auto allocations = allocations_per_op(reply);
+                replies->flush_now();
+                replies->close();
+
+                results.push_back(Result {"echo/reply/" + std::to_string(size) + "/pooled" + (coalesce ? "/coalesced" : "")}
+                                      .add("ns_per_op", timing.ns_per_op)
+                                      .add("allocations_per_op", allocations)
+                                      .add("messages_per_send", (double)calls / (double)std::max<uint64_t>(sent.messages.load(), 1)));
+            }
+        }
+    }
+
+    inline void resample_benchmarks(const Options& options, std::vector<Result>& results)
+    {
+        const auto channels = 2;
+        const auto block = 480; // 10ms at 48kHz
+
+        // A 1kHz tone, so the filters work on realistic data
+        const auto pi = 3.14159265358979323846;
+        std::vector<int16_t> input(block * channels);
+        for (size_t i = 0; i < block; i++)
+            input[i * channels] = input[i * channels + 1] = (int16_t)(12000 * std::sin(2 * pi * 1000 * i / 48000.0));
+        std::vector<int16_t> output(block * channels);
+
+        using Quality = audio::ResamplerQuality;
+        for (auto [quality, quality_name] : {std::pair {Quality::Fast, "fast"}, {Quality::High, "high"}, {Quality::Best, "best"}})
+        {
+            for (auto& [level, features] : feature_levels({"scalar", "sse2", "avx2", "neon"}))
+            {
+                auto resampler = audio::Resampler {48000, 44100, channels, quality, audio::select_dot(features)};
+                auto timing = time_op(options.min_time, [&]() {
+                    resampler.push(input.data(), block);
+                    keep(resampler.pull(output.data(), block));
+                });
+                results.push_back(Result {"audio/resample/48000_to_44100/" + std::string(quality_name) + "/" + level}
+                                      .add("ns_per_10ms", timing.ns_per_op)
+                                      .add("realtime_x", 1e7 / timing.ns_per_op));
+            }
+        }
+    }
+
+    inline void packetize_benchmarks(const Options& options, std::vector<Result>& results)
+    {
+        // Decoder-sized chunks cut into SDK packets, as every stream does
+        const auto rate = 44100u;
+        const auto chunk = 1024;
+        std::vector<int16_t> pcm(chunk * 2, 1);
+
+        for (uint32_t packet_ms : {10, 20})
+        {
+            auto packets = audio::Packetizer {rate, 2, packet_ms};
+            uint64_t position = 0;
+            auto timing = time_op(options.min_time, [&]() {
+                auto timestamp = (int64_t)(position * 10000000 / rate);
+                packets.push(pcm.data(), chunk, timestamp, [](const int16_t* samples, size_t frames, int64_t) { keep(samples[0] + frames); });
+                position += chunk;
+            });
+            results.push_back(Result {"audio/packetize/" + std::to_string(packet_ms) + "ms"}
+                                  .add("ns_per_chunk", timing.ns_per_op)
+                                  .add("ns_per_frame", timing.ns_per_op / chunk));
+        }
+    }
+
+    struct Size
+    {
+        const char* name;
+        uint32_t width;
+        uint32_t height;
+    };
+
+    inline void change_benchmarks(const Options& options, std::vector<Result>& results)
+    {
+        for (auto size : {Size {"1080p", 1920, 1080}, Size {"2160p", 3840, 2160}})
+        {
+            // A frame, the same frame with one pixel changed, and a different frame
+            auto frame = pattern((size_t)size.width * size.height * 4);
+            auto touched = frame;
+            touched[((size_t)size.height / 2 * size.width + size.width / 2) * 4] ^= 0xff;
+            auto other = frame;
+            for (auto& byte : other)
+                byte = (uint8_t)~byte;
+
+            for (auto& [level, features] : feature_levels({"scalar", "neon"}))
+            {
+                auto compare = change::select_row_equal(features);
+                auto time_changes = [&](const std::vector<uint8_t>& next) {
+                    auto detector = change::TileDetector {compare};
+                    auto flip = false;
+                    return time_op(options.min_time, [&]() {
+                        // Alternate with the frame, so every update compares against it
+                        const auto& shown = flip ? next : frame;
+                        flip = !flip;
+                        keep(detector.update(change::bgra_picture(shown.data(), (size_t)size.width * 4, size.width, size.height)));
+                    });
+                };
+
+                auto still = time_changes(frame);
+                auto one_tile = time_changes(touched);
+                auto all = time_changes(other);
+                for (auto [what, timing] : {std::pair {"unchanged", still}, {"one_tile", one_tile}, {"all_tiles", all}})
+                {
+                    results.push_back(Result {"frame/changes/" + std::string(what) + "/" + size.name + "/" + level}
+                                          .add("ms_per_frame", timing.ns_per_op / 1e6)
+                                          .add("gb_per_s", (double)frame.size() / timing.ns_per_op));
+                }
+            }
+        }
+    }
+
+    inline void convert_benchmarks(const Options& options, std::vector<Result>& results)
+    {
+        for (auto size : {Size {"1080p", 1920, 1080}, Size {"2160p", 3840, 2160}})
+        {
+            auto luma = pattern((size_t)size.width * size.height);
+            auto chroma = pattern((size_t)size.width * size.height / 2);
+            std::vector<uint8_t> bgra((size_t)size.width * size.height * 4);
+            auto k = color::coefficients(color::Matrix::Bt709, color::Range::Limited);
+            auto half = size.width / 2;
+
+            for (auto& [level, features] : feature_levels({"scalar", "sse41", "avx2", "neon"}))
+            {
+                auto kernels = color::select_kernels(features);
+                auto i420 = time_op(options.min_time, [&]() {
+                    for (uint32_t line = 0; line < size.height; line++)
+                    {
+                        auto u = chroma.data() + line / 2 * half;
+                        auto v = u + (size_t)half * size.height / 2;
+                        kernels.i420(luma.data() + (size_t)line * size.width, u, v, bgra.data() + (size_t)line * size.width * 4, size.width, k);
+                    }
+                    keep(bgra[0]);
+                });
+                auto nv12 = time_op(options.min_time, [&]() {
+                    for (uint32_t line = 0; line < size.height; line++)
+                    {
+                        auto uv = chroma.data() + line / 2 * size.width;
+                        kernels.nv12(luma.data() + (size_t)line * size.width, uv, nullptr, bgra.data() + (size_t)line * size.width * 4, size.width, k);
+                    }
+                    keep(bgra[0]);
+                });
+
+                for (auto [format, timing] : {std::pair {"i420", i420}, {"nv12", nv12}})
+                {
+                    results.push_back(Result {"frame/convert/" + std::string(format) + "_to_bgra/" + size.name + "/" + level}
+                                          .add("ms_per_frame", timing.ns_per_op / 1e6)
+                                          .add("gb_per_s", (double)bgra.size() / timing.ns_per_op));
+                }
+            }
+        }
+    }
+
+    inline void scale_benchmarks(const Options& options, std::vector<Result>& results)
+    {
+        struct Case
+        {
+            Size from;
+            Size to;
+        };
+
+        for (auto c : {Case {{"2160p", 3840, 2160}, {"1080p", 1920, 1080}}, Case {{"1080p", 1920, 1080}, {"720p", 1280, 720}}})
+        {
+            auto src = pattern((size_t)c.from.width * c.from.height * 4);
+            std::vector<uint8_t> dst((size_t)c.to.width * c.to.height * 4);
+
+            for (auto [filter, filter_name] : {std::pair {scale::Filter::Bilinear, "bilinear"}, {scale::Filter::Area, "area"}})
+            {
+                for (auto& [level, features] : feature_levels({"scalar", "sse41", "avx2", "neon"}))
+                {
+                    auto scaler = scale::Scaler {c.from.width, c.from.height, c.to.width, c.to.height, filter, scale::select_kernels(features)};
+                    auto timing = time_op(options.min_time, [&]() {
+                        scaler.run(src.data(), (size_t)c.from.width * 4, dst.data(), (size_t)c.to.width * 4);
+                        keep(dst[0]);
+                    });
+                    results.push_back(Result {"frame/scale/" + std::string(c.from.name) + "_to_" + c.to.name + "/" + filter_name + "/" + level}
+                                          .add("ms_per_frame", timing.ns_per_op / 1e6));
+                }
+            }
+        }
+    }
+
+    inline void copy_benchmarks(const Options& options, std::vector<Result>& results)
+    {
+        // What a CPU-side frame copy costs; the floor for any conversion above
+        for (auto size : {Size {"1080p", 1920, 1080}, Size {"2160p", 3840, 2160}})
+        {
+            auto src = pattern((size_t)size.width * size.height * 4);
+            std::vector<uint8_t> dst(src.size());
+            auto timing = time_op(options.min_time, [&]() {
+                memcpy(dst.data(), src.data(), src.size());
+                keep(dst[0]);
+            });
+            results.push_back(Result {"frame/copy/bgra/" + std::string(size.name)}
+                                  .add("ms_per_frame", timing.ns_per_op / 1e6)
+                                  .add("gb_per_s", (double)src.size() / timing.ns_per_op));
+        }
+    }
+
+    inline void pacing_benchmarks(const Options& options, std::vector<Result>& results)
+    {
+        // The pacer's bookkeeping alone: a fake clock makes every sleep and spin instant
+        {
+            auto clock = pacing::FakeClock {};
+            clock.spin_step = std::chrono::milliseconds(1);
+            auto pacer = pacing::FramePacer<pacing::FakeClock> {clock};
+            pacer.start();
+            int64_t timestamp = 0;
+            auto timing = time_op(options.min_time, [&]() {
+                timestamp += 166667;
+                keep((uint64_t)pacer.wait_until(pacing::MediaDuration {timestamp}).count());
+            });
+            results.push_back(Result {"pacing/overhead/fake_clock"}.add("ns_per_wait", timing.ns_per_op));
+        }
+
+        // Real waits at 2ms intervals: how late the OS and the spin leave us
+        {
+            auto clock = pacing::SteadyClock {};
+            auto pacer = pacing::FramePacer<> {clock};
+            metrics::Histogram errors;
+            const auto interval = 20000; // 2ms
+            auto waits = std::max<int64_t>(50, options.min_time.count() / 2);
+
+            auto cpu_start = std::clock();
+            pacer.start();
+            for (int64_t i = 1; i <= waits; i++)
+                errors.record(pacer.wait_until(pacing::MediaDuration {i * interval}));
+            auto cpu = (double)(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+
+            auto error = errors.snapshot();
+            results.push_back(Result {"pacing/wait_error/steady_clock_2ms"}
+                                  .add("p50_us", error.percentile(0.5) / 1e3)
+                                  .add("p99_us", error.percentile(0.99) / 1e3)
+                                  .add("p999_us", error.percentile(0.999) / 1e3)
+                                  .add("cpu_pct", 100.0 * cpu / (waits * 0.002)));
+        }
+    }
+
+    using LogSink = std::function<void(logging::Level level, const char* target, const char* message)>;
+
+    /// @brief Log from `threads` threads through `sink`, timing every call
+    inline metrics::HistogramSnapshot log_call_latency(const LogSink& sink, size_t threads, size_t calls)
+    {
+        const std::string long_message = "Sent video frame: encoder queue depth 3, bitrate 8421 kbps, rtt 12.4 ms, "
+                                         "loss 0.01%, keyframe interval 120, resolution 1920x1080, frame 123456";
+
+        metrics::Histogram latencies;
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < threads; t++)
+        {
+            workers.emplace_back([&, t]() {
+                char message[256];
+                for (size_t i = 0; i < calls; i++)
+                {
+                    // Distinct messages, so the logger's repeat limit doesn't flatter it
+                    if (i % 4 == 0)
+                        snprintf(message, sizeof(message), "%s #%zu", long_message.c_str(), i);
+                    else
+                        snprintf(message, sizeof(message), "tick %zu on thread %zu", i, t);
+
+                    auto start = std::chrono::steady_clock::now();
+                    sink(logging::Level::Debug, "rainway::media", message);
+                    latencies.record(std::chrono::steady_clock::now() - start);
+
+                    // Roughly the rate a busy SDK logs at, rather than a tight loop
+                    if (i % 8 == 7)
+                        std::this_thread::sleep_for(std::chrono::microseconds(100));
+                }
+            });
+        }
+        for (auto& worker : workers)
+            worker.join();
+
+        return latencies.snapshot();
+    }
+
+    inline void log_benchmarks(const Options&, std::vector<Result>& results)
+    {
+        // Every sink writes to /dev/null; a real file or terminal makes the
+        // synchronous ones slower still
+        const auto path = "/dev/null";
+        const size_t threads = 4;
+        const size_t calls = 5000;
+
+        auto report = [&](const char* name, const metrics::HistogramSnapshot& latency) {
+            results.push_back(Result {std::string("log/call/") + name}
+                                  .add("p50_ns", (double)latency.percentile(0.5))
+                                  .add("p99_ns", (double)latency.percentile(0.99))
+                                  .add("p999_ns", (double)latency.percentile(0.999)));
+        };
+
+        if (auto file = fopen(path, "w"))
+        {
+            // The video player's old sink
+            report("printf", log_call_latency([&](logging::Level level, const char* target, const char* message) {
+                fprintf(file, "[RW] (%8s) %s: %s\n", logging::to_string(level), target, message);
+            }, threads, calls));
+            fclose(file);
+        }
+
+        {
+            // The host example's old sink, which flushes every line
+            std::ofstream file(path);
+            report("iostream_endl", log_call_latency([&](logging::Level level, const char* target, const char* message) {
+                file << logging::to_string(level) << " [" << target << "] " << message << std::endl;
+            }, threads, calls));
+        }
+
+        if (auto file = fopen(path, "w"))
+        {
+            auto config = logging::LoggerConfig {};
+            config.level = logging::Level::Debug;
+            auto logger = logging::Logger {config, logging::default_format, [&](const char* data, size_t size) {
+                fwrite(data, 1, size, file);
+                fflush(file);
+            }};
+            logger.start();
+
+            auto async = results.size();
+            report("async", log_call_latency([&](logging::Level level, const char* target, const char* message) {
+                logger.write(level, target, message);
+            }, threads, calls));
+
+            // Below the threshold, nothing is copied
+            report("async_filtered", log_call_latency([&](logging::Level, const char* target, const char* message) {
+                logger.write(logging::Level::Trace, target, message);
+            }, threads, calls));
+
+            logger.stop();
+            fclose(file);
+
+            results[async].add("dropped", (double)logger.stats().dropped);
+        }
+    }
+
+    inline void metric_benchmarks(const Options& options, std::vector<Result>& results)
+    {
+        metrics::Histogram histogram;
+        uint64_t value = 12345;
+        auto timing = time_op(options.min_time, [&]() {
+            value = value * 6364136223846793005ull + 1442695040888963407ull;
+            histogram.record(value >> 40);
+        });
+        results.push_back(Result {"metrics/histogram_record"}.add("ns_per_op", timing.ns_per_op));
+    }
+
+    inline void add_micro_benchmarks(Suite& suite)
+    {
+        suite.add("echo", echo_benchmarks);
+        suite.add("audio/resample", resample_benchmarks);
+        suite.add("audio/packetize", packetize_benchmarks);
+        suite.add("frame/convert", convert_benchmarks);
+        suite.add("frame/changes", change_benchmarks);
+        suite.add("frame/scale", scale_benchmarks);
+        suite.add("frame/copy", copy_benchmarks);
+        suite.add("pacing", pacing_benchmarks);
+        suite.add("log", log_benchmarks);
+        suite.add("metrics", metric_benchmarks);
+    }
+} // namespace bench
@@ -0,0 +1,81 @@
+// Macro benchmark: streams starting one after another, each taking a media
+// session from a `pool::SessionPool` and waiting for its first decoded frame.
+//
+// A stub factory stands in for opening media, sleeping as long as a device,
+// source reader and resampler take to build before handing back a synthetic
+// source. With no pool every start pays for that; with one, starts that find
+// a session ready only wait for the decode-ahead worker. Reports the time to
+// first frame (p50 and max) and how many checkouts were warm and cold.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame_source.h"
+#include "harness.h"
+#include "metrics.h"
+#include "raw_media.h"
+#include "session_pool.h"
+
+namespace bench
+{
+    /// @brief What the stub factory opens: just the media
+    struct StubSession
+    {
+        std::unique_ptr<source::SyntheticSource<raw::VideoFrame>> media;
+    };
+
+    /// @param pool_size Sessions opened ahead of time, or 0 for none
+    /// @param starts How many streams start
+    /// @param open_time How long the stub takes to open a session
+    /// @param arrival_interval Time between one stream starting and the next
+    inline Result run_session_starts(size_t pool_size, size_t starts, std::chrono::milliseconds open_time, std::chrono::milliseconds arrival_interval)
+    {
+        auto config = pool::SessionPoolConfig {};
+        config.size = pool_size;
+        auto sessions = pool::SessionPool<StubSession> {
+            [open_time]() {
+                std::this_thread::sleep_for(open_time);
+                auto session = std::make_unique<StubSession>();
+                session->media = std::make_unique<source::SyntheticSource<raw::VideoFrame>>(600, 60, 48000);
+                return session;
+            },
+            config};
+        sessions.wait_full(std::chrono::seconds(5));
+
+        metrics::Histogram first_frame;
+        for (size_t i = 0; i < starts; i++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            auto session = sessions.checkout();
+            auto decoder = source::DecodeAhead<raw::VideoFrame> {*session->media, []() { return std::make_shared<raw::VideoFrame>(); }};
+            while (!decoder.peek_video())
+                std::this_thread::yield();
+            first_frame.record(std::chrono::steady_clock::now() - start);
+
+            std::this_thread::sleep_until(start + arrival_interval);
+        }
+
+        auto latency = first_frame.snapshot();
+        auto stats = sessions.stats();
+        return Result {"sessions/start/pool_" + std::to_string(pool_size)}
+            .add("first_frame_p50_ms", latency.percentile(0.5) / 1e6)
+            .add("first_frame_max_ms", latency.percentile(1.0) / 1e6)
+            .add("warm_checkouts", (double)stats.warm_checkouts)
+            .add("cold_checkouts", (double)stats.cold_checkouts);
+    }
+
+    inline void add_session_benchmarks(Suite& suite)
+    {
+        suite.add("sessions", [](const Options&, std::vector<Result>& results) {
+            // Streams arriving faster than one session opens drain a pool of one
+            for (size_t pool_size : {0, 1, 4})
+                results.push_back(run_session_starts(pool_size, 20, std::chrono::milliseconds(30), std::chrono::milliseconds(20)));
+        });
+    }
+} // namespace bench
@@ -0,0 +1,77 @@
+// Stand-ins for the Rainway SDK objects the examples hand their work to.
+//
+// `OutboundStream` and `DataChannel` take what the real ones do (video
+// frames, PCM packets, reply buffers) and only count it and touch the first
+// bytes, the way an encoder or a socket would start to. That leaves the cost
+// of everything on our side of the SDK boundary, which is what the
+// benchmarks measure, and lets them run anywhere without the SDK or a GPU.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "raw_media.h"
+
+namespace standin
+{
+    /// @brief The fields of the SDK's audio submission we use
+    struct AudioOptions
+    {
+        uint32_t sample_rate;
+        uint16_t channels;
+        uint32_t frames;
+        const int16_t* samples;
+    };
+
+    class OutboundStream
+    {
+    public:
+        void SubmitVideo(const raw::VideoFrame& frame)
+        {
+            checksum += frame.y[0] + frame.u[0] + frame.v[0];
+            video_frames++;
+        }
+
+        void SubmitAudio(const AudioOptions& options)
+        {
+            checksum += (uint16_t)options.samples[0];
+            audio_packets++;
+            audio_frames += options.frames;
+        }
+
+        uint64_t video_frames = 0;
+        uint64_t audio_packets = 0;
+        uint64_t audio_frames = 0;
+        uint64_t checksum = 0;
+    };
+
+    class DataChannel
+    {
+    public:
+        /// @return Always true; the real channel reports whether it queued the message
+        bool Send(const std::vector<uint8_t>& message)
+        {
+            if (!message.empty())
+                checksum.fetch_add(message[0] + message.back(), std::memory_order_relaxed);
+            messages.fetch_add(1, std::memory_order_relaxed);
+            bytes.fetch_add(message.size(), std::memory_order_relaxed);
+            return true;
+        }
+
+        std::atomic<uint64_t> messages {0};
+        std::atomic<uint64_t> bytes {0};
+        std::atomic<uint64_t> checksum {0};
+    };
+
+    /// @brief A copyable handle to a `DataChannel`, as the SDK's channels are,
+    /// for what takes its channel by value (a `batch::BatchSender`)
+    struct DataChannelHandle
+    {
+        bool Send(const std::vector<uint8_t>& message) const { return channel->Send(message); }
+
+        DataChannel* channel;
+    };
+} // namespace standin
@@ -0,0 +1,188 @@
+// Macro benchmarks: N simulated streams watching one synthetic 720p60 media
+// for a fixed time, through the same decode-ahead, pacing, fanout and
+// executor path as the player, into stand-in OutboundStreams.
+//
+// Reports the CPU each stream costs, the frames per second delivered, how
+// far each frame's arrival strayed from its media interval (p50, p99 and
+// p99.9 over every stream), and how late the executor ran stream steps.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "audio_packetizer.h"
+#include "frame_source.h"
+#include "harness.h"
+#include "media_fanout.h"
+#include "metrics.h"
+#include "pacer.h"
+#include "player_loop.h"
+#include "raw_media.h"
+#include "stand_ins.h"
+#include "stream_executor.h"
+#include "stream_lifecycle.h"
+
+namespace bench
+{
+    /// @brief A chunk of interleaved 16-bit PCM shared between streams
+    struct AudioChunk
+    {
+        std::vector<uint8_t> pcm;
+        int64_t timestamp = 0;
+    };
+
+    /// @brief What the player's StreamSink does, into a stand-in stream, timing
+    /// the gap between frames against the media gap
+    struct BenchSink
+    {
+        standin::OutboundStream stream;
+        audio::Packetizer packets;
+        metrics::Histogram& interval_error;
+
+        std::chrono::steady_clock::time_point last_arrival {};
+        int64_t last_timestamp = -1;
+
+        void submit_video(const raw::VideoFrame& frame)
+        {
+            auto now = std::chrono::steady_clock::now();
+            if (last_timestamp >= 0)
+            {
+                auto wall = now - last_arrival;
+                auto media = std::chrono::nanoseconds {(frame.timestamp - last_timestamp) * 100};
+                interval_error.record(wall > media ? wall - media : media - wall);
+            }
+            last_arrival = now;
+            last_timestamp = frame.timestamp;
+
+            stream.SubmitVideo(frame);
+        }
+
+        void submit_audio(const AudioChunk& chunk)
+        {
+            auto frames = chunk.pcm.size() / (sizeof(int16_t) * packets.channels());
+            packets.push((const int16_t*)chunk.pcm.data(), frames, chunk.timestamp, [&](const int16_t* samples, size_t packet_frames, int64_t) {
+                stream.SubmitAudio(standin::AudioOptions {packets.sample_rate(), packets.channels(), (uint32_t)packet_frames, samples});
+            });
+        }
+    };
+
+    inline Result run_streams(size_t stream_count, std::chrono::seconds duration)
+    {
+        using Fanout = fanout::MediaFanout<raw::VideoFrame, AudioChunk>;
+        using Producer = fanout::SharedProducer<raw::VideoFrame, AudioChunk>;
+        using Consumer = exec::ConsumerTask<raw::VideoFrame, AudioChunk, BenchSink>;
+
+        const uint32_t width = 1280;
+        const uint32_t height = 720;
+        const uint32_t fps = 60;
+
+        // Every frame shows the same picture; nothing downstream reads past the first bytes
+        static const auto luma = std::vector<uint8_t>((size_t)width * height, 0x80);
+        static const auto chroma = std::vector<uint8_t>((size_t)width * height / 2, 0x80);
+
+        auto config = player::ProducerConfig {};
+        config.sample_rate = 48000;
+        config.channels = 2;
+
+        auto cpu_start = std::clock();
+        auto wall_start = std::chrono::steady_clock::now();
+
+        auto producer = std::make_shared<Producer>(8, 64, [&](Fanout& out, const lifecycle::CancellationToken& stop) {
+            // Enough frames to outlast the run; the producer is stopped at the end
+            auto frames = (uint64_t)(duration.count() + 5) * fps;
+            auto synthetic = source::SyntheticSource<raw::VideoFrame> {frames, fps, config.sample_rate, [&](raw::VideoFrame& frame, uint64_t) {
+                frame.y = luma.data();
+                frame.u = chroma.data();
+                frame.v = chroma.data() + chroma.size() / 2;
+                frame.y_stride = width;
+                frame.uv_stride = width / 2;
+                frame.width = width;
+                frame.height = height;
+            }};
+
+            auto decode_config = source::DecodeAheadConfig {};
+            decode_config.audio_frames = config.sample_rate / 2;
+            auto decoder = source::DecodeAhead<raw::VideoFrame> {
+                synthetic,
+                []() { return std::make_shared<raw::VideoFrame>(); },
+                decode_config};
+
+            auto clock = pacing::SteadyClock {};
+            player::run_producer(out, decoder, clock, stop, config);
+        });
+
+        metrics::Histogram interval_error;
+        std::vector<std::unique_ptr<BenchSink>> sinks;
+        for (size_t i = 0; i < stream_count; i++)
+            sinks.push_back(std::make_unique<BenchSink>(BenchSink {{}, audio::Packetizer {config.sample_rate, config.channels, 10}, interval_error}));
+
+        auto clock = pacing::SteadyClock {};
+        auto executor = exec::StreamExecutor<> {clock};
+        executor.start();
+
+        std::vector<std::unique_ptr<lifecycle::StreamLifecycle>> lives;
+        std::vector<std::unique_ptr<Consumer>> consumers;
+        for (auto& sink : sinks)
+        {
+            auto life = lives.emplace_back(std::make_unique<lifecycle::StreamLifecycle>()).get();
+            auto consumer = consumers.emplace_back(std::make_unique<Consumer>(producer->media(), *sink, life->token())).get();
+            auto task = executor.spawn(
+                [life, consumer](auto now) {
+                    life->start();
+                    return (*consumer)(now);
+                },
+                clock.now(),
+                [life](bool) { life->close(); });
+            life->token().on_cancel([&executor, task]() { executor.wake(task); });
+        }
+
+        std::this_thread::sleep_for(duration);
+        auto wall_end = std::chrono::steady_clock::now();
+        auto cpu_end = std::clock();
+
+        for (auto& life : lives)
+            life->request_close();
+        while (executor.task_count() > 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        executor.shutdown();
+        producer.reset();
+
+        auto wall = std::chrono::duration<double>(wall_end - wall_start).count();
+        auto cpu = (double)(cpu_end - cpu_start) / CLOCKS_PER_SEC;
+
+        uint64_t video_frames = 0;
+        uint64_t audio_frames = 0;
+        for (auto& sink : sinks)
+        {
+            video_frames += sink->stream.video_frames;
+            audio_frames += sink->stream.audio_frames;
+            keep(sink->stream.checksum);
+        }
+
+        auto error = interval_error.snapshot();
+        auto executor_stats = executor.stats();
+        return Result {"streams/720p60/" + std::to_string(stream_count)}
+            .add("cpu_pct_per_stream", 100.0 * cpu / wall / (double)stream_count)
+            .add("frames_per_s", (double)video_frames / wall)
+            .add("fps_per_stream", (double)video_frames / wall / (double)stream_count)
+            .add("audio_realtime_x", (double)audio_frames / wall / config.sample_rate / (double)stream_count)
+            .add("interval_error_p50_ms", error.percentile(0.5) / 1e6)
+            .add("interval_error_p99_ms", error.percentile(0.99) / 1e6)
+            .add("interval_error_p999_ms", error.percentile(0.999) / 1e6)
+            .add("executor_lateness_mean_ms", executor_stats.mean_lateness().count() / 1e6);
+    }
+
+    inline void add_stream_benchmarks(Suite& suite)
+    {
+        suite.add("streams", [](const Options& options, std::vector<Result>& results) {
+            for (auto count : options.stream_counts)
+                results.push_back(run_streams(count, options.stream_duration));
+        });
+    }
+} // namespace bench
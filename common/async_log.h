@@ -0,0 +1,435 @@
+// Asynchronous logging for the SDK's log sink.
+//
+// The SDK calls its log sink on whichever of its threads has something to
+// say, including the ones that deliver media, so the sink must return
+// quickly and never block. A call here checks the level, copies the raw
+// target and message into a fixed-size record in the calling thread's own
+// ring (single producer, single consumer, no locks), and returns. A
+// background writer thread drains every ring, orders the records by time,
+// formats them and writes them out in one go.
+//
+// Memory is bounded: each thread's ring has a fixed number of records, long
+// messages are truncated, and only so many threads get a ring. When a ring
+// is full the record is dropped and counted, and the writer reports the
+// count in place of what was lost. A message repeated back to back by the
+// same thread is only recorded a few times per window; the rest are counted
+// and reported the same way.
+//
+// A thread's first call to a logger registers its ring under a lock; after
+// that the writer is the only other party. A thread may log to any number
+// of loggers, with a ring in each. Rings of threads that have exited are
+// freed once drained.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace logging
+{
+    /// @brief Mirrors the SDK's log levels, so they convert with a cast
+    enum class Level : uint8_t
+    {
+        Silent,
+        Error,
+        Warn,
+        Info,
+        Debug,
+        Trace,
+    };
+
+    inline const char* to_string(Level level)
+    {
+        const char* names[] = {"silent", "error", "warn", "info", "debug", "trace"};
+        return (size_t)level < sizeof(names) / sizeof(names[0]) ? names[(size_t)level] : "unknown";
+    }
+
+    /// @brief Bytes of target and message a record holds; more is truncated
+    constexpr size_t RECORD_TEXT = 480;
+
+    /// @brief One log call, as copied by the calling thread
+    struct Record
+    {
+        /// @brief steady_clock time of the call
+        std::chrono::steady_clock::time_point time {};
+        Level level = Level::Info;
+        bool truncated = false;
+        uint16_t target_length = 0;
+        uint16_t message_length = 0;
+        /// @brief Registration order of the calling thread
+        uint32_t thread = 0;
+        char text[RECORD_TEXT];
+
+        std::string_view target() const { return {text, target_length}; }
+        std::string_view message() const { return {text + target_length, message_length}; }
+    };
+
+    struct LoggerConfig
+    {
+        /// @brief Calls above this level are discarded before anything is copied
+        Level level = Level::Info;
+        /// @brief Records each thread can have waiting; rounded up to a power of two
+        size_t ring_records = 256;
+        /// @brief Threads that get a ring; calls from any more are dropped
+        size_t max_threads = 64;
+        /// @brief How often the writer drains
+        std::chrono::milliseconds flush_interval {5};
+        /// @brief Back to back repeats of a message recorded per window
+        uint32_t repeat_burst = 5;
+        std::chrono::milliseconds repeat_window {1000};
+    };
+
+    struct LogStats
+    {
+        uint64_t written = 0;
+        /// @brief Dropped because a thread's ring was full
+        uint64_t dropped = 0;
+        /// @brief Repeats that weren't recorded
+        uint64_t suppressed = 0;
+        /// @brief Dropped because too many threads were logging
+        uint64_t unregistered = 0;
+    };
+
+    /// @brief Appends the line for `record` to `line`; runs on the writer thread
+    using Format = std::function<void(std::string& line, const Record& record)>;
+    /// @brief Writes a batch of formatted lines; runs on the writer thread
+    using Output = std::function<void(const char* data, size_t size)>;
+
+    /// @brief "level target: message"
+    inline void default_format(std::string& line, const Record& record)
+    {
+        line += to_string(record.level);
+        line += ' ';
+        line += record.target();
+        line += ": ";
+        line += record.message();
+        if (record.truncated)
+            line += "...";
+        line += '\n';
+    }
+
+    inline void stdout_output(const char* data, size_t size)
+    {
+        fwrite(data, 1, size, stdout);
+        fflush(stdout);
+    }
+
+    class Logger
+    {
+    public:
+        explicit Logger(LoggerConfig config = {}, Format format = default_format, Output output = stdout_output)
+            : config(config)
+            , format(std::move(format))
+            , output(std::move(output))
+            , id(next_logger_id()++)
+            , threshold((uint8_t)config.level)
+        {
+            capacity = 1;
+            while (capacity < std::max<size_t>(config.ring_records, 2))
+                capacity *= 2;
+        }
+
+        /// @brief Stops the writer, after writing whatever is left
+        ~Logger() { stop(); }
+
+        Logger(const Logger&) = delete;
+        Logger& operator=(const Logger&) = delete;
+
+        /// @brief Start the writer thread. Calls made before this are kept
+        /// (as far as the rings hold them) and written once it starts.
+        void start()
+        {
+            writer = std::thread {[this]() { run_writer(); }};
+        }
+
+        /// @brief Write everything logged so far and stop the writer. Later
+        /// calls are queued but not written, unless `flush` is called.
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(wake_mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            if (writer.joinable())
+                writer.join();
+            flush();
+        }
+
+        /// @brief Write everything logged so far, on the calling thread
+        void flush() { drain(); }
+
+        void set_level(Level level) { threshold.store((uint8_t)level, std::memory_order_relaxed); }
+
+        bool enabled(Level level) const
+        {
+            return level != Level::Silent && (uint8_t)level <= threshold.load(std::memory_order_relaxed);
+        }
+
+        /// @brief Log `message`, as the SDK's sink does. Never blocks once the
+        /// calling thread has logged before; safe from any thread.
+        void write(Level level, const char* target, const char* message)
+        {
+            if (!enabled(level))
+                return;
+
+            auto ring = thread_ring();
+            if (!ring)
+            {
+                unregistered.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            auto target_length = strlen(target);
+            auto message_length = strlen(message);
+            auto kept_target = std::min(target_length, RECORD_TEXT);
+            auto kept_message = std::min(message_length, RECORD_TEXT - kept_target);
+
+            auto head = ring->head.load(std::memory_order_relaxed);
+
+            // Back to back repeats of the same message only count after the
+            // burst. The thread's last record is still intact in its ring
+            // (the writer only reads it, and this thread writes the slot after).
+            if (head > 0 && now - ring->window_start < config.repeat_window)
+            {
+                auto& last = ring->records[(head - 1) & (capacity - 1)];
+                if (last.level == level && last.target_length == kept_target && last.message_length == kept_message &&
+                    memcmp(last.text, target, kept_target) == 0 && memcmp(last.text + kept_target, message, kept_message) == 0)
+                {
+                    if (++ring->repeats > config.repeat_burst)
+                        ring->suppressed.fetch_add(1, std::memory_order_relaxed);
+                    else
+                        push(*ring, head, now, level, target, message, kept_target, kept_message, target_length + message_length);
+                    return;
+                }
+            }
+
+            ring->window_start = now;
+            ring->repeats = 1;
+            push(*ring, head, now, level, target, message, kept_target, kept_message, target_length + message_length);
+        }
+
+        LogStats stats() const
+        {
+            std::lock_guard<std::mutex> lock(drain_mutex);
+            auto result = counters;
+            result.unregistered = unregistered.load(std::memory_order_relaxed);
+            return result;
+        }
+
+    private:
+        struct Ring
+        {
+            explicit Ring(size_t capacity, uint32_t thread)
+                : records(capacity)
+                , thread(thread)
+            {
+            }
+
+            std::vector<Record> records;
+            uint32_t thread;
+            alignas(64) std::atomic<uint64_t> head {0};
+            alignas(64) std::atomic<uint64_t> tail {0};
+            std::atomic<uint64_t> dropped {0};
+            std::atomic<uint64_t> suppressed {0};
+            // Set when the owning thread exits
+            std::atomic<bool> orphaned {false};
+
+            // Only touched by the owning thread
+            uint32_t repeats = 0;
+            std::chrono::steady_clock::time_point window_start {};
+        };
+
+        // A thread's ring for each logger it has used, so a thread that logs to
+        // several in turn keeps one ring in each. Logger ids are never reused,
+        // so a stale entry can't be mistaken for a live logger's.
+        struct ThreadSlots
+        {
+            struct Slot
+            {
+                uint64_t logger = 0;
+                // Null if the logger had no ring to spare
+                std::shared_ptr<Ring> ring;
+            };
+
+            std::vector<Slot> slots;
+
+            ~ThreadSlots()
+            {
+                for (auto& slot : slots)
+                {
+                    if (slot.ring)
+                        slot.ring->orphaned = true;
+                }
+            }
+        };
+
+        /// @brief Copy a call into `ring` at `head`, unless the ring is full
+        void push(
+            Ring& ring,
+            uint64_t head,
+            std::chrono::steady_clock::time_point now,
+            Level level,
+            const char* target,
+            const char* message,
+            size_t target_length,
+            size_t message_length,
+            size_t full_length)
+        {
+            if (head - ring.tail.load(std::memory_order_acquire) == capacity)
+            {
+                ring.dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            auto& record = ring.records[head & (capacity - 1)];
+            record.time = now;
+            record.level = level;
+            record.thread = ring.thread;
+            record.target_length = (uint16_t)target_length;
+            record.message_length = (uint16_t)message_length;
+            record.truncated = target_length + message_length < full_length;
+            memcpy(record.text, target, target_length);
+            memcpy(record.text + target_length, message, message_length);
+
+            ring.head.store(head + 1, std::memory_order_release);
+        }
+
+        static std::atomic<uint64_t>& next_logger_id()
+        {
+            static std::atomic<uint64_t> id {1};
+            return id;
+        }
+
+        Ring* thread_ring()
+        {
+            thread_local ThreadSlots mine;
+            for (auto& slot : mine.slots)
+            {
+                if (slot.logger == id)
+                    return slot.ring.get();
+            }
+
+            // First call from this thread to this logger. A ring only this
+            // thread still holds belongs to a logger that has gone, so let go of it.
+            mine.slots.erase(
+                std::remove_if(mine.slots.begin(), mine.slots.end(), [](const ThreadSlots::Slot& slot) {
+                    return !slot.ring || slot.ring.use_count() == 1;
+                }),
+                mine.slots.end());
+
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            auto& slot = mine.slots.emplace_back();
+            slot.logger = id;
+            if (rings.size() >= config.max_threads)
+                return nullptr;
+
+            slot.ring = std::make_shared<Ring>(capacity, next_thread++);
+            rings.push_back(slot.ring);
+            return slot.ring.get();
+        }
+
+        void run_writer()
+        {
+            std::unique_lock<std::mutex> lock(wake_mutex);
+            while (!stopping)
+            {
+                lock.unlock();
+                drain();
+                lock.lock();
+                wake.wait_for(lock, config.flush_interval, [&] { return stopping; });
+            }
+        }
+
+        void drain()
+        {
+            std::lock_guard<std::mutex> lock(drain_mutex);
+
+            {
+                // Snapshot the rings, forgetting those of exited threads once empty
+                std::lock_guard<std::mutex> rings_lock(rings_mutex);
+                draining.assign(rings.begin(), rings.end());
+                rings.erase(
+                    std::remove_if(rings.begin(), rings.end(), [](const std::shared_ptr<Ring>& ring) {
+                        return ring->orphaned && ring->head.load(std::memory_order_acquire) == ring->tail.load(std::memory_order_relaxed);
+                    }),
+                    rings.end());
+            }
+
+            // Merge what every thread has logged so far into time order
+            pending.clear();
+            ends.clear();
+            for (auto& ring : draining)
+            {
+                auto tail = ring->tail.load(std::memory_order_relaxed);
+                auto head = ring->head.load(std::memory_order_acquire);
+                for (auto i = tail; i != head; i++)
+                    pending.push_back(&ring->records[i & (capacity - 1)]);
+                ends.push_back(head);
+            }
+            std::stable_sort(pending.begin(), pending.end(), [](const Record* a, const Record* b) { return a->time < b->time; });
+
+            batch.clear();
+            for (auto record : pending)
+                format(batch, *record);
+            counters.written += pending.size();
+
+            for (size_t i = 0; i < draining.size(); i++)
+            {
+                auto& ring = *draining[i];
+                ring.tail.store(ends[i], std::memory_order_release);
+
+                auto dropped = ring.dropped.exchange(0, std::memory_order_relaxed);
+                auto suppressed = ring.suppressed.exchange(0, std::memory_order_relaxed);
+                counters.dropped += dropped;
+                counters.suppressed += suppressed;
+                if (dropped)
+                    batch += "[log] thread " + std::to_string(ring.thread) + " dropped " + std::to_string(dropped) + " messages\n";
+                if (suppressed)
+                    batch += "[log] thread " + std::to_string(ring.thread) + " repeated its last message " + std::to_string(suppressed) + " more times\n";
+            }
+            draining.clear();
+
+            if (!batch.empty())
+                output(batch.data(), batch.size());
+        }
+
+        LoggerConfig config;
+        Format format;
+        Output output;
+        const uint64_t id;
+        size_t capacity;
+        std::atomic<uint8_t> threshold;
+        std::atomic<uint64_t> unregistered {0};
+
+        std::mutex rings_mutex;
+        std::vector<std::shared_ptr<Ring>> rings;
+        uint32_t next_thread = 0;
+
+        // Only touched while draining
+        mutable std::mutex drain_mutex;
+        std::vector<std::shared_ptr<Ring>> draining;
+        std::vector<const Record*> pending;
+        std::vector<uint64_t> ends;
+        std::string batch;
+        LogStats counters;
+
+        std::mutex wake_mutex;
+        std::condition_variable wake;
+        bool stopping = false;
+        std::thread writer;
+    };
+} // namespace logging
@@ -0,0 +1,117 @@
+// Runtime CPU feature detection shared by the examples' SIMD kernels.
+//
+// Kernels are compiled for their instruction set with `CPU_TARGET_*` (so the
+// rest of the build stays at the baseline ISA) and selected once at runtime
+// from `cpu::features()`.
+
+#pragma once
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+    #define CPU_X86 1
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+    #else
+        #include <cpuid.h>
+    #endif
+    #include <immintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    #define CPU_NEON 1
+    #include <arm_neon.h>
+#endif
+
+#include <cstdlib>
+#include <cstring>
+
+// MSVC lets any function use any intrinsic; GCC and Clang need the target
+// enabled per function.
+#if defined(CPU_X86) && !defined(_MSC_VER)
+    #define CPU_TARGET_SSE2 __attribute__((target("sse2")))
+    #define CPU_TARGET_SSE41 __attribute__((target("sse4.1")))
+    #define CPU_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+    #define CPU_TARGET_SSE2
+    #define CPU_TARGET_SSE41
+    #define CPU_TARGET_AVX2
+#endif
+
+namespace cpu
+{
+    /// @brief Instruction set extensions usable by this process
+    struct Features
+    {
+        bool sse2 = false;
+        bool sse41 = false;
+        bool avx2 = false;
+        bool neon = false;
+    };
+
+    /// @brief Probe the CPU (and OS support for the wider register state)
+    inline Features detect_features()
+    {
+        Features result;
+
+#if defined(CPU_X86)
+        int regs[4] = {};
+        auto cpuid = [&](int leaf, int subleaf) {
+    #if defined(_MSC_VER)
+            __cpuidex(regs, leaf, subleaf);
+    #else
+            unsigned a, b, c, d;
+            __cpuid_count(leaf, subleaf, a, b, c, d);
+            regs[0] = (int)a, regs[1] = (int)b, regs[2] = (int)c, regs[3] = (int)d;
+    #endif
+        };
+
+        cpuid(0, 0);
+        auto max_leaf = regs[0];
+
+        cpuid(1, 0);
+        result.sse2 = (regs[3] & (1 << 26)) != 0;
+        result.sse41 = (regs[2] & (1 << 19)) != 0;
+        auto osxsave = (regs[2] & (1 << 27)) != 0;
+        auto avx = (regs[2] & (1 << 28)) != 0;
+
+        if (max_leaf >= 7 && osxsave && avx)
+        {
+            // The OS has to save the YMM registers for AVX2 to be usable
+    #if defined(_MSC_VER)
+            auto xcr0 = _xgetbv(0);
+    #else
+            unsigned eax, edx;
+            __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+            auto xcr0 = ((unsigned long long)edx << 32) | eax;
+    #endif
+            cpuid(7, 0);
+            result.avx2 = (xcr0 & 0x6) == 0x6 && (regs[1] & (1 << 5)) != 0;
+        }
+#elif defined(CPU_NEON)
+        result.neon = true;
+#endif
+
+        return result;
+    }
+
+    /// @brief Apply the `RAINWAY_EXAMPLES_SIMD` override ("scalar", "sse2",
+    /// "sse41", "avx2"), which caps the features reported, e.g. for benchmarking
+    inline Features cap_features(Features detected, const char* cap)
+    {
+        if (cap == nullptr)
+            return detected;
+
+        if (strcmp(cap, "scalar") == 0)
+            return Features {};
+        if (strcmp(cap, "sse2") == 0)
+            detected.sse41 = detected.avx2 = false;
+        else if (strcmp(cap, "sse41") == 0)
+            detected.avx2 = false;
+
+        return detected;
+    }
+
+    /// @brief Features detected once for the process
+    inline const Features& features()
+    {
+        static const Features features = cap_features(detect_features(), getenv("RAINWAY_EXAMPLES_SIMD"));
+        return features;
+    }
+} // namespace cpu
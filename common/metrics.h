@@ -0,0 +1,627 @@
+// Counters and latency histograms, exported as Prometheus text.
+//
+// Metrics come in sets that share labels: one set per stream, say, or per
+// decoded media. Updating a metric is a relaxed atomic add, so the threads
+// that deliver media can count and time themselves without locks. Creating
+// a metric takes the set's lock and belongs in setup.
+//
+// Histograms are log-linear in the style of HdrHistogram. Values below 16
+// get a bucket each, and every power of two above that is split into 16
+// buckets, so any value is recorded to within about 6%. They are exported
+// as Prometheus summaries (quantiles, sum and count).
+//
+// A `Registry` owns every set, one per distinct set of labels: creating a
+// set with labels it already has shares the existing one. When it collects
+// (on each export), sets that nobody else holds any more are folded into
+// per-metric totals labelled `scope="closed"`. Summing a metric over all its
+// series therefore gives the host-wide total, including streams that have
+// ended.
+//
+// An `Exporter` collects and writes the text periodically. It writes to a
+// file, replacing it each time so a reader never sees a partial export. On
+// platforms with Unix domain sockets it can instead serve a fresh export to
+// each connection on a socket path.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#endif
+
+#if !defined(_WIN32)
+    #define METRICS_UNIX_SOCKET 1
+    #include <poll.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <unistd.h>
+#endif
+
+namespace metrics
+{
+    class Counter
+    {
+    public:
+        void add(uint64_t n = 1) { count.fetch_add(n, std::memory_order_relaxed); }
+        uint64_t value() const { return count.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint64_t> count {0};
+    };
+
+    /// @brief Buckets of a histogram at one point in time
+    struct HistogramSnapshot
+    {
+        std::vector<uint64_t> buckets;
+        uint64_t count = 0;
+        uint64_t sum = 0;
+
+        void merge(const HistogramSnapshot& other)
+        {
+            if (buckets.size() < other.buckets.size())
+                buckets.resize(other.buckets.size());
+            for (size_t i = 0; i < other.buckets.size(); i++)
+                buckets[i] += other.buckets[i];
+            count += other.count;
+            sum += other.sum;
+        }
+
+        /// @brief The value that `p` (0 to 1) of recorded values are at or below,
+        /// to within the bucket width (the bucket's highest value is returned)
+        uint64_t percentile(double p) const;
+    };
+
+    class Histogram
+    {
+    public:
+        /// @brief Buckets per power of two, as a power of two
+        static constexpr uint32_t SUB_BUCKET_BITS = 4;
+        static constexpr uint32_t SUB_BUCKETS = 1u << SUB_BUCKET_BITS;
+        /// @brief Larger values are recorded as this (about 18 minutes, in ns)
+        static constexpr uint64_t MAX_VALUE = (1ull << 40) - 1;
+        static constexpr size_t BUCKETS = (40 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+        void record(uint64_t value)
+        {
+            value = std::min(value, MAX_VALUE);
+            buckets[index(value)].fetch_add(1, std::memory_order_relaxed);
+            count.fetch_add(1, std::memory_order_relaxed);
+            sum.fetch_add(value, std::memory_order_relaxed);
+        }
+
+        void record(std::chrono::nanoseconds duration) { record((uint64_t)std::max<int64_t>(0, duration.count())); }
+
+        HistogramSnapshot snapshot() const
+        {
+            HistogramSnapshot result;
+            result.buckets.resize(BUCKETS);
+            for (size_t i = 0; i < BUCKETS; i++)
+                result.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+            result.count = count.load(std::memory_order_relaxed);
+            result.sum = sum.load(std::memory_order_relaxed);
+            return result;
+        }
+
+        static size_t index(uint64_t value)
+        {
+            if (value < SUB_BUCKETS)
+                return (size_t)value;
+
+            auto exponent = highest_bit(value);
+            auto mantissa = (value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+            return (size_t)(exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + (size_t)mantissa;
+        }
+
+        /// @brief The lowest value recorded into bucket `i`
+        static uint64_t lowest(size_t i)
+        {
+            if (i < SUB_BUCKETS)
+                return i;
+
+            auto exponent = (uint32_t)(i / SUB_BUCKETS) + SUB_BUCKET_BITS - 1;
+            auto mantissa = (uint64_t)(i % SUB_BUCKETS);
+            return (SUB_BUCKETS + mantissa) << (exponent - SUB_BUCKET_BITS);
+        }
+
+        /// @brief The highest value recorded into bucket `i`
+        static uint64_t highest(size_t i) { return i + 1 < BUCKETS ? lowest(i + 1) - 1 : MAX_VALUE; }
+
+    private:
+        static uint32_t highest_bit(uint64_t value)
+        {
+#if defined(_MSC_VER)
+            unsigned long bit;
+            _BitScanReverse64(&bit, value);
+            return (uint32_t)bit;
+#else
+            return 63u - (uint32_t)__builtin_clzll(value);
+#endif
+        }
+
+        std::atomic<uint64_t> buckets[BUCKETS] = {};
+        std::atomic<uint64_t> count {0};
+        std::atomic<uint64_t> sum {0};
+    };
+
+    inline uint64_t HistogramSnapshot::percentile(double p) const
+    {
+        if (count == 0)
+            return 0;
+
+        auto rank = std::max<uint64_t>(1, (uint64_t)(p * (double)count + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < buckets.size(); i++)
+        {
+            seen += buckets[i];
+            if (seen >= rank)
+                return Histogram::highest(i);
+        }
+        return Histogram::MAX_VALUE;
+    }
+
+    enum class Kind
+    {
+        Counter,
+        /// @brief Recorded in nanoseconds, exported in seconds
+        Latency,
+    };
+
+    /// @brief Metrics sharing a set of labels, such as one stream's
+    class MetricSet
+    {
+    public:
+        /// @param labels Prometheus labels without braces, e.g. `stream="3"`
+        explicit MetricSet(std::string labels)
+            : label_text(std::move(labels))
+        {
+        }
+
+        MetricSet(const MetricSet&) = delete;
+        MetricSet& operator=(const MetricSet&) = delete;
+
+        /// @brief The counter called `name`, created on first use
+        Counter& counter(const std::string& name, const std::string& help)
+        {
+            return *find(name, help, Kind::Counter).counter;
+        }
+
+        /// @brief The latency histogram called `name`, created on first use
+        Histogram& latency(const std::string& name, const std::string& help)
+        {
+            return *find(name, help, Kind::Latency).histogram;
+        }
+
+        const std::string& labels() const { return label_text; }
+
+    private:
+        friend class Registry;
+
+        struct Metric
+        {
+            std::string name;
+            std::string help;
+            Kind kind;
+            std::unique_ptr<Counter> counter;
+            std::unique_ptr<Histogram> histogram;
+        };
+
+        Metric& find(const std::string& name, const std::string& help, Kind kind)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& metric : metrics)
+            {
+                if (metric->name == name)
+                    return *metric;
+            }
+
+            auto metric = std::make_unique<Metric>(Metric {name, help, kind, nullptr, nullptr});
+            if (kind == Kind::Counter)
+                metric->counter = std::make_unique<Counter>();
+            else
+                metric->histogram = std::make_unique<Histogram>();
+            metrics.push_back(std::move(metric));
+            return *metrics.back();
+        }
+
+        std::string label_text;
+        std::mutex mutex;
+        std::vector<std::unique_ptr<Metric>> metrics;
+    };
+
+    class Registry
+    {
+    public:
+        /// @brief Start a set of metrics. It is exported until the last
+        /// reference to it is dropped, and counted in the closed totals after.
+        /// Labels the registry already has a set for (a producer replaced
+        /// under the same key, say) get that set, so no series is exported twice.
+        std::shared_ptr<MetricSet> create(std::string labels)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& set : sets)
+            {
+                if (set->label_text == labels)
+                    return set;
+            }
+
+            auto set = std::make_shared<MetricSet>(std::move(labels));
+            sets.push_back(set);
+            return set;
+        }
+
+        /// @brief Fold sets nobody holds any more into the closed totals
+        void collect()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto it = sets.begin(); it != sets.end();)
+            {
+                if (it->use_count() > 1)
+                {
+                    it++;
+                    continue;
+                }
+
+                std::lock_guard<std::mutex> set_lock((*it)->mutex);
+                for (auto& metric : (*it)->metrics)
+                {
+                    auto& family = families[metric->name];
+                    family.help = metric->help;
+                    family.kind = metric->kind;
+                    family.closed_sets++;
+                    if (metric->counter)
+                        family.closed_count += metric->counter->value();
+                    else
+                        family.closed_latency.merge(metric->histogram->snapshot());
+                }
+                it = sets.erase(it);
+            }
+        }
+
+        /// @brief Every metric, live and closed, in Prometheus text format
+        std::string render()
+        {
+            struct Series
+            {
+                const std::string* labels;
+                const MetricSet::Metric* metric;
+            };
+
+            std::lock_guard<std::mutex> lock(mutex);
+
+            // Group live metrics by name, in name order
+            std::map<std::string, std::vector<Series>> live;
+            std::vector<std::unique_lock<std::mutex>> set_locks;
+            for (auto& set : sets)
+            {
+                set_locks.emplace_back(set->mutex);
+                for (auto& metric : set->metrics)
+                    live[metric->name].push_back(Series {&set->label_text, metric.get()});
+            }
+
+            std::string text;
+            auto names = std::vector<std::string> {};
+            for (auto& [name, series] : live)
+                names.push_back(name);
+            for (auto& [name, family] : families)
+            {
+                if (!live.count(name))
+                    names.push_back(name);
+            }
+            std::sort(names.begin(), names.end());
+
+            for (auto& name : names)
+            {
+                auto series = live.find(name);
+                auto family = families.find(name);
+                auto kind = series != live.end() ? series->second.front().metric->kind : family->second.kind;
+                auto& help = series != live.end() ? series->second.front().metric->help : family->second.help;
+
+                text += "# HELP " + name + " " + help + "\n";
+                text += "# TYPE " + name + (kind == Kind::Counter ? " counter\n" : " summary\n");
+
+                if (series != live.end())
+                {
+                    for (auto& s : series->second)
+                    {
+                        if (s.metric->counter)
+                            write_counter(text, name, *s.labels, s.metric->counter->value());
+                        else
+                            write_latency(text, name, *s.labels, s.metric->histogram->snapshot());
+                    }
+                }
+
+                if (family != families.end() && family->second.closed_sets > 0)
+                {
+                    if (kind == Kind::Counter)
+                        write_counter(text, name, "scope=\"closed\"", family->second.closed_count);
+                    else
+                        write_latency(text, name, "scope=\"closed\"", family->second.closed_latency);
+                }
+            }
+
+            return text;
+        }
+
+    private:
+        struct Family
+        {
+            std::string help;
+            Kind kind = Kind::Counter;
+            uint64_t closed_sets = 0;
+            uint64_t closed_count = 0;
+            HistogramSnapshot closed_latency;
+        };
+
+        static std::string braces(const std::string& labels, const std::string& extra = {})
+        {
+            if (labels.empty() && extra.empty())
+                return {};
+            return "{" + labels + (labels.empty() || extra.empty() ? "" : ",") + extra + "}";
+        }
+
+        static void write_counter(std::string& text, const std::string& name, const std::string& labels, uint64_t value)
+        {
+            text += name + braces(labels) + " " + std::to_string(value) + "\n";
+        }
+
+        static void write_latency(std::string& text, const std::string& name, const std::string& labels, const HistogramSnapshot& snapshot)
+        {
+            char value[32];
+            for (auto q : {"0.5", "0.9", "0.99", "0.999"})
+            {
+                snprintf(value, sizeof(value), "%.9f", snapshot.percentile(atof(q)) / 1e9);
+                text += name + braces(labels, std::string("quantile=\"") + q + "\"") + " " + value + "\n";
+            }
+            snprintf(value, sizeof(value), "%.9f", snapshot.sum / 1e9);
+            text += name + "_sum" + braces(labels) + " " + value + "\n";
+            text += name + "_count" + braces(labels) + " " + std::to_string(snapshot.count) + "\n";
+        }
+
+        std::mutex mutex;
+        std::vector<std::shared_ptr<MetricSet>> sets;
+        std::map<std::string, Family> families;
+    };
+
+    /// @brief Times a scope into a latency histogram, if there is one
+    class ScopedTimer
+    {
+    public:
+        explicit ScopedTimer(Histogram* histogram)
+            : histogram(histogram)
+            , start(histogram ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point {})
+        {
+        }
+
+        ~ScopedTimer()
+        {
+            if (histogram)
+                histogram->record(std::chrono::steady_clock::now() - start);
+        }
+
+        ScopedTimer(const ScopedTimer&) = delete;
+        ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+    private:
+        Histogram* histogram;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    /// @brief Periodically collects a registry and writes it out
+    class Exporter
+    {
+    public:
+        /// @param target A file path, or `unix:` and a socket path to serve on
+        /// @param interval How often to collect (and rewrite the file)
+        Exporter(Registry& registry, std::string target, std::chrono::milliseconds interval = std::chrono::seconds(5))
+            : registry(registry)
+            , target(std::move(target))
+            , interval(interval)
+        {
+        }
+
+        ~Exporter() { stop(); }
+
+        Exporter(const Exporter&) = delete;
+        Exporter& operator=(const Exporter&) = delete;
+
+        /// @return false (with `error()` set) if the target can't be used
+        bool start()
+        {
+            if (target.compare(0, 5, "unix:") == 0)
+            {
+#if defined(METRICS_UNIX_SOCKET)
+                if (!listen(target.substr(5)))
+                    return false;
+                thread = std::thread {[this]() { serve(); }};
+                return true;
+#else
+                message = "Unix domain sockets aren't supported here; export to a file instead";
+                return false;
+#endif
+            }
+
+            if (!write_file())
+                return false;
+            thread = std::thread {[this]() { run_file(); }};
+            return true;
+        }
+
+        /// @brief Stop exporting, writing the file a last time
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            if (!thread.joinable())
+                return;
+            thread.join();
+
+#if defined(METRICS_UNIX_SOCKET)
+            if (listener >= 0)
+            {
+                close(listener);
+                listener = -1;
+                unlink(target.c_str() + 5);
+                return;
+            }
+#endif
+            write_file();
+        }
+
+        const std::string& error() const { return message; }
+
+    private:
+        bool write_file()
+        {
+            registry.collect();
+            auto text = registry.render();
+
+            // Write beside the target and swap it in, so readers never see half an export
+            auto temporary = target + ".tmp";
+            auto file = fopen(temporary.c_str(), "wb");
+            if (!file)
+            {
+                message = "Failed to open " + temporary;
+                return false;
+            }
+            auto written = fwrite(text.data(), 1, text.size(), file) == text.size();
+            written = fclose(file) == 0 && written;
+#if defined(_WIN32)
+            std::remove(target.c_str());
+#endif
+            if (!written || std::rename(temporary.c_str(), target.c_str()) != 0)
+            {
+                message = "Failed to write " + target;
+                return false;
+            }
+            return true;
+        }
+
+        void run_file()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!wake.wait_for(lock, interval, [&] { return stopping; }))
+            {
+                lock.unlock();
+                write_file();
+                lock.lock();
+            }
+        }
+
+#if defined(METRICS_UNIX_SOCKET)
+        bool listen(const std::string& path)
+        {
+            auto address = sockaddr_un {};
+            address.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(address.sun_path))
+            {
+                message = "Socket path too long: " + path;
+                return false;
+            }
+            memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+            listener = socket(AF_UNIX, SOCK_STREAM, 0);
+            unlink(path.c_str());
+            if (listener < 0 || bind(listener, (const sockaddr*)&address, sizeof(address)) != 0 || ::listen(listener, 8) != 0)
+            {
+                message = "Failed to listen on " + path + ": " + strerror(errno);
+                if (listener >= 0)
+                    close(listener);
+                listener = -1;
+                return false;
+            }
+            return true;
+        }
+
+        /// @brief Answer each connection with a fresh export, collecting at
+        /// least every interval in between
+        void serve()
+        {
+            auto next_collect = std::chrono::steady_clock::now() + interval;
+            while (true)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (stopping)
+                        return;
+                }
+
+                // Short polls, so stopping doesn't wait on a quiet socket
+                auto poller = pollfd {listener, POLLIN, 0};
+                if (poll(&poller, 1, 100) > 0 && (poller.revents & POLLIN))
+                {
+                    auto client = accept(listener, nullptr, nullptr);
+                    if (client >= 0)
+                    {
+                        registry.collect();
+                        auto text = registry.render();
+                        size_t sent = 0;
+                        while (sent < text.size())
+                        {
+                            auto n = send(client, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+                            if (n <= 0)
+                                break;
+                            sent += (size_t)n;
+                        }
+                        close(client);
+                    }
+                }
+
+                if (std::chrono::steady_clock::now() >= next_collect)
+                {
+                    registry.collect();
+                    next_collect += interval;
+                }
+            }
+        }
+
+        int listener = -1;
+#endif
+
+        Registry& registry;
+        std::string target;
+        std::chrono::milliseconds interval;
+        std::string message;
+
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool stopping = false;
+        std::thread thread;
+    };
+
+    /// @brief Start exporting `registry` to wherever `RAINWAY_EXAMPLES_METRICS`
+    /// says (a file path, or `unix:` and a socket path)
+    /// @return The running exporter, or nullptr if the variable isn't set or
+    /// the target can't be used (which is reported)
+    inline std::unique_ptr<Exporter> export_from_env(Registry& registry)
+    {
+        auto target = getenv("RAINWAY_EXAMPLES_METRICS");
+        if (target == nullptr || *target == 0)
+            return nullptr;
+
+        auto exporter = std::make_unique<Exporter>(registry, target);
+        if (!exporter->start())
+        {
+            printf("Error. Failed to export metrics: %s\n", exporter->error().c_str());
+            return nullptr;
+        }
+        return exporter;
+    }
+} // namespace metrics
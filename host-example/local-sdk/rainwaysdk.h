@@ -0,0 +1,701 @@
+// A local, in-process stand-in for the parts of rainwaysdk.h the host example
+// uses, for load testing its handlers without the Rainway Network.
+//
+// Put this directory ahead of (or instead of) the SDK's include directory and
+// the host's handler code builds unchanged. Nothing leaves the process:
+// `rainway::local::network()` plays the Rainway Network and every remote
+// peer. A driver asks it to connect peers, request streams, open data
+// channels and deliver messages. The host's handlers are called back on a
+// fixed number of callback threads, as the SDK's would be, and whatever the
+// host sends is passed to the driver's `Events`.
+//
+// Every callback for one peer runs on the same callback thread, in the order
+// it was raised, so a peer's handlers never run concurrently with each other.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "metrics.h"
+
+namespace rainway
+{
+    enum Error : int32_t
+    {
+        RAINWAY_ERROR_SUCCESS = 0,
+        RAINWAY_ERROR_ALREADY_INITIALIZED,
+        RAINWAY_ERROR_CHANNEL_CLOSED,
+    };
+
+    enum LogLevel : int32_t
+    {
+        RAINWAY_LOG_LEVEL_SILENT = 0,
+        RAINWAY_LOG_LEVEL_ERROR,
+        RAINWAY_LOG_LEVEL_WARNING,
+        RAINWAY_LOG_LEVEL_INFO,
+        RAINWAY_LOG_LEVEL_DEBUG,
+        RAINWAY_LOG_LEVEL_TRACE,
+    };
+
+    enum StreamType : int32_t
+    {
+        RAINWAY_STREAM_TYPE_FULL_DESKTOP = 0,
+        RAINWAY_STREAM_TYPE_BYOFB,
+    };
+
+    enum InputLevel : int32_t
+    {
+        RAINWAY_INPUT_LEVEL_NONE = 0,
+        RAINWAY_INPUT_LEVEL_MOUSE = 1,
+        RAINWAY_INPUT_LEVEL_KEYBOARD = 2,
+        RAINWAY_INPUT_LEVEL_GAMEPAD = 4,
+        RAINWAY_INPUT_LEVEL_ALL = 7,
+    };
+
+    using LogSink = void (*)(LogLevel level, const char* target, const char* message);
+
+    namespace internal
+    {
+        inline const char* rainway_version() { return "local"; }
+    } // namespace internal
+
+    namespace local
+    {
+        struct PeerState;
+        struct ChannelState;
+        struct StreamState;
+        class Network;
+        Network& network();
+    } // namespace local
+
+    class OutboundStream
+    {
+    public:
+        explicit OutboundStream(std::shared_ptr<local::StreamState> state)
+            : state(std::move(state))
+        {
+        }
+
+        uint64_t Id() const;
+
+    private:
+        std::shared_ptr<local::StreamState> state;
+    };
+
+    struct OutboundStreamStartOptions
+    {
+        StreamType type = RAINWAY_STREAM_TYPE_FULL_DESKTOP;
+        InputLevel defaultPermissions = RAINWAY_INPUT_LEVEL_NONE;
+    };
+
+    struct OutboundStreamStartCallback
+    {
+        std::function<void(OutboundStream)> success;
+        std::function<void(Error)> failure;
+    };
+
+    class OutboundStreamRequest
+    {
+    public:
+        explicit OutboundStreamRequest(std::shared_ptr<local::PeerState> peer)
+            : peer(std::move(peer))
+        {
+        }
+
+        void Accept(const OutboundStreamStartOptions& options, OutboundStreamStartCallback callback);
+
+    private:
+        std::shared_ptr<local::PeerState> peer;
+    };
+
+    class DataChannel
+    {
+    public:
+        struct DataChannelDataEvent
+        {
+            const uint8_t* data;
+            size_t len;
+        };
+
+        struct DataChannelDataHandler
+        {
+            std::function<void(DataChannelDataEvent)> handler;
+        };
+
+        DataChannel(std::string name, std::shared_ptr<local::ChannelState> state)
+            : name(std::move(name))
+            , state(std::move(state))
+        {
+        }
+
+        void SetDataChannelDataHandler(DataChannelDataHandler handler);
+        Error Send(const std::vector<uint8_t>& data) const;
+
+        std::string name;
+
+    private:
+        std::shared_ptr<local::ChannelState> state;
+    };
+
+    struct PeerOptions
+    {
+    };
+
+    class PeerConnection
+    {
+    public:
+        enum State : int32_t
+        {
+            RAINWAY_PEER_STATE_CONNECTING = 0,
+            RAINWAY_PEER_STATE_CONNECTED,
+            RAINWAY_PEER_STATE_FAILED,
+            RAINWAY_PEER_STATE_CLOSED,
+        };
+
+        struct StateChangeHandler
+        {
+            std::function<void(State)> handler;
+        };
+
+        struct OutboundStreamRequestHandler
+        {
+            std::function<void(OutboundStreamRequest)> handler;
+        };
+
+        struct DataChannelOpenedHandler
+        {
+            std::function<void(DataChannel)> handler;
+        };
+
+        explicit PeerConnection(std::shared_ptr<local::PeerState> state)
+            : state(std::move(state))
+        {
+        }
+
+        uint64_t Id() const;
+        void SetStateChangeHandler(StateChangeHandler handler);
+        void SetOutboundStreamRequestHandler(OutboundStreamRequestHandler handler);
+        void SetDataChannelOpenedHandler(DataChannelOpenedHandler handler);
+
+    private:
+        std::shared_ptr<local::PeerState> state;
+    };
+
+    class IncomingConnectionRequest
+    {
+    public:
+        struct AcceptCallback
+        {
+            std::function<void(PeerConnection)> success;
+            std::function<void(Error)> failure;
+        };
+
+        explicit IncomingConnectionRequest(std::shared_ptr<local::PeerState> peer)
+            : peer(std::move(peer))
+        {
+        }
+
+        uint64_t Id() const;
+        void Accept(const PeerOptions& options, AcceptCallback callback);
+
+    private:
+        std::shared_ptr<local::PeerState> peer;
+    };
+
+    class Connection
+    {
+    public:
+        struct CreateOptions
+        {
+            std::string apiKey;
+            std::string externalId;
+        };
+
+        struct CreatedCallback
+        {
+            std::function<void(Connection)> success;
+            std::function<void(Error)> failure;
+        };
+
+        struct PeerConnectionRequestHandler
+        {
+            std::function<void(IncomingConnectionRequest)> handler;
+        };
+
+        static void Create(const CreateOptions& options, CreatedCallback callback);
+
+        uint64_t Id() const { return id; }
+        void SetPeerConnectionRequestHandler(PeerConnectionRequestHandler handler);
+
+    private:
+        explicit Connection(uint64_t id)
+            : id(id)
+        {
+        }
+
+        friend class local::Network;
+        uint64_t id;
+    };
+
+    namespace local
+    {
+        struct PeerState
+        {
+            explicit PeerState(uint64_t id)
+                : id(id)
+            {
+            }
+
+            const uint64_t id;
+
+            std::mutex mutex;
+            PeerConnection::State state = PeerConnection::RAINWAY_PEER_STATE_CONNECTING;
+            PeerConnection::StateChangeHandler on_state;
+            PeerConnection::OutboundStreamRequestHandler on_stream_request;
+            PeerConnection::DataChannelOpenedHandler on_channel_opened;
+            std::vector<std::shared_ptr<ChannelState>> channels;
+        };
+
+        struct ChannelState
+        {
+            ChannelState(uint64_t id, std::shared_ptr<PeerState> peer)
+                : id(id)
+                , peer(std::move(peer))
+            {
+            }
+
+            const uint64_t id;
+            const std::shared_ptr<PeerState> peer;
+
+            std::mutex mutex;
+            DataChannel::DataChannelDataHandler on_data;
+            std::atomic<bool> open {true};
+        };
+
+        struct StreamState
+        {
+            uint64_t id;
+            uint64_t peer;
+        };
+
+        struct NetworkConfig
+        {
+            /// @brief Threads the host's callbacks run on
+            size_t callback_threads = 4;
+        };
+
+        /// @brief What the host did, reported to the driver on the callback thread
+        struct Events
+        {
+            std::function<void(uint64_t peer)> peer_connected;
+            std::function<void(uint64_t peer, uint64_t stream)> stream_started;
+            std::function<void(uint64_t peer, uint64_t channel)> channel_opened;
+            std::function<void(uint64_t channel, const std::vector<uint8_t>& data)> sent;
+        };
+
+        struct NetworkStats
+        {
+            uint64_t callbacks = 0;
+            uint64_t unhandled = 0;
+            uint64_t sends = 0;
+            uint64_t send_failures = 0;
+            /// @brief How long each callback waited for its callback thread, in ns
+            metrics::HistogramSnapshot queue_delay;
+        };
+
+        class Network
+        {
+        public:
+            /// @brief Set up the network; call before rainway::Initialize
+            void configure(NetworkConfig config, Events events)
+            {
+                this->config = config;
+                this->events = std::move(events);
+            }
+
+            /// @brief A remote peer asks to connect; the host's peer connection
+            /// request handler is called with it
+            std::shared_ptr<PeerState> connect_peer()
+            {
+                auto peer = std::make_shared<PeerState>(next_id++);
+                post(peer->id, [this, peer]() {
+                    auto handler = locked(mutex, on_peer_request);
+                    if (!handler.handler)
+                    {
+                        unhandled.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
+                    handler.handler(IncomingConnectionRequest {peer});
+                });
+                return peer;
+            }
+
+            /// @brief The peer asks for an outbound stream
+            void request_stream(const std::shared_ptr<PeerState>& peer)
+            {
+                post(peer->id, [this, peer]() {
+                    auto handler = locked(peer->mutex, peer->on_stream_request);
+                    if (!handler.handler)
+                    {
+                        unhandled.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
+                    handler.handler(OutboundStreamRequest {peer});
+                });
+            }
+
+            /// @brief The peer opens a data channel
+            std::shared_ptr<ChannelState> open_channel(const std::shared_ptr<PeerState>& peer, std::string name)
+            {
+                auto channel = std::make_shared<ChannelState>(next_id++, peer);
+                {
+                    std::lock_guard<std::mutex> lock(peer->mutex);
+                    peer->channels.push_back(channel);
+                }
+
+                post(peer->id, [this, channel, name = std::move(name)]() {
+                    auto handler = locked(channel->peer->mutex, channel->peer->on_channel_opened);
+                    if (!handler.handler)
+                    {
+                        unhandled.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
+                    handler.handler(DataChannel {name, channel});
+                    if (events.channel_opened)
+                        events.channel_opened(channel->peer->id, channel->id);
+                });
+                return channel;
+            }
+
+            /// @brief The peer sends a message on `channel`; copied before returning
+            Error deliver(const std::shared_ptr<ChannelState>& channel, const uint8_t* data, size_t len)
+            {
+                if (!channel->open.load(std::memory_order_acquire))
+                    return RAINWAY_ERROR_CHANNEL_CLOSED;
+
+                post(channel->peer->id, [this, channel, message = std::vector<uint8_t>(data, data + len)]() {
+                    auto handler = locked(channel->mutex, channel->on_data);
+                    if (!handler.handler)
+                    {
+                        unhandled.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
+                    handler.handler(DataChannel::DataChannelDataEvent {message.data(), message.size()});
+                });
+                return RAINWAY_ERROR_SUCCESS;
+            }
+
+            /// @brief The peer goes away: its state becomes `state` (closed or
+            /// failed), then its channels close and its handlers are released
+            void close_peer(const std::shared_ptr<PeerState>& peer, PeerConnection::State state = PeerConnection::RAINWAY_PEER_STATE_CLOSED)
+            {
+                post(peer->id, [this, peer, state]() {
+                    set_state(peer, state);
+                    log(RAINWAY_LOG_LEVEL_INFO, "rainway::local", ("Peer " + std::to_string(peer->id) + " disconnected").c_str());
+
+                    std::vector<std::shared_ptr<ChannelState>> channels;
+                    {
+                        std::lock_guard<std::mutex> lock(peer->mutex);
+                        channels.swap(peer->channels);
+                        peer->on_state = {};
+                        peer->on_stream_request = {};
+                        peer->on_channel_opened = {};
+                    }
+                    for (auto& channel : channels)
+                    {
+                        channel->open.store(false, std::memory_order_release);
+                        std::lock_guard<std::mutex> lock(channel->mutex);
+                        channel->on_data = {};
+                    }
+                });
+            }
+
+            /// @brief Block until every callback raised so far has run
+            void wait_idle()
+            {
+                while (completed.load(std::memory_order_acquire) < posted.load(std::memory_order_acquire))
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+
+            NetworkStats stats() const
+            {
+                NetworkStats result;
+                result.callbacks = completed.load(std::memory_order_relaxed);
+                result.unhandled = unhandled.load(std::memory_order_relaxed);
+                result.sends = sends.load(std::memory_order_relaxed);
+                result.send_failures = send_failures.load(std::memory_order_relaxed);
+                result.queue_delay = queue_delay.snapshot();
+                return result;
+            }
+
+            // The SDK surface's side of the network
+
+            Error start()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!lanes.empty())
+                    return RAINWAY_ERROR_ALREADY_INITIALIZED;
+
+                for (size_t i = 0; i < std::max<size_t>(1, config.callback_threads); i++)
+                {
+                    auto lane = lanes.emplace_back(std::make_unique<Lane>()).get();
+                    lane->thread = std::thread {[this, lane]() { run(*lane); }};
+                }
+                return RAINWAY_ERROR_SUCCESS;
+            }
+
+            void stop()
+            {
+                std::vector<std::unique_ptr<Lane>> stopping;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stopping.swap(lanes);
+                    on_peer_request = {};
+                }
+                for (auto& lane : stopping)
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(lane->mutex);
+                        lane->stopping = true;
+                    }
+                    lane->wake.notify_one();
+                    lane->thread.join();
+                }
+            }
+
+            void create_connection(Connection::CreatedCallback callback)
+            {
+                auto id = next_id++;
+                post(id, [id, callback = std::move(callback)]() {
+                    if (callback.success)
+                        callback.success(Connection {id});
+                });
+            }
+
+            void set_peer_request_handler(Connection::PeerConnectionRequestHandler handler)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                on_peer_request = std::move(handler);
+            }
+
+            void accept_peer(const std::shared_ptr<PeerState>& peer, IncomingConnectionRequest::AcceptCallback callback)
+            {
+                post(peer->id, [this, peer, callback = std::move(callback)]() {
+                    if (callback.success)
+                        callback.success(PeerConnection {peer});
+                    set_state(peer, PeerConnection::RAINWAY_PEER_STATE_CONNECTED);
+                    log(RAINWAY_LOG_LEVEL_INFO, "rainway::local", ("Peer " + std::to_string(peer->id) + " connected").c_str());
+                    if (events.peer_connected)
+                        events.peer_connected(peer->id);
+                });
+            }
+
+            void accept_stream(const std::shared_ptr<PeerState>& peer, OutboundStreamStartCallback callback)
+            {
+                auto stream = std::make_shared<StreamState>(StreamState {next_id++, peer->id});
+                post(peer->id, [this, stream, callback = std::move(callback)]() {
+                    if (callback.success)
+                        callback.success(OutboundStream {stream});
+                    if (events.stream_started)
+                        events.stream_started(stream->peer, stream->id);
+                });
+            }
+
+            Error send(const std::shared_ptr<ChannelState>& channel, const std::vector<uint8_t>& data)
+            {
+                if (!channel->open.load(std::memory_order_acquire))
+                {
+                    send_failures.fetch_add(1, std::memory_order_relaxed);
+                    return RAINWAY_ERROR_CHANNEL_CLOSED;
+                }
+
+                sends.fetch_add(1, std::memory_order_relaxed);
+                if (events.sent)
+                    events.sent(channel->id, data);
+                return RAINWAY_ERROR_SUCCESS;
+            }
+
+            void log(LogLevel level, const char* target, const char* message)
+            {
+                auto current = sink.load(std::memory_order_acquire);
+                if (current && level <= log_level.load(std::memory_order_relaxed))
+                    current(level, target, message);
+            }
+
+            std::atomic<LogSink> sink {nullptr};
+            std::atomic<LogLevel> log_level {RAINWAY_LOG_LEVEL_INFO};
+
+        private:
+            struct Task
+            {
+                std::function<void()> run;
+                std::chrono::steady_clock::time_point posted;
+            };
+
+            // One callback thread and its queue
+            struct Lane
+            {
+                std::mutex mutex;
+                std::condition_variable wake;
+                std::deque<Task> tasks;
+                bool stopping = false;
+                std::thread thread;
+            };
+
+            template <typename Handler>
+            static Handler locked(std::mutex& mutex, const Handler& handler)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                return handler;
+            }
+
+            void set_state(const std::shared_ptr<PeerState>& peer, PeerConnection::State state)
+            {
+                auto handler = [&] {
+                    std::lock_guard<std::mutex> lock(peer->mutex);
+                    peer->state = state;
+                    return peer->on_state;
+                }();
+                if (handler.handler)
+                    handler.handler(state);
+            }
+
+            // Callbacks for one peer always go to the same lane, so they stay in order
+            void post(uint64_t key, std::function<void()> run)
+            {
+                Lane* lane = nullptr;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (lanes.empty())
+                        return;
+                    lane = lanes[key % lanes.size()].get();
+                }
+
+                posted.fetch_add(1, std::memory_order_acq_rel);
+                {
+                    std::lock_guard<std::mutex> lock(lane->mutex);
+                    lane->tasks.push_back(Task {std::move(run), std::chrono::steady_clock::now()});
+                }
+                lane->wake.notify_one();
+            }
+
+            void run(Lane& lane)
+            {
+                std::unique_lock<std::mutex> lock(lane.mutex);
+                while (true)
+                {
+                    lane.wake.wait(lock, [&]() { return lane.stopping || !lane.tasks.empty(); });
+                    if (lane.stopping)
+                        break;
+
+                    auto task = std::move(lane.tasks.front());
+                    lane.tasks.pop_front();
+                    lock.unlock();
+
+                    queue_delay.record(std::chrono::steady_clock::now() - task.posted);
+                    task.run();
+                    task.run = nullptr;
+                    completed.fetch_add(1, std::memory_order_acq_rel);
+
+                    lock.lock();
+                }
+
+                // Whatever never ran still counts as done, so nothing waits on it
+                completed.fetch_add(lane.tasks.size(), std::memory_order_acq_rel);
+                lane.tasks.clear();
+            }
+
+            NetworkConfig config;
+            Events events;
+
+            std::mutex mutex;
+            std::vector<std::unique_ptr<Lane>> lanes;
+            Connection::PeerConnectionRequestHandler on_peer_request;
+
+            std::atomic<uint64_t> next_id {1};
+            std::atomic<uint64_t> posted {0};
+            std::atomic<uint64_t> completed {0};
+            std::atomic<uint64_t> unhandled {0};
+            std::atomic<uint64_t> sends {0};
+            std::atomic<uint64_t> send_failures {0};
+            metrics::Histogram queue_delay;
+        };
+
+        /// @brief The process's network, shared by every SDK object
+        inline Network& network()
+        {
+            static Network instance;
+            return instance;
+        }
+    } // namespace local
+
+    inline Error Initialize() { return local::network().start(); }
+    inline void Shutdown() { local::network().stop(); }
+
+    inline void SetLogLevel(LogLevel level, const char*) { local::network().log_level.store(level, std::memory_order_relaxed); }
+    inline void SetLogSink(LogSink sink) { local::network().sink.store(sink, std::memory_order_release); }
+
+    inline uint64_t OutboundStream::Id() const { return state->id; }
+
+    inline void OutboundStreamRequest::Accept(const OutboundStreamStartOptions&, OutboundStreamStartCallback callback)
+    {
+        local::network().accept_stream(peer, std::move(callback));
+    }
+
+    inline void DataChannel::SetDataChannelDataHandler(DataChannelDataHandler handler)
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->on_data = std::move(handler);
+    }
+
+    inline Error DataChannel::Send(const std::vector<uint8_t>& data) const { return local::network().send(state, data); }
+
+    inline uint64_t PeerConnection::Id() const { return state->id; }
+
+    inline void PeerConnection::SetStateChangeHandler(StateChangeHandler handler)
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->on_state = std::move(handler);
+    }
+
+    inline void PeerConnection::SetOutboundStreamRequestHandler(OutboundStreamRequestHandler handler)
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->on_stream_request = std::move(handler);
+    }
+
+    inline void PeerConnection::SetDataChannelOpenedHandler(DataChannelOpenedHandler handler)
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->on_channel_opened = std::move(handler);
+    }
+
+    inline uint64_t IncomingConnectionRequest::Id() const { return peer->id; }
+
+    inline void IncomingConnectionRequest::Accept(const PeerOptions&, AcceptCallback callback)
+    {
+        local::network().accept_peer(peer, std::move(callback));
+    }
+
+    inline void Connection::Create(const CreateOptions&, CreatedCallback callback)
+    {
+        local::network().create_connection(std::move(callback));
+    }
+
+    inline void Connection::SetPeerConnectionRequestHandler(PeerConnectionRequestHandler handler)
+    {
+        local::network().set_peer_request_handler(std::move(handler));
+    }
+} // namespace rainway
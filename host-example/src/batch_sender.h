@@ -0,0 +1,778 @@
+// A per-channel outbound queue in front of `DataChannel::Send`.
+//
+// Replies are queued rather than sent from the handler that produced them.
+// With coalescing on, small messages that arrive within a latency window go
+// out together in one `Send` (each framed with its length, see
+// `append_frame`/`split_batch`), and one too big for a batch goes alone,
+// framed in its own buffer; with it off every message is still sent on
+// its own, unframed, and one passed to `Send` with nothing queued or being
+// sent ahead of it goes straight from the caller's buffer without taking the
+// sender's lock. The queue tracks its bytes against a high and a low watermark: past
+// the high one it either drops the oldest queued messages or blocks the
+// producer until it has drained to the low one, and it reports backpressure
+// on and off at those two points. A failed `Send` is retried with backoff a
+// bounded number of times, and a batch that still fails is reported rather
+// than silently dropped. Closing the sender reports what it was still
+// holding the same way: queued messages as dropped, and a batch waiting to
+// be retried as failed.
+//
+// Coalescing windows and retry backoff are timed by a `Flusher`, one thread
+// shared by every sender.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace batch
+{
+    using Clock = std::chrono::steady_clock;
+
+    enum class OverflowPolicy
+    {
+        /// @brief Drop the oldest queued messages to make room
+        DropOldest,
+        /// @brief Block the producer until the queue drains to the low watermark
+        Block,
+    };
+
+    struct SenderConfig
+    {
+        /// @brief Send small messages together, length-framed; the receiver must
+        /// expect batches (see `split_batch`)
+        bool coalesce = false;
+        /// @brief Longest a message waits for others to share its send
+        std::chrono::microseconds window {2000};
+        /// @brief Largest batch, framing included; a bigger message goes alone
+        size_t max_batch_bytes = 16 * 1024;
+        /// @brief Queued bytes at which backpressure starts
+        size_t high_watermark = 1 << 20;
+        /// @brief Queued bytes at which backpressure ends
+        size_t low_watermark = 256 << 10;
+        OverflowPolicy overflow = OverflowPolicy::DropOldest;
+        /// @brief Longest a producer blocks under `OverflowPolicy::Block`
+        std::chrono::milliseconds block_timeout {100};
+        /// @brief Retries of a failed send before its messages are given up on
+        uint32_t retries = 3;
+        /// @brief Wait before the first retry, doubled for each one after
+        std::chrono::milliseconds retry_backoff {2};
+    };
+
+    enum class Enqueued
+    {
+        /// @brief Not queued: sent straight away
+        Sent,
+        Queued,
+        /// @brief Queued, after dropping older messages to make room
+        QueuedAfterDrop,
+        /// @brief Not queued: blocked for `block_timeout` without room
+        TimedOut,
+        /// @brief Not queued: the sender is closed
+        Closed,
+    };
+
+    struct SenderStats
+    {
+        uint64_t messages = 0;
+        uint64_t sends = 0;
+        uint64_t retries = 0;
+        /// @brief Messages dropped to make room
+        uint64_t dropped = 0;
+        /// @brief Messages given up on after every retry failed
+        uint64_t failed = 0;
+        /// @brief Enqueues that blocked without room until they timed out
+        uint64_t timed_out = 0;
+        /// @brief Times backpressure started
+        uint64_t backpressure_events = 0;
+        size_t queued_bytes = 0;
+        size_t queued_bytes_high_water = 0;
+    };
+
+    /// @brief Bytes of framing ahead of each message in a batch
+    constexpr size_t FRAME_HEADER = 4;
+
+    /// @brief Write the frame header for a `len` byte message to `dst`: its
+    /// length as a 32-bit little-endian integer
+    inline void write_frame_header(uint8_t* dst, size_t len)
+    {
+        auto length = (uint32_t)len;
+        dst[0] = (uint8_t)length;
+        dst[1] = (uint8_t)(length >> 8);
+        dst[2] = (uint8_t)(length >> 16);
+        dst[3] = (uint8_t)(length >> 24);
+    }
+
+    /// @brief Append `data` to `batch` as one frame: its header, then the bytes
+    inline void append_frame(std::vector<uint8_t>& batch, const uint8_t* data, size_t len)
+    {
+        uint8_t header[FRAME_HEADER];
+        write_frame_header(header, len);
+        batch.insert(batch.end(), header, header + FRAME_HEADER);
+        batch.insert(batch.end(), data, data + len);
+    }
+
+    /// @brief Call `each(data, len)` for every message in a coalesced batch
+    /// @return false if the batch is malformed (a frame runs past the end)
+    template <typename Each>
+    bool split_batch(const uint8_t* data, size_t len, Each&& each)
+    {
+        size_t offset = 0;
+        while (offset < len)
+        {
+            if (len - offset < FRAME_HEADER)
+                return false;
+
+            auto p = data + offset;
+            auto length = (size_t)p[0] | (size_t)p[1] << 8 | (size_t)p[2] << 16 | (size_t)p[3] << 24;
+            offset += FRAME_HEADER;
+            if (len - offset < length)
+                return false;
+
+            each(data + offset, length);
+            offset += length;
+        }
+        return true;
+    }
+
+    /// @brief Whatever `Send` returned means it worked: true, or a zero error
+    /// code such as RAINWAY_ERROR_SUCCESS
+    template <typename Result>
+    bool succeeded(const Result& result)
+    {
+        if constexpr (std::is_same<Result, bool>::value)
+            return result;
+        else
+            return result == Result {};
+    }
+
+    /// @brief Something a `Flusher` calls back when it asked to be
+    class Flushable
+    {
+    public:
+        virtual ~Flushable() = default;
+
+        /// @return When to be called again, if at all
+        virtual std::optional<Clock::time_point> flush(Clock::time_point now) = 0;
+    };
+
+    /// @brief One thread that flushes senders when their window or backoff ends
+    class Flusher
+    {
+    public:
+        Flusher() { thread = std::thread {[this]() { run(); }}; }
+
+        ~Flusher()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            changed.notify_one();
+            thread.join();
+        }
+
+        Flusher(const Flusher&) = delete;
+        Flusher& operator=(const Flusher&) = delete;
+
+        /// @brief Call `target` back at `at`, unless it has gone by then
+        void schedule(std::weak_ptr<Flushable> target, Clock::time_point at)
+        {
+            bool earliest;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                earliest = due.empty() || at < due.top().at;
+                due.push(Entry {at, sequence++, std::move(target)});
+            }
+            if (earliest)
+                changed.notify_one();
+        }
+
+    private:
+        struct Entry
+        {
+            Clock::time_point at;
+            uint64_t sequence;
+            std::weak_ptr<Flushable> target;
+
+            // Earliest first, and in the order scheduled when tied
+            bool operator<(const Entry& other) const
+            {
+                return at != other.at ? at > other.at : sequence > other.sequence;
+            }
+        };
+
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!stopping)
+            {
+                if (due.empty())
+                {
+                    changed.wait(lock);
+                    continue;
+                }
+
+                auto now = Clock::now();
+                if (due.top().at > now)
+                {
+                    changed.wait_until(lock, due.top().at);
+                    continue;
+                }
+
+                auto target = due.top().target.lock();
+                due.pop();
+                lock.unlock();
+
+                if (target)
+                {
+                    if (auto next = target->flush(now))
+                        schedule(target, *next);
+                }
+
+                lock.lock();
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::priority_queue<Entry> due;
+        uint64_t sequence = 0;
+        bool stopping = false;
+        std::thread thread;
+    };
+
+    /// @tparam Channel Anything with a `Send(const std::vector<uint8_t>&)`,
+    /// copied into the sender (a handle such as rainway::DataChannel)
+    template <typename Channel>
+    class BatchSender : public Flushable, public std::enable_shared_from_this<BatchSender<Channel>>
+    {
+    public:
+        using SendResult = decltype(std::declval<const Channel&>().Send(std::declval<const std::vector<uint8_t>&>()));
+
+        /// @brief Told about what happened to queued messages, on whichever
+        /// thread it happened; must not call back into the sender
+        struct Handlers
+        {
+            /// @brief `Send` succeeded, carrying this many messages
+            std::function<void(size_t messages)> sent;
+            /// @brief Messages dropped to make room
+            std::function<void(size_t messages)> dropped;
+            /// @brief Messages given up on after `Send` failed every retry
+            std::function<void(SendResult error, size_t messages)> failed;
+            /// @brief Backpressure started (true) or ended (false)
+            std::function<void(bool on)> backpressure;
+        };
+
+        BatchSender(Channel channel, Flusher& flusher, SenderConfig config = {}, Handlers handlers = {})
+            : channel(std::move(channel))
+            , flusher(flusher)
+            , config(config)
+            , handlers(std::move(handlers))
+        {
+            this->config.low_watermark = std::min(this->config.low_watermark, this->config.high_watermark);
+        }
+
+        BatchSender(const BatchSender&) = delete;
+        BatchSender& operator=(const BatchSender&) = delete;
+
+        /// @brief Queue a `len` byte message, written by `fill(uint8_t* dst)`
+        /// straight into the queue's buffer (after its frame header, when
+        /// coalescing)
+        template <typename Fill>
+        Enqueued enqueue(size_t len, Fill&& fill)
+        {
+            auto header = config.coalesce ? FRAME_HEADER : 0;
+            auto buffer = take_buffer();
+            buffer.resize(header + len);
+            if (header)
+                write_frame_header(buffer.data(), len);
+            fill(buffer.data() + header);
+            return push(std::move(buffer), len);
+        }
+
+        /// @brief Queue a copy of `data`
+        Enqueued enqueue(const uint8_t* data, size_t len)
+        {
+            return enqueue(len, [&](uint8_t* dst) { memcpy(dst, data, len); });
+        }
+
+        /// @brief The channel interface, so the sender can stand in for one.
+        /// Without coalescing, and with nothing queued, waiting to be retried
+        /// or being sent, `message` is sent from the caller's buffer; otherwise
+        /// a copy is queued.
+        Enqueued Send(const std::vector<uint8_t>& message)
+        {
+            if (!config.coalesce && send_direct(message))
+                return Enqueued::Sent;
+            return enqueue(message.data(), message.size());
+        }
+
+        /// @brief Whether a message has reached or would have passed the high
+        /// watermark, and the queue hasn't yet drained to the low one
+        bool backpressured() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return pressure;
+        }
+
+        /// @brief Send everything queued now, ignoring the coalescing window
+        void flush_now()
+        {
+            if (auto next = pump(Clock::now(), true))
+                flusher.schedule(this->weak_from_this(), *next);
+        }
+
+        /// @brief Drop everything queued and refuse more; wakes blocked
+        /// producers. Queued messages are counted and reported as dropped, and
+        /// a batch waiting to be retried as failed with the error it last got.
+        void close()
+        {
+            size_t dropped = 0;
+            size_t abandoned = 0;
+            SendResult error {};
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (closed)
+                    return;
+                closed = true;
+                dropped = queue.size();
+                counters.dropped += dropped;
+                waiting -= dropped;
+                while (!queue.empty())
+                {
+                    recycle(std::move(queue.front().bytes));
+                    queue.pop_front();
+                }
+                counters.queued_bytes = 0;
+
+                // A pump in progress gives up its own batch once it sees the close
+                if (!pumping)
+                    abandoned = abandon_batch(error);
+            }
+            drained.notify_all();
+
+            if (dropped && handlers.dropped)
+                handlers.dropped(dropped);
+            if (abandoned && handlers.failed)
+                handlers.failed(error, abandoned);
+        }
+
+        SenderStats stats() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto stats = counters;
+            auto direct = direct_sends.load(std::memory_order_relaxed);
+            stats.messages += direct;
+            stats.sends += direct;
+            return stats;
+        }
+
+    private:
+        std::optional<Clock::time_point> flush(Clock::time_point now) override { return pump(now, false); }
+
+        // Send `message` from the caller's buffer, without the lock, if nothing
+        // is waiting and nothing is being sent: holding `pumping` keeps the pump
+        // out, and a message queued meanwhile is pumped once it is let go. A
+        // failed send becomes the batch to retry, from a copy.
+        // @return false if `message` has to be queued instead
+        bool send_direct(const std::vector<uint8_t>& message)
+        {
+            if (closed || waiting != 0 || pumping.exchange(true))
+                return false;
+            if (waiting != 0)
+            {
+                release_pumping();
+                return false;
+            }
+
+            auto result = channel.Send(message);
+            if (succeeded(result))
+            {
+                // Only the thread holding `pumping` writes it
+                direct_sends.store(direct_sends.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                release_pumping();
+                if (handlers.sent)
+                    handlers.sent(1);
+                return true;
+            }
+
+            bool retry;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                counters.messages++;
+                retry = !closed && config.retries > 0;
+                if (retry)
+                {
+                    batch.assign(message.begin(), message.end());
+                    batch_messages = 1;
+                    waiting++;
+                    attempts = 1;
+                    last_error = result;
+                    counters.retries++;
+                    retry_at = Clock::now() + config.retry_backoff;
+                    pumping = false;
+                }
+                else
+                {
+                    counters.failed++;
+                }
+            }
+
+            if (retry)
+            {
+                flusher.schedule(this->weak_from_this(), retry_at);
+                return true;
+            }
+            release_pumping();
+            if (handlers.failed)
+                handlers.failed(result, 1);
+            return true;
+        }
+
+        // Let go of `pumping` after a direct send, then pump whatever was
+        // queued while it was held (whoever queued it couldn't)
+        void release_pumping()
+        {
+            pumping = false;
+            if (waiting != 0)
+            {
+                if (auto next = pump(Clock::now(), false))
+                    flusher.schedule(this->weak_from_this(), *next);
+            }
+        }
+
+        std::vector<uint8_t> take_buffer()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (spare.empty())
+                return {};
+            auto buffer = std::move(spare.back());
+            spare.pop_back();
+            spare_bytes -= buffer.capacity();
+            return buffer;
+        }
+
+        // Keep buffers for the next messages, so steady state doesn't allocate:
+        // any as big as the largest message seen (up to the high watermark),
+        // and together a batch's worth of small ones besides
+        void recycle(std::vector<uint8_t> buffer)
+        {
+            auto capacity = buffer.capacity();
+            auto largest = std::max(config.max_batch_bytes, std::min(largest_message + FRAME_HEADER, config.high_watermark));
+            if (capacity > 0 && capacity <= largest && spare_bytes + capacity <= largest + config.max_batch_bytes)
+            {
+                spare_bytes += capacity;
+                spare.push_back(std::move(buffer));
+            }
+        }
+
+        // `message` holds `len` bytes, after their frame header when coalescing
+        Enqueued push(std::vector<uint8_t> message, size_t len)
+        {
+            auto result = Enqueued::Queued;
+            size_t dropped = 0;
+            bool pressure_started = false;
+            bool send_now = false;
+            std::optional<Clock::time_point> window_end;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (closed)
+                    return Enqueued::Closed;
+
+                if (counters.queued_bytes + len > config.high_watermark && counters.queued_bytes > 0)
+                {
+                    // Over the watermark is backpressure, whatever is then
+                    // dropped or waited for to make room
+                    if (!pressure)
+                    {
+                        pressure = pressure_started = true;
+                        counters.backpressure_events++;
+                    }
+
+                    if (config.overflow == OverflowPolicy::Block)
+                    {
+                        // Say so before blocking, so whoever is told can stop producing
+                        if (pressure_started && handlers.backpressure)
+                        {
+                            pressure_started = false;
+                            lock.unlock();
+                            handlers.backpressure(true);
+                            lock.lock();
+                        }
+
+                        // Wait for the queue to drain to the low watermark (or for there to be room at all)
+                        auto has_room = [&]() {
+                            return closed || counters.queued_bytes == 0 || counters.queued_bytes + len <= config.low_watermark;
+                        };
+                        if (!drained.wait_for(lock, config.block_timeout, has_room))
+                        {
+                            counters.timed_out++;
+                            return Enqueued::TimedOut;
+                        }
+                        if (closed)
+                            return Enqueued::Closed;
+                    }
+                    else
+                    {
+                        while (!queue.empty() && counters.queued_bytes + len > config.high_watermark)
+                        {
+                            counters.queued_bytes -= queue.front().len;
+                            recycle(std::move(queue.front().bytes));
+                            queue.pop_front();
+                            dropped++;
+                        }
+                        counters.dropped += dropped;
+                        waiting -= dropped;
+                        result = Enqueued::QueuedAfterDrop;
+                    }
+                }
+
+                queue.push_back(Queued {std::move(message), len, Clock::now()});
+                largest_message = std::max(largest_message, len);
+                waiting++;
+                counters.messages++;
+                counters.queued_bytes += len;
+                counters.queued_bytes_high_water = std::max(counters.queued_bytes_high_water, counters.queued_bytes);
+
+                if (!pressure && counters.queued_bytes >= config.high_watermark)
+                {
+                    pressure = pressure_started = true;
+                    counters.backpressure_events++;
+                }
+
+                // Without coalescing there is nothing to wait for; with it, a
+                // full batch goes now and anything less waits for its window
+                if (!config.coalesce || counters.queued_bytes + queue.size() * FRAME_HEADER >= config.max_batch_bytes)
+                    send_now = true;
+                else if (queue.size() == 1)
+                    window_end = queue.front().at + config.window;
+            }
+
+            if (dropped && handlers.dropped)
+                handlers.dropped(dropped);
+            if (pressure_started && handlers.backpressure)
+                handlers.backpressure(true);
+
+            if (send_now)
+                window_end = pump(Clock::now(), false);
+            if (window_end)
+                flusher.schedule(this->weak_from_this(), *window_end);
+
+            return result;
+        }
+
+        // Send whatever is due, one batch at a time, until the queue is empty
+        // or has to wait; only one thread does this at a time, so batches go out
+        // in order
+        std::optional<Clock::time_point> pump(Clock::time_point now, bool force)
+        {
+            if (pumping.exchange(true))
+                return std::nullopt;
+
+            std::optional<Clock::time_point> next;
+            while (true)
+            {
+                bool pressure_ended = false;
+                size_t abandoned = 0;
+                SendResult error {};
+                bool taken;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (closed)
+                        abandoned = abandon_batch(error);
+                    taken = !closed && take_batch(now, force, next, pressure_ended);
+                    if (!taken)
+                        pumping = false;
+                }
+                if (abandoned && handlers.failed)
+                    handlers.failed(error, abandoned);
+                if (!taken)
+                    break;
+
+                if (pressure_ended)
+                {
+                    drained.notify_all();
+                    if (handlers.backpressure)
+                        handlers.backpressure(false);
+                }
+
+                auto result = channel.Send(batch);
+                if (succeeded(result))
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        counters.sends++;
+                    }
+                    if (handlers.sent)
+                        handlers.sent(batch_messages);
+                    finish_batch();
+                    continue;
+                }
+
+                last_error = result;
+                attempts++;
+                if (attempts > config.retries)
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        counters.failed += batch_messages;
+                    }
+                    if (handlers.failed)
+                        handlers.failed(result, batch_messages);
+                    finish_batch();
+                    continue;
+                }
+
+                {
+                    // Closed while sending: round again to give the batch up now
+                    // rather than wait out a retry
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (closed)
+                        continue;
+                    counters.retries++;
+                    retry_at = Clock::now() + config.retry_backoff * (1 << std::min<uint32_t>(attempts - 1, 16));
+                    next = retry_at;
+                    pumping = false;
+                }
+                break;
+            }
+            return next;
+        }
+
+        // With the lock held, and nothing pumping or the pump calling: give up
+        // on a batch waiting to be retried, counting its messages as failed
+        // @return How many messages it held, with the error it last got
+        size_t abandon_batch(SendResult& error)
+        {
+            auto abandoned = batch_messages;
+            counters.failed += abandoned;
+            error = last_error;
+            batch.clear();
+            finish_batch();
+            return abandoned;
+        }
+
+        // With the lock held: make `batch` the next thing to send, if anything is due
+        bool take_batch(Clock::time_point now, bool force, std::optional<Clock::time_point>& next, bool& pressure_ended)
+        {
+            // A failed batch is retried before anything queued after it
+            if (batch_messages > 0)
+            {
+                if (now < retry_at)
+                {
+                    next = retry_at;
+                    return false;
+                }
+                return true;
+            }
+
+            if (queue.empty())
+                return false;
+
+            // The oldest message's window is the batch's, so none waits longer than its own
+            if (config.coalesce && !force)
+            {
+                auto queued = counters.queued_bytes + queue.size() * FRAME_HEADER;
+                auto due = queue.front().at + config.window;
+                if (queued < config.max_batch_bytes && now < due)
+                {
+                    next = due;
+                    return false;
+                }
+            }
+
+            if (!config.coalesce || queue.front().bytes.size() > config.max_batch_bytes)
+            {
+                // On its own, from its own buffer: unframed when not
+                // coalescing, and already framed when it is
+                auto message = std::move(queue.front());
+                queue.pop_front();
+                counters.queued_bytes -= message.len;
+                recycle(std::move(batch));
+                batch = std::move(message.bytes);
+                batch_messages = 1;
+            }
+            else
+            {
+                // Each queued message is already framed
+                batch.clear();
+                while (!queue.empty() && batch.size() + queue.front().bytes.size() <= config.max_batch_bytes)
+                {
+                    auto& message = queue.front();
+                    batch.insert(batch.end(), message.bytes.begin(), message.bytes.end());
+                    counters.queued_bytes -= message.len;
+                    recycle(std::move(message.bytes));
+                    queue.pop_front();
+                    batch_messages++;
+                }
+            }
+
+            if (pressure && counters.queued_bytes <= config.low_watermark)
+                pressure = false, pressure_ended = true;
+            else if (config.overflow == OverflowPolicy::Block)
+                drained.notify_all();
+
+            return true;
+        }
+
+        void finish_batch()
+        {
+            waiting -= batch_messages;
+            batch_messages = 0;
+            attempts = 0;
+        }
+
+        struct Queued
+        {
+            /// @brief The message, after its frame header when coalescing
+            std::vector<uint8_t> bytes;
+            size_t len;
+            /// @brief When it was queued, which its window runs from
+            Clock::time_point at;
+        };
+
+        Channel channel;
+        Flusher& flusher;
+        SenderConfig config;
+        Handlers handlers;
+
+        mutable std::mutex mutex;
+        std::condition_variable drained;
+        std::deque<Queued> queue;
+        std::vector<std::vector<uint8_t>> spare;
+        size_t spare_bytes = 0;
+        size_t largest_message = 0;
+        bool pressure = false;
+        SenderStats counters;
+
+        // Read without the lock by `send_direct`. Whoever holds `pumping` is
+        // the one thread sending; `waiting` counts the messages queued or in a
+        // batch not yet finished with.
+        std::atomic<bool> pumping {false};
+        std::atomic<bool> closed {false};
+        std::atomic<size_t> waiting {0};
+        std::atomic<uint64_t> direct_sends {0};
+
+        // Owned by whichever thread is pumping
+        std::vector<uint8_t> batch;
+        size_t batch_messages = 0;
+        uint32_t attempts = 0;
+        SendResult last_error {};
+        Clock::time_point retry_at {};
+    };
+} // namespace batch
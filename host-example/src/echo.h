@@ -0,0 +1,241 @@
+// Allocation-free data channel echo.
+//
+// Each channel owns a small pool of reply buffers. A message is reversed
+// straight from the SDK's buffer into a pooled one (copy and reverse in a
+// single SIMD pass) and that buffer is handed to `Send`, so in steady state a
+// message costs no heap allocation and no intermediate copy. The pool takes
+// no lock, and neither does the channel's `batch::BatchSender` when it can
+// send the reply straight away.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "cpu_features.h"
+
+namespace echo
+{
+    /// @brief Write `src` into `dst` in reverse byte order. One byte at a time;
+    /// the reference the SIMD kernels are checked against.
+    inline void reverse_copy_scalar(const uint8_t* src, uint8_t* dst, size_t len)
+    {
+        for (size_t i = 0; i < len; i++)
+            dst[len - 1 - i] = src[i];
+    }
+
+#if defined(CPU_X86)
+    CPU_TARGET_SSE2 inline void reverse_copy_sse2(const uint8_t* src, uint8_t* dst, size_t len)
+    {
+        size_t i = 0;
+        for (; i + 16 <= len; i += 16)
+        {
+            auto v = _mm_loadu_si128((const __m128i*)(src + i));
+            // Reverse the 16-bit words, then swap the bytes within each word
+            v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+            v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+            v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            _mm_storeu_si128((__m128i*)(dst + len - i - 16), v);
+        }
+        reverse_copy_scalar(src + i, dst, len - i);
+    }
+
+    CPU_TARGET_AVX2 inline void reverse_copy_avx2(const uint8_t* src, uint8_t* dst, size_t len)
+    {
+        const auto mask = _mm256_setr_epi8(
+            15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+            15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+
+        size_t i = 0;
+        for (; i + 32 <= len; i += 32)
+        {
+            auto v = _mm256_loadu_si256((const __m256i*)(src + i));
+            // Reverse within each 128-bit lane, then swap the lanes
+            v = _mm256_shuffle_epi8(v, mask);
+            v = _mm256_permute2x128_si256(v, v, 0x01);
+            _mm256_storeu_si256((__m256i*)(dst + len - i - 32), v);
+        }
+        reverse_copy_scalar(src + i, dst, len - i);
+    }
+#endif
+
+#if defined(CPU_NEON)
+    inline void reverse_copy_neon(const uint8_t* src, uint8_t* dst, size_t len)
+    {
+        size_t i = 0;
+        for (; i + 16 <= len; i += 16)
+        {
+            auto v = vrev64q_u8(vld1q_u8(src + i));
+            v = vextq_u8(v, v, 8);
+            vst1q_u8(dst + len - i - 16, v);
+        }
+        reverse_copy_scalar(src + i, dst, len - i);
+    }
+#endif
+
+    using ReverseCopyFn = void (*)(const uint8_t*, uint8_t*, size_t);
+
+    /// @brief The fastest reverse-copy kernel this CPU supports
+    inline ReverseCopyFn select_reverse_copy()
+    {
+        const auto& features = cpu::features();
+#if defined(CPU_X86)
+        if (features.avx2)
+            return reverse_copy_avx2;
+        if (features.sse2)
+            return reverse_copy_sse2;
+#elif defined(CPU_NEON)
+        if (features.neon)
+            return reverse_copy_neon;
+#endif
+        (void)features;
+        return reverse_copy_scalar;
+    }
+
+    /// @brief Write `src` into `dst` (which must not overlap it) in reverse byte order
+    inline void reverse_copy(const uint8_t* src, uint8_t* dst, size_t len)
+    {
+        static const auto kernel = select_reverse_copy();
+        kernel(src, dst, len);
+    }
+
+    /// @brief Reusable message buffers for one data channel.
+    ///
+    /// Buffers keep their capacity between messages. The pool holds
+    /// `MAX_POOLED` buffers, each in a slot of its own: checking one out is a
+    /// single atomic exchange, and it goes back to the same slot, which
+    /// nothing else can fill while it is out, with a plain store, so neither
+    /// takes a lock. With every slot checked out a buffer is made for the
+    /// message alone. Buffers that grew beyond `max_retained_size` (one-off
+    /// huge messages) are released instead of pinning that memory.
+    class BufferPool
+    {
+    public:
+        static constexpr size_t MAX_POOLED = 4;
+
+        /// @brief A buffer checked out of a pool, returned to it on destruction
+        class Lease
+        {
+        public:
+            Lease(BufferPool& pool, size_t slot, std::unique_ptr<std::vector<uint8_t>> buffer)
+                : pool(&pool)
+                , slot(slot)
+                , buffer(std::move(buffer))
+            {
+            }
+
+            Lease(Lease&& other) noexcept
+                : pool(other.pool)
+                , slot(other.slot)
+                , buffer(std::move(other.buffer))
+            {
+                other.pool = nullptr;
+            }
+
+            Lease(const Lease&) = delete;
+            Lease& operator=(const Lease&) = delete;
+            Lease& operator=(Lease&&) = delete;
+
+            ~Lease()
+            {
+                if (pool)
+                    pool->release(slot, std::move(buffer));
+            }
+
+            std::vector<uint8_t>& get() { return *buffer; }
+
+        private:
+            BufferPool* pool;
+            size_t slot;
+            std::unique_ptr<std::vector<uint8_t>> buffer;
+        };
+
+        explicit BufferPool(size_t max_retained_size = 1 << 20)
+            : max_retained_size(max_retained_size)
+        {
+            for (auto& slot : slots)
+                slot = new std::vector<uint8_t>();
+        }
+
+        BufferPool(const BufferPool&) = delete;
+        BufferPool& operator=(const BufferPool&) = delete;
+
+        ~BufferPool()
+        {
+            for (auto& slot : slots)
+                delete slot.load();
+        }
+
+        /// @brief Check out a buffer resized to `len`. Only allocates when
+        /// every buffer is out or the one taken is smaller than `len`.
+        Lease acquire(size_t len)
+        {
+            std::unique_ptr<std::vector<uint8_t>> buffer;
+            size_t taken = MAX_POOLED;
+            for (size_t i = 0; i < MAX_POOLED && !buffer; i++)
+            {
+                if (slots[i].load(std::memory_order_relaxed) != nullptr)
+                {
+                    buffer.reset(slots[i].exchange(nullptr, std::memory_order_acquire));
+                    taken = i;
+                }
+            }
+            if (!buffer)
+            {
+                buffer = std::make_unique<std::vector<uint8_t>>();
+                taken = MAX_POOLED;
+            }
+
+            if (buffer->capacity() < len)
+                allocations.fetch_add(1, std::memory_order_relaxed);
+
+            buffer->resize(len);
+            return Lease {*this, taken, std::move(buffer)};
+        }
+
+        /// @brief How many times `acquire` had to grow or create a buffer
+        size_t allocation_count() const { return allocations.load(std::memory_order_relaxed); }
+
+    private:
+        void release(size_t slot, std::unique_ptr<std::vector<uint8_t>> buffer)
+        {
+            if (slot == MAX_POOLED)
+                return;
+
+            if (buffer->capacity() > max_retained_size)
+                *buffer = std::vector<uint8_t>();
+            slots[slot].store(buffer.release(), std::memory_order_release);
+        }
+
+        std::atomic<std::vector<uint8_t>*> slots[MAX_POOLED];
+        size_t max_retained_size;
+        std::atomic<size_t> allocations {0};
+    };
+
+    /// @brief Per-channel echo state: reverses each message into a pooled buffer
+    /// and sends it back
+    class EchoChannel
+    {
+    public:
+        /// @brief Send `data` back on `channel` reversed
+        /// @param channel Anything with a `Send(const std::vector<uint8_t>&)`,
+        /// such as a `batch::BatchSender`
+        /// @return Whatever `channel.Send` returns
+        template <typename Channel>
+        auto reply(Channel& channel, const uint8_t* data, size_t len)
+        {
+            auto lease = pool.acquire(len);
+            reverse_copy(data, lease.get().data(), len);
+            return channel.Send(lease.get());
+        }
+
+        const BufferPool& buffers() const { return pool; }
+
+    private:
+        BufferPool pool;
+    };
+} // namespace echo
@@ -0,0 +1,197 @@
+// The host's Rainway SDK handlers, shared by the host example and its load test.
+//
+// `handle_connection` installs them on a connection: every peer is accepted,
+// every stream request is accepted as a full desktop stream, and every data
+// channel message is echoed back reversed. Each peer has a session in a
+// `session::SessionTable` from being accepted until it fails or closes, when
+// its session is removed and its channels' queues released. Replies are
+// reversed into an `echo::EchoChannel`'s pooled buffers and go out through a
+// `batch::BatchSender` per channel, so a slow or failing channel queues,
+// sheds and retries rather than stalling the callback thread. They build
+// against the real rainwaysdk.h or the local stand-in in ../local-sdk
+// unchanged.
+
+#pragma once
+
+#include <iostream>
+#include <memory>
+
+#include "async_log.h"
+#include "batch_sender.h"
+#include "echo.h"
+#include "metrics.h"
+#include "rainwaysdk.h"
+#include "session_table.h"
+
+namespace host
+{
+    /// @brief Counts of connection, peer, stream and data channel events
+    struct HostMetrics {
+        explicit HostMetrics(metrics::Registry& registry)
+            : set(registry.create(""))
+        {
+        }
+
+        std::shared_ptr<metrics::MetricSet> set;
+        metrics::Counter& connections = set->counter("rainway_host_connections_total", "Connections to the Rainway Network made");
+        metrics::Counter& connectionFailures = set->counter("rainway_host_connection_failures_total", "Connections to the Rainway Network that failed");
+        metrics::Counter& peerRequests = set->counter("rainway_host_peer_requests_total", "Incoming peer connection requests");
+        metrics::Counter& peerAcceptFailures = set->counter("rainway_host_peer_accept_failures_total", "Peer connection requests that failed to be accepted");
+        metrics::Counter& peerStateChanges = set->counter("rainway_host_peer_state_changes_total", "Peer state changes");
+        metrics::Counter& sessionsOpened = set->counter("rainway_host_peer_sessions_opened_total", "Peer sessions opened, one per accepted peer");
+        metrics::Counter& sessionsClosed = set->counter("rainway_host_peer_sessions_closed_total", "Peer sessions closed when their peer failed or closed");
+        metrics::Counter& streams = set->counter("rainway_host_streams_created_total", "Outbound streams created");
+        metrics::Counter& channels = set->counter("rainway_host_channels_opened_total", "Data channels opened");
+        metrics::Counter& messages = set->counter("rainway_host_channel_messages_total", "Data channel messages received");
+        metrics::Counter& messageBytes = set->counter("rainway_host_channel_message_bytes_total", "Data channel bytes received");
+        metrics::Counter& sendFailures = set->counter("rainway_host_channel_send_failures_total", "Data channel replies that failed to send");
+        metrics::Counter& sendDrops = set->counter("rainway_host_channel_send_drops_total", "Data channel replies dropped because the channel's queue was full");
+        metrics::Counter& sends = set->counter("rainway_host_channel_sends_total", "Data channel sends, each carrying one or more replies");
+        metrics::Counter& backpressure = set->counter("rainway_host_channel_backpressure_total", "Times a data channel's reply queue passed its high watermark");
+        metrics::Histogram& replyTime = set->latency("rainway_host_channel_reply_seconds", "Time to echo a data channel message");
+    };
+
+    struct HostOptions {
+        /// @brief Print peer, stream and channel events
+        bool logEvents = true;
+        /// @brief Log a line for every data channel message. Off by default: without
+        /// `messageLog` the line is printed on the SDK's callback thread.
+        bool logMessages = false;
+        /// @brief Where message lines go when `logMessages` is on. Its writer thread
+        /// prints them, so the callback thread never waits on the console.
+        logging::Logger* messageLog = nullptr;
+        /// @brief How each data channel queues, batches and retries its replies
+        batch::SenderConfig replies = {};
+    };
+
+    /// @brief Handle the peers that connect through `conn`
+    /// @param hostMetrics Where events are counted; must outlive the connection
+    /// @param flusher Times every channel's batching and retries; must outlive the connection
+    /// @param sessions Where connected peers are kept; must outlive the connection
+    inline void handle_connection(
+        rainway::Connection conn,
+        HostMetrics& hostMetrics,
+        batch::Flusher& flusher,
+        session::SessionTable& sessions,
+        HostOptions options = {})
+    {
+        // set up the peer handler
+        conn.SetPeerConnectionRequestHandler(rainway::Connection::PeerConnectionRequestHandler{
+            [&hostMetrics, &flusher, &sessions, options](rainway::IncomingConnectionRequest req) {
+                hostMetrics.peerRequests.add();
+
+                // accept all requests, handling the created peer
+                req.Accept(rainway::PeerOptions{}, rainway::IncomingConnectionRequest::AcceptCallback{
+                    // on success
+                    [&hostMetrics, &flusher, &sessions, options](rainway::PeerConnection peer) {
+                        // the handlers below run long after this callback returns, so they keep the peer's id
+                        // rather than a reference to `peer`, and find its session by that id
+                        auto peerId = peer.Id();
+                        sessions.open(peerId);
+                        hostMetrics.sessionsOpened.add();
+
+                        // set a state change handler for the peer to log when it changes state,
+                        // and to let go of everything the peer had once it has failed or closed
+                        peer.SetStateChangeHandler(rainway::PeerConnection::StateChangeHandler {
+                            [&hostMetrics, &sessions, options, peerId](rainway::PeerConnection::State state) {
+                                hostMetrics.peerStateChanges.add();
+                                if (options.logEvents)
+                                    std::cout << "Peer " << peerId << " moved to state " << state << std::endl;
+
+                                if (state == rainway::PeerConnection::State::RAINWAY_PEER_STATE_FAILED || state == rainway::PeerConnection::State::RAINWAY_PEER_STATE_CLOSED) {
+                                    if (sessions.close(peerId))
+                                        hostMetrics.sessionsClosed.add();
+                                }
+                            }
+                        });
+
+                        // accept all stream requests, handling the created stream
+                        peer.SetOutboundStreamRequestHandler(rainway::PeerConnection::OutboundStreamRequestHandler {
+                            [&hostMetrics, &sessions, options, peerId](rainway::OutboundStreamRequest req) {
+                                // for this demo, we always create a full desktop, all permission stream
+                                // for your application, you probably want something better scoped than this
+                                rainway::OutboundStreamStartOptions config;
+                                config.type = rainway::StreamType::RAINWAY_STREAM_TYPE_FULL_DESKTOP;
+                                config.defaultPermissions = rainway::InputLevel::RAINWAY_INPUT_LEVEL_ALL;
+
+                                // accept the stream
+                                req.Accept(config, rainway::OutboundStreamStartCallback {
+                                    [&hostMetrics, &sessions, options, peerId](rainway::OutboundStream stream) {
+                                        hostMetrics.streams.add();
+                                        sessions.visit(peerId, [&](session::PeerSession& peerSession) { peerSession.add_stream(stream.Id()); });
+                                        if (options.logEvents)
+                                            std::cout << "Stream " << stream.Id() << " created" << std::endl;
+                                    },
+                                    // on failure
+                                    [](rainway::Error err) {
+                                        std::cout << "Error. Failed to accept stream: " << err << std::endl;
+                                    }
+                                });
+                            }
+                        });
+
+                        // monitor data channel creation, installing an echo handler on each one
+                        peer.SetDataChannelOpenedHandler(rainway::PeerConnection::DataChannelOpenedHandler {
+                            [&hostMetrics, &flusher, &sessions, options, peerId](rainway::DataChannel channel) {
+                                hostMetrics.channels.add();
+                                if (options.logEvents)
+                                    std::cout << "Channel " << channel.name << " created" << std::endl;
+
+                                // each channel sends its replies through a queue, from a pool of buffers so echoing doesn't allocate per message
+                                auto handlers = batch::BatchSender<rainway::DataChannel>::Handlers {};
+                                handlers.sent = [&hostMetrics](size_t) { hostMetrics.sends.add(); };
+                                handlers.dropped = [&hostMetrics](size_t messages) { hostMetrics.sendDrops.add(messages); };
+                                handlers.failed = [&hostMetrics, name = channel.name](rainway::Error err, size_t messages) {
+                                    hostMetrics.sendFailures.add(messages);
+                                    std::cout << "Failed to send data to channel " << name << " due to: " << err << std::endl;
+                                };
+                                handlers.backpressure = [&hostMetrics](bool on) {
+                                    if (on)
+                                        hostMetrics.backpressure.add();
+                                };
+                                auto replies = std::make_shared<batch::BatchSender<rainway::DataChannel>>(channel, flusher, options.replies, handlers);
+                                auto echoes = std::make_shared<echo::EchoChannel>();
+
+                                // the peer's session drops the channel's queued replies when the peer goes
+                                sessions.visit(peerId, [&](session::PeerSession& peerSession) {
+                                    peerSession.add_channel(channel.name, [queue = std::weak_ptr(replies)] {
+                                        if (auto replies = queue.lock())
+                                            replies->close();
+                                    });
+                                });
+
+                                // install the handler
+                                channel.SetDataChannelDataHandler(rainway::DataChannel::DataChannelDataHandler {
+                                    [=, &hostMetrics, &sessions](rainway::DataChannel::DataChannelDataEvent ev) {
+                                        if (options.logMessages) {
+                                            if (options.messageLog)
+                                                options.messageLog->write(logging::Level::Info, "host", "Got message");
+                                            else
+                                                std::cout << "Got message" << std::endl;
+                                        }
+                                        hostMetrics.messages.add();
+                                        hostMetrics.messageBytes.add(ev.len);
+                                        sessions.visit(peerId, [&](session::PeerSession& peerSession) { peerSession.touch(ev.len); });
+
+                                        // send the message back reversed, straight away when nothing is queued ahead of it
+                                        auto queued = [&] {
+                                            auto timer = metrics::ScopedTimer {&hostMetrics.replyTime};
+                                            return echoes->reply(*replies, ev.data, ev.len);
+                                        }();
+                                        if (queued == batch::Enqueued::TimedOut || queued == batch::Enqueued::Closed)
+                                            hostMetrics.sendDrops.add();
+                                    }
+                                });
+                            }
+                        });
+                    },
+                    // on failure
+                    [&hostMetrics](rainway::Error err) {
+                        hostMetrics.peerAcceptFailures.add();
+                        std::cout << "Error. Failed to accept connection: " << err << std::endl;
+                    }
+                });
+            },
+        });
+    }
+} // namespace host
@@ -0,0 +1,288 @@
+// A load test for the host's handlers, against the local Rainway SDK
+// stand-in (../local-sdk) instead of the Rainway Network. Use it as:
+//
+//     host-load-test [peers] [channels per peer] [messages/s per channel] [seconds] [callback threads] [message bytes] [coalescing window us]
+//
+// It connects the peers, has each request a stream and open its data
+// channels, then sends messages on every channel at the given rate for the
+// given time, spread evenly. The host runs the same handlers as host-example
+// (host_handlers.h), called back on the given number of callback threads.
+// A coalescing window above zero has each channel batch its replies for that
+// long (see batch_sender.h); the peers split the batches back up.
+// It prints how long setup took, the handlers' throughput, and latency
+// percentiles for each step, so the callback path's scaling limits show up
+// here rather than in production.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "rainwaysdk.h"
+#include "async_log.h"
+#include "host_handlers.h"
+#include "metrics.h"
+
+using Clock = std::chrono::steady_clock;
+
+/// @brief A data channel as the remote peer sees it: messages sent, and
+/// when, so each echo can be matched to the message it answers
+struct Probe
+{
+    std::shared_ptr<rainway::local::ChannelState> channel;
+    std::mutex mutex;
+    std::deque<Clock::time_point> in_flight;
+};
+
+void print_latency(const char* name, const metrics::HistogramSnapshot& latency)
+{
+    printf(
+        "  %-24s %9llu, p50 %9.1fus, p99 %9.1fus, p99.9 %9.1fus\n",
+        name,
+        (unsigned long long)latency.count,
+        latency.percentile(0.5) / 1e3,
+        latency.percentile(0.99) / 1e3,
+        latency.percentile(0.999) / 1e3);
+}
+
+int main(int argc, const char* argv[])
+{
+    const auto peer_count = argc > 1 ? (size_t)std::max(1, atoi(argv[1])) : 1000;
+    const auto channels_per_peer = argc > 2 ? (size_t)std::max(0, atoi(argv[2])) : 1;
+    const auto rate = argc > 3 ? std::max(0.0, atof(argv[3])) : 10.0;
+    const auto seconds = argc > 4 ? std::max(1, atoi(argv[4])) : 5;
+    const auto callback_threads = argc > 5 ? (size_t)std::max(1, atoi(argv[5])) : 4;
+    const auto message_bytes = argc > 6 ? (size_t)std::max(1, atoi(argv[6])) : 256;
+    const auto window_us = argc > 7 ? std::max(0, atoi(argv[7])) : 0;
+
+    printf(
+        "%zu peers x %zu channels at %.1f messages/s each for %ds, %zu callback threads, %zu byte messages, %s\n",
+        peer_count,
+        channels_per_peer,
+        rate,
+        seconds,
+        callback_threads,
+        message_bytes,
+        window_us ? (std::to_string(window_us) + "us coalescing window").c_str() : "no coalescing");
+
+    auto options = host::HostOptions {false, false};
+    options.replies.coalesce = window_us > 0;
+    options.replies.window = std::chrono::microseconds(window_us);
+
+    metrics::Registry registry;
+    auto hostMetrics = host::HostMetrics {registry};
+
+    // When each request was made, until the host's answer arrives
+    std::mutex pending_mutex;
+    std::unordered_map<uint64_t, Clock::time_point> pending;
+    metrics::Histogram connect_latency;
+    metrics::Histogram stream_latency;
+    metrics::Histogram channel_latency;
+    metrics::Histogram round_trip;
+
+    auto answered = [&](uint64_t key, metrics::Histogram& latency) {
+        auto now = Clock::now();
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        auto request = pending.find(key);
+        if (request == pending.end())
+            return;
+        latency.record(now - request->second);
+        pending.erase(request);
+    };
+
+    // Looked up without a lock; filled in before any message is sent
+    std::unordered_map<uint64_t, Probe*> probes;
+
+    auto events = rainway::local::Events {};
+    events.peer_connected = [&](uint64_t peer) { answered(peer, connect_latency); };
+    events.stream_started = [&](uint64_t peer, uint64_t) { answered(peer, stream_latency); };
+    events.channel_opened = [&](uint64_t, uint64_t channel) { answered(channel, channel_latency); };
+    events.sent = [&](uint64_t channel, const std::vector<uint8_t>& data) {
+        auto now = Clock::now();
+        auto probe = probes.find(channel);
+        if (probe == probes.end())
+            return;
+
+        size_t echoes = 1;
+        if (options.replies.coalesce)
+        {
+            echoes = 0;
+            batch::split_batch(data.data(), data.size(), [&](const uint8_t*, size_t) { echoes++; });
+        }
+
+        std::lock_guard<std::mutex> lock(probe->second->mutex);
+        for (; echoes > 0 && !probe->second->in_flight.empty(); echoes--)
+        {
+            round_trip.record(now - probe->second->in_flight.front());
+            probe->second->in_flight.pop_front();
+        }
+    };
+
+    auto& network = rainway::local::network();
+    network.configure(rainway::local::NetworkConfig {callback_threads}, events);
+
+    if (rainway::Initialize() != rainway::Error::RAINWAY_ERROR_SUCCESS)
+    {
+        printf("Error. Failed to initialize the local network\n");
+        return 1;
+    }
+
+    // The host example's log path, quietened so thousands of peers don't flood the output
+    static logging::Logger sdkLog {logging::LoggerConfig {logging::Level::Warn}};
+    sdkLog.start();
+    rainway::SetLogLevel(rainway::LogLevel::RAINWAY_LOG_LEVEL_INFO, nullptr);
+    rainway::SetLogSink([](rainway::LogLevel level, const char* target, const char* message) {
+        sdkLog.write((logging::Level)level, target, message);
+    });
+
+    batch::Flusher flusher;
+    session::SessionTable sessions;
+    std::promise<void> connected;
+    rainway::Connection::Create(rainway::Connection::CreateOptions {}, rainway::Connection::CreatedCallback {
+        [&](rainway::Connection conn) {
+            hostMetrics.connections.add();
+            host::handle_connection(conn, hostMetrics, flusher, sessions, options);
+            connected.set_value();
+        },
+        [&](rainway::Error) {
+            hostMetrics.connectionFailures.add();
+            connected.set_value();
+        }});
+    connected.get_future().wait();
+
+    auto cpu_start = std::clock();
+    auto setup_start = Clock::now();
+
+    std::vector<std::shared_ptr<rainway::local::PeerState>> peers;
+    for (size_t i = 0; i < peer_count; i++)
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        auto peer = peers.emplace_back(network.connect_peer());
+        pending[peer->id] = Clock::now();
+    }
+    network.wait_idle();
+
+    std::vector<std::unique_ptr<Probe>> channels;
+    for (auto& peer : peers)
+    {
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            pending[peer->id] = Clock::now();
+            network.request_stream(peer);
+        }
+
+        for (size_t c = 0; c < channels_per_peer; c++)
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            auto& probe = channels.emplace_back(std::make_unique<Probe>());
+            probe->channel = network.open_channel(peer, "echo-" + std::to_string(c));
+            pending[probe->channel->id] = Clock::now();
+            probes[probe->channel->id] = probe.get();
+        }
+    }
+    network.wait_idle();
+    auto setup = std::chrono::duration<double, std::milli>(Clock::now() - setup_start).count();
+    auto open_sessions = sessions.size();
+
+    // Every channel sends at `rate`, staggered so the load is even rather than in bursts
+    const auto message = std::vector<uint8_t>(message_bytes, 0x5a);
+    const auto total_rate = rate * (double)channels.size();
+    const auto duration = std::chrono::seconds(seconds);
+    uint64_t sent = 0;
+    uint64_t rejected = 0;
+
+    auto send_start = Clock::now();
+    if (total_rate > 0)
+    {
+        while (true)
+        {
+            auto elapsed = Clock::now() - send_start;
+            if (elapsed >= duration)
+                break;
+
+            auto due = (uint64_t)(std::chrono::duration<double>(elapsed).count() * total_rate);
+            for (; sent < due; sent++)
+            {
+                auto& probe = *channels[sent % channels.size()];
+                {
+                    std::lock_guard<std::mutex> lock(probe.mutex);
+                    probe.in_flight.push_back(Clock::now());
+                }
+                if (network.deliver(probe.channel, message.data(), message.size()) != rainway::Error::RAINWAY_ERROR_SUCCESS)
+                    rejected++;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    auto send_end = Clock::now();
+    network.wait_idle();
+    // Replies still waiting out a coalescing window
+    std::this_thread::sleep_for(std::chrono::microseconds(window_us) * 2);
+    network.wait_idle();
+    auto drain = std::chrono::duration<double, std::milli>(Clock::now() - send_end).count();
+    auto send_seconds = std::chrono::duration<double>(send_end - send_start).count();
+
+    // Every peer leaves; the host's handlers are released with them
+    auto close_start = Clock::now();
+    for (auto& peer : peers)
+        network.close_peer(peer);
+    network.wait_idle();
+    auto close = std::chrono::duration<double, std::milli>(Clock::now() - close_start).count();
+    auto leftover_sessions = sessions.size();
+
+    auto cpu = (double)(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+    auto stats = network.stats();
+    rainway::Shutdown();
+    sdkLog.stop();
+
+    printf(
+        "Setup: %llu peers, %llu streams and %llu channels in %.1fms; %zu sessions open\n",
+        (unsigned long long)hostMetrics.peerRequests.value(),
+        (unsigned long long)hostMetrics.streams.value(),
+        (unsigned long long)hostMetrics.channels.value(),
+        setup,
+        open_sessions);
+    print_latency("peer connect", connect_latency.snapshot());
+    print_latency("stream start", stream_latency.snapshot());
+    print_latency("channel open", channel_latency.snapshot());
+
+    auto echoed = hostMetrics.messages.value();
+    printf(
+        "Messages: %llu sent, %llu echoed (%.0f/s), %llu rejected, %llu failed to send; backlog drained in %.1fms\n",
+        (unsigned long long)sent,
+        (unsigned long long)echoed,
+        echoed / send_seconds,
+        (unsigned long long)rejected,
+        (unsigned long long)hostMetrics.sendFailures.value(),
+        drain);
+    printf(
+        "Replies: %llu sends (%.2f replies each), %llu dropped, %llu times over the high watermark\n",
+        (unsigned long long)hostMetrics.sends.value(),
+        hostMetrics.sends.value() ? (double)echoed / (double)hostMetrics.sends.value() : 0.0,
+        (unsigned long long)hostMetrics.sendDrops.value(),
+        (unsigned long long)hostMetrics.backpressure.value());
+    print_latency("echo handler", hostMetrics.replyTime.snapshot());
+    print_latency("round trip", round_trip.snapshot());
+    print_latency("callback queue", stats.queue_delay);
+
+    printf(
+        "Close: %zu peers in %.1fms, %llu state changes, %zu sessions left; %llu callbacks, %llu had no handler\n",
+        peers.size(),
+        close,
+        (unsigned long long)hostMetrics.peerStateChanges.value(),
+        leftover_sessions,
+        (unsigned long long)stats.callbacks,
+        (unsigned long long)stats.unhandled);
+    printf("CPU: %.3fs, %.1fus per message\n", cpu, echoed ? cpu * 1e6 / (double)echoed : 0.0);
+
+    return 0;
+}
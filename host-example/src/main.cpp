@@ -1,12 +1,27 @@
 #include <iostream>
 #include <string>
 #include <algorithm>
+#include <memory>
 #include <optional>
 #include "rainwaysdk.h"
+#include "async_log.h"
+#include "host_handlers.h"
+#include "metrics.h"
 
 // Mirrors rainway::RainwayLogLevel indicies for conversion to string
 const char *LOG_LEVEL_STR_MAP[] = {"Silent", "Error", "Warning", "Info", "Debug", "Trace"}; 
 
+// Counts of connection, peer, stream and data channel events, exported when
+// RAINWAY_EXAMPLES_METRICS is set (see common/metrics.h)
+metrics::Registry metricRegistry;
+host::HostMetrics hostMetrics {metricRegistry};
+
+// Flushes every data channel's batched and retried replies (see batch_sender.h)
+batch::Flusher replyFlusher;
+
+// Every connected peer's state (see session_table.h)
+session::SessionTable peerSessions;
+
 // host-example entry point
 // expects your API_KEY as the first and only argument
 int main(int argc, char *argv[])
@@ -27,11 +42,26 @@ int main(int argc, char *argv[])
     }
 
     // install the global logging handlers
+    // SDK messages are written by a background thread, so logging never blocks the SDK's threads
+    static logging::Logger sdkLog {
+        logging::LoggerConfig {logging::Level::Info},
+        [](std::string& line, const logging::Record& record) {
+            line += LOG_LEVEL_STR_MAP[(size_t)record.level];
+            line += " [";
+            line += record.target();
+            line += "] ";
+            line += record.message();
+            line += record.truncated ? "...\n" : "\n";
+        }};
+    sdkLog.start();
     rainway::SetLogLevel(rainway::LogLevel::RAINWAY_LOG_LEVEL_INFO, nullptr);
     rainway::SetLogSink([](rainway::LogLevel level, const char* target, const char* message) {
-         std::cout << LOG_LEVEL_STR_MAP[level] << " [" << target << "] " << message << std::endl;
+         sdkLog.write((logging::Level)level, target, message);
     });
 
+    // export the event counters, if asked to
+    auto metricsExporter = metrics::export_from_env(metricRegistry);
+
     // set up the connection config
     rainway::Connection::CreateOptions config;
     config.apiKey = apiKey;
@@ -41,76 +71,22 @@ int main(int argc, char *argv[])
     rainway::Connection::Create(config, rainway::Connection::CreatedCallback{
         // on success
         [](rainway::Connection conn) {
+            hostMetrics.connections.add();
+
             // log information about the SDK
             std::cout << "Connected to the Rainway Network as Peer " << conn.Id() << " using SDK version " << rainway::internal::rainway_version() << std::endl;
 
-            // set up the peer handler
-            conn.SetPeerConnectionRequestHandler(rainway::Connection::PeerConnectionRequestHandler{
-                [](rainway::IncomingConnectionRequest req) {
-                    // accept all requests, handling the created peer
-                    req.Accept(rainway::PeerOptions{}, rainway::IncomingConnectionRequest::AcceptCallback{
-                        // on success
-                        [](rainway::PeerConnection peer) {
-                            // set a state change handler for the peer to log when it changes state
-                            peer.SetStateChangeHandler(rainway::PeerConnection::StateChangeHandler {
-                                [&](rainway::PeerConnection::State state) {
-                                    std::cout << "Peer " << peer.Id() << " moved to state " << state << std::endl;
-                                }
-                            });
-
-                            // accept all stream requests, handling the created stream 
-                            peer.SetOutboundStreamRequestHandler(rainway::PeerConnection::OutboundStreamRequestHandler {
-                                [](rainway::OutboundStreamRequest req) {
-                                    // for this demo, we always create a full desktop, all permission stream
-                                    // for your application, you probably want something better scoped than this
-                                    rainway::OutboundStreamStartOptions config;
-                                    config.type = rainway::StreamType::RAINWAY_STREAM_TYPE_FULL_DESKTOP;
-                                    config.defaultPermissions = rainway::InputLevel::RAINWAY_INPUT_LEVEL_ALL;
-
-                                    // accept the stream
-                                    req.Accept(config, rainway::OutboundStreamStartCallback {
-                                        [](rainway::OutboundStream stream) {
-                                            std::cout << "Stream " << stream.Id() << " created" << std::endl;
-                                        }
-                                    });
-                                }
-                            });
-
-                            // monitor data channel creation, installing an echo handler on each one
-                            peer.SetDataChannelOpenedHandler(rainway::PeerConnection::DataChannelOpenedHandler {
-                                [](rainway::DataChannel channel) {
-                                    std::cout << "Channel " << channel.name << " created" << std::endl;
-
-                                    // install the handler
-                                    channel.SetDataChannelDataHandler(rainway::DataChannel::DataChannelDataHandler {
-                                        [=](rainway::DataChannel::DataChannelDataEvent ev) {
-                                            std::cout << "Got message" << std::endl;
-                                            // wrap the bit message in a vector
-                                            std::vector<uint8_t> input(ev.data, ev.data + (ev.len * sizeof(const uint8_t)));
-
-                                            // reverse the vector in place
-                                            std::reverse(input.begin(), input.end());
-
-                                            // send the peer the reversed vector message
-                                            auto hr = channel.Send(input);
-                                            if (hr != rainway::Error::RAINWAY_ERROR_SUCCESS) {
-                                                std::cout << "Failed to send data to channel " << channel.name << " due to: " << hr << std::endl;
-                                            }
-                                        }
-                                    });
-                                }
-                            });
-                        },
-                        // on failure
-                        [](rainway::Error err) {
-                             std::cout << "Error. Failed to accept connection: " << err << std::endl;
-                        }
-                    });
-                },
-            });
+            // accept every peer, stream and data channel (see host_handlers.h), logging each
+            // message through the SDK's logger so the callback thread doesn't wait on the console
+            auto options = host::HostOptions {};
+            options.logMessages = true;
+            options.messageLog = &sdkLog;
+            host::handle_connection(conn, hostMetrics, replyFlusher, peerSessions, options);
         },
         // on failure
         [](rainway::Error err) {
+            hostMetrics.connectionFailures.add();
+
             // log
             std::cout << "Error. Failed to connect to Rainway: " << err << std::endl;
         }
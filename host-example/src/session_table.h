@@ -0,0 +1,332 @@
+// The host's connected peers, by peer id.
+//
+// A `PeerSession` holds what the host knows about one peer: when it
+// connected and was last heard from, what it has sent, and its streams and
+// data channels. The fields every message touches sit on a cache line of
+// their own, away from the lists that only change when a stream or channel
+// opens.
+//
+// `SessionTable` maps peer ids to sessions for the SDK's callback threads. It
+// is split into shards, each an open-addressing (linear probing) table behind
+// its own reader-writer lock, so lookups from different threads rarely touch
+// the same lock and never block each other. A peer is removed by
+// backward-shift deletion, which leaves no tombstones behind, so tearing one
+// down costs the same however many peers have come and gone.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace session
+{
+    using Clock = std::chrono::steady_clock;
+
+    /// @brief One connected peer
+    class PeerSession
+    {
+    public:
+        explicit PeerSession(uint64_t id)
+            : id(id)
+            , connected_at(Clock::now())
+        {
+            activity.last_active.store(connected_at.time_since_epoch().count(), std::memory_order_relaxed);
+        }
+
+        PeerSession(const PeerSession&) = delete;
+        PeerSession& operator=(const PeerSession&) = delete;
+
+        const uint64_t id;
+        const Clock::time_point connected_at;
+
+        /// @brief Count a message of `bytes` from the peer
+        void touch(size_t bytes)
+        {
+            activity.messages.fetch_add(1, std::memory_order_relaxed);
+            activity.bytes.fetch_add(bytes, std::memory_order_relaxed);
+            activity.last_active.store(Clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+        }
+
+        uint64_t messages() const { return activity.messages.load(std::memory_order_relaxed); }
+        uint64_t bytes() const { return activity.bytes.load(std::memory_order_relaxed); }
+        Clock::time_point last_active() const
+        {
+            return Clock::time_point(Clock::duration(activity.last_active.load(std::memory_order_relaxed)));
+        }
+
+        void add_stream(uint64_t stream_id)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            streams.push_back(stream_id);
+        }
+
+        /// @brief Note an open data channel
+        /// @param close Called when the session closes, to release the channel's resources
+        /// @return false if the session has already closed (`close` has been called)
+        bool add_channel(std::string name, std::function<void()> close)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!closed)
+                {
+                    channels.push_back(Channel {std::move(name), std::move(close)});
+                    return true;
+                }
+            }
+            if (close)
+                close();
+            return false;
+        }
+
+        std::vector<uint64_t> stream_ids() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return streams;
+        }
+
+        size_t channel_count() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return channels.size();
+        }
+
+        /// @brief Close every channel; channels added after this are closed at once
+        void close()
+        {
+            std::vector<Channel> closing;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                closed = true;
+                closing.swap(channels);
+            }
+            for (auto& channel : closing)
+            {
+                if (channel.close)
+                    channel.close();
+            }
+        }
+
+    private:
+        struct Channel
+        {
+            std::string name;
+            std::function<void()> close;
+        };
+
+        // Written on every message, so kept off the cache line of anything else
+        struct alignas(64) Activity
+        {
+            std::atomic<uint64_t> messages {0};
+            std::atomic<uint64_t> bytes {0};
+            std::atomic<Clock::rep> last_active {0};
+        };
+
+        Activity activity;
+
+        alignas(64) mutable std::mutex mutex;
+        std::vector<uint64_t> streams;
+        std::vector<Channel> channels;
+        bool closed = false;
+    };
+
+    /// @brief Concurrent map of peer id to session
+    class SessionTable
+    {
+    public:
+        /// @param shards How many independently locked tables to split peers
+        /// across, rounded up to a power of two
+        explicit SessionTable(size_t shards = 64)
+        {
+            size_t count = 1;
+            while (count < shards)
+                count <<= 1;
+            shard_mask = count - 1;
+            shard_list = std::make_unique<Shard[]>(count);
+        }
+
+        SessionTable(const SessionTable&) = delete;
+        SessionTable& operator=(const SessionTable&) = delete;
+
+        /// @brief The session for `id`, created if it has none
+        std::shared_ptr<PeerSession> open(uint64_t id)
+        {
+            auto hash = mix(id);
+            auto& shard = shard_for(hash);
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+
+            auto slot = shard.find(hash, id);
+            if (slot != NONE)
+                return shard.slots[slot].session;
+
+            if ((shard.count + 1) * 10 > shard.slots.size() * 7)
+                shard.grow();
+
+            auto session = std::make_shared<PeerSession>(id);
+            shard.insert(hash, id, session);
+            total.fetch_add(1, std::memory_order_relaxed);
+            return session;
+        }
+
+        /// @return The session for `id`, or null if it has none
+        std::shared_ptr<PeerSession> find(uint64_t id) const
+        {
+            auto hash = mix(id);
+            auto& shard = shard_for(hash);
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+
+            auto slot = shard.find(hash, id);
+            return slot != NONE ? shard.slots[slot].session : nullptr;
+        }
+
+        /// @brief Call `fn(PeerSession&)` with the session for `id`, without
+        /// taking a reference to it; `fn` must not open or close sessions
+        /// @return false if `id` has no session
+        template <typename Fn>
+        bool visit(uint64_t id, Fn&& fn) const
+        {
+            auto hash = mix(id);
+            auto& shard = shard_for(hash);
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+
+            auto slot = shard.find(hash, id);
+            if (slot == NONE)
+                return false;
+            fn(*shard.slots[slot].session);
+            return true;
+        }
+
+        /// @brief Remove the session for `id` and close it
+        /// @return The closed session, or null if `id` had none
+        std::shared_ptr<PeerSession> close(uint64_t id)
+        {
+            auto hash = mix(id);
+            auto& shard = shard_for(hash);
+            std::shared_ptr<PeerSession> session;
+            {
+                std::unique_lock<std::shared_mutex> lock(shard.mutex);
+                auto slot = shard.find(hash, id);
+                if (slot == NONE)
+                    return nullptr;
+                session = shard.erase(slot);
+                total.fetch_sub(1, std::memory_order_relaxed);
+            }
+
+            // Outside the lock: closing releases the peer's channels
+            session->close();
+            return session;
+        }
+
+        size_t size() const { return total.load(std::memory_order_relaxed); }
+
+        /// @brief Call `fn(const PeerSession&)` for every session, one shard at a time
+        template <typename Fn>
+        void for_each(Fn&& fn) const
+        {
+            for (size_t i = 0; i <= shard_mask; i++)
+            {
+                std::shared_lock<std::shared_mutex> lock(shard_list[i].mutex);
+                for (auto& slot : shard_list[i].slots)
+                {
+                    if (slot.session)
+                        fn(static_cast<const PeerSession&>(*slot.session));
+                }
+            }
+        }
+
+    private:
+        static constexpr size_t NONE = SIZE_MAX;
+
+        struct Slot
+        {
+            uint64_t id = 0;
+            std::shared_ptr<PeerSession> session;
+        };
+
+        struct alignas(64) Shard
+        {
+            mutable std::shared_mutex mutex;
+            std::vector<Slot> slots = std::vector<Slot>(16);
+            size_t count = 0;
+
+            size_t find(uint64_t hash, uint64_t id) const
+            {
+                auto mask = slots.size() - 1;
+                for (auto i = (size_t)hash & mask;; i = (i + 1) & mask)
+                {
+                    if (!slots[i].session)
+                        return NONE;
+                    if (slots[i].id == id)
+                        return i;
+                }
+            }
+
+            void insert(uint64_t hash, uint64_t id, std::shared_ptr<PeerSession> session)
+            {
+                auto mask = slots.size() - 1;
+                auto i = (size_t)hash & mask;
+                while (slots[i].session)
+                    i = (i + 1) & mask;
+                slots[i] = Slot {id, std::move(session)};
+                count++;
+            }
+
+            void grow()
+            {
+                auto old = std::move(slots);
+                slots = std::vector<Slot>(old.size() * 2);
+                count = 0;
+                for (auto& slot : old)
+                {
+                    if (slot.session)
+                        insert(mix(slot.id), slot.id, std::move(slot.session));
+                }
+            }
+
+            // Empty `hole` and pull later entries of its probe run back over it,
+            // so lookups never need to step over deleted slots
+            std::shared_ptr<PeerSession> erase(size_t hole)
+            {
+                auto mask = slots.size() - 1;
+                auto session = std::move(slots[hole].session);
+                count--;
+
+                for (auto i = (hole + 1) & mask; slots[i].session; i = (i + 1) & mask)
+                {
+                    auto home = (size_t)mix(slots[i].id) & mask;
+                    if (((i - home) & mask) >= ((i - hole) & mask))
+                    {
+                        slots[hole] = std::move(slots[i]);
+                        hole = i;
+                    }
+                }
+                slots[hole].session.reset();
+                return session;
+            }
+        };
+
+        // Peer ids may be sequential; spread them over shards and slots alike
+        static uint64_t mix(uint64_t x)
+        {
+            x ^= x >> 30;
+            x *= 0xbf58476d1ce4e5b9ull;
+            x ^= x >> 27;
+            x *= 0x94d049bb133111ebull;
+            x ^= x >> 31;
+            return x;
+        }
+
+        Shard& shard_for(uint64_t hash) const { return shard_list[(hash >> 32) & shard_mask]; }
+
+        size_t shard_mask = 0;
+        std::unique_ptr<Shard[]> shard_list;
+        std::atomic<size_t> total {0};
+    };
+} // namespace session
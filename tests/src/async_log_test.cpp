@@ -0,0 +1,243 @@
+// Tests of the asynchronous logger through a capturing sink: calls above
+// the level are discarded before anything is formatted, repeats beyond the
+// burst and records that don't fit a full ring are counted and reported in
+// their place, each thread's records come out in the order it logged them,
+// and a thread logging to two loggers in turn keeps one ring in each.
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "async_log.h"
+#include "check.h"
+
+namespace
+{
+    /// @brief Keeps every line written, and counts the records formatted
+    struct Capture
+    {
+        std::mutex mutex;
+        std::string text;
+        std::atomic<uint64_t> formatted {0};
+        /// @brief Thread number of every record formatted
+        std::vector<uint32_t> threads;
+
+        logging::Format format()
+        {
+            return [this](std::string& line, const logging::Record& record) {
+                formatted++;
+                threads.push_back(record.thread);
+                logging::default_format(line, record);
+            };
+        }
+
+        logging::Output output()
+        {
+            return [this](const char* data, size_t size) {
+                std::lock_guard<std::mutex> lock(mutex);
+                text.append(data, size);
+            };
+        }
+
+        std::vector<std::string> lines()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::vector<std::string> result;
+            size_t start = 0;
+            for (auto end = text.find('\n'); end != std::string::npos; end = text.find('\n', start))
+            {
+                result.push_back(text.substr(start, end - start));
+                start = end + 1;
+            }
+            return result;
+        }
+
+        bool contains(const std::string& wanted)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return text.find(wanted) != std::string::npos;
+        }
+    };
+} // namespace
+
+TEST(log_discards_calls_above_the_level_before_formatting)
+{
+    auto capture = Capture {};
+    auto config = logging::LoggerConfig {};
+    config.level = logging::Level::Warn;
+    auto log = logging::Logger(config, capture.format(), capture.output());
+
+    log.write(logging::Level::Debug, "t", "debug");
+    log.write(logging::Level::Info, "t", "info");
+    log.write(logging::Level::Silent, "t", "silent");
+    log.flush();
+    CHECK_EQ(capture.formatted.load(), 0u);
+    CHECK_EQ(log.stats().written, 0u);
+
+    log.write(logging::Level::Error, "t", "error");
+    log.write(logging::Level::Warn, "t", "warn");
+    log.set_level(logging::Level::Debug);
+    log.write(logging::Level::Debug, "t", "debug");
+    log.flush();
+
+    auto lines = capture.lines();
+    CHECK_EQ(lines.size(), 3u);
+    CHECK(lines.size() == 3 && lines[0] == "error t: error" && lines[1] == "warn t: warn" && lines[2] == "debug t: debug");
+    CHECK_EQ(log.stats().written, 3u);
+}
+
+TEST(log_records_a_burst_of_repeats_and_counts_the_rest)
+{
+    auto capture = Capture {};
+    auto config = logging::LoggerConfig {};
+    config.repeat_burst = 3;
+    config.repeat_window = std::chrono::milliseconds(60000);
+    auto log = logging::Logger(config, capture.format(), capture.output());
+
+    for (int i = 0; i < 10; i++)
+        log.write(logging::Level::Info, "t", "again");
+    log.write(logging::Level::Info, "t", "different");
+    log.flush();
+
+    auto lines = capture.lines();
+    CHECK_EQ(lines.size(), 5u);
+    CHECK(lines.size() == 5 && lines[2] == "info t: again" && lines[3] == "info t: different");
+    CHECK(capture.contains("[log] thread 0 repeated its last message 7 more times\n"));
+
+    auto stats = log.stats();
+    CHECK_EQ(stats.written, 4u);
+    CHECK_EQ(stats.suppressed, 7u);
+}
+
+TEST(log_drops_what_a_full_ring_cannot_hold_and_says_so)
+{
+    auto capture = Capture {};
+    auto config = logging::LoggerConfig {};
+    config.ring_records = 4;
+    auto log = logging::Logger(config, capture.format(), capture.output());
+
+    for (int i = 0; i < 10; i++)
+        log.write(logging::Level::Info, "t", std::to_string(i).c_str());
+    log.flush();
+
+    // The oldest are kept; the writer reports what was lost in their place
+    auto lines = capture.lines();
+    CHECK_EQ(lines.size(), 5u);
+    CHECK(lines.size() == 5 && lines[0] == "info t: 0" && lines[3] == "info t: 3");
+    CHECK(capture.contains("[log] thread 0 dropped 6 messages\n"));
+    CHECK_EQ(log.stats().dropped, 6u);
+
+    // Drained, the ring takes more again
+    log.write(logging::Level::Info, "t", "after");
+    log.flush();
+    CHECK(capture.contains("info t: after\n"));
+    CHECK_EQ(log.stats().dropped, 6u);
+}
+
+TEST(log_truncates_long_messages)
+{
+    auto capture = Capture {};
+    auto log = logging::Logger({}, capture.format(), capture.output());
+
+    auto message = std::string(logging::RECORD_TEXT * 2, 'x');
+    log.write(logging::Level::Info, "t", message.c_str());
+    log.flush();
+
+    auto lines = capture.lines();
+    CHECK_EQ(lines.size(), 1u);
+    CHECK(lines.size() == 1 && lines[0] == "info t: " + std::string(logging::RECORD_TEXT - 1, 'x') + "...");
+}
+
+TEST(log_keeps_each_threads_records_in_order)
+{
+    const int threads = 4;
+    const int messages = 200;
+
+    auto capture = Capture {};
+    auto config = logging::LoggerConfig {};
+    config.ring_records = 1024;
+    config.flush_interval = std::chrono::milliseconds(1);
+    auto log = logging::Logger(config, capture.format(), capture.output());
+    log.start();
+
+    std::vector<std::thread> writers;
+    for (int t = 0; t < threads; t++)
+    {
+        writers.emplace_back([&log, t] {
+            auto target = "t" + std::to_string(t);
+            for (int i = 0; i < messages; i++)
+                log.write(logging::Level::Info, target.c_str(), std::to_string(i).c_str());
+        });
+    }
+    for (auto& writer : writers)
+        writer.join();
+    log.stop();
+
+    std::vector<int> next(threads, 0);
+    auto misordered = 0;
+    for (auto& line : capture.lines())
+    {
+        // "info tN: i"
+        auto t = line[6] - '0';
+        auto i = std::stoi(line.substr(line.find(": ") + 2));
+        misordered += i != next[t];
+        next[t] = i + 1;
+    }
+    CHECK_EQ(misordered, 0);
+    for (int t = 0; t < threads; t++)
+        CHECK_EQ(next[t], messages);
+    CHECK_EQ(log.stats().written, (uint64_t)(threads * messages));
+}
+
+TEST(log_thread_logging_to_two_loggers_keeps_a_ring_in_each)
+{
+    auto first_capture = Capture {};
+    auto second_capture = Capture {};
+    auto config = logging::LoggerConfig {};
+    config.max_threads = 1;
+    config.repeat_burst = 1000;
+    auto first = logging::Logger(config, first_capture.format(), first_capture.output());
+    auto second = logging::Logger(config, second_capture.format(), second_capture.output());
+
+    // Switching back and forth doesn't register a new ring each time, which
+    // with one ring allowed would leave nowhere to log
+    for (int i = 0; i < 50; i++)
+    {
+        first.write(logging::Level::Info, "a", "first");
+        second.write(logging::Level::Info, "b", "second");
+    }
+    first.flush();
+    second.flush();
+
+    CHECK_EQ(first.stats().written, 50u);
+    CHECK_EQ(second.stats().written, 50u);
+    CHECK_EQ(first.stats().unregistered, 0u);
+    CHECK_EQ(second.stats().unregistered, 0u);
+    for (auto thread : first_capture.threads)
+        CHECK_EQ(thread, 0u);
+    for (auto thread : second_capture.threads)
+        CHECK_EQ(thread, 0u);
+}
+
+TEST(log_thread_outliving_a_logger_can_use_a_new_one)
+{
+    auto capture = Capture {};
+    {
+        auto gone = logging::Logger({}, capture.format(), capture.output());
+        gone.write(logging::Level::Info, "t", "before");
+        gone.flush();
+    }
+
+    auto config = logging::LoggerConfig {};
+    config.max_threads = 1;
+    auto log = logging::Logger(config, capture.format(), capture.output());
+    log.write(logging::Level::Info, "t", "after");
+    log.flush();
+    CHECK(capture.contains("info t: after\n"));
+    CHECK_EQ(log.stats().unregistered, 0u);
+}
+
+TEST_MAIN()
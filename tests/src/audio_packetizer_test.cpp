@@ -0,0 +1,152 @@
+// Tests of the audio packetizer: whatever chunk sizes go in, packets come
+// out on a fixed-duration grid with timestamps from the sample position,
+// uneven rates alternate packet sizes without drifting, and a jump in the
+// input restarts the grid.
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "audio_packetizer.h"
+#include "check.h"
+
+namespace
+{
+    struct Packet
+    {
+        std::vector<int16_t> samples;
+        int64_t timestamp;
+    };
+
+    /// @brief Push `frames` stereo frames starting at stream position `start`,
+    /// in chunks of the sizes given in turn, collecting every packet
+    std::vector<Packet> packetize(audio::Packetizer& packets, uint64_t start, uint64_t frames, std::vector<size_t> chunks)
+    {
+        std::vector<Packet> out;
+        auto emit = [&](const int16_t* samples, size_t count, int64_t timestamp) {
+            out.push_back(Packet {std::vector<int16_t>(samples, samples + count * packets.channels()), timestamp});
+        };
+
+        std::vector<int16_t> pcm;
+        for (uint64_t position = start, i = 0; position < start + frames; i++)
+        {
+            auto n = std::min<uint64_t>(chunks[i % chunks.size()], start + frames - position);
+            pcm.resize(n * 2);
+            for (size_t f = 0; f < n; f++)
+                pcm[f * 2] = pcm[f * 2 + 1] = (int16_t)(position + f);
+
+            auto timestamp = (int64_t)(position * 10000000 / packets.sample_rate());
+            packets.push(pcm.data(), n, timestamp, emit);
+            position += n;
+        }
+        return out;
+    }
+} // namespace
+
+TEST(packetizer_cuts_fixed_duration_packets_from_any_chunk_size)
+{
+    auto packets = audio::Packetizer(48000, 2, 20);
+    CHECK_EQ(packets.max_packet_frames(), 960u);
+
+    auto out = packetize(packets, 0, 48000, {1024, 17, 480, 3000});
+
+    // A second of audio is exactly 50 packets of 960 frames, every one
+    // continuing where the last ended
+    CHECK_EQ(out.size(), 50u);
+    for (size_t p = 0; p < out.size(); p++)
+    {
+        CHECK_EQ(out[p].samples.size(), 960u * 2);
+        CHECK_EQ(out[p].timestamp, (int64_t)p * 200000);
+        CHECK_EQ(out[p].samples[0], (int16_t)(p * 960));
+        CHECK_EQ(out[p].samples.back(), (int16_t)(p * 960 + 959));
+    }
+
+    CHECK_EQ(packets.input_frames(), 48000u);
+    CHECK_EQ(packets.output_frames(), 48000u);
+    CHECK_EQ(packets.padded_frames(), 0u);
+    CHECK_EQ(packets.discontinuity_count(), 0u);
+}
+
+TEST(packetizer_alternates_sizes_at_uneven_rates_without_drift)
+{
+    // 30ms at 22050Hz is 661.5 frames: packets alternate between 661 and 662
+    auto packets = audio::Packetizer(22050, 2, 30);
+    auto out = packetize(packets, 0, 22050 * 6, {1000});
+
+    CHECK_EQ(out.size(), 200u);
+    uint64_t position = 0;
+    for (size_t p = 0; p < out.size(); p++)
+    {
+        auto frames = out[p].samples.size() / 2;
+        CHECK(frames == 661 || frames == 662);
+        CHECK_EQ(out[p].samples[0], (int16_t)position);
+
+        // Packet p starts at floor(p * 661.5) frames, whatever came before
+        CHECK_EQ(position, (uint64_t)p * 1323 / 2);
+        CHECK_EQ(out[p].timestamp, (int64_t)(position * 10000000 / 22050));
+        position += frames;
+    }
+    CHECK_EQ(position, 22050u * 6);
+}
+
+TEST(packetizer_starts_its_grid_at_the_first_timestamp)
+{
+    auto packets = audio::Packetizer(48000, 2, 10);
+
+    // Starting 2.5s in: the grid starts there, not at a multiple of 10ms
+    auto out = packetize(packets, 120013, 4800, {333});
+    CHECK_EQ(out.size(), 10u);
+    CHECK_EQ(out[0].samples[0], (int16_t)120013);
+    CHECK_EQ(out[0].timestamp, (int64_t)(120013ull * 10000000 / 48000));
+    CHECK_EQ(out[1].timestamp - out[0].timestamp, 100000);
+}
+
+TEST(packetizer_flush_pads_the_last_packet_with_silence)
+{
+    auto packets = audio::Packetizer(48000, 2, 20);
+    auto out = packetize(packets, 0, 1000, {1000});
+    CHECK_EQ(out.size(), 1u);
+
+    std::vector<Packet> flushed;
+    CHECK_EQ(packets.flush([&](const int16_t* samples, size_t frames, int64_t timestamp) {
+        flushed.push_back(Packet {std::vector<int16_t>(samples, samples + frames * 2), timestamp});
+    }), 1u);
+
+    CHECK_EQ(flushed.size(), 1u);
+    if (!flushed.empty())
+    {
+        CHECK_EQ(flushed[0].samples.size(), 960u * 2);
+        CHECK_EQ(flushed[0].timestamp, 200000);
+        CHECK_EQ(flushed[0].samples[0], 960);
+        CHECK_EQ(flushed[0].samples[39 * 2], 999);
+        CHECK_EQ(flushed[0].samples[40 * 2], 0);
+    }
+    CHECK_EQ(packets.padded_frames(), 920u);
+
+    // Nothing is pending any more
+    CHECK_EQ(packets.flush([](const int16_t*, size_t, int64_t) {}), 0u);
+}
+
+TEST(packetizer_restarts_the_grid_after_a_jump)
+{
+    auto packets = audio::Packetizer(48000, 2, 20);
+    auto first = packetize(packets, 0, 1500, {1500});
+    CHECK_EQ(first.size(), 1u);
+
+    // Half a second later: the pending 540 frames go out padded, and the
+    // packets after the jump are timed from where the input resumed
+    auto second = packetize(packets, 24000, 1920, {700});
+    CHECK_EQ(packets.discontinuity_count(), 1u);
+    CHECK_EQ(second.size(), 3u);
+    if (second.size() == 3)
+    {
+        CHECK_EQ(second[0].timestamp, 200000);
+        CHECK_EQ(second[0].samples[0], 960);
+        CHECK_EQ(second[1].timestamp, 5000000);
+        CHECK_EQ(second[1].samples[0], (int16_t)24000);
+        CHECK_EQ(second[2].timestamp, 5200000);
+    }
+    CHECK_EQ(packets.padded_frames(), 420u);
+}
+
+TEST_MAIN()
@@ -0,0 +1,395 @@
+// Tests of audio/video sync: the controller steps a jump in the offset out a
+// frame at a time, no faster than its step interval, or resamples a creep
+// away within its rate limit, and starts over when reset; the producer loop,
+// paced by a fake clock over a synthetic source with a gap injected in its
+// audio, drops frames for the gap and undoes them when a loop lines the
+// audio up with the video again.
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "av_sync.h"
+#include "check.h"
+#include "player_loop.h"
+#include "seek_index.h"
+
+namespace
+{
+    struct Frame
+    {
+        int64_t timestamp = 0;
+        uint64_t index = 0;
+    };
+
+    struct Chunk
+    {
+        std::vector<uint8_t> pcm;
+        int64_t timestamp = 0;
+    };
+
+    using Source = source::SyntheticSource<Frame>;
+
+    constexpr int64_t INTERVAL = 333333;
+
+    /// @brief Plays `seconds` of 30fps video against the controller, with the
+    /// audio `drift(now)` ahead of the media clock plus whatever its rate has
+    /// made up, and the video moved on or back a frame as it says
+    struct Playback
+    {
+        Playback(avsync::SyncConfig config, std::function<int64_t(int64_t)> drift)
+            : sync(config)
+            , drift(std::move(drift))
+        {
+        }
+
+        void play(double seconds)
+        {
+            for (int64_t end = now + (int64_t)(seconds * 1e7); now < end; now += INTERVAL)
+            {
+                stretch += (sync.audio_rate() - 1.0) * (double)INTERVAL;
+                auto action = sync.update(now, now + offset(), now + shift, INTERVAL);
+                if (action == avsync::Action::DropFrame)
+                {
+                    shift += INTERVAL;
+                    steps.push_back(now);
+                }
+                else if (action == avsync::Action::RepeatFrame)
+                {
+                    shift -= INTERVAL;
+                    steps.push_back(now);
+                }
+
+                rates.push_back(sync.audio_rate());
+                worst = std::max(worst, std::abs(offset() - shift));
+            }
+        }
+
+        /// @brief How far the audio is from the media clock, before correction
+        int64_t offset() const { return drift(now) + (int64_t)stretch; }
+
+        avsync::SyncController sync;
+        std::function<int64_t(int64_t)> drift;
+        int64_t now = 0;
+        int64_t shift = 0;
+        double stretch = 0.0;
+        std::vector<int64_t> steps;
+        std::vector<double> rates;
+        int64_t worst = 0;
+    };
+
+    /// @brief A jump of `by` in the audio at one second in
+    std::function<int64_t(int64_t)> jump(int64_t by)
+    {
+        return [by](int64_t now) { return now >= 10000000 ? by : 0; };
+    }
+
+    bool spaced(const std::vector<int64_t>& steps, int64_t interval)
+    {
+        for (size_t i = 1; i < steps.size(); i++)
+        {
+            if (steps[i] - steps[i - 1] < interval)
+                return false;
+        }
+        return true;
+    }
+
+    /// @brief A synthetic 30fps, 48kHz source whose audio leaves out `gap`
+    /// (in 100ns units) once `gap_at` audio frames have been read since the
+    /// start or the last seek, as a gap in a file's audio timestamps would,
+    /// and reports it as drift until the next seek
+    class GappedSource : public Source
+    {
+    public:
+        GappedSource(uint64_t frame_count, uint64_t gap_at, int64_t gap)
+            : Source(frame_count, 30, 48000, [](Frame& frame, uint64_t index) { frame.index = index; }, 30)
+            , gap_at(gap_at)
+            , gap(gap)
+        {
+        }
+
+        bool read_audio(audio::PcmRing& output, size_t max_frames) override
+        {
+            if (!skipped)
+                max_frames = (size_t)std::min<uint64_t>(max_frames, gap_at - position);
+
+            auto written = output.written_frames();
+            auto more = Source::read_audio(output, max_frames);
+            position += output.written_frames() - written;
+
+            if (!skipped && position >= gap_at)
+            {
+                auto frames = (size_t)(gap * 48000 / 10000000);
+                auto dropped = audio::PcmRing(frames, output.channels());
+                more = Source::read_audio(dropped, frames);
+                position += dropped.readable_frames();
+                skipped = true;
+            }
+            return more;
+        }
+
+        bool seek(const source::SeekPoint& keyframe) override
+        {
+            if (!Source::seek(keyframe))
+                return false;
+            position = keyframe.frame * 1600;
+            skipped = false;
+            return true;
+        }
+
+        int64_t audio_drift() const override { return skipped ? gap : 0; }
+
+    private:
+        uint64_t gap_at;
+        int64_t gap;
+        uint64_t position = 0;
+        bool skipped = false;
+    };
+
+    /// @brief Ends `inner` after `frames` video frames and their audio
+    class Limited : public source::FrameSource<Frame>
+    {
+    public:
+        Limited(source::FrameSource<Frame>& inner, uint64_t frames)
+            : inner(inner)
+            , frames(frames)
+            , audio_frames(frames * 1600)
+        {
+        }
+
+        source::VideoRead read_video(Frame& frame) override
+        {
+            if (shown >= frames)
+                return source::VideoRead::Ended;
+            auto read = inner.read_video(frame);
+            shown += read == source::VideoRead::Decoded ? 1 : 0;
+            return read;
+        }
+
+        bool skip_video() override { return shown++ < frames && inner.skip_video(); }
+
+        bool read_audio(audio::PcmRing& output, size_t max_frames) override
+        {
+            auto written = output.written_frames();
+            inner.read_audio(output, (size_t)std::min<uint64_t>(max_frames, audio_frames - audio_read));
+            audio_read += output.written_frames() - written;
+            return audio_read < audio_frames;
+        }
+
+        int64_t audio_drift() const override { return inner.audio_drift(); }
+        uint64_t audio_resyncs() const override { return inner.audio_resyncs(); }
+
+    private:
+        source::FrameSource<Frame>& inner;
+        uint64_t frames;
+        uint64_t audio_frames;
+        uint64_t shown = 0;
+        uint64_t audio_read = 0;
+    };
+} // namespace
+
+TEST(sync_controller_drops_frames_for_audio_ahead_until_within_tolerance)
+{
+    // A 100ms gap: three frames, half a second apart
+    auto playback = Playback({}, jump(1000000));
+    playback.play(10);
+
+    auto stats = playback.sync.stats();
+    CHECK_EQ(stats.frames_dropped, 3u);
+    CHECK_EQ(stats.frames_repeated, 0u);
+    CHECK(spaced(playback.steps, 5000000));
+    CHECK(std::abs(playback.offset() - playback.shift) <= INTERVAL / 2);
+    CHECK(std::abs(playback.sync.offset()) <= 200000);
+    CHECK_EQ(stats.offset_max, 1000000);
+}
+
+TEST(sync_controller_repeats_frames_for_audio_behind_until_within_tolerance)
+{
+    // A 70ms overlap: two frames leave it within the tolerance
+    auto playback = Playback({}, jump(-700000));
+    playback.play(10);
+
+    auto stats = playback.sync.stats();
+    CHECK_EQ(stats.frames_repeated, 2u);
+    CHECK_EQ(stats.frames_dropped, 0u);
+    CHECK(spaced(playback.steps, 5000000));
+    CHECK(std::abs(playback.offset() - playback.shift) <= 200000);
+}
+
+TEST(sync_controller_steps_no_faster_than_its_step_interval)
+{
+    // Half a second behind at once, with a slower step: a frame every two seconds
+    auto config = avsync::SyncConfig {};
+    config.step_interval = 20000000;
+    auto playback = Playback(config, jump(-5000000));
+    playback.play(12);
+
+    CHECK_EQ(playback.steps.size(), 6u);
+    CHECK(spaced(playback.steps, 20000000));
+
+    // Within the tolerance nothing is done at all
+    auto within = Playback({}, jump(150000));
+    within.play(10);
+    CHECK(within.steps.empty());
+
+    auto measuring = avsync::SyncConfig {};
+    measuring.correction = avsync::Correction::None;
+    auto measured = Playback(measuring, jump(1000000));
+    measured.play(10);
+    CHECK(measured.steps.empty());
+    CHECK(measured.sync.offset() > 990000);
+}
+
+TEST(sync_controller_resamples_a_creep_away_within_its_rate_limit)
+{
+    // 200ppm fast: 60ms over five minutes, more than the tolerance
+    auto config = avsync::SyncConfig {};
+    config.correction = avsync::Correction::Resample;
+    auto playback = Playback(config, [](int64_t now) { return now / 5000; });
+    playback.play(300);
+
+    // Only ever the nominal rate or the most it may be adjusted by, and back
+    // to nominal each time the offset is well inside the tolerance
+    size_t adjusted = 0;
+    size_t restored = 0;
+    for (size_t i = 0; i < playback.rates.size(); i++)
+    {
+        auto rate = playback.rates[i];
+        CHECK(rate == 1.0 || std::abs(rate - (1.0 - config.max_rate_adjust)) < 1e-12);
+        adjusted += rate != 1.0 ? 1 : 0;
+        restored += i > 0 && rate == 1.0 && playback.rates[i - 1] != 1.0 ? 1 : 0;
+    }
+    CHECK(adjusted > 0);
+    CHECK(restored > 0);
+    CHECK(playback.steps.empty());
+    CHECK(playback.worst <= config.tolerance + 10000);
+}
+
+TEST(sync_controller_corrects_past_the_resample_limit_on_video)
+{
+    // 150ms is more than resampling could take back in good time
+    auto config = avsync::SyncConfig {};
+    config.correction = avsync::Correction::Resample;
+    auto playback = Playback(config, jump(1500000));
+    playback.play(20);
+
+    // Two frames bring it within the limit, and resampling takes it from there
+    auto stats = playback.sync.stats();
+    CHECK_EQ(stats.frames_dropped, 2u);
+    CHECK(spaced(playback.steps, 5000000));
+    CHECK(std::abs(playback.sync.audio_rate() - (1.0 - config.max_rate_adjust)) < 1e-12);
+    auto left = playback.offset() - playback.shift;
+    CHECK(left < 1500000 - 2 * INTERVAL - 10000);
+    CHECK(left > 200000);
+}
+
+TEST(sync_controller_corrects_on_video_while_the_audio_cannot_be_resampled)
+{
+    // The same creep as above, from a source that leaves the rate alone
+    auto config = avsync::SyncConfig {};
+    config.correction = avsync::Correction::Resample;
+    auto playback = Playback(config, [](int64_t now) { return now / 5000; });
+    playback.sync.set_resamplable(false);
+    playback.play(300);
+
+    CHECK(!playback.steps.empty());
+    CHECK(spaced(playback.steps, config.step_interval));
+    CHECK_EQ(playback.sync.stats().rate_adjusted, 0u);
+
+    // And resamples once it can
+    playback.sync.set_resamplable(true);
+    playback.play(300);
+    CHECK(playback.sync.stats().rate_adjusted > 0);
+}
+
+TEST(sync_controller_starts_over_when_reset)
+{
+    auto config = avsync::SyncConfig {};
+    config.correction = avsync::Correction::Resample;
+    auto sync = avsync::SyncController(config);
+    for (int64_t now = 0; now < 30000000; now += INTERVAL)
+        sync.update(now, now + 400000, now, INTERVAL);
+    CHECK(sync.offset() > 300000);
+    CHECK(sync.audio_rate() != 1.0);
+
+    sync.reset();
+    CHECK_EQ(sync.offset(), 0);
+    CHECK_EQ(sync.audio_rate(), 1.0);
+    CHECK_EQ(sync.stats().resyncs, 1u);
+
+    // The first measurement after is taken as it is, not smoothed into the old ones
+    sync.update(30000000, 29900000, 30000000, INTERVAL);
+    CHECK_EQ(sync.offset(), -100000);
+    CHECK_EQ(sync.stats().offset_max, 400000);
+}
+
+TEST(producer_drops_frames_for_a_gap_and_undoes_them_when_the_audio_resyncs)
+{
+    // Four seconds looped twice, with 100ms left out of the audio half a
+    // second into each pass
+    auto media = GappedSource(120, 24000, 1000000);
+    auto index = seek::SeekIndex::every(120, 30, media.timestamp(120), [&](uint64_t frame) { return media.timestamp(frame); });
+    auto seeking_config = seek::SeekingConfig {};
+    seeking_config.loop = true;
+    seeking_config.sample_rate = 48000;
+    seeking_config.audio_read_frames = 1024;
+    auto seeking = seek::SeekingSource<Frame>(media, index, seeking_config);
+    auto limited = Limited(seeking, 240);
+
+    // Everything is decoded before playing starts, so what the worker does
+    // meanwhile doesn't depend on how the threads run
+    auto decode_config = source::DecodeAheadConfig {};
+    decode_config.video_frames = 256;
+    decode_config.pool_frames = 256;
+    decode_config.audio_frames = 400000;
+    auto decoder = source::DecodeAhead<Frame>(limited, [] { return std::make_shared<Frame>(); }, decode_config);
+    CHECK(test::eventually([&] { return decoder.stats().video_decoded == 240 && decoder.audio().readable_frames(240 * 1600) == 240 * 1600; }));
+
+    auto out = fanout::MediaFanout<Frame, Chunk>(512, 2048);
+    auto cursor = out.subscribe();
+    auto clock = pacing::FakeClock {};
+    auto stop = lifecycle::CancellationToken {};
+    auto config = player::ProducerConfig {};
+    config.sample_rate = 48000;
+    config.stop_at_end = true;
+    auto sync = avsync::SyncController {};
+    player::run_producer(out, decoder, clock, stop, config, nullptr, &sync);
+
+    // Three frames dropped for each gap, half a second apart, and none
+    // repeated: the loop put the video back rather than waiting for the
+    // controller to step it back
+    std::vector<uint64_t> missing;
+    uint64_t next = 0;
+    while (auto frame = out.next_video(cursor))
+    {
+        auto number = (uint64_t)std::llround((double)frame->timestamp * 30 / 1e7);
+        while (next < number)
+            missing.push_back(next++);
+        next = number + 1;
+    }
+    CHECK_EQ(next, 240u);
+    CHECK_EQ(missing.size(), 6u);
+    for (size_t i = 1; i < missing.size(); i++)
+    {
+        if (missing[i - 1] < 120 && missing[i] >= 120)
+            continue;
+        CHECK(missing[i] - missing[i - 1] >= 15);
+    }
+    if (missing.size() == 6)
+    {
+        CHECK(missing[0] >= 15 && missing[2] < 120);
+        CHECK(missing[3] >= 135);
+    }
+
+    auto stats = sync.stats();
+    CHECK_EQ(stats.frames_dropped, 6u);
+    CHECK_EQ(stats.frames_repeated, 0u);
+    CHECK_EQ(stats.resyncs, 1u);
+    CHECK(stats.offset_min > -200000);
+    CHECK(std::abs(sync.offset()) <= 200000);
+}
+
+TEST_MAIN()
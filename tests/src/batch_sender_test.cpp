@@ -0,0 +1,575 @@
+// Tests of the batch sender: without coalescing each message goes out on its
+// own as it's queued, or from the caller's buffer when passed to `Send`, with it small messages share a length-framed send up to
+// the batch size or the end of their window, a queue over its high watermark
+// drops its oldest messages or blocks the producer and reports backpressure
+// until it drains, a failed send is retried before it's given up on, and
+// closing reports what was still queued or waiting to be retried.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "batch_sender.h"
+#include "check.h"
+
+namespace
+{
+    using namespace std::chrono_literals;
+
+    /// @brief Stands in for the SDK's error codes, zero on success
+    enum class Error
+    {
+        Success,
+        Busy,
+    };
+
+    /// @brief A copyable handle to a stub data channel, as the SDK's are
+    struct StubChannel
+    {
+        struct State
+        {
+            std::mutex mutex;
+            std::vector<std::vector<uint8_t>> sent;
+            /// @brief Every send fails while the channel is down
+            bool down = false;
+            /// @brief Sends still to fail before the channel works again
+            int failures = 0;
+            uint64_t attempts = 0;
+        };
+
+        Error Send(const std::vector<uint8_t>& message) const
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->attempts++;
+            if (state->down || state->failures > 0)
+            {
+                state->failures -= state->failures > 0;
+                return Error::Busy;
+            }
+            state->sent.push_back(message);
+            return Error::Success;
+        }
+
+        void set_down(bool down) const
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->down = down;
+        }
+
+        std::vector<std::vector<uint8_t>> sent() const
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            return state->sent;
+        }
+
+        uint64_t attempts() const
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            return state->attempts;
+        }
+
+        std::shared_ptr<State> state = std::make_shared<State>();
+    };
+
+    using Sender = batch::BatchSender<StubChannel>;
+
+    /// @brief `len` bytes of `id`, so a message can be told apart wherever it ends up
+    std::vector<uint8_t> message(uint8_t id, size_t len) { return std::vector<uint8_t>(len, id); }
+
+    batch::Enqueued enqueue(Sender& sender, uint8_t id, size_t len)
+    {
+        auto bytes = message(id, len);
+        return sender.enqueue(bytes.data(), bytes.size());
+    }
+
+    /// @brief The messages in a coalesced batch
+    std::vector<std::vector<uint8_t>> split(const std::vector<uint8_t>& batch)
+    {
+        std::vector<std::vector<uint8_t>> messages;
+        CHECK(batch::split_batch(batch.data(), batch.size(), [&](const uint8_t* data, size_t len) { messages.emplace_back(data, data + len); }));
+        return messages;
+    }
+
+    /// @brief The first byte of each message sent, unframed
+    std::vector<uint8_t> ids(const std::vector<std::vector<uint8_t>>& messages)
+    {
+        std::vector<uint8_t> out;
+        for (const auto& m : messages)
+            out.push_back(m.empty() ? 0 : m[0]);
+        return out;
+    }
+
+    /// @brief A queue that goes over its high watermark at the third 300 byte
+    /// message held behind a failing send, and drains at the last one queued
+    batch::SenderConfig overflow_config(batch::OverflowPolicy overflow)
+    {
+        auto config = batch::SenderConfig {};
+        config.high_watermark = 900;
+        config.low_watermark = 300;
+        config.overflow = overflow;
+        config.retries = 100;
+        config.retry_backoff = 5ms;
+        return config;
+    }
+} // namespace
+
+TEST(sender_without_coalescing_sends_each_message_as_it_is_queued)
+{
+    auto channel = StubChannel {};
+    size_t sent = 0;
+    auto handlers = Sender::Handlers {};
+    handlers.sent = [&](size_t messages) { sent += messages; };
+    // Outlives the sender, and whatever its handlers use outlives both
+    auto flusher = batch::Flusher {};
+    auto sender = std::make_shared<Sender>(channel, flusher, batch::SenderConfig {}, handlers);
+
+    for (uint8_t id = 1; id <= 3; id++)
+    {
+        CHECK(enqueue(*sender, id, 10 * id) == batch::Enqueued::Queued);
+
+        // Sent from the caller before enqueue returns, unframed
+        auto messages = channel.sent();
+        CHECK_EQ(messages.size(), (size_t)id);
+        CHECK(messages.back() == message(id, 10 * id));
+    }
+
+    auto stats = sender->stats();
+    CHECK_EQ(sent, 3u);
+    CHECK_EQ(stats.messages, 3u);
+    CHECK_EQ(stats.sends, 3u);
+    CHECK_EQ(stats.queued_bytes, 0u);
+}
+
+TEST(sender_sends_a_message_passed_to_send_from_its_buffer_until_one_fails)
+{
+    auto channel = StubChannel {};
+    auto config = batch::SenderConfig {};
+    config.retry_backoff = 5ms;
+    auto flusher = batch::Flusher {};
+    auto sender = std::make_shared<Sender>(channel, flusher, config);
+
+    CHECK(sender->Send(message(1, 10)) == batch::Enqueued::Sent);
+    CHECK_EQ(channel.sent().size(), 1u);
+
+    // A failed one waits for its retry, and what follows queues behind it
+    channel.state->failures = 1;
+    CHECK(sender->Send(message(2, 10)) == batch::Enqueued::Sent);
+    CHECK(sender->Send(message(3, 10)) == batch::Enqueued::Queued);
+    CHECK(test::eventually([&] { return channel.sent().size() == 3; }));
+    CHECK(ids(channel.sent()) == (std::vector<uint8_t> {1, 2, 3}));
+
+    // Then sends go straight out again
+    CHECK(sender->Send(message(4, 10)) == batch::Enqueued::Sent);
+
+    auto stats = sender->stats();
+    CHECK_EQ(stats.messages, 4u);
+    CHECK_EQ(stats.sends, 4u);
+    CHECK_EQ(stats.retries, 1u);
+}
+
+TEST(sender_coalesces_small_messages_up_to_the_batch_size)
+{
+    auto channel = StubChannel {};
+    auto config = batch::SenderConfig {};
+    config.coalesce = true;
+    config.window = 1h;
+    config.max_batch_bytes = 64;
+    auto flusher = batch::Flusher {};
+    auto sender = std::make_shared<Sender>(channel, flusher, config);
+
+    // Four 10 byte messages and their framing fit in 64 bytes; the fifth
+    // fills the batch, which goes without it
+    for (uint8_t id = 1; id <= 4; id++)
+        enqueue(*sender, id, 10);
+    CHECK(channel.sent().empty());
+    enqueue(*sender, 5, 10);
+
+    auto sent = channel.sent();
+    CHECK_EQ(sent.size(), 1u);
+    if (sent.size() == 1)
+    {
+        CHECK_EQ(sent[0].size(), 4 * (batch::FRAME_HEADER + 10));
+        auto messages = split(sent[0]);
+        CHECK(ids(messages) == (std::vector<uint8_t> {1, 2, 3, 4}));
+        CHECK(messages[0] == message(1, 10));
+    }
+
+    // The fifth waits for its window, unless flushed; one too big for a
+    // batch goes alone, still framed
+    sender->flush_now();
+    enqueue(*sender, 6, 100);
+    sent = channel.sent();
+    CHECK_EQ(sent.size(), 3u);
+    if (sent.size() == 3)
+    {
+        CHECK(ids(split(sent[1])) == (std::vector<uint8_t> {5}));
+        auto big = split(sent[2]);
+        CHECK_EQ(big.size(), 1u);
+        CHECK(big.size() == 1 && big[0] == message(6, 100));
+    }
+    CHECK_EQ(sender->stats().sends, 3u);
+
+    // A batch cut short is refused
+    auto truncated = sent.empty() ? std::vector<uint8_t> {} : sent[0];
+    truncated.resize(truncated.size() ? truncated.size() - 1 : 3);
+    CHECK(!batch::split_batch(truncated.data(), truncated.size(), [](const uint8_t*, size_t) {}));
+}
+
+TEST(sender_sends_a_coalesced_message_at_the_end_of_its_window)
+{
+    auto channel = StubChannel {};
+    auto config = batch::SenderConfig {};
+    config.coalesce = true;
+    config.window = 5ms;
+    auto flusher = batch::Flusher {};
+    auto sender = std::make_shared<Sender>(channel, flusher, config);
+
+    enqueue(*sender, 1, 10);
+    enqueue(*sender, 2, 10);
+    CHECK(channel.sent().empty());
+
+    CHECK(test::eventually([&] { return !channel.sent().empty(); }));
+    auto sent = channel.sent();
+    CHECK_EQ(sent.size(), 1u);
+    CHECK(ids(split(sent[0])) == (std::vector<uint8_t> {1, 2}));
+}
+
+TEST(sender_sends_a_message_left_out_of_a_batch_at_the_end_of_its_own_window)
+{
+    auto channel = StubChannel {};
+    channel.state->failures = 1;
+    auto config = batch::SenderConfig {};
+    config.coalesce = true;
+    config.window = 300ms;
+    config.max_batch_bytes = 64;
+    config.retry_backoff = 200ms;
+    auto flusher = batch::Flusher {};
+    auto sender = std::make_shared<Sender>(channel, flusher, config);
+
+    // The fifth fills a batch of the first four, whose send fails; five more
+    // queue behind its retry, and the last of them doesn't fit the next batch
+    auto start = std::chrono::steady_clock::now();
+    for (uint8_t id = 1; id <= 9; id++)
+        enqueue(*sender, id, 10);
+
+    // Retried, then the next batch goes at once as it's full, and the one
+    // left out goes at the end of the window it has waited since it was
+    // queued, rather than one restarted by the batch before it
+    CHECK(test::eventually([&] { return channel.sent().size() == 3; }));
+    CHECK(std::chrono::steady_clock::now() - start < 450ms);
+    auto sent = channel.sent();
+    if (sent.size() == 3)
+    {
+        CHECK(ids(split(sent[0])) == (std::vector<uint8_t> {1, 2, 3, 4}));
+        CHECK(ids(split(sent[1])) == (std::vector<uint8_t> {5, 6, 7, 8}));
+        CHECK(ids(split(sent[2])) == (std::vector<uint8_t> {9}));
+    }
+}
+
+TEST(sender_sends_a_message_too_big_to_coalesce_from_its_own_buffer)
+{
+    auto channel = StubChannel {};
+    auto config = batch::SenderConfig {};
+    config.coalesce = true;
+    config.window = 1h;
+    config.max_batch_bytes = 64;
+    auto flusher = batch::Flusher {};
+    auto sender = std::make_shared<Sender>(channel, flusher, config);
+
+    // Framed as it was queued, so it goes as is, and its buffer is kept for
+    // the next one that size
+    for (uint8_t id = 1; id <= 3; id++)
+    {
+        enqueue(*sender, id, 1000);
+        auto sent = channel.sent();
+        CHECK_EQ(sent.size(), (size_t)id);
+        auto messages = split(sent.back());
+        CHECK(messages.size() == 1 && messages[0] == message(id, 1000));
+    }
+    CHECK_EQ(sender->stats().sends, 3u);
+}
+
+TEST(sender_drops_the_oldest_messages_over_its_high_watermark)
+{
+    auto channel = StubChannel {};
+    channel.set_down(true);
+
+    size_t dropped = 0;
+    std::vector<bool> pressure;
+    std::mutex pressure_mutex;
+    auto handlers = Sender::Handlers {};
+    handlers.dropped = [&](size_t messages) { dropped += messages; };
+    handlers.backpressure = [&](bool on) {
+        std::lock_guard<std::mutex> lock(pressure_mutex);
+        pressure.push_back(on);
+    };
+    auto flusher = batch::Flusher {};
+    auto sender = std::make_shared<Sender>(channel, flusher, overflow_config(batch::OverflowPolicy::DropOldest), handlers);
+
+    // The first is taken for a send that fails, and waits to be retried; the
+    // next three queue behind it up to the high watermark
+    for (uint8_t id = 1; id <= 4; id++)
+        CHECK(enqueue(*sender, id, 300) == batch::Enqueued::Queued);
+    CHECK(sender->backpressured());
+
+    // The fifth makes room by dropping the second
+    CHECK(enqueue(*sender, 5, 300) == batch::Enqueued::QueuedAfterDrop);
+    CHECK_EQ(dropped, 1u);
+
+    // Once the channel is back the retry sends the first, then the rest
+    // drain and backpressure ends
+    channel.set_down(false);
+    CHECK(test::eventually([&] { return channel.sent().size() == 4; }));
+    CHECK(ids(channel.sent()) == (std::vector<uint8_t> {1, 3, 4, 5}));
+    CHECK(!sender->backpressured());
+    {
+        std::lock_guard<std::mutex> lock(pressure_mutex);
+        CHECK(pressure == (std::vector<bool> {true, false}));
+    }
+
+    auto stats = sender->stats();
+    CHECK_EQ(stats.dropped, 1u);
+    CHECK_EQ(stats.backpressure_events, 1u);
+    CHECK_EQ(stats.queued_bytes_high_water, 900u);
+    CHECK(stats.retries >= 1);
+}
+
+TEST(sender_reports_backpressure_when_a_message_would_pass_its_high_watermark)
+{
+    // 400 byte messages never land exactly on the 900 byte watermark
+    for (auto overflow : {batch::OverflowPolicy::DropOldest, batch::OverflowPolicy::Block})
+    {
+        auto channel = StubChannel {};
+        channel.set_down(true);
+
+        std::vector<bool> pressure;
+        std::mutex pressure_mutex;
+        auto handlers = Sender::Handlers {};
+        handlers.backpressure = [&](bool on) {
+            std::lock_guard<std::mutex> lock(pressure_mutex);
+            pressure.push_back(on);
+        };
+        auto config = overflow_config(overflow);
+        config.block_timeout = 20ms;
+        auto flusher = batch::Flusher {};
+        auto sender = std::make_shared<Sender>(channel, flusher, config, handlers);
+
+        // The first waits to be retried, the next two queue 800 bytes
+        for (uint8_t id = 1; id <= 3; id++)
+            CHECK(enqueue(*sender, id, 400) == batch::Enqueued::Queued);
+        CHECK(!sender->backpressured());
+
+        // The fourth would take the queue to 1200
+        auto result = enqueue(*sender, 4, 400);
+        CHECK(result == (overflow == batch::OverflowPolicy::Block ? batch::Enqueued::TimedOut : batch::Enqueued::QueuedAfterDrop));
+        CHECK(sender->backpressured());
+        CHECK_EQ(sender->stats().backpressure_events, 1u);
+
+        // Another while it lasts is still the same backpressure
+        enqueue(*sender, 5, 400);
+        CHECK_EQ(sender->stats().backpressure_events, 1u);
+
+        channel.set_down(false);
+        CHECK(test::eventually([&] { return !sender->backpressured() && sender->stats().queued_bytes == 0; }));
+        {
+            std::lock_guard<std::mutex> lock(pressure_mutex);
+            CHECK(pressure == (std::vector<bool> {true, false}));
+        }
+    }
+}
+
+TEST(sender_blocks_the_producer_over_its_high_watermark_until_it_times_out)
+{
+    auto channel = StubChannel {};
+    channel.set_down(true);
+    auto config = overflow_config(batch::OverflowPolicy::Block);
+    config.block_timeout = 20ms;
+    auto flusher = batch::Flusher {};
+    auto sender = std::make_shared<Sender>(channel, flusher, config);
+
+    for (uint8_t id = 1; id <= 4; id++)
+        CHECK(enqueue(*sender, id, 300) == batch::Enqueued::Queued);
+
+    // Nothing drains while the channel is down: the fifth isn't queued, and
+    // nothing already queued is dropped for it
+    auto start = std::chrono::steady_clock::now();
+    CHECK(enqueue(*sender, 5, 300) == batch::Enqueued::TimedOut);
+    CHECK(std::chrono::steady_clock::now() - start >= 20ms);
+
+    auto stats = sender->stats();
+    CHECK_EQ(stats.timed_out, 1u);
+    CHECK_EQ(stats.dropped, 0u);
+    CHECK_EQ(stats.queued_bytes, 900u);
+
+    channel.set_down(false);
+    CHECK(test::eventually([&] { return channel.sent().size() == 4; }));
+    CHECK(ids(channel.sent()) == (std::vector<uint8_t> {1, 2, 3, 4}));
+}
+
+TEST(sender_blocked_producer_resumes_once_the_queue_drains)
+{
+    auto channel = StubChannel {};
+    channel.set_down(true);
+    auto config = overflow_config(batch::OverflowPolicy::Block);
+    config.block_timeout = 5s;
+    auto flusher = batch::Flusher {};
+    auto sender = std::make_shared<Sender>(channel, flusher, config);
+
+    for (uint8_t id = 1; id <= 4; id++)
+        enqueue(*sender, id, 300);
+
+    std::atomic<bool> done {false};
+    auto result = batch::Enqueued::Closed;
+    auto producer = std::thread([&]() {
+        result = enqueue(*sender, 5, 300);
+        done = true;
+    });
+
+    // Still blocked while nothing can drain
+    std::this_thread::sleep_for(20ms);
+    CHECK(!done);
+
+    channel.set_down(false);
+    CHECK(test::eventually([&] { return done.load(); }));
+    producer.join();
+    CHECK(result == batch::Enqueued::Queued);
+
+    CHECK(test::eventually([&] { return channel.sent().size() == 5; }));
+    CHECK(ids(channel.sent()) == (std::vector<uint8_t> {1, 2, 3, 4, 5}));
+    CHECK_EQ(sender->stats().timed_out, 0u);
+}
+
+TEST(sender_retries_a_failed_send)
+{
+    auto channel = StubChannel {};
+    channel.state->failures = 2;
+    auto config = batch::SenderConfig {};
+    config.retries = 3;
+    config.retry_backoff = 1ms;
+    size_t failed = 0;
+    auto handlers = Sender::Handlers {};
+    handlers.failed = [&](Error, size_t messages) { failed += messages; };
+    auto flusher = batch::Flusher {};
+    auto sender = std::make_shared<Sender>(channel, flusher, config, handlers);
+
+    // Fails twice, then goes on the second retry
+    enqueue(*sender, 1, 10);
+    CHECK(test::eventually([&] { return channel.sent().size() == 1; }));
+    CHECK_EQ(channel.attempts(), 3u);
+
+    auto stats = sender->stats();
+    CHECK_EQ(stats.retries, 2u);
+    CHECK_EQ(stats.sends, 1u);
+    CHECK_EQ(stats.failed, 0u);
+    CHECK_EQ(failed, 0u);
+}
+
+TEST(sender_reports_a_send_that_fails_every_retry)
+{
+    auto channel = StubChannel {};
+    channel.set_down(true);
+    auto config = batch::SenderConfig {};
+    config.retries = 2;
+    config.retry_backoff = 1ms;
+
+    std::atomic<size_t> failed {0};
+    std::atomic<bool> busy {false};
+    auto handlers = Sender::Handlers {};
+    handlers.failed = [&](Error error, size_t messages) {
+        busy = error == Error::Busy;
+        failed += messages;
+    };
+    auto flusher = batch::Flusher {};
+    auto sender = std::make_shared<Sender>(channel, flusher, config, handlers);
+
+    // Tried once and retried twice, then given up on with the last error
+    enqueue(*sender, 1, 10);
+    CHECK(test::eventually([&] { return failed == 1; }));
+    CHECK(busy);
+    CHECK_EQ(channel.attempts(), 3u);
+    CHECK_EQ(sender->stats().failed, 1u);
+
+    // What's queued after it isn't held up
+    channel.set_down(false);
+    enqueue(*sender, 2, 10);
+    CHECK(test::eventually([&] { return channel.sent().size() == 1; }));
+    CHECK(ids(channel.sent()) == (std::vector<uint8_t> {2}));
+}
+
+TEST(sender_close_reports_queued_messages_as_dropped)
+{
+    auto channel = StubChannel {};
+    auto config = batch::SenderConfig {};
+    config.coalesce = true;
+    config.window = 10s;
+
+    std::atomic<size_t> dropped {0};
+    auto handlers = Sender::Handlers {};
+    handlers.dropped = [&](size_t messages) { dropped += messages; };
+    auto flusher = batch::Flusher {};
+    auto sender = std::make_shared<Sender>(channel, flusher, config, handlers);
+
+    // Waiting out their window when the sender closes
+    for (uint8_t id = 1; id <= 3; id++)
+        enqueue(*sender, id, 10);
+    sender->close();
+
+    CHECK_EQ(dropped.load(), 3u);
+    auto stats = sender->stats();
+    CHECK_EQ(stats.dropped, 3u);
+    CHECK_EQ(stats.queued_bytes, 0u);
+    CHECK(enqueue(*sender, 4, 10) == batch::Enqueued::Closed);
+    CHECK(channel.sent().empty());
+
+    // Closing again reports nothing more
+    sender->close();
+    CHECK_EQ(dropped.load(), 3u);
+}
+
+TEST(sender_close_reports_a_batch_waiting_to_be_retried_as_failed)
+{
+    auto channel = StubChannel {};
+    channel.set_down(true);
+    auto config = batch::SenderConfig {};
+    config.retries = 100;
+    config.retry_backoff = 20ms;
+
+    std::atomic<size_t> failed {0};
+    std::atomic<size_t> dropped {0};
+    std::atomic<bool> busy {false};
+    auto handlers = Sender::Handlers {};
+    handlers.failed = [&](Error error, size_t messages) {
+        busy = error == Error::Busy;
+        failed += messages;
+    };
+    handlers.dropped = [&](size_t messages) { dropped += messages; };
+    auto flusher = batch::Flusher {};
+    auto sender = std::make_shared<Sender>(channel, flusher, config, handlers);
+
+    // The first fails and waits to be retried, holding up the two after it
+    enqueue(*sender, 1, 10);
+    CHECK(test::eventually([&] { return sender->stats().retries >= 1; }));
+    enqueue(*sender, 2, 10);
+    enqueue(*sender, 3, 10);
+    sender->close();
+
+    // Given up on by the close, or by a retry already under way when it came
+    CHECK(test::eventually([&] { return failed == 1; }));
+    CHECK(busy);
+    CHECK_EQ(dropped.load(), 2u);
+    auto stats = sender->stats();
+    CHECK_EQ(stats.failed, 1u);
+    CHECK_EQ(stats.dropped, 2u);
+
+    // The retry that was due finds nothing to send
+    auto attempts = channel.attempts();
+    std::this_thread::sleep_for(60ms);
+    CHECK_EQ(channel.attempts(), attempts);
+    CHECK_EQ(sender->stats().failed, 1u);
+}
+
+TEST_MAIN()
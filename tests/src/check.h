@@ -0,0 +1,137 @@
+// A minimal unit test harness.
+//
+// A test is a function declared with `TEST(name)`, and `CHECK`/`CHECK_EQ`
+// inside it record a failure, with where and what, without stopping the test.
+// Each test executable ends with `TEST_MAIN()`, runs every test it declares
+// (or only those whose name contains its first argument) and exits non-zero
+// if any check failed, which is all ctest looks at.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cpu_features.h"
+
+namespace test
+{
+    struct Registry
+    {
+        std::vector<std::pair<std::string, std::function<void()>>> tests;
+        uint64_t failures = 0;
+
+        static Registry& instance()
+        {
+            static Registry registry;
+            return registry;
+        }
+    };
+
+    struct Registration
+    {
+        Registration(const char* name, std::function<void()> run)
+        {
+            Registry::instance().tests.emplace_back(name, std::move(run));
+        }
+    };
+
+    inline void fail(const char* file, int line, const std::string& what)
+    {
+        Registry::instance().failures++;
+        printf("%s:%d: check failed: %s\n", file, line, what.c_str());
+        fflush(stdout);
+    }
+
+    /// @brief Every instruction set level this CPU can run ("scalar", "sse2",
+    /// "sse41", "avx2", "neon"), each with the features capped to it, so a
+    /// kernel selected from them can be checked against the scalar one
+    inline std::vector<std::pair<std::string, cpu::Features>> feature_levels()
+    {
+        auto detected = cpu::detect_features();
+        std::vector<std::pair<std::string, cpu::Features>> levels {{"scalar", cpu::Features {}}};
+        if (detected.sse2)
+            levels.emplace_back("sse2", cpu::cap_features(detected, "sse2"));
+        if (detected.sse41)
+            levels.emplace_back("sse41", cpu::cap_features(detected, "sse41"));
+        if (detected.avx2 || detected.neon)
+            levels.emplace_back(detected.avx2 ? "avx2" : "neon", detected);
+        return levels;
+    }
+
+    /// @brief Poll `condition` until it holds or `timeout` passes, for waiting
+    /// on another thread without sleeping a fixed time
+    /// @return Whether it held
+    template <typename Condition>
+    bool eventually(Condition condition, std::chrono::milliseconds timeout = std::chrono::milliseconds(5000))
+    {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (!condition())
+        {
+            if (std::chrono::steady_clock::now() > deadline)
+                return false;
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+        return true;
+    }
+
+    template <typename A, typename B>
+    void check_equal(const A& a, const B& b, const char* expression, const char* file, int line)
+    {
+        if (a == b)
+            return;
+
+        std::ostringstream what;
+        what << expression << " (" << a << " != " << b << ")";
+        fail(file, line, what.str());
+    }
+
+    /// @brief Run the registered tests whose name contains `filter`
+    /// @return The process exit code: 0 if every check passed
+    inline int run(const char* filter)
+    {
+        auto& registry = Registry::instance();
+        size_t ran = 0;
+        for (auto& [name, test] : registry.tests)
+        {
+            if (filter && name.find(filter) == std::string::npos)
+                continue;
+
+            auto before = registry.failures;
+            printf("%-72s", name.c_str());
+            fflush(stdout);
+            test();
+            printf("%s\n", registry.failures == before ? "ok" : "FAILED");
+            ran++;
+        }
+
+        printf("%zu tests, %llu failed checks\n", ran, (unsigned long long)registry.failures);
+        return registry.failures == 0 && ran > 0 ? 0 : 1;
+    }
+} // namespace test
+
+#define TEST(name)                                                    \
+    static void test_##name();                                        \
+    static test::Registration registration_##name(#name, test_##name); \
+    static void test_##name()
+
+#define CHECK(condition)                                        \
+    do                                                          \
+    {                                                           \
+        if (!(condition))                                       \
+            test::fail(__FILE__, __LINE__, #condition);         \
+    } while (0)
+
+#define CHECK_EQ(a, b) test::check_equal((a), (b), #a " == " #b, __FILE__, __LINE__)
+
+#define TEST_MAIN()                                          \
+    int main(int argc, const char* argv[])                   \
+    {                                                        \
+        return test::run(argc > 1 ? argv[1] : nullptr);      \
+    }
@@ -0,0 +1,239 @@
+// Tests of YUV to BGRA conversion: every row kernel this CPU can run gives
+// exactly the bytes the scalar reference does, for both matrices and both
+// ranges, I420 and NV12, widths that leave a scalar tail or an odd last
+// chroma column, padded strides and values that saturate; and the reference
+// itself puts black, white and the primaries where they belong.
+
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "check.h"
+#include "color_convert.h"
+
+namespace
+{
+    /// @brief Every set of kernels this CPU can run, with its level's name
+    std::vector<std::pair<std::string, color::Kernels>> kernel_levels()
+    {
+        std::vector<std::pair<std::string, color::Kernels>> out;
+        for (const auto& level : test::feature_levels())
+            out.emplace_back(level.first, color::select_kernels(level.second));
+        return out;
+    }
+
+    constexpr color::Matrix MATRICES[] = {color::Matrix::Bt601, color::Matrix::Bt709};
+    constexpr color::Range RANGES[] = {color::Range::Limited, color::Range::Full};
+
+    /// @brief A 4:2:0 picture in both layouts, each plane's rows padded past
+    /// their width with bytes no kernel should read into its output
+    struct Yuv
+    {
+        Yuv(uint32_t width, uint32_t height, size_t padding, uint32_t seed)
+            : width(width)
+            , height(height)
+            , chroma_width((width + 1) / 2)
+            , chroma_height((height + 1) / 2)
+            , y_stride(width + padding)
+            , uv_stride(chroma_width + padding)
+            , nv12_stride(chroma_width * 2 + padding)
+            , y(y_stride * height)
+            , u(uv_stride * chroma_height)
+            , v(uv_stride * chroma_height)
+            , nv12(nv12_stride * chroma_height)
+        {
+            // Mostly the extremes, so every clamp saturates, and the rest anything
+            const uint8_t extremes[] = {0, 1, 16, 128, 235, 240, 254, 255};
+            std::mt19937 random(seed);
+            auto sample = [&]() { return random() % 2 ? extremes[random() % 8] : (uint8_t)random(); };
+            for (auto& byte : y)
+                byte = sample();
+            for (auto& byte : u)
+                byte = sample();
+            for (auto& byte : v)
+                byte = sample();
+
+            for (size_t i = 0; i < nv12.size(); i++)
+                nv12[i] = (uint8_t)random();
+            for (uint32_t row = 0; row < chroma_height; row++)
+            {
+                for (uint32_t x = 0; x < chroma_width; x++)
+                {
+                    nv12[row * nv12_stride + x * 2] = u[row * uv_stride + x];
+                    nv12[row * nv12_stride + x * 2 + 1] = v[row * uv_stride + x];
+                }
+            }
+        }
+
+        /// @brief Convert row by row as `i420_to_bgra`/`nv12_to_bgra` do,
+        /// into rows of `bgra_stride` bytes
+        std::vector<uint8_t> convert(color::RowFn row, bool as_nv12, const color::Coefficients& k, size_t bgra_stride) const
+        {
+            std::vector<uint8_t> bgra(bgra_stride * height, 0xcd);
+            for (uint32_t line = 0; line < height; line++)
+            {
+                auto chroma = line / 2;
+                if (as_nv12)
+                    row(y.data() + line * y_stride, nv12.data() + chroma * nv12_stride, nullptr, bgra.data() + line * bgra_stride, width, k);
+                else
+                    row(y.data() + line * y_stride, u.data() + chroma * uv_stride, v.data() + chroma * uv_stride, bgra.data() + line * bgra_stride, width, k);
+            }
+            return bgra;
+        }
+
+        uint32_t width;
+        uint32_t height;
+        uint32_t chroma_width;
+        uint32_t chroma_height;
+        size_t y_stride;
+        size_t uv_stride;
+        size_t nv12_stride;
+        std::vector<uint8_t> y;
+        std::vector<uint8_t> u;
+        std::vector<uint8_t> v;
+        std::vector<uint8_t> nv12;
+    };
+
+    /// @brief One pixel of a 2x2 picture of a single colour, by the reference
+    std::vector<uint8_t> pixel(uint8_t y, uint8_t u, uint8_t v, color::Matrix matrix, color::Range range)
+    {
+        uint8_t luma[2] = {y, y};
+        uint8_t bgra[8] = {};
+        color::row_scalar<false>(luma, &u, &v, bgra, 2, color::coefficients(matrix, range));
+        return std::vector<uint8_t>(bgra, bgra + 4);
+    }
+
+    bool near(const std::vector<uint8_t>& a, const std::vector<uint8_t>& b)
+    {
+        for (size_t i = 0; i < a.size() && i < b.size(); i++)
+        {
+            if (a[i] + 2 < b[i] || b[i] + 2 < a[i])
+                return false;
+        }
+        return a.size() == b.size();
+    }
+} // namespace
+
+TEST(color_kernels_match_the_scalar_reference)
+{
+    // A scalar tail of every length after 8 and 16 pixel blocks, odd widths
+    // whose last chroma column covers one pixel, and rows narrower than a block
+    const uint32_t widths[] = {1, 2, 3, 7, 8, 9, 15, 16, 17, 23, 31, 32, 33, 47, 63, 64, 65, 127, 130};
+    for (const auto& level : kernel_levels())
+    {
+        for (auto width : widths)
+        {
+            // Rows padded past their width, as decoders' planes are
+            auto picture = Yuv(width, 5, 13, width);
+            for (auto matrix : MATRICES)
+            {
+                for (auto range : RANGES)
+                {
+                    auto k = color::coefficients(matrix, range);
+                    auto bgra_stride = (size_t)width * 4 + 12;
+                    for (auto as_nv12 : {false, true})
+                    {
+                        auto expected = picture.convert(as_nv12 ? color::row_scalar<true> : color::row_scalar<false>, as_nv12, k, bgra_stride);
+                        auto actual = picture.convert(as_nv12 ? level.second.nv12 : level.second.i420, as_nv12, k, bgra_stride);
+                        if (actual != expected)
+                        {
+                            std::printf(
+                                "%s %s width %u, %s %s range\n",
+                                level.first.c_str(),
+                                as_nv12 ? "nv12" : "i420",
+                                width,
+                                matrix == color::Matrix::Bt709 ? "bt709" : "bt601",
+                                range == color::Range::Full ? "full" : "limited");
+                        }
+                        CHECK(actual == expected);
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST(color_pictures_convert_with_padded_strides)
+{
+    // The selected kernels through the picture functions, against the reference
+    auto picture = Yuv(101, 9, 27, 7);
+    auto bgra_stride = (size_t)picture.width * 4 + 36;
+    for (auto matrix : MATRICES)
+    {
+        for (auto range : RANGES)
+        {
+            auto k = color::coefficients(matrix, range);
+
+            std::vector<uint8_t> i420(bgra_stride * picture.height, 0xcd);
+            color::i420_to_bgra(
+                picture.y.data(),
+                picture.y_stride,
+                picture.u.data(),
+                picture.v.data(),
+                picture.uv_stride,
+                i420.data(),
+                bgra_stride,
+                picture.width,
+                picture.height,
+                matrix,
+                range);
+            CHECK(i420 == picture.convert(color::row_scalar<false>, false, k, bgra_stride));
+
+            std::vector<uint8_t> nv12(bgra_stride * picture.height, 0xcd);
+            color::nv12_to_bgra(
+                picture.y.data(),
+                picture.y_stride,
+                picture.nv12.data(),
+                picture.nv12_stride,
+                nv12.data(),
+                bgra_stride,
+                picture.width,
+                picture.height,
+                matrix,
+                range);
+            CHECK(nv12 == picture.convert(color::row_scalar<true>, true, k, bgra_stride));
+
+            // Both layouts of the same picture are the same picture
+            CHECK(i420 == nv12);
+        }
+    }
+}
+
+TEST(color_reference_puts_black_white_and_primaries_in_place)
+{
+    using color::Matrix;
+    using color::Range;
+    using Bgra = std::vector<uint8_t>;
+
+    for (auto matrix : MATRICES)
+    {
+        // Limited range: 16 is black and 235 white, and beyond them clamps
+        CHECK(pixel(16, 128, 128, matrix, Range::Limited) == (Bgra {0, 0, 0, 255}));
+        CHECK(pixel(235, 128, 128, matrix, Range::Limited) == (Bgra {255, 255, 255, 255}));
+        CHECK(pixel(0, 128, 128, matrix, Range::Limited) == (Bgra {0, 0, 0, 255}));
+        CHECK(pixel(255, 128, 128, matrix, Range::Limited) == (Bgra {255, 255, 255, 255}));
+
+        // Full range uses all of it
+        CHECK(pixel(0, 128, 128, matrix, Range::Full) == (Bgra {0, 0, 0, 255}));
+        CHECK(pixel(255, 128, 128, matrix, Range::Full) == (Bgra {255, 255, 255, 255}));
+        CHECK(pixel(128, 128, 128, matrix, Range::Full) == (Bgra {128, 128, 128, 255}));
+
+        // Chroma at its extremes saturates a channel either way
+        auto blue = pixel(128, 255, 128, matrix, Range::Full);
+        CHECK_EQ(blue[0], 255);
+        auto red = pixel(128, 128, 255, matrix, Range::Full);
+        CHECK_EQ(red[2], 255);
+        auto yellow = pixel(128, 0, 128, matrix, Range::Full);
+        CHECK_EQ(yellow[0], 0);
+    }
+
+    // Pure red as each standard encodes it in limited range, to within the
+    // rounding of its 8-bit code values
+    CHECK(near(pixel(81, 90, 240, Matrix::Bt601, Range::Limited), Bgra {0, 0, 255, 255}));
+    CHECK(near(pixel(63, 102, 240, Matrix::Bt709, Range::Limited), Bgra {0, 0, 255, 255}));
+}
+
+TEST_MAIN()
@@ -0,0 +1,304 @@
+// Tests of decode-ahead over a synthetic source: frames and audio come out
+// complete and in order, the queue stays bounded, an exhausted pool makes
+// the worker wait and drop or skip, as configured, only the frames the
+// consumer's clock has passed, and drift changes (and whether the audio can
+// be resampled) reach the consumer with the audio they apply to.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "check.h"
+#include "frame_source.h"
+
+namespace
+{
+    struct Frame
+    {
+        int64_t timestamp = 0;
+        uint64_t index = 0;
+    };
+
+    using Source = source::SyntheticSource<Frame>;
+    using Ahead = source::DecodeAhead<Frame>;
+
+    std::shared_ptr<Frame> allocate() { return std::make_shared<Frame>(); }
+
+    Source::Paint number_frames()
+    {
+        return [](Frame& frame, uint64_t index) { frame.index = index; };
+    }
+
+    /// @brief A synthetic source whose audio drifts by `step` after every read,
+    /// and which records the rate it was last asked to play at
+    class DriftingSource : public Source
+    {
+    public:
+        DriftingSource(uint64_t frame_count, int64_t step)
+            : Source(frame_count, 30, 48000)
+            , step(step)
+        {
+        }
+
+        bool read_audio(audio::PcmRing& output, size_t max_frames) override
+        {
+            auto more = Source::read_audio(output, max_frames);
+            drift += step;
+            return more;
+        }
+
+        int64_t audio_drift() const override { return drift; }
+
+        void adjust_audio_rate(double ratio) override { rate = ratio; }
+
+        int64_t step;
+        int64_t drift = 0;
+        std::atomic<double> rate {1.0};
+    };
+
+    /// @brief A synthetic source whose audio can be resampled until its
+    /// `switch_at`th read, when it resyncs and can't be any more, as at the
+    /// next item of a playlist from another backend
+    class SwitchingSource : public Source
+    {
+    public:
+        SwitchingSource(uint64_t frame_count, uint64_t switch_at)
+            : Source(frame_count, 30, 48000)
+            , switch_at(switch_at)
+        {
+        }
+
+        bool read_audio(audio::PcmRing& output, size_t max_frames) override
+        {
+            auto more = Source::read_audio(output, max_frames);
+            reads++;
+            return more;
+        }
+
+        uint64_t audio_resyncs() const override { return reads >= switch_at ? 1 : 0; }
+        bool audio_resamplable() const override { return reads < switch_at; }
+
+        uint64_t switch_at;
+        std::atomic<uint64_t> reads {0};
+    };
+} // namespace
+
+TEST(decode_ahead_delivers_every_frame_and_sample_in_order)
+{
+    auto media = Source(90, 30, 48000, number_frames());
+    auto config = source::DecodeAheadConfig {};
+    config.video_frames = 3;
+    config.audio_frames = 4096;
+    auto ahead = Ahead(media, allocate, config);
+
+    std::vector<uint64_t> frames;
+    uint64_t samples = 0, misplaced = 0;
+    std::vector<int16_t> pcm(512 * 2);
+    CHECK(test::eventually([&] {
+        while (auto frame = ahead.pop_video())
+            frames.push_back(frame->index);
+
+        auto read = ahead.audio().read(pcm.data(), 512);
+        for (size_t i = 0; i < read; i++)
+            misplaced += pcm[i * 2] != (int16_t)(samples + i) || pcm[i * 2 + 1] != (int16_t)(samples + i);
+        samples += read;
+
+        return ahead.video_finished() && ahead.audio_finished();
+    }));
+
+    CHECK_EQ(frames.size(), 90u);
+    for (size_t i = 0; i < frames.size(); i++)
+        CHECK_EQ(frames[i], (uint64_t)i);
+    CHECK_EQ(samples, 90u * 48000 / 30);
+    CHECK_EQ(misplaced, 0u);
+
+    auto stats = ahead.stats();
+    CHECK_EQ(stats.video_decoded, 90u);
+    CHECK(stats.video_depth_high_water <= 3);
+    CHECK_EQ(stats.video_dropped, 0u);
+    CHECK_EQ(stats.video_skipped, 0u);
+}
+
+namespace
+{
+    /// @brief Decode frames 0 to 3 into a pool of four and hold on to the first
+    /// three, as streams slow to release them would, leaving frame 3 queued
+    std::vector<std::shared_ptr<Frame>> hold_pool(Ahead& ahead)
+    {
+        std::vector<std::shared_ptr<Frame>> held;
+        CHECK(test::eventually([&] { return ahead.stats().video_decoded == 2; }));
+        held.push_back(ahead.pop_video());
+        held.push_back(ahead.pop_video());
+        CHECK(test::eventually([&] { return ahead.stats().video_decoded == 4; }));
+        held.push_back(ahead.pop_video());
+        return held;
+    }
+
+    source::DecodeAheadConfig held_config(pool::ExhaustedPolicy policy)
+    {
+        auto config = source::DecodeAheadConfig {};
+        config.video_frames = 2;
+        config.pool_frames = 4;
+        config.exhausted_policy = policy;
+        config.idle_poll = std::chrono::milliseconds(1);
+        return config;
+    }
+
+    /// @brief Wait until the worker has found the pool exhausted a few more
+    /// times, so whatever it would do about it has been done
+    void wait_out_pool(Ahead& ahead)
+    {
+        auto waits = ahead.stats().video_pool_waits;
+        CHECK(test::eventually([&] { return ahead.stats().video_pool_waits >= waits + 3; }));
+    }
+
+    /// @brief Pop every frame left, as the pool allows, into `frames`
+    void drain(Ahead& ahead, std::vector<uint64_t>& frames)
+    {
+        CHECK(test::eventually([&] {
+            while (auto frame = ahead.pop_video())
+                frames.push_back(frame->index);
+            return ahead.video_finished();
+        }));
+    }
+} // namespace
+
+TEST(decode_ahead_drops_only_frames_behind_the_clock_when_the_pool_is_exhausted)
+{
+    auto media = Source(50, 30, 48000, number_frames());
+    auto ahead = Ahead(media, allocate, held_config(pool::ExhaustedPolicy::DropOldest));
+    auto held = hold_pool(ahead);
+    CHECK_EQ(held[2]->index, 2u);
+
+    // With no clock yet, the worker waits rather than replace frame 3
+    wait_out_pool(ahead);
+    auto stats = ahead.stats();
+    CHECK_EQ(stats.video_decoded, 4u);
+    CHECK_EQ(stats.video_dropped, 0u);
+    CHECK_EQ(stats.video_skipped, 0u);
+
+    // Once the clock is between frames 9 and 10, the queued frames before it
+    // are replaced one by one, and frame 10 waits to be shown
+    ahead.set_media_time((media.timestamp(9) + media.timestamp(10)) / 2);
+    CHECK(test::eventually([&] { return ahead.stats().video_decoded == 11; }));
+    wait_out_pool(ahead);
+    stats = ahead.stats();
+    CHECK_EQ(stats.video_decoded, 11u);
+    CHECK_EQ(stats.video_dropped, 7u);
+    CHECK_EQ(stats.pool.allocated, 4u);
+
+    // Released frames let the worker carry on from there without dropping more
+    held.clear();
+    std::vector<uint64_t> frames;
+    drain(ahead, frames);
+    CHECK_EQ(frames.size(), 40u);
+    for (size_t i = 0; i < frames.size(); i++)
+        CHECK_EQ(frames[i], (uint64_t)(10 + i));
+
+    stats = ahead.stats();
+    CHECK_EQ(stats.video_dropped, 7u);
+    CHECK_EQ(stats.video_skipped, 0u);
+}
+
+TEST(decode_ahead_skips_only_frames_behind_the_clock_when_the_pool_is_exhausted)
+{
+    auto media = Source(50, 30, 48000, number_frames());
+    auto ahead = Ahead(media, allocate, held_config(pool::ExhaustedPolicy::SkipNewest));
+    auto held = hold_pool(ahead);
+
+    wait_out_pool(ahead);
+    CHECK_EQ(ahead.stats().video_skipped, 0u);
+
+    // Frame 3 stays queued; frames 4 to 9, which the clock has passed, are
+    // never decoded
+    ahead.set_media_time((media.timestamp(9) + media.timestamp(10)) / 2);
+    CHECK(test::eventually([&] { return ahead.stats().video_skipped == 6; }));
+    wait_out_pool(ahead);
+    auto stats = ahead.stats();
+    CHECK_EQ(stats.video_skipped, 6u);
+    CHECK_EQ(stats.video_decoded, 4u);
+
+    held.clear();
+    std::vector<uint64_t> frames;
+    drain(ahead, frames);
+    CHECK_EQ(frames.size(), 41u);
+    CHECK_EQ(frames[0], 3u);
+    for (size_t i = 1; i < frames.size(); i++)
+        CHECK_EQ(frames[i], (uint64_t)(9 + i));
+
+    stats = ahead.stats();
+    CHECK_EQ(stats.video_skipped, 6u);
+    CHECK_EQ(stats.video_dropped, 0u);
+}
+
+TEST(decode_ahead_reports_drift_as_of_the_audio_consumed)
+{
+    // A second of audio at 48kHz, read 1024 frames at a time, drifting 1ms
+    // further with each read
+    auto media = DriftingSource(30, 10000);
+    auto config = source::DecodeAheadConfig {};
+    config.audio_frames = 8192;
+    config.audio_read_frames = 1024;
+    auto ahead = Ahead(media, allocate, config);
+
+    CHECK(test::eventually([&] { return ahead.audio().readable_frames(8192) == 8192; }));
+
+    // Drift changed after each read, so each change applies from the end of
+    // the read's audio
+    CHECK_EQ(ahead.audio_drift(0), 0);
+    CHECK_EQ(ahead.audio_drift(1023), 0);
+    CHECK_EQ(ahead.audio_drift(1024), 10000);
+    CHECK_EQ(ahead.audio_drift(3000), 20000);
+    CHECK_EQ(ahead.audio_drift(8192), 80000);
+
+    // Marks a whole ring behind are let go of as the worker writes on, so
+    // consuming without asking still ends at the latest drift
+    std::vector<int16_t> pcm(8192 * 2);
+    uint64_t consumed = 0;
+    CHECK(test::eventually([&] {
+        consumed += ahead.audio().read(pcm.data(), 8192);
+        return ahead.audio_finished();
+    }));
+    CHECK_EQ(consumed, 48000u);
+    CHECK_EQ(ahead.audio_drift(consumed), media.drift);
+}
+
+TEST(decode_ahead_reports_whether_the_audio_consumed_can_be_resampled)
+{
+    auto media = SwitchingSource(30, 3);
+    auto config = source::DecodeAheadConfig {};
+    config.audio_frames = 8192;
+    config.audio_read_frames = 1024;
+    auto ahead = Ahead(media, allocate, config);
+
+    CHECK(test::eventually([&] { return ahead.audio().readable_frames(8192) == 8192; }));
+
+    // From the very start, and up to the end of the third read's audio
+    CHECK(ahead.audio_resamplable(0));
+    CHECK(ahead.audio_resamplable(3071));
+    CHECK_EQ(ahead.audio_resyncs(3071), 0u);
+    CHECK(!ahead.audio_resamplable(3072));
+    CHECK_EQ(ahead.audio_resyncs(3072), 1u);
+    CHECK(!ahead.audio_resamplable(8192));
+}
+
+TEST(decode_ahead_passes_rate_adjustments_to_the_source)
+{
+    auto media = DriftingSource(300, 0);
+    auto config = source::DecodeAheadConfig {};
+    config.audio_frames = 4096;
+    auto ahead = Ahead(media, allocate, config);
+
+    CHECK(test::eventually([&] { return ahead.audio().readable_frames(3072) >= 3072; }));
+    CHECK(media.rate == 1.0);
+
+    // Applied before the next read, which needs room in the ring
+    ahead.adjust_audio_rate(1.001);
+    std::vector<int16_t> pcm(4096 * 2);
+    ahead.audio().read(pcm.data(), 4096);
+    CHECK(test::eventually([&] { return media.rate == 1.001; }));
+}
+
+TEST_MAIN()
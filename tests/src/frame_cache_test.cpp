@@ -0,0 +1,406 @@
+// Tests of the decoded media cache: a container written frame by frame reads
+// back the same frames and audio, a recorded play serves the next one, a
+// stale, foreign or damaged entry is refused, writers of the same entry
+// don't share a file, and the directory evicts the least
+// recently used entries to fit its budget.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "check.h"
+#include "frame_cache.h"
+
+namespace
+{
+    namespace fs = std::filesystem;
+
+    struct Frame
+    {
+        int64_t timestamp = 0;
+        std::vector<uint8_t> pixels;
+    };
+
+    /// @brief A directory of its own under the system's temporary one, removed
+    /// with everything in it when the test ends
+    struct TempDirectory
+    {
+        TempDirectory()
+        {
+            auto suffix = std::to_string(std::random_device {}());
+            path = fs::temp_directory_path() / ("rainway-cache-test-" + suffix);
+            fs::create_directories(path);
+        }
+
+        ~TempDirectory()
+        {
+            std::error_code error;
+            fs::remove_all(path, error);
+        }
+
+        fs::path path;
+    };
+
+    cache::Format test_format()
+    {
+        auto format = cache::Format {};
+        format.width = 4;
+        format.height = 2;
+        format.pixel_format = cache::PIXEL_FORMAT_BGRA;
+        format.sample_rate = 48000;
+        format.channels = 2;
+        return format;
+    }
+
+    /// @brief Frame `index`'s pixels: 4 x 2 BGRA, every byte derived from the index
+    std::vector<uint8_t> pixels(uint64_t index)
+    {
+        std::vector<uint8_t> bytes(4 * 2 * 4);
+        for (size_t i = 0; i < bytes.size(); i++)
+            bytes[i] = (uint8_t)(index * 7 + i);
+        return bytes;
+    }
+
+    using Source = source::SyntheticSource<Frame>;
+
+    Source synthetic(uint64_t frames)
+    {
+        return Source(frames, 30, 48000, [](Frame& frame, uint64_t index) { frame.pixels = pixels(index); });
+    }
+
+    /// @brief Read every frame and audio sample `media` has
+    void drain(source::FrameSource<Frame>& media, std::vector<Frame>& frames, std::vector<int16_t>& samples)
+    {
+        auto ring = audio::PcmRing(4096, 2);
+        std::vector<int16_t> chunk(4096 * 2);
+
+        for (Frame frame; media.read_video(frame) == source::VideoRead::Decoded;)
+            frames.push_back(frame);
+
+        for (auto more = true; more;)
+        {
+            more = media.read_audio(ring, 1024);
+            auto read = ring.read(chunk.data(), ring.readable_frames(4096));
+            samples.insert(samples.end(), chunk.begin(), chunk.begin() + (ptrdiff_t)read * 2);
+        }
+    }
+
+    /// @brief Write a container of `frames` frames of 4 x 2 BGRA at `path`
+    bool write_entry(const fs::path& path, uint64_t key_hash, uint64_t frames)
+    {
+        auto writer = cache::Writer {};
+        if (!writer.open(path, test_format(), key_hash))
+            return false;
+        for (uint64_t i = 0; i < frames; i++)
+        {
+            auto bytes = pixels(i);
+            writer.add_video(bytes.data(), bytes.size(), (int64_t)i * 333333);
+        }
+        return writer.finish();
+    }
+} // namespace
+
+TEST(cache_writer_and_reader_round_trip)
+{
+    auto dir = TempDirectory {};
+    auto path = dir.path / "entry.rwfc";
+
+    auto writer = cache::Writer {};
+    CHECK(writer.open(path, test_format(), 1234));
+
+    // Audio chunks of uneven lengths between the frames, as a decoder makes them
+    std::vector<int16_t> audio;
+    for (uint64_t i = 0; i < 10; i++)
+    {
+        auto bytes = pixels(i);
+        writer.add_video(bytes.data(), bytes.size(), (int64_t)i * 333333);
+
+        std::vector<int16_t> chunk((100 + i * 37) * 2);
+        for (size_t s = 0; s < chunk.size(); s++)
+            chunk[s] = (int16_t)(audio.size() + s);
+        writer.add_audio(chunk.data(), chunk.size() / 2);
+        audio.insert(audio.end(), chunk.begin(), chunk.end());
+    }
+
+    // Nothing is published until the container is finished
+    CHECK(!fs::exists(path));
+    CHECK(writer.finish());
+    CHECK(fs::exists(path));
+
+    auto reader = cache::Reader {};
+    CHECK(reader.open(path, test_format(), 1234));
+    CHECK_EQ(reader.frame_count(), 10u);
+    CHECK_EQ(reader.audio_chunk_count(), 10u);
+    CHECK_EQ(reader.audio_frame_count(), audio.size() / 2);
+    CHECK_EQ(reader.width(), 4u);
+    CHECK_EQ(reader.height(), 2u);
+
+    for (uint64_t i = 0; i < reader.frame_count(); i++)
+    {
+        auto view = reader.frame(i);
+        auto expected = pixels(i);
+        CHECK_EQ(view.timestamp, (int64_t)i * 333333);
+        CHECK(view.size == expected.size() && memcmp(view.data, expected.data(), view.size) == 0);
+        CHECK_EQ((uintptr_t)view.data % cache::RECORD_ALIGNMENT, 0u);
+    }
+
+    std::vector<int16_t> read_back;
+    for (uint64_t i = 0; i < reader.audio_chunk_count(); i++)
+    {
+        size_t frames = 0;
+        auto samples = reader.audio_chunk(i, frames);
+        read_back.insert(read_back.end(), samples, samples + frames * 2);
+    }
+    CHECK(read_back == audio);
+
+    // Audio frame 150 is 50 frames into the second chunk (of 137)
+    size_t offset = 0;
+    CHECK_EQ(reader.audio_chunk_at(150, offset), 1u);
+    CHECK_EQ(offset, 50u);
+    CHECK_EQ(reader.audio_chunk_at(reader.audio_frame_count(), offset), reader.audio_chunk_count());
+}
+
+TEST(cache_reader_refuses_other_keys_and_formats)
+{
+    auto dir = TempDirectory {};
+    auto path = dir.path / "entry.rwfc";
+    CHECK(write_entry(path, 1234, 3));
+
+    auto reader = cache::Reader {};
+    CHECK(!reader.open(path, test_format(), 4321));
+
+    auto other_size = test_format();
+    other_size.width = 8;
+    CHECK(!reader.open(path, other_size, 1234));
+
+    auto other_rate = test_format();
+    other_rate.sample_rate = 44100;
+    CHECK(!reader.open(path, other_rate, 1234));
+
+    // Played at its own size, any size will do
+    auto any_size = test_format();
+    any_size.width = any_size.height = 0;
+    CHECK(reader.open(path, any_size, 1234));
+}
+
+TEST(cache_reader_refuses_an_entry_pointing_outside_the_file)
+{
+    auto dir = TempDirectory {};
+    auto path = dir.path / "entry.rwfc";
+    CHECK(write_entry(path, 1234, 3));
+
+    auto header = cache::FileHeader {};
+    auto file = fopen(path.string().c_str(), "r+b");
+    CHECK(file != nullptr);
+    if (!file)
+        return;
+    CHECK_EQ(fread(&header, 1, sizeof(header), file), sizeof(header));
+
+    // The last frame's offset, then its size, pushed past the end of the
+    // file, once so far that adding them wraps around
+    auto entry = cache::VideoIndexEntry {};
+    auto at = (long)(header.video_index_offset + 2 * sizeof(entry));
+    fseek(file, at, SEEK_SET);
+    CHECK_EQ(fread(&entry, 1, sizeof(entry), file), sizeof(entry));
+    auto good = entry;
+
+    auto reader = cache::Reader {};
+    for (auto [offset, size] : {std::pair<uint64_t, uint32_t> {fs::file_size(path), good.size}, {good.offset, 0xffffffffu}, {~0ull - 8, good.size}})
+    {
+        entry.offset = offset;
+        entry.size = size;
+        fseek(file, at, SEEK_SET);
+        fwrite(&entry, 1, sizeof(entry), file);
+        fflush(file);
+        CHECK(!reader.open(path, test_format(), 1234));
+    }
+
+    fseek(file, at, SEEK_SET);
+    fwrite(&good, 1, sizeof(good), file);
+    fclose(file);
+    CHECK(reader.open(path, test_format(), 1234));
+}
+
+TEST(cache_writers_of_the_same_entry_do_not_share_a_file)
+{
+    auto dir = TempDirectory {};
+    auto path = dir.path / "entry.rwfc";
+
+    // As when a producer winding down and its replacement record the same media
+    auto first = cache::Writer {};
+    auto second = cache::Writer {};
+    CHECK(first.open(path, test_format(), 1234));
+    CHECK(second.open(path, test_format(), 1234));
+    auto bytes = pixels(0);
+    first.add_video(bytes.data(), bytes.size(), 0);
+    second.add_video(bytes.data(), bytes.size(), 0);
+
+    // One giving up leaves the other's file alone
+    first.abandon();
+    CHECK(second.finish());
+    auto reader = cache::Reader {};
+    CHECK(reader.open(path, test_format(), 1234));
+    CHECK_EQ(reader.frame_count(), 1u);
+}
+
+TEST(cache_writer_abandons_an_unfinished_container)
+{
+    auto dir = TempDirectory {};
+    auto path = dir.path / "entry.rwfc";
+    {
+        auto writer = cache::Writer {};
+        CHECK(writer.open(path, test_format(), 1));
+        auto bytes = pixels(0);
+        writer.add_video(bytes.data(), bytes.size(), 0);
+    }
+
+    CHECK(fs::is_empty(dir.path));
+}
+
+TEST(cache_recorded_play_is_served_back)
+{
+    auto dir = TempDirectory {};
+    auto directory = cache::Directory(dir.path, 1 << 30);
+    auto key = cache::Key {42, "recorded.rwfc"};
+
+    // The first play decodes, recording as it goes
+    auto decoded = synthetic(20);
+    auto writer = cache::Writer {};
+    CHECK(directory.create(key, test_format(), writer));
+    auto published = false;
+    auto recording = cache::RecordingSource<Frame>(
+        decoded,
+        std::move(writer),
+        [](const Frame& frame, std::vector<uint8_t>& bytes) { bytes = frame.pixels; },
+        [&] { published = true; });
+
+    std::vector<Frame> first_frames;
+    std::vector<int16_t> first_audio;
+    drain(recording, first_frames, first_audio);
+    CHECK(published);
+
+    // The next play reads the same frames and audio out of the cache
+    auto reader = cache::Reader {};
+    CHECK(directory.open(key, test_format(), reader));
+    auto cached = cache::CachedSource<Frame>(reader, [](Frame& frame, const cache::FrameView& view) {
+        frame.pixels.assign(view.data, view.data + view.size);
+        return true;
+    });
+
+    std::vector<Frame> frames;
+    std::vector<int16_t> audio;
+    drain(cached, frames, audio);
+
+    CHECK_EQ(frames.size(), 20u);
+    CHECK_EQ(frames.size(), first_frames.size());
+    for (size_t i = 0; i < frames.size() && i < first_frames.size(); i++)
+    {
+        CHECK_EQ(frames[i].timestamp, first_frames[i].timestamp);
+        CHECK(frames[i].pixels == first_frames[i].pixels);
+    }
+    CHECK_EQ(audio.size(), 20u * 48000 / 30 * 2);
+    CHECK(audio == first_audio);
+
+    // Seeking lands on the frame and the audio at its timestamp
+    CHECK(cached.seek(source::SeekPoint {decoded.timestamp(10), 10}));
+    Frame frame;
+    CHECK(cached.read_video(frame) == source::VideoRead::Decoded);
+    CHECK_EQ(frame.timestamp, decoded.timestamp(10));
+    auto ring = audio::PcmRing(16, 2);
+    cached.read_audio(ring, 1);
+    int16_t sample[2] = {};
+    ring.read(sample, 1);
+    CHECK_EQ(sample[0], (int16_t)(10 * 48000 / 30));
+}
+
+TEST(cache_recording_with_a_hole_is_not_published)
+{
+    auto dir = TempDirectory {};
+    auto directory = cache::Directory(dir.path, 1 << 30);
+    auto key = cache::Key {42, "skipped.rwfc"};
+
+    auto decoded = synthetic(5);
+    auto writer = cache::Writer {};
+    CHECK(directory.create(key, test_format(), writer));
+    auto recording = cache::RecordingSource<Frame>(decoded, std::move(writer), [](const Frame& frame, std::vector<uint8_t>& bytes) {
+        bytes = frame.pixels;
+    });
+
+    CHECK(recording.skip_video());
+    std::vector<Frame> frames;
+    std::vector<int16_t> audio;
+    drain(recording, frames, audio);
+
+    auto reader = cache::Reader {};
+    CHECK(!directory.open(key, test_format(), reader));
+}
+
+TEST(cache_directory_evicts_least_recently_used_entries)
+{
+    auto dir = TempDirectory {};
+    auto directory = cache::Directory(dir.path, 0);
+
+    // Three entries, used an hour, a minute and a second ago
+    auto now = fs::file_time_type::clock::now();
+    std::vector<cache::Key> keys {{1, "a.rwfc"}, {2, "b.rwfc"}, {3, "c.rwfc"}};
+    std::vector<std::chrono::seconds> ages {std::chrono::seconds(3600), std::chrono::seconds(60), std::chrono::seconds(1)};
+    uint64_t entry_size = 0;
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        CHECK(write_entry(directory.path_for(keys[i]), keys[i].hash, 16));
+        fs::last_write_time(directory.path_for(keys[i]), now - ages[i]);
+        entry_size = fs::file_size(directory.path_for(keys[i]));
+    }
+
+    // Opening the oldest makes it the most recently used
+    auto reader = cache::Reader {};
+    CHECK(directory.open(keys[0], test_format(), reader));
+
+    // A budget of two entries evicts the least recently used: "b"
+    auto budget = cache::Directory(dir.path, entry_size * 2);
+    budget.enforce_budget();
+    CHECK(fs::exists(directory.path_for(keys[0])));
+    CHECK(!fs::exists(directory.path_for(keys[1])));
+    CHECK(fs::exists(directory.path_for(keys[2])));
+
+    // Files that aren't cache entries are left alone
+    fclose(fopen((dir.path / "notes.txt").string().c_str(), "w"));
+    auto none = cache::Directory(dir.path, 0);
+    none.enforce_budget();
+    CHECK(fs::exists(dir.path / "notes.txt"));
+#if !defined(_WIN32)
+    // (On Windows the mapped entry refuses removal)
+    CHECK(!fs::exists(directory.path_for(keys[2])));
+#endif
+}
+
+TEST(cache_key_follows_the_media_and_the_format)
+{
+    auto dir = TempDirectory {};
+    auto media = dir.path / "media.y4m";
+    fclose(fopen(media.string().c_str(), "w"));
+
+    auto key = cache::make_key(media.string(), test_format());
+    CHECK(!key.file_name.empty());
+    CHECK_EQ(cache::make_key(media.string(), test_format()).hash, key.hash);
+
+    auto other_format = test_format();
+    other_format.pixel_format = cache::PIXEL_FORMAT_I420;
+    CHECK(cache::make_key(media.string(), other_format).hash != key.hash);
+
+    // An edited file is a different entry
+    auto file = fopen(media.string().c_str(), "w");
+    fputs("edited", file);
+    fclose(file);
+    CHECK(cache::make_key(media.string(), test_format()).hash != key.hash);
+
+    CHECK(cache::make_key((dir.path / "missing.y4m").string(), test_format()).file_name.empty());
+}
+
+TEST_MAIN()
@@ -0,0 +1,334 @@
+// Tests of change detection: every row comparison kernel agrees with memcmp
+// whatever the length and wherever the difference, the tile detector marks
+// exactly the tiles that differ (at tile, row and picture edges, with padded
+// strides and in each plane), a picture that repeats keeps its content id,
+// and a stream skips what it has already submitted until its keep-alive.
+
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "check.h"
+#include "frame_changes.h"
+
+namespace
+{
+    /// @brief Every kernel this CPU can run, with its level's name
+    std::vector<std::pair<std::string, change::RowEqualFn>> kernels()
+    {
+        std::vector<std::pair<std::string, change::RowEqualFn>> out;
+        for (const auto& level : test::feature_levels())
+            out.emplace_back(level.first, change::select_row_equal(level.second));
+        return out;
+    }
+
+    /// @brief A BGRA picture whose rows are padded past its width
+    struct Bgra
+    {
+        Bgra(uint32_t width, uint32_t height, size_t padding)
+            : width(width)
+            , height(height)
+            , stride((size_t)width * 4 + padding)
+            , bytes(stride * height)
+        {
+            std::mt19937 random(width * 31 + height);
+            for (auto& byte : bytes)
+                byte = (uint8_t)random();
+        }
+
+        change::Picture picture(uint32_t tile_size = change::DEFAULT_TILE_SIZE) const
+        {
+            return change::bgra_picture(bytes.data(), stride, width, height, tile_size);
+        }
+
+        uint8_t& at(uint32_t x, uint32_t y, uint32_t channel = 0) { return bytes[y * stride + (size_t)x * 4 + channel]; }
+
+        uint32_t width;
+        uint32_t height;
+        size_t stride;
+        std::vector<uint8_t> bytes;
+    };
+
+    /// @brief Which tiles differ between two pictures of the same layout,
+    /// compared byte by byte
+    std::vector<uint8_t> differing_tiles(const change::Picture& a, const change::Picture& b, uint32_t columns, uint32_t rows)
+    {
+        std::vector<uint8_t> tiles((size_t)columns * rows, 0);
+        for (size_t p = 0; p < a.count; p++)
+        {
+            auto& pa = a.planes[p];
+            auto& pb = b.planes[p];
+            for (uint32_t y = 0; y < pa.rows; y++)
+            {
+                for (size_t x = 0; x < pa.row_bytes; x++)
+                {
+                    if (pa.data[y * pa.stride + x] != pb.data[y * pb.stride + x])
+                        tiles[(size_t)(y / pa.tile_rows) * columns + x / pa.tile_bytes] = 1;
+                }
+            }
+        }
+        return tiles;
+    }
+} // namespace
+
+TEST(row_equal_kernels_match_memcmp_at_every_length_and_position)
+{
+    std::vector<uint8_t> a(1200 + 64), b;
+    for (size_t i = 0; i < a.size(); i++)
+        a[i] = (uint8_t)(i * 37 + 11);
+    b = a;
+
+    // Lengths around each vector width and each early-out block
+    std::vector<size_t> lengths;
+    for (size_t n = 0; n <= 70; n++)
+        lengths.push_back(n);
+    for (size_t edge : {255, 256, 257, 511, 512, 513, 1023, 1024, 1025, 1200})
+        lengths.push_back(edge);
+
+    for (const auto& [name, kernel] : kernels())
+    {
+        size_t wrong = 0;
+        // Unaligned starts too, as tiles within a row are
+        for (size_t offset : {0, 1, 4, 7})
+        {
+            for (auto n : lengths)
+            {
+                wrong += !kernel(a.data() + offset, b.data() + offset, n);
+
+                // One byte different at the start, the end and in between,
+                // including the last byte of a vector and the first after it
+                for (size_t at : {(size_t)0, n / 2, n - 1, (size_t)15, (size_t)16, (size_t)31, (size_t)32, (size_t)256, (size_t)512})
+                {
+                    if (n == 0 || at >= n)
+                        continue;
+                    b[offset + at] ^= 0x80;
+                    wrong += kernel(a.data() + offset, b.data() + offset, n) != change::row_equal_scalar(a.data() + offset, b.data() + offset, n);
+                    b[offset + at] ^= 0x80;
+                }
+
+                // A difference just past the end isn't seen
+                b[offset + n] ^= 0x01;
+                wrong += !kernel(a.data() + offset, b.data() + offset, n);
+                b[offset + n] ^= 0x01;
+            }
+        }
+        if (wrong)
+            printf("\n  %s differs from memcmp %zu times\n", name.c_str(), wrong);
+        CHECK_EQ(wrong, 0u);
+    }
+}
+
+TEST(detector_marks_the_tile_of_each_changed_byte_at_tile_edges)
+{
+    // 100 x 70 leaves a partial column of tiles on the right and a partial
+    // row at the bottom; the padding past each row isn't part of the picture
+    struct Point
+    {
+        uint32_t x, y, channel;
+    };
+    const Point points[] = {{0, 0, 0}, {31, 0, 3}, {32, 0, 0}, {31, 31, 3}, {32, 32, 0}, {95, 63, 3}, {96, 64, 0}, {99, 0, 3}, {0, 69, 0}, {99, 69, 3}};
+
+    for (const auto& [name, kernel] : kernels())
+    {
+        auto frame = Bgra(100, 70, 24);
+        auto detector = change::TileDetector {kernel};
+
+        // The first picture is dirty all over
+        CHECK_EQ(detector.update(frame.picture()), 12u);
+        CHECK_EQ(detector.dirty().columns, 4u);
+        CHECK_EQ(detector.dirty().rows, 3u);
+        auto first = detector.content_id();
+        CHECK(first != 0);
+
+        // The same picture again is clean and keeps its id
+        CHECK_EQ(detector.update(frame.picture()), 0u);
+        CHECK_EQ(detector.content_id(), first);
+
+        for (const auto& point : points)
+        {
+            auto before = detector.content_id();
+            frame.at(point.x, point.y, point.channel) ^= 0x40;
+            CHECK_EQ(detector.update(frame.picture()), 1u);
+            auto column = point.x / 32, row = point.y / 32;
+            if (!detector.dirty().dirty(column, row))
+                printf("\n  %s: (%u, %u) didn't mark tile (%u, %u)\n", name.c_str(), point.x, point.y, column, row);
+            CHECK(detector.dirty().dirty(column, row));
+            CHECK(detector.content_id() != before);
+
+            // The reference took the change, so the next update is clean
+            CHECK_EQ(detector.update(frame.picture()), 0u);
+        }
+
+        // Padding past the end of a row isn't compared
+        frame.bytes[frame.stride - 1] ^= 0xff;
+        frame.bytes[frame.stride * 40 + frame.width * 4] ^= 0xff;
+        CHECK_EQ(detector.update(frame.picture()), 0u);
+
+        auto stats = detector.stats();
+        CHECK_EQ(stats.frames, 2u + 2 * (sizeof(points) / sizeof(points[0])) + 1);
+        CHECK_EQ(stats.dirty_tiles, 12u + sizeof(points) / sizeof(points[0]));
+    }
+}
+
+TEST(detector_dirty_map_matches_a_byte_by_byte_comparison)
+{
+    // Random scattered changes over odd sizes, strides and tile sizes
+    struct Layout
+    {
+        uint32_t width, height, tile_size;
+        size_t padding;
+    };
+    for (const auto& [name, kernel] : kernels())
+    {
+        for (auto layout : {Layout {1920, 1080, 32, 0}, Layout {257, 129, 32, 12}, Layout {33, 17, 16, 4}, Layout {1, 1, 32, 0}, Layout {640, 360, 64, 64}})
+        {
+            auto previous = Bgra(layout.width, layout.height, layout.padding);
+            auto frame = previous;
+            auto detector = change::TileDetector {kernel};
+            detector.update(previous.picture(layout.tile_size));
+
+            std::mt19937 random(layout.width);
+            size_t mismatches = 0;
+            for (int round = 0; round < 8; round++)
+            {
+                auto changes = random() % 12;
+                for (size_t i = 0; i < changes; i++)
+                    frame.at(random() % layout.width, random() % layout.height, random() % 4) ^= (uint8_t)(1 + random() % 255);
+
+                auto expected = differing_tiles(frame.picture(layout.tile_size), previous.picture(layout.tile_size), detector.dirty().columns, detector.dirty().rows);
+                detector.update(frame.picture(layout.tile_size));
+                mismatches += detector.dirty().tiles != expected;
+                previous = frame;
+            }
+            if (mismatches)
+                printf("\n  %s, %ux%u in %u tiles: %zu maps differ\n", name.c_str(), layout.width, layout.height, layout.tile_size, mismatches);
+            CHECK_EQ(mismatches, 0u);
+        }
+    }
+}
+
+TEST(detector_tiles_i420_planes_alike)
+{
+    // Odd sizes: 65 x 33 luma has 33 x 17 chroma, 3 x 2 tiles of 32
+    const uint32_t width = 65, height = 33;
+    const size_t y_stride = 80, uv_stride = 48;
+    std::vector<uint8_t> y(y_stride * height, 16), u(uv_stride * 17, 128), v(uv_stride * 17, 128);
+    auto picture = [&]() { return change::i420_picture(y.data(), u.data(), v.data(), y_stride, uv_stride, width, height); };
+
+    auto detector = change::TileDetector {};
+    CHECK_EQ(detector.update(picture()), 6u);
+    CHECK_EQ(detector.dirty().columns, 3u);
+    CHECK_EQ(detector.dirty().rows, 2u);
+
+    // The last chroma sample of each plane belongs to the bottom right tile
+    u[16 * uv_stride + 32] = 0;
+    CHECK_EQ(detector.update(picture()), 1u);
+    CHECK(detector.dirty().dirty(2, 1));
+
+    // A chroma sample at 16 is the second column, as luma at 32 is
+    v[15 * uv_stride + 16] = 0;
+    CHECK_EQ(detector.update(picture()), 1u);
+    CHECK(detector.dirty().dirty(1, 0));
+
+    y[32 * y_stride + 64] = 235;
+    CHECK_EQ(detector.update(picture()), 1u);
+    CHECK(detector.dirty().dirty(2, 1));
+}
+
+TEST(detector_starts_over_on_a_new_layout_or_when_invalidated)
+{
+    auto detector = change::TileDetector {};
+    auto small = Bgra(64, 64, 0);
+    auto large = Bgra(128, 64, 0);
+
+    CHECK_EQ(detector.update(small.picture()), 4u);
+    CHECK_EQ(detector.update(small.picture()), 0u);
+    CHECK_EQ(detector.update(large.picture()), 8u);
+    CHECK_EQ(detector.update(large.picture()), 0u);
+
+    auto before = detector.content_id();
+    detector.invalidate();
+    CHECK_EQ(detector.update(large.picture()), 8u);
+    CHECK(detector.content_id() != before);
+
+    // No planes: nothing to compare
+    CHECK_EQ(detector.update(change::Picture {}), 0u);
+}
+
+namespace
+{
+    struct Frame
+    {
+        int64_t timestamp = 0;
+        uint64_t content = 0;
+        std::vector<uint8_t> pixels;
+    };
+} // namespace
+
+TEST(detecting_source_gives_repeated_pictures_the_same_content_id)
+{
+    // Each picture is shown three times, as a slide would be
+    auto media = source::SyntheticSource<Frame>(9, 30, 48000, [](Frame& frame, uint64_t index) {
+        frame.pixels.assign(16 * 16 * 4, (uint8_t)(index / 3));
+    });
+    auto detecting = change::DetectingSource<Frame>(media, [](const Frame& frame) {
+        return change::bgra_picture(frame.pixels.data(), 16 * 4, 16, 16);
+    });
+
+    std::vector<uint64_t> ids;
+    auto frame = Frame {};
+    while (detecting.read_video(frame) == source::VideoRead::Decoded)
+        ids.push_back(frame.content);
+
+    CHECK_EQ(ids.size(), 9u);
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        CHECK(ids[i] != 0);
+        if (i % 3 != 0)
+            CHECK_EQ(ids[i], ids[i - 1]);
+        else if (i > 0)
+            CHECK(ids[i] != ids[i - 1]);
+    }
+    CHECK_EQ(detecting.changes().stats().unchanged_frames, 6u);
+
+    // A frame that can't be read on the CPU is new every time
+    auto blind_media = source::SyntheticSource<Frame>(2, 30, 48000);
+    auto blind = change::DetectingSource<Frame>(blind_media, [](const Frame&) { return change::Picture {}; });
+    blind.read_video(frame);
+    auto a = frame.content;
+    blind.read_video(frame);
+    CHECK(a != 0 && frame.content != 0 && frame.content != a);
+}
+
+TEST(submit_filter_skips_submitted_content_until_its_keep_alive)
+{
+    // A second, in 100ns units
+    auto filter = change::SubmitFilter {10000000};
+
+    CHECK(filter.should_submit(5, 0));
+    CHECK(!filter.should_submit(5, 333333));
+    CHECK(!filter.should_submit(5, 9999999));
+
+    // The keep-alive is counted from the last submission
+    CHECK(filter.should_submit(5, 10000000));
+    CHECK(!filter.should_submit(5, 10333333));
+
+    // New content, unknown content and time going backwards all go
+    CHECK(filter.should_submit(6, 10666666));
+    CHECK(filter.should_submit(0, 11000000));
+    CHECK(filter.should_submit(0, 11333333));
+    CHECK(filter.should_submit(6, 11666666));
+    CHECK(filter.should_submit(6, 0));
+    CHECK_EQ(filter.skipped(), 3u);
+
+    // With no keep-alive, everything is submitted
+    auto every = change::SubmitFilter {0};
+    CHECK(every.should_submit(7, 0));
+    CHECK(every.should_submit(7, 1));
+    CHECK_EQ(every.skipped(), 0u);
+}
+
+TEST_MAIN()
@@ -0,0 +1,258 @@
+// Tests of the frame pool: buffers are reused round-robin once nothing
+// references them, allocation stops at the capacity, a backend still using
+// a buffer passes it over, and a frame a source finds busy at the copy goes
+// back to the pool while the worker waits, or once the clock has passed the
+// picture the exhausted policy decides where it goes.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <vector>
+
+#include "check.h"
+#include "frame_pool.h"
+#include "frame_source.h"
+
+namespace
+{
+    struct Frame
+    {
+        int64_t timestamp = 0;
+        uint64_t index = 0;
+        /// @brief Stands in for a texture an encoder holds
+        std::atomic<bool> busy {false};
+    };
+
+    using Pool = pool::FramePool<Frame>;
+
+    std::shared_ptr<Frame> allocate() { return std::make_shared<Frame>(); }
+
+    /// @brief A synthetic source whose writes fail on busy frames, keeping the
+    /// picture for the next read or skip as a texture copy would
+    class BusySource : public source::SyntheticSource<Frame>
+    {
+    public:
+        explicit BusySource(uint64_t frame_count)
+            : SyntheticSource(frame_count, 30, 48000, [](Frame& frame, uint64_t index) { frame.index = index; })
+            , frame_count(frame_count)
+        {
+        }
+
+        source::VideoRead read_video(Frame& frame) override
+        {
+            if (next < frame_count && frame.busy)
+            {
+                busy_reads++;
+                return source::VideoRead::Busy;
+            }
+
+            auto read = SyntheticSource::read_video(frame);
+            next += read == source::VideoRead::Decoded;
+            return read;
+        }
+
+        bool skip_video() override
+        {
+            auto more = SyntheticSource::skip_video();
+            next += more;
+            return more;
+        }
+
+        uint64_t frame_count;
+        uint64_t next = 0;
+        std::atomic<uint64_t> busy_reads {0};
+    };
+} // namespace
+
+TEST(frame_pool_reuses_released_frames_round_robin)
+{
+    auto frames = Pool(3, allocate);
+
+    // Allocated lazily, one per acquire while every frame is held
+    auto a = frames.try_acquire();
+    auto b = frames.try_acquire();
+    CHECK(a && b && a != b);
+    CHECK_EQ(frames.stats().allocated, 2u);
+
+    // Released frames come back in turn rather than the same one every time
+    auto first = a.get(), second = b.get();
+    a.reset();
+    b.reset();
+    auto c = frames.try_acquire();
+    CHECK(c.get() == first);
+    c.reset();
+    auto d = frames.try_acquire();
+    CHECK(d.get() == second);
+
+    auto stats = frames.stats();
+    CHECK_EQ(stats.allocated, 2u);
+    CHECK_EQ(stats.acquired, 4u);
+    CHECK_EQ(stats.exhausted, 0u);
+}
+
+TEST(frame_pool_stops_allocating_at_its_capacity)
+{
+    auto frames = Pool(4, allocate);
+
+    std::vector<std::shared_ptr<Frame>> held;
+    std::set<Frame*> distinct;
+    for (int i = 0; i < 4; i++)
+    {
+        held.push_back(frames.try_acquire());
+        distinct.insert(held.back().get());
+    }
+    CHECK_EQ(distinct.size(), 4u);
+
+    // Everything is held: nothing is handed out, and nothing more allocated
+    CHECK(frames.try_acquire() == nullptr);
+    CHECK(frames.try_acquire() == nullptr);
+    auto stats = frames.stats();
+    CHECK_EQ(stats.allocated, 4u);
+    CHECK_EQ(stats.exhausted, 2u);
+
+    held.pop_back();
+    CHECK(frames.try_acquire() != nullptr);
+    CHECK_EQ(frames.stats().allocated, 4u);
+}
+
+TEST(frame_pool_passes_over_frames_its_backend_still_uses)
+{
+    auto frames = Pool(2, allocate, [](const Frame& frame) { return !frame.busy; });
+
+    auto a = frames.try_acquire();
+    auto b = frames.try_acquire();
+    a->busy = true;
+    auto busy = a.get();
+    a.reset();
+    b.reset();
+
+    // Only the one the backend is done with is handed out, however often
+    for (int i = 0; i < 3; i++)
+    {
+        auto frame = frames.try_acquire();
+        CHECK(frame != nullptr && frame.get() != busy);
+    }
+    CHECK_EQ(frames.stats().contended, 3u);
+
+    busy->busy = false;
+    auto frame = frames.try_acquire();
+    auto other = frames.try_acquire();
+    CHECK(frame && other && (frame.get() == busy || other.get() == busy));
+}
+
+namespace
+{
+    /// @brief Decode frames 0 to 2 into a pool of three, then have the one
+    /// frame not held or queued taken by an encoder after it is let go of,
+    /// so the pool hands it out and the copy into it fails every time
+    /// @return The frame held, frame 1; frame 2 is left queued
+    std::shared_ptr<Frame> make_frames_busy(source::DecodeAhead<Frame>& ahead, Frame*& busy)
+    {
+        CHECK(test::eventually([&] { return ahead.stats().video_decoded == 2; }));
+        auto first = ahead.pop_video();
+        CHECK(test::eventually([&] { return ahead.stats().video_decoded == 3; }));
+        first->busy = true;
+        busy = first.get();
+        first.reset();
+        return ahead.pop_video();
+    }
+
+    source::DecodeAheadConfig busy_config(pool::ExhaustedPolicy policy)
+    {
+        auto config = source::DecodeAheadConfig {};
+        config.video_frames = 2;
+        config.pool_frames = 3;
+        config.exhausted_policy = policy;
+        config.idle_poll = std::chrono::milliseconds(1);
+        return config;
+    }
+
+    /// @brief Wait until the worker has given up on the busy frame a few more
+    /// times, so whatever it would do about it has been done
+    void wait_out_busy(source::DecodeAhead<Frame>& ahead)
+    {
+        auto waits = ahead.stats().video_pool_waits;
+        CHECK(test::eventually([&] { return ahead.stats().video_pool_waits >= waits + 3; }));
+    }
+
+    std::vector<uint64_t> drain(source::DecodeAhead<Frame>& ahead)
+    {
+        std::vector<uint64_t> frames;
+        CHECK(test::eventually([&] {
+            while (auto frame = ahead.pop_video())
+                frames.push_back(frame->index);
+            return ahead.video_finished();
+        }));
+        return frames;
+    }
+} // namespace
+
+TEST(frame_busy_at_the_copy_drops_queued_frames_only_behind_the_clock)
+{
+    auto media = BusySource(20);
+    auto ahead = source::DecodeAhead<Frame>(media, allocate, busy_config(pool::ExhaustedPolicy::DropOldest));
+    Frame* busy = nullptr;
+    auto held = make_frames_busy(ahead, busy);
+    CHECK(held != nullptr && held->index == 1);
+
+    // Frame 3 finds its frame busy and no other free, and nothing is late yet,
+    // so the busy frame goes back to the pool and the worker waits
+    wait_out_busy(ahead);
+    auto stats = ahead.stats();
+    CHECK(media.busy_reads >= 1);
+    CHECK(stats.video_busy >= 1);
+    CHECK_EQ(stats.video_decoded, 3u);
+    CHECK_EQ(stats.video_dropped, 0u);
+
+    // With the clock between frames 7 and 8, frames 3 to 8 each replace the
+    // one queued, which the clock has passed, and frame 8 is kept
+    ahead.set_media_time((media.timestamp(7) + media.timestamp(8)) / 2);
+    CHECK(test::eventually([&] { return ahead.stats().video_decoded == 9; }));
+    wait_out_busy(ahead);
+    stats = ahead.stats();
+    CHECK_EQ(stats.video_decoded, 9u);
+    CHECK_EQ(stats.video_dropped, 6u);
+    CHECK_EQ(stats.video_skipped, 0u);
+    CHECK_EQ(stats.pool.allocated, 3u);
+
+    // Once the encoder lets go, the rest are decoded in order
+    busy->busy = false;
+    auto frames = drain(ahead);
+    CHECK_EQ(frames.size(), 12u);
+    for (size_t i = 0; i < frames.size(); i++)
+        CHECK_EQ(frames[i], (uint64_t)(8 + i));
+    CHECK_EQ(ahead.stats().video_dropped, 6u);
+}
+
+TEST(frame_busy_at_the_copy_skips_frames_only_behind_the_clock)
+{
+    auto media = BusySource(20);
+    auto ahead = source::DecodeAhead<Frame>(media, allocate, busy_config(pool::ExhaustedPolicy::SkipNewest));
+    Frame* busy = nullptr;
+    auto held = make_frames_busy(ahead, busy);
+
+    wait_out_busy(ahead);
+    CHECK_EQ(ahead.stats().video_skipped, 0u);
+
+    // Frame 2 stays queued; frames 3 to 7, which the clock has passed, find
+    // their frame busy and are skipped, never decoded
+    ahead.set_media_time((media.timestamp(7) + media.timestamp(8)) / 2);
+    CHECK(test::eventually([&] { return ahead.stats().video_skipped == 5; }));
+    wait_out_busy(ahead);
+    auto stats = ahead.stats();
+    CHECK_EQ(stats.video_skipped, 5u);
+    CHECK_EQ(stats.video_decoded, 3u);
+    CHECK_EQ(stats.video_dropped, 0u);
+
+    busy->busy = false;
+    auto frames = drain(ahead);
+    CHECK_EQ(frames.size(), 13u);
+    CHECK_EQ(frames[0], 2u);
+    for (size_t i = 1; i < frames.size(); i++)
+        CHECK_EQ(frames[i], (uint64_t)(7 + i));
+    CHECK_EQ(ahead.stats().video_skipped, 5u);
+}
+
+TEST_MAIN()
@@ -0,0 +1,269 @@
+// Tests of the decode-once fanout: every consumer sees what is published
+// after it joins, in order, and one that falls more than a ring behind
+// skips ahead (counting what it lost) without holding anyone else back. A
+// viewer that joins after the media has finished gets a new producer, and a
+// producer released with a reaper doesn't wait for its thread.
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+#include "media_fanout.h"
+
+namespace
+{
+    using Fanout = fanout::MediaFanout<int, int>;
+
+    /// @brief Records what it is given, optionally taking its time over each frame
+    struct StubSink
+    {
+        std::vector<int> video;
+        std::vector<int> audio;
+        std::chrono::microseconds delay {0};
+
+        void submit_video(const int& frame)
+        {
+            if (delay.count() > 0)
+                std::this_thread::sleep_for(delay);
+            video.push_back(frame);
+        }
+
+        void submit_audio(const int& chunk) { audio.push_back(chunk); }
+    };
+} // namespace
+
+TEST(fanout_subscribers_start_at_the_live_head)
+{
+    auto media = Fanout(8, 8);
+    media.publish_video(std::make_shared<int>(1));
+    media.publish_audio(std::make_shared<int>(100));
+
+    auto cursor = media.subscribe();
+    CHECK(media.next_video(cursor) == nullptr);
+    CHECK(media.next_audio(cursor) == nullptr);
+
+    media.publish_video(std::make_shared<int>(2));
+    auto frame = media.next_video(cursor);
+    CHECK(frame != nullptr && *frame == 2);
+    CHECK_EQ(cursor.skipped_video, 0u);
+}
+
+TEST(fanout_every_consumer_sees_every_item_in_order)
+{
+    auto media = Fanout(8, 8);
+    auto first = media.subscribe();
+    auto second = media.subscribe();
+
+    for (int i = 0; i < 6; i++)
+    {
+        media.publish_audio(std::make_shared<int>(100 + i));
+        media.publish_video(std::make_shared<int>(i));
+    }
+
+    StubSink a, b;
+    CHECK(fanout::drain(media, first, a));
+    CHECK(fanout::drain(media, second, b));
+    CHECK(!fanout::drain(media, first, a));
+
+    CHECK(a.video == (std::vector<int> {0, 1, 2, 3, 4, 5}));
+    CHECK(a.audio == (std::vector<int> {100, 101, 102, 103, 104, 105}));
+    CHECK(b.video == a.video);
+    CHECK(b.audio == a.audio);
+}
+
+TEST(fanout_lagging_cursor_skips_to_the_oldest_item_kept)
+{
+    auto media = Fanout(4, 4);
+    auto slow = media.subscribe();
+    auto fast = media.subscribe();
+
+    StubSink fast_sink;
+    for (int i = 0; i < 10; i++)
+    {
+        media.publish_video(std::make_shared<int>(i));
+        fanout::drain(media, fast, fast_sink);
+    }
+
+    // The slow cursor is 10 behind a ring of 4: it loses the first 6
+    StubSink slow_sink;
+    fanout::drain(media, slow, slow_sink);
+    CHECK(slow_sink.video == (std::vector<int> {6, 7, 8, 9}));
+    CHECK_EQ(slow.skipped_video, 6u);
+    CHECK_EQ(slow.video, 10u);
+
+    CHECK_EQ(fast_sink.video.size(), 10u);
+    CHECK_EQ(fast.skipped_video, 0u);
+}
+
+TEST(fanout_returns_evicted_items_for_recycling)
+{
+    auto media = Fanout(2, 2);
+    auto first = std::make_shared<int>(1);
+    CHECK(media.publish_video(first) == nullptr);
+    CHECK(media.publish_video(std::make_shared<int>(2)) == nullptr);
+
+    auto evicted = media.publish_video(std::make_shared<int>(3));
+    CHECK(evicted == first);
+}
+
+TEST(fanout_slow_consumer_does_not_hold_back_the_producer)
+{
+    using namespace std::chrono_literals;
+
+    const int frames = 200;
+    auto media = Fanout(8, 8);
+
+    std::atomic<bool> stopped {false};
+    std::atomic<bool> subscribed {false};
+    StubSink fast_sink, slow_sink;
+    slow_sink.delay = 200us;
+
+    uint64_t slow_skipped = 0;
+    std::thread fast_thread([&] { fanout::run_consumer(media, fast_sink, stopped); });
+    std::thread slow_thread([&] {
+        auto cursor = media.subscribe();
+        subscribed = true;
+        while (!stopped)
+        {
+            if (!media.wait(cursor, 50ms))
+            {
+                if (media.is_finished())
+                    break;
+                continue;
+            }
+            fanout::drain(media, cursor, slow_sink);
+        }
+        slow_skipped = cursor.skipped_video;
+    });
+
+    while (!subscribed)
+        std::this_thread::yield();
+    std::this_thread::sleep_for(10ms);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++)
+        media.publish_video(std::make_shared<int>(i));
+    auto publishing = std::chrono::steady_clock::now() - start;
+    media.finish();
+
+    fast_thread.join();
+    slow_thread.join();
+
+    // Publishing never waits for a consumer: 200 frames at 200us each would
+    // take the slow one 40ms
+    CHECK(publishing < 40ms);
+
+    // The slow consumer lost frames rather than seeing them out of order,
+    // and every frame is either seen or counted as skipped
+    CHECK_EQ(slow_sink.video.size() + slow_skipped, (size_t)frames);
+    for (size_t i = 1; i < slow_sink.video.size(); i++)
+        CHECK(slow_sink.video[i] > slow_sink.video[i - 1]);
+    CHECK(!slow_sink.video.empty() && slow_sink.video.back() == frames - 1);
+}
+
+TEST(fanout_registry_shares_a_producer_per_key)
+{
+    using Registry = fanout::ProducerRegistry<int, int>;
+    auto registry = Registry {};
+    auto created = 0;
+
+    auto create = [&] {
+        created++;
+        return std::make_shared<Registry::Producer>(4, 4, [](Fanout& media, const lifecycle::CancellationToken& stop) {
+            media.publish_video(std::make_shared<int>(1));
+            stop.wait_until(std::chrono::steady_clock::now() + std::chrono::seconds(10));
+        });
+    };
+
+    auto a = registry.acquire("a.mp4", create);
+    auto b = registry.acquire("a.mp4", create);
+    auto c = registry.acquire("c.mp4", create);
+    CHECK(a == b);
+    CHECK(a != c);
+    CHECK_EQ(created, 2);
+
+    // Released by every consumer, the producer stops (without waiting out
+    // its body) and the next acquire starts a new one
+    a.reset();
+    b.reset();
+    auto again = registry.acquire("a.mp4", create);
+    CHECK_EQ(created, 3);
+
+    // Keys whose producer has died are forgotten at the next start
+    c.reset();
+    CHECK_EQ(registry.size(), 2u);
+    for (int size = 0; size < 5; size++)
+        registry.acquire("c.mp4@" + std::to_string(size), create);
+    CHECK_EQ(registry.size(), 2u);
+}
+
+TEST(fanout_registry_starts_a_new_producer_once_the_media_has_finished)
+{
+    using namespace std::chrono_literals;
+    using Registry = fanout::ProducerRegistry<int, int>;
+    auto registry = Registry {};
+    auto created = 0;
+
+    // Media that plays a few frames and ends, as a file that doesn't loop does
+    auto create = [&] {
+        created++;
+        return std::make_shared<Registry::Producer>(4, 4, [](Fanout& media, const lifecycle::CancellationToken& stop) {
+            for (int frame = 0; frame < 5 && !stop.cancelled(); frame++)
+            {
+                stop.wait_until(std::chrono::steady_clock::now() + 10ms);
+                media.publish_video(std::make_shared<int>(frame));
+            }
+        });
+    };
+
+    auto first = registry.acquire("a.mp4", create);
+    CHECK(test::eventually([&] { return first->media().is_finished(); }));
+
+    // A viewer joining after the end, while the first still holds its
+    // producer, gets one that plays the media again
+    auto late = registry.acquire("a.mp4", create);
+    CHECK(late != first);
+    CHECK_EQ(created, 2);
+
+    auto sink = StubSink {};
+    std::atomic<bool> stopped {false};
+    fanout::run_consumer(late->media(), sink, stopped);
+    CHECK(!sink.video.empty());
+    CHECK(!sink.video.empty() && sink.video.back() == 4);
+}
+
+TEST(fanout_producer_released_with_a_reaper_does_not_wait_for_its_body)
+{
+    using namespace std::chrono_literals;
+    using Producer = fanout::SharedProducer<int, int>;
+    auto reaper = fanout::Reaper {};
+    std::atomic<bool> finished {false};
+
+    // A body slow to notice it was stopped, as one blocked in a read would be
+    auto producer = std::make_shared<Producer>(
+        4,
+        4,
+        [&](Fanout& media, const lifecycle::CancellationToken& stop) {
+            media.publish_video(std::make_shared<int>(1));
+            stop.wait_until(std::chrono::steady_clock::now() + 10s);
+            std::this_thread::sleep_for(200ms);
+            finished = true;
+        },
+        &reaper);
+    auto& media = producer->media();
+    CHECK(test::eventually([&] { return media.subscribe().video == 1; }));
+
+    auto releasing = std::chrono::steady_clock::now();
+    producer.reset();
+    CHECK(std::chrono::steady_clock::now() - releasing < 100ms);
+    CHECK(!finished);
+
+    // The reaper joins it once the body is done
+    reaper.drain();
+    CHECK(finished);
+}
+
+TEST_MAIN()
@@ -0,0 +1,224 @@
+// Tests of the metrics: histogram buckets cover every value to within their
+// width at both ends of the range, quantiles come from the right bucket,
+// the Prometheus text for a counter and a summary is exactly as expected,
+// sets with the same labels are one set, closed sets fold into the totals,
+// and both exporters write what the registry renders.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "check.h"
+#include "metrics.h"
+
+using metrics::Histogram;
+
+TEST(histogram_buckets_cover_every_value_at_both_ends)
+{
+    // One bucket per value below 16
+    for (uint64_t value = 0; value < Histogram::SUB_BUCKETS; value++)
+    {
+        CHECK_EQ(Histogram::index(value), (size_t)value);
+        CHECK_EQ(Histogram::lowest((size_t)value), value);
+        CHECK_EQ(Histogram::highest((size_t)value), value);
+    }
+    CHECK_EQ(Histogram::index(16), 16u);
+    CHECK_EQ(Histogram::index(31), 31u);
+    CHECK_EQ(Histogram::index(32), 32u);
+    CHECK_EQ(Histogram::index(33), 32u);
+
+    // Every bucket's bounds map back to it, and abut the next bucket's
+    for (size_t i = 0; i < Histogram::BUCKETS; i++)
+    {
+        CHECK_EQ(Histogram::index(Histogram::lowest(i)), i);
+        CHECK_EQ(Histogram::index(Histogram::highest(i)), i);
+        if (i + 1 < Histogram::BUCKETS)
+            CHECK_EQ(Histogram::highest(i) + 1, Histogram::lowest(i + 1));
+    }
+
+    // The top bucket ends at the largest value kept, and anything larger is
+    // recorded as it
+    CHECK_EQ(Histogram::index(Histogram::MAX_VALUE), Histogram::BUCKETS - 1);
+    CHECK_EQ(Histogram::highest(Histogram::BUCKETS - 1), Histogram::MAX_VALUE);
+
+    auto histogram = Histogram {};
+    histogram.record(UINT64_MAX);
+    auto snapshot = histogram.snapshot();
+    CHECK_EQ(snapshot.buckets[Histogram::BUCKETS - 1], 1u);
+    CHECK_EQ(snapshot.sum, Histogram::MAX_VALUE);
+
+    // Within a sixteenth of the value anywhere in the range
+    for (uint64_t value = 16; value < Histogram::MAX_VALUE / 3; value = value * 3 + 1)
+    {
+        auto i = Histogram::index(value);
+        CHECK((double)(Histogram::highest(i) - Histogram::lowest(i)) <= (double)value / 16);
+    }
+}
+
+TEST(histogram_quantiles_come_from_the_bucket_holding_the_rank)
+{
+    auto histogram = Histogram {};
+    CHECK_EQ(histogram.snapshot().percentile(0.5), 0u);
+
+    for (uint64_t value = 1; value <= 100; value++)
+        histogram.record(value);
+    auto snapshot = histogram.snapshot();
+    CHECK_EQ(snapshot.count, 100u);
+    CHECK_EQ(snapshot.sum, 5050u);
+
+    // Each is the highest value of the bucket the rank falls in: 50 is in
+    // 50-51, 99 in 96-99 and 100 in 100-103
+    CHECK_EQ(snapshot.percentile(0.01), 1u);
+    CHECK_EQ(snapshot.percentile(0.5), 51u);
+    CHECK_EQ(snapshot.percentile(0.99), 99u);
+    CHECK_EQ(snapshot.percentile(1.0), 103u);
+
+    // Merged snapshots count both
+    auto merged = snapshot;
+    merged.merge(snapshot);
+    CHECK_EQ(merged.count, 200u);
+    CHECK_EQ(merged.percentile(0.5), 51u);
+}
+
+namespace
+{
+    std::string seconds(uint64_t nanoseconds)
+    {
+        char text[32];
+        snprintf(text, sizeof(text), "%.9f", nanoseconds / 1e9);
+        return text;
+    }
+
+    /// @brief The text rendered for `frames_total` at `frames` and one
+    /// `submit_seconds` of `latency`, both labelled `labels`
+    std::string expected_text(const std::string& labels, uint64_t frames, uint64_t latency)
+    {
+        auto quantile = seconds(Histogram::highest(Histogram::index(latency)));
+        std::string text;
+        text += "# HELP frames_total Frames submitted\n";
+        text += "# TYPE frames_total counter\n";
+        text += "frames_total{" + labels + "} " + std::to_string(frames) + "\n";
+        text += "# HELP submit_seconds Time to submit\n";
+        text += "# TYPE submit_seconds summary\n";
+        for (auto q : {"0.5", "0.9", "0.99", "0.999"})
+            text += "submit_seconds{" + labels + ",quantile=\"" + q + "\"} " + quantile + "\n";
+        text += "submit_seconds_sum{" + labels + "} " + seconds(latency) + "\n";
+        text += "submit_seconds_count{" + labels + "} 1\n";
+        return text;
+    }
+
+    std::shared_ptr<metrics::MetricSet> make_stream(metrics::Registry& registry, const std::string& labels)
+    {
+        auto set = registry.create(labels);
+        set->counter("frames_total", "Frames submitted").add(3);
+        set->latency("submit_seconds", "Time to submit").record(std::chrono::milliseconds(1));
+        return set;
+    }
+} // namespace
+
+TEST(registry_renders_a_counter_and_a_summary)
+{
+    auto registry = metrics::Registry {};
+    auto set = make_stream(registry, "stream=\"1\"");
+    CHECK_EQ(registry.render(), expected_text("stream=\"1\"", 3, 1000000));
+}
+
+TEST(registry_shares_a_set_between_creators_with_the_same_labels)
+{
+    auto registry = metrics::Registry {};
+    auto first = make_stream(registry, "media=\"a.mp4\"");
+
+    // A producer replaced under the same key, while the first is still held
+    auto second = registry.create("media=\"a.mp4\"");
+    CHECK(first == second);
+    second->counter("frames_total", "Frames submitted").add(2);
+
+    // One series, counting both
+    auto text = registry.render();
+    CHECK(text.find("frames_total{media=\"a.mp4\"} 5\n") != std::string::npos);
+    CHECK(text.find("frames_total{media=\"a.mp4\"}") == text.rfind("frames_total{media=\"a.mp4\"}"));
+
+    // Different labels are a different set
+    auto other = registry.create("media=\"b.mp4\"");
+    CHECK(other != first);
+}
+
+TEST(registry_folds_released_sets_into_closed_totals)
+{
+    auto registry = metrics::Registry {};
+    auto open = make_stream(registry, "stream=\"1\"");
+    make_stream(registry, "stream=\"2\"");
+    make_stream(registry, "stream=\"3\"");
+    registry.collect();
+
+    auto text = registry.render();
+    CHECK(text.find("frames_total{stream=\"1\"} 3\n") != std::string::npos);
+    CHECK(text.find("stream=\"2\"") == std::string::npos);
+    CHECK(text.find("frames_total{scope=\"closed\"} 6\n") != std::string::npos);
+    CHECK(text.find("submit_seconds_count{scope=\"closed\"} 2\n") != std::string::npos);
+
+    // A released set's labels can be used again, for a fresh set
+    auto again = registry.create("stream=\"2\"");
+    CHECK_EQ(again->counter("frames_total", "Frames submitted").value(), 0u);
+}
+
+TEST(exporter_writes_the_rendered_text_to_a_file)
+{
+    auto path = std::filesystem::temp_directory_path() / ("metrics_test_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".prom");
+    auto registry = metrics::Registry {};
+    auto set = make_stream(registry, "stream=\"1\"");
+
+    auto exporter = metrics::Exporter {registry, path.string(), std::chrono::milliseconds(10)};
+    CHECK(exporter.start());
+    set->counter("frames_total", "Frames submitted").add(1);
+    exporter.stop();
+
+    // Written a last time on stopping
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream text;
+    text << file.rdbuf();
+    CHECK_EQ(text.str(), expected_text("stream=\"1\"", 4, 1000000));
+    CHECK(!std::filesystem::exists(path.string() + ".tmp"));
+    file.close();
+    std::filesystem::remove(path);
+
+    auto missing = metrics::Exporter {registry, (std::filesystem::temp_directory_path() / "no_such_dir" / "x.prom").string()};
+    CHECK(!missing.start());
+    CHECK(!missing.error().empty());
+}
+
+#if defined(METRICS_UNIX_SOCKET)
+TEST(exporter_serves_the_rendered_text_on_a_unix_socket)
+{
+    auto path = std::filesystem::temp_directory_path() / ("metrics_test_" + std::to_string(getpid()) + ".sock");
+    auto registry = metrics::Registry {};
+    auto set = make_stream(registry, "stream=\"1\"");
+
+    auto exporter = metrics::Exporter {registry, "unix:" + path.string()};
+    CHECK(exporter.start());
+
+    auto client = socket(AF_UNIX, SOCK_STREAM, 0);
+    auto address = sockaddr_un {};
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path.c_str());
+    CHECK(connect(client, (const sockaddr*)&address, sizeof(address)) == 0);
+
+    std::string text;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = recv(client, buffer, sizeof(buffer), 0)) > 0)
+        text.append(buffer, (size_t)n);
+    close(client);
+    CHECK_EQ(text, expected_text("stream=\"1\"", 3, 1000000));
+
+    // The socket goes away with the exporter
+    exporter.stop();
+    CHECK(!std::filesystem::exists(path));
+}
+#endif
+
+TEST_MAIN()
@@ -0,0 +1,178 @@
+// Tests of the frame pacer on a fake clock: deadlines follow the anchor, a
+// stall moves the anchor instead of bursting, oversleep is learned and
+// spun off, errors never accumulate from frame to frame, and only wakes
+// past the late threshold count as late.
+
+#include <chrono>
+#include <cstdint>
+
+#include "check.h"
+#include "pacer.h"
+
+namespace
+{
+    using namespace std::chrono_literals;
+
+    using Pacer = pacing::FramePacer<pacing::FakeClock>;
+
+    /// @brief 60fps frame `n`, in 100ns units
+    pacing::MediaDuration frame(int64_t n) { return pacing::MediaDuration {n * 10000000 / 60}; }
+} // namespace
+
+TEST(pacer_anchors_media_time_at_start)
+{
+    auto clock = pacing::FakeClock {};
+    clock.advance(5s);
+    auto pacer = Pacer {clock};
+
+    // Starting 2s into the media puts media time 2s at now
+    pacer.start(pacing::MediaDuration {20000000});
+    CHECK(pacer.due_at(pacing::MediaDuration {20000000}) == clock.now());
+    CHECK(pacer.due_at(pacing::MediaDuration {30000000}) == clock.now() + 1s);
+    CHECK_EQ(pacer.media_now().count(), 20000000);
+
+    clock.advance(250ms);
+    CHECK_EQ(pacer.media_now().count(), 22500000);
+}
+
+TEST(pacer_wakes_on_each_deadline)
+{
+    auto clock = pacing::FakeClock {};
+    auto pacer = Pacer {clock};
+    pacer.start();
+
+    for (int64_t n = 1; n <= 120; n++)
+    {
+        auto error = pacer.wait_until(frame(n));
+        CHECK(error >= 0ns && error <= clock.spin_step);
+        CHECK(clock.now() >= pacer.due_at(frame(n)));
+    }
+
+    auto& stats = pacer.statistics();
+    CHECK_EQ(stats.waits, 120u);
+    CHECK_EQ(stats.late, 0u);
+    CHECK_EQ(stats.reanchors, 0u);
+}
+
+TEST(pacer_learns_to_spin_off_oversleep)
+{
+    auto clock = pacing::FakeClock {};
+    clock.sleep_overshoot = 1500us;
+    auto pacer = Pacer {clock};
+    pacer.start();
+
+    // The first wakes overshoot a 500us margin; once the margin has grown
+    // past the overshoot, every wake lands within a spin step
+    for (int64_t n = 1; n <= 60; n++)
+        pacer.wait_until(frame(n));
+
+    CHECK(pacer.current_spin_margin() > 1500us);
+    CHECK(pacer.current_spin_margin() <= 2ms);
+    for (int64_t n = 61; n <= 120; n++)
+        CHECK(pacer.wait_until(frame(n)) <= clock.spin_step);
+
+    CHECK(pacer.statistics().late < 10);
+}
+
+TEST(pacer_errors_do_not_accumulate)
+{
+    auto clock = pacing::FakeClock {};
+    clock.sleep_overshoot = 300us;
+    auto pacer = Pacer {clock};
+    pacer.start();
+
+    // Every wake is late by up to the overshoot, but each deadline is from
+    // the anchor, so after an hour of frames the clock is still on the last
+    // deadline rather than an hour of overshoots past it
+    const int64_t frames = 60 * 60 * 60;
+    for (int64_t n = 1; n <= frames; n++)
+        pacer.wait_until(frame(n));
+
+    auto drift = clock.now() - pacer.due_at(frame(frames));
+    CHECK(drift >= 0ns && drift <= 300us);
+    CHECK_EQ(pacer.statistics().reanchors, 0u);
+}
+
+TEST(pacer_reanchors_after_a_stall)
+{
+    auto clock = pacing::FakeClock {};
+    auto pacer = Pacer {clock};
+    pacer.start();
+
+    pacer.wait_until(frame(1));
+    auto anchor_due = pacer.due_at(frame(2));
+
+    // A 250ms stall: frame 2 is that late, and the anchor moves by as much
+    // so the frames after it don't burst out to catch up
+    clock.advance(250ms);
+    auto late = pacer.wait_until(frame(2));
+    CHECK(late > 200ms);
+    CHECK_EQ(pacer.statistics().reanchors, 1u);
+    CHECK(pacer.due_at(frame(2)) == anchor_due + late);
+
+    auto before = clock.now();
+    CHECK(pacer.wait_until(frame(3)) <= clock.spin_step);
+    CHECK(clock.now() - before >= 16ms);
+    CHECK_EQ(pacer.statistics().reanchors, 1u);
+
+    // A short stall is caught up on instead: the frames after it are still
+    // due where they were, so they go out late, back to back
+    clock.advance(50ms);
+    CHECK(pacer.wait_until(frame(4)) > 30ms);
+    CHECK(pacer.wait_until(frame(5)) > 10ms);
+    CHECK_EQ(pacer.statistics().reanchors, 1u);
+}
+
+TEST(pacer_counts_late_only_past_the_threshold)
+{
+    auto clock = pacing::FakeClock {};
+    auto config = pacing::PacerConfig {};
+    config.late_threshold = 1ms;
+    auto pacer = Pacer {clock, config};
+    pacer.start();
+
+    // Woken past the deadline by a set amount each time
+    int64_t n = 0;
+    auto wake_late_by = [&](std::chrono::nanoseconds error) {
+        n++;
+        clock.current = pacer.due_at(frame(n)) + error;
+        CHECK(pacer.wait_until(frame(n)) == error);
+    };
+
+    wake_late_by(0ns);
+    wake_late_by(40us);
+    wake_late_by(500us);
+    wake_late_by(1ms);
+    wake_late_by(3ms);
+    wake_late_by(20ms);
+
+    auto& stats = pacer.statistics();
+    CHECK_EQ(stats.waits, 6u);
+    CHECK_EQ(stats.late, 2u);
+
+    // <=10us, <=50us, ..., <=500us, <=1ms, <=2ms, <=5ms, <=10ms, above
+    CHECK_EQ(stats.error_distribution[0], 1u);
+    CHECK_EQ(stats.error_distribution[1], 1u);
+    CHECK_EQ(stats.error_distribution[4], 1u);
+    CHECK_EQ(stats.error_distribution[5], 1u);
+    CHECK_EQ(stats.error_distribution[7], 1u);
+    CHECK_EQ(stats.error_distribution[pacing::WAKE_ERROR_BUCKETS - 1], 1u);
+
+    CHECK(stats.error_percentile(0.5) == 500us);
+    CHECK(stats.error_percentile(0.8) == 5ms);
+    CHECK(stats.error_percentile(1.0) == 20ms);
+}
+
+TEST(pacer_cancelled_wait_is_not_counted)
+{
+    auto clock = pacing::FakeClock {};
+    auto pacer = Pacer {clock};
+    pacer.start();
+
+    auto cancel = lifecycle::CancellationToken {};
+    cancel.cancel();
+    CHECK(pacer.wait_until(frame(10), &cancel) == 0ns);
+    CHECK_EQ(pacer.statistics().waits, 0u);
+}
+
+TEST_MAIN()
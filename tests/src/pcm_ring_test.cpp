@@ -0,0 +1,169 @@
+// Tests of the SPSC PCM ring: writes past its capacity count as overruns,
+// short reads as underruns, spans split where the storage wraps, and a
+// producer and consumer on separate threads hand over every frame in order.
+
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+#include "pcm_ring.h"
+
+namespace
+{
+    /// @brief `frames` stereo frames counting up from `first`, both channels alike
+    std::vector<int16_t> ramp(int16_t first, size_t frames)
+    {
+        std::vector<int16_t> samples(frames * 2);
+        for (size_t i = 0; i < frames; i++)
+            samples[i * 2] = samples[i * 2 + 1] = (int16_t)(first + (int16_t)i);
+        return samples;
+    }
+} // namespace
+
+TEST(pcm_ring_counts_overruns_when_full)
+{
+    auto ring = audio::PcmRing(8, 2);
+    auto input = ramp(0, 12);
+
+    CHECK_EQ(ring.write(input.data(), 12), 8u);
+    CHECK_EQ(ring.overrun_frames(), 4u);
+    CHECK_EQ(ring.writable_frames(), 0u);
+
+    // A full ring drops all of the next write
+    CHECK_EQ(ring.write(input.data(), 3), 0u);
+    CHECK_EQ(ring.overrun_frames(), 7u);
+    CHECK_EQ(ring.underrun_frames(), 0u);
+}
+
+TEST(pcm_ring_counts_underruns_on_short_reads)
+{
+    auto ring = audio::PcmRing(8, 2);
+    auto input = ramp(0, 5);
+    ring.write(input.data(), 5);
+
+    std::vector<int16_t> output(8 * 2);
+    CHECK_EQ(ring.read(output.data(), 8), 5u);
+    CHECK_EQ(ring.underrun_frames(), 3u);
+
+    CHECK_EQ(ring.read(output.data(), 2), 0u);
+    CHECK_EQ(ring.underrun_frames(), 5u);
+    CHECK_EQ(ring.overrun_frames(), 0u);
+
+    ring.note_underrun(10);
+    CHECK_EQ(ring.underrun_frames(), 15u);
+}
+
+TEST(pcm_ring_wraps_around_its_storage)
+{
+    auto ring = audio::PcmRing(8, 2);
+    std::vector<int16_t> output(8 * 2);
+
+    // Move the positions to 6 of 8, so the next write has to wrap
+    auto first = ramp(0, 6);
+    ring.write(first.data(), 6);
+    ring.read(output.data(), 6);
+
+    auto second = ramp(100, 7);
+    CHECK_EQ(ring.write(second.data(), 7), 7u);
+    CHECK_EQ(ring.readable_frames(), 7u);
+
+    // The readable span stops at the end of the storage
+    auto span = ring.readable();
+    CHECK_EQ(span.frames, 2u);
+    CHECK_EQ(span.samples[0], 100);
+
+    // A read copies across the wrap, in order
+    CHECK_EQ(ring.read(output.data(), 7), 7u);
+    CHECK(std::vector<int16_t>(output.begin(), output.begin() + 14) == second);
+    CHECK_EQ(ring.overrun_frames(), 0u);
+    CHECK_EQ(ring.underrun_frames(), 0u);
+    CHECK_EQ(ring.written_frames(), 13u);
+}
+
+TEST(pcm_ring_writable_span_stops_at_the_wrap)
+{
+    auto ring = audio::PcmRing(8, 2);
+    std::vector<int16_t> output(8 * 2);
+    auto input = ramp(0, 5);
+    ring.write(input.data(), 5);
+    ring.read(output.data(), 5);
+
+    auto span = ring.writable();
+    CHECK_EQ(span.frames, 3u);
+
+    // The producer's view of the consumer is only refreshed once it isn't enough
+    CHECK_EQ(ring.writable_frames(), 3u);
+    CHECK_EQ(ring.writable_frames(8), 8u);
+
+    span.samples[0] = span.samples[1] = 42;
+    ring.commit(1);
+    CHECK_EQ(ring.read(output.data(), 1), 1u);
+    CHECK_EQ(output[0], 42);
+}
+
+TEST(pcm_ring_upmixes_mono_and_drops_extra_channels)
+{
+    auto ring = audio::PcmRing(8, 2);
+    std::vector<int16_t> mono {1, 2, 3};
+    CHECK_EQ(ring.write(mono.data(), 3, 1), 3u);
+
+    std::vector<int16_t> surround {10, 11, 12, 13, 20, 21, 22, 23};
+    CHECK_EQ(ring.write(surround.data(), 2, 4), 2u);
+
+    std::vector<int16_t> output(5 * 2);
+    CHECK_EQ(ring.read(output.data(), 5), 5u);
+    CHECK(output == (std::vector<int16_t> {1, 1, 2, 2, 3, 3, 10, 11, 20, 21}));
+}
+
+TEST(pcm_ring_hands_over_every_frame_between_threads)
+{
+    const size_t total = 200000;
+    auto ring = audio::PcmRing(257, 2);
+
+    std::thread producer([&] {
+        std::vector<int16_t> chunk(61 * 2);
+        size_t sent = 0;
+        while (sent < total)
+        {
+            auto frames = std::min<size_t>(61, total - sent);
+            if (ring.writable_frames(frames) < frames)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            for (size_t i = 0; i < frames; i++)
+                chunk[i * 2] = chunk[i * 2 + 1] = (int16_t)(sent + i);
+            ring.write(chunk.data(), frames);
+            sent += frames;
+        }
+    });
+
+    size_t received = 0;
+    size_t out_of_order = 0;
+    while (received < total)
+    {
+        auto span = ring.readable();
+        if (span.frames == 0)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        for (size_t i = 0; i < span.frames; i++)
+        {
+            auto expected = (int16_t)(received + i);
+            if (span.samples[i * 2] != expected || span.samples[i * 2 + 1] != expected)
+                out_of_order++;
+        }
+        received += span.frames;
+        ring.consume(span.frames);
+    }
+    producer.join();
+
+    CHECK_EQ(received, total);
+    CHECK_EQ(out_of_order, 0u);
+    CHECK_EQ(ring.overrun_frames(), 0u);
+}
+
+TEST_MAIN()
@@ -0,0 +1,295 @@
+// Tests of the playlist: an M3U file lists its items relative to itself,
+// items play back to back with timestamps that carry on exactly where the
+// one before ended and audio cut or padded to span each item's video, an
+// item that can't be opened is passed over, and a looping playlist goes
+// round again.
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "playlist.h"
+
+namespace
+{
+    namespace fs = std::filesystem;
+
+    struct Frame
+    {
+        int64_t timestamp = 0;
+        size_t item = 0;
+        uint64_t index = 0;
+    };
+
+    using Source = source::SyntheticSource<Frame>;
+    using Playlist = playlist::PlaylistSource<Frame>;
+
+    /// @brief Opens item `i` as `frames[i]` frames at 30fps with 48kHz audio,
+    /// each frame marked with its item, and probed `extra[i]` longer than
+    /// its video (or not at all)
+    Playlist::Open synthetic_items(std::vector<uint64_t> frames, std::vector<int64_t> extra = {})
+    {
+        return [frames, extra](size_t index, playlist::Item<Frame>& item) {
+            if (frames[index] == 0)
+                return false;
+
+            auto media = std::make_unique<Source>(frames[index], 30, 48000, [index](Frame& frame, uint64_t i) {
+                frame.item = index;
+                frame.index = i;
+            });
+            item.duration = media->timestamp(frames[index]) + (index < extra.size() ? extra[index] : 0);
+            item.source = std::move(media);
+            return true;
+        };
+    }
+
+    /// @brief A synthetic source whose audio can be resampled, as decoded audio is
+    class ResampledSource : public Source
+    {
+    public:
+        using Source::Source;
+
+        bool audio_resamplable() const override { return true; }
+    };
+
+    playlist::PlaylistConfig playlist_config()
+    {
+        auto config = playlist::PlaylistConfig {};
+        config.sample_rate = 48000;
+        config.channels = 2;
+        return config;
+    }
+
+    std::vector<Frame> read_video(source::FrameSource<Frame>& media, size_t most = SIZE_MAX)
+    {
+        std::vector<Frame> frames;
+        auto frame = Frame {};
+        while (frames.size() < most && media.read_video(frame) == source::VideoRead::Decoded)
+            frames.push_back(frame);
+        return frames;
+    }
+
+    /// @brief The first channel of all the audio `media` has left
+    std::vector<int16_t> read_audio(source::FrameSource<Frame>& media)
+    {
+        std::vector<int16_t> samples;
+        auto ring = audio::PcmRing(4096, 2);
+        while (true)
+        {
+            auto more = media.read_audio(ring, 2048);
+            auto n = ring.readable_frames();
+            for (size_t i = 0; i < n; i++)
+            {
+                int16_t frame[2];
+                ring.read(frame, 1);
+                samples.push_back(frame[0]);
+            }
+            if (!more || n == 0)
+                break;
+        }
+        return samples;
+    }
+
+    struct TempDirectory
+    {
+        TempDirectory()
+        {
+            auto suffix = std::to_string(std::random_device {}());
+            path = fs::temp_directory_path() / ("rainway-playlist-test-" + suffix);
+            fs::create_directories(path);
+        }
+
+        ~TempDirectory()
+        {
+            std::error_code error;
+            fs::remove_all(path, error);
+        }
+
+        fs::path path;
+    };
+} // namespace
+
+TEST(playlist_reads_m3u_items_relative_to_itself)
+{
+    CHECK(playlist::is_playlist("list.m3u"));
+    CHECK(playlist::is_playlist("dir/list.m3u8"));
+    CHECK(!playlist::is_playlist("media.mp4"));
+
+    auto directory = TempDirectory {};
+    auto path = directory.path / "list.m3u8";
+    auto absolute = (directory.path / "elsewhere" / "c.mp4").string();
+    std::ofstream(path, std::ios::binary) << "\xEF\xBB\xBF#EXTM3U\r\n"
+                                          << "a.mp4\r\n"
+                                          << "\n"
+                                          << "# a comment\n"
+                                          << "sub/b.y4m  \n"
+                                          << absolute << "\n";
+
+    auto items = playlist::read_m3u(path.string());
+    CHECK_EQ(items.size(), 3u);
+    if (items.size() == 3)
+    {
+        CHECK(fs::path(items[0]) == directory.path / "a.mp4");
+        CHECK(fs::path(items[1]) == directory.path / "sub" / "b.y4m");
+        CHECK_EQ(items[2], absolute);
+    }
+    CHECK(playlist::read_m3u((directory.path / "missing.m3u").string()).empty());
+}
+
+TEST(playlist_hands_over_gaplessly_at_a_frame_boundary)
+{
+    // One, one and a half and two seconds
+    std::vector<uint64_t> lengths {30, 45, 60};
+    auto media = Playlist(3, synthetic_items(lengths), playlist_config());
+
+    auto frames = read_video(media);
+    CHECK_EQ(frames.size(), 135u);
+
+    // Every item's frames in order, each item starting exactly where the one
+    // before it ended, and no two frames further apart than one interval
+    size_t at = 0;
+    int64_t start = 0;
+    for (size_t item = 0; item < lengths.size(); item++)
+    {
+        for (uint64_t i = 0; i < lengths[item] && at < frames.size(); i++, at++)
+        {
+            CHECK_EQ(frames[at].item, item);
+            CHECK_EQ(frames[at].index, i);
+            CHECK_EQ(frames[at].timestamp, start + (int64_t)(i * 10000000 / 30));
+        }
+        start += (int64_t)(lengths[item] * 10000000 / 30);
+    }
+    for (size_t i = 1; i < frames.size(); i++)
+        CHECK(frames[i].timestamp - frames[i - 1].timestamp <= 333334);
+
+    // The audio is each item's from its start, back to back, and exactly as
+    // long as the video
+    auto samples = read_audio(media);
+    CHECK_EQ(samples.size(), (size_t)(4.5 * 48000));
+    size_t wrong = 0;
+    for (size_t p = 0; p < samples.size(); p++)
+    {
+        auto position = p < 48000 ? p : p < 120000 ? p - 48000 : p - 120000;
+        wrong += samples[p] != (int16_t)position;
+    }
+    CHECK_EQ(wrong, 0u);
+
+    auto stats = media.stats();
+    CHECK_EQ(stats.items, 3u);
+    CHECK_EQ(stats.switches, 2u);
+    // Timestamps truncated to 100ns leave at most a tick between items
+    CHECK(stats.timestamp_gap_max <= 1);
+    CHECK_EQ(stats.audio_frames_padded, 0u);
+    CHECK_EQ(stats.audio_frames_trimmed, 0u);
+}
+
+TEST(playlist_pads_an_item_probed_longer_than_its_video_with_silence)
+{
+    // The first item says it's half a second longer than it turns out to be
+    auto media = Playlist(2, synthetic_items({30, 30}, {5000000}), playlist_config());
+
+    auto frames = read_video(media);
+    CHECK_EQ(frames.size(), 60u);
+    CHECK_EQ(frames[30].timestamp, 15000000);
+
+    // Its audio runs out at one second, and is padded to where the next starts
+    auto samples = read_audio(media);
+    CHECK_EQ(samples.size(), (size_t)(2.5 * 48000));
+    size_t wrong = 0;
+    for (size_t p = 0; p < samples.size(); p++)
+    {
+        auto expected = p < 48000 ? (int16_t)p : p < 72000 ? (int16_t)0 : (int16_t)(p - 72000);
+        wrong += samples[p] != expected;
+    }
+    CHECK_EQ(wrong, 0u);
+
+    auto stats = media.stats();
+    CHECK(stats.timestamp_gap_max >= 5000000 && stats.timestamp_gap_max <= 5000001);
+    CHECK_EQ(stats.audio_frames_padded, 24000u);
+}
+
+TEST(playlist_passes_over_an_item_it_cannot_open)
+{
+    auto media = Playlist(3, synthetic_items({10, 0, 10}), playlist_config());
+
+    auto frames = read_video(media);
+    CHECK_EQ(frames.size(), 20u);
+    CHECK_EQ(frames[9].item, 0u);
+    CHECK_EQ(frames[10].item, 2u);
+    auto step = frames[10].timestamp - frames[9].timestamp;
+    CHECK(step == 333333 || step == 333334);
+
+    auto stats = media.stats();
+    CHECK_EQ(stats.items, 2u);
+    CHECK_EQ(stats.failed_opens, 1u);
+}
+
+TEST(playlist_says_whether_each_items_audio_can_be_resampled)
+{
+    // A second that can, then one that can't
+    auto open = [](size_t index, playlist::Item<Frame>& item) {
+        auto media = index == 0 ? std::make_unique<ResampledSource>(30, 30, 48000) : std::make_unique<Source>(30, 30, 48000);
+        item.duration = media->timestamp(30);
+        item.source = std::move(media);
+        return true;
+    };
+    auto media = Playlist(2, open, playlist_config());
+    read_video(media);
+
+    // Each item's say holds from its first audio to its last, changing where
+    // its audio is lined up again
+    auto ring = audio::PcmRing(4096, 2);
+    std::vector<int16_t> pcm(1024 * 2);
+    size_t resamplable = 0, fixed = 0, wrong = 0;
+    while (media.read_audio(ring, 1024))
+    {
+        ring.read(pcm.data(), 1024);
+        resamplable += media.audio_resamplable() ? 1 : 0;
+        fixed += media.audio_resamplable() ? 0 : 1;
+        wrong += media.audio_resamplable() != (media.audio_resyncs() == 0);
+    }
+    CHECK(resamplable >= 46);
+    CHECK(fixed >= 46);
+    CHECK_EQ(wrong, 0u);
+}
+
+TEST(playlist_loops_back_to_the_first_item)
+{
+    auto config = playlist_config();
+    config.loop = true;
+    config.audio = false;
+    auto media = Playlist(2, synthetic_items({10, 20}), config);
+
+    // Three times round, timestamps still increasing
+    auto frames = read_video(media, 90);
+    CHECK_EQ(frames.size(), 90u);
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        auto in_round = i % 30;
+        CHECK_EQ(frames[i].item, in_round < 10 ? 0u : 1u);
+        CHECK_EQ(frames[i].index, in_round < 10 ? in_round : in_round - 10);
+        if (i > 0)
+            CHECK(frames[i].timestamp > frames[i - 1].timestamp);
+    }
+    CHECK_EQ(frames[30].timestamp, 10000000);
+    CHECK_EQ(media.stats().switches, 5u);
+}
+
+TEST(playlist_of_items_that_cannot_be_opened_ends)
+{
+    auto config = playlist_config();
+    config.loop = true;
+    auto media = Playlist(2, synthetic_items({0, 0}), config);
+
+    auto frame = Frame {};
+    CHECK(media.read_video(frame) == source::VideoRead::Ended);
+    CHECK_EQ(media.stats().failed_opens, 2u);
+}
+
+TEST_MAIN()
@@ -0,0 +1,335 @@
+// Tests of the raw media readers: a generated Y4M parses however its header
+// is spaced, refuses colourspaces of more than 8 bits, and hands out only
+// the whole frames of a truncated file; a generated WAV parses plain or
+// WAVE_FORMAT_EXTENSIBLE, with the data size a streaming writer leaves or
+// one past the end of the file.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "raw_media.h"
+
+namespace
+{
+    namespace fs = std::filesystem;
+
+    /// @brief A directory of its own under the system's temporary one, removed
+    /// with everything in it when the test ends
+    struct TempDirectory
+    {
+        TempDirectory()
+        {
+            auto suffix = std::to_string(std::random_device {}());
+            path = fs::temp_directory_path() / ("rainway-raw-test-" + suffix);
+            fs::create_directories(path);
+        }
+
+        ~TempDirectory()
+        {
+            std::error_code error;
+            fs::remove_all(path, error);
+        }
+
+        /// @brief Write `bytes` to `name` in the directory
+        std::string write(const std::string& name, const std::vector<uint8_t>& bytes) const
+        {
+            auto file_path = (path / name).string();
+            auto file = fopen(file_path.c_str(), "wb");
+            fwrite(bytes.data(), 1, bytes.size(), file);
+            fclose(file);
+            return file_path;
+        }
+
+        fs::path path;
+    };
+
+    // 5 x 3, so the chroma planes round up to 3 x 2
+    constexpr uint32_t WIDTH = 5;
+    constexpr uint32_t HEIGHT = 3;
+    constexpr size_t PICTURE_BYTES = WIDTH * HEIGHT + 2 * 3 * 2;
+
+    void append(std::vector<uint8_t>& bytes, const std::string& text)
+    {
+        bytes.insert(bytes.end(), text.begin(), text.end());
+    }
+
+    /// @brief A Y4M with `header` as its parameters and `frames` frames, each
+    /// byte of frame i being i; `truncate` bytes short of the last frame
+    std::vector<uint8_t> y4m(const std::string& header, size_t frames, size_t truncate = 0)
+    {
+        std::vector<uint8_t> bytes;
+        append(bytes, "YUV4MPEG2 " + header + "\n");
+        for (size_t i = 0; i < frames; i++)
+        {
+            append(bytes, "FRAME\n");
+            bytes.insert(bytes.end(), PICTURE_BYTES, (uint8_t)i);
+        }
+        bytes.resize(bytes.size() - truncate);
+        return bytes;
+    }
+
+    void append_u16(std::vector<uint8_t>& bytes, uint16_t value)
+    {
+        bytes.push_back((uint8_t)value);
+        bytes.push_back((uint8_t)(value >> 8));
+    }
+
+    void append_u32(std::vector<uint8_t>& bytes, uint32_t value)
+    {
+        append_u16(bytes, (uint16_t)value);
+        append_u16(bytes, (uint16_t)(value >> 16));
+    }
+
+    struct WavFormat
+    {
+        uint16_t format = 1;
+        uint16_t channels = 2;
+        uint16_t bits = 16;
+        /// @brief Write a WAVE_FORMAT_EXTENSIBLE fmt chunk with `format` as
+        /// its sub-format
+        bool extensible = false;
+    };
+
+    /// @brief A WAV of `frames` frames whose samples count up from 0, its
+    /// data chunk's size field `data_size` (the real size if unset), after a
+    /// LIST chunk of odd length
+    std::vector<uint8_t> wav(const WavFormat& format, size_t frames, int64_t data_size = -1)
+    {
+        std::vector<uint8_t> bytes;
+        append(bytes, "RIFF");
+        append_u32(bytes, 0);
+        append(bytes, "WAVE");
+
+        append(bytes, "fmt ");
+        append_u32(bytes, format.extensible ? 40 : 16);
+        append_u16(bytes, format.extensible ? 0xFFFE : format.format);
+        append_u16(bytes, format.channels);
+        append_u32(bytes, 48000);
+        append_u32(bytes, 48000 * format.channels * format.bits / 8);
+        append_u16(bytes, (uint16_t)(format.channels * format.bits / 8));
+        append_u16(bytes, format.bits);
+        if (format.extensible)
+        {
+            append_u16(bytes, 22);
+            append_u16(bytes, format.bits);
+            append_u32(bytes, 3);
+            // KSDATAFORMAT_SUBTYPE_PCM and friends: the format, then a fixed tail
+            append_u16(bytes, format.format);
+            const uint8_t tail[] = {0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71};
+            bytes.insert(bytes.end(), tail, tail + sizeof(tail));
+        }
+
+        append(bytes, "LIST");
+        append_u32(bytes, 3);
+        append(bytes, "abc");
+        bytes.push_back(0);
+
+        auto samples = frames * format.channels;
+        append(bytes, "data");
+        append_u32(bytes, data_size >= 0 ? (uint32_t)data_size : (uint32_t)(samples * 2));
+        for (size_t i = 0; i < samples; i++)
+            append_u16(bytes, (uint16_t)i);
+
+        auto riff_size = (uint32_t)(bytes.size() - 8);
+        memcpy(bytes.data() + 4, &riff_size, 4);
+        return bytes;
+    }
+
+    /// @brief Whether samples [first, first + frames) of `wav` count up as written
+    bool samples_count_up(const raw::WavReader& reader, uint64_t first, size_t frames)
+    {
+        auto got = frames;
+        auto samples = reader.samples(first, got);
+        if (got != frames)
+            return false;
+        for (size_t i = 0; i < frames * reader.channels(); i++)
+        {
+            if (samples[i] != (int16_t)(first * reader.channels() + i))
+                return false;
+        }
+        return true;
+    }
+} // namespace
+
+TEST(y4m_parses_its_header_and_frames)
+{
+    auto dir = TempDirectory {};
+    auto reader = raw::Y4mReader {};
+    CHECK(reader.open(dir.write("a.y4m", y4m("W5 H3 F30000:1001 Ip A1:1 C420jpeg XCOLORRANGE=FULL", 3))));
+    CHECK_EQ(reader.width(), WIDTH);
+    CHECK_EQ(reader.height(), HEIGHT);
+    CHECK_EQ(reader.frame_count(), 3u);
+    CHECK(reader.fps() > 29.97 && reader.fps() < 29.98);
+    CHECK(reader.full_range());
+
+    auto frame = reader.frame(2);
+    CHECK(frame.y != nullptr);
+    CHECK_EQ(frame.y_stride, 5u);
+    CHECK_EQ(frame.uv_stride, 3u);
+    CHECK_EQ(frame.u - frame.y, 15);
+    CHECK_EQ(frame.v - frame.u, 6);
+    CHECK_EQ(frame.y[0], 2);
+    CHECK_EQ(frame.v[5], 2);
+    CHECK_EQ(frame.timestamp, reader.timestamp(2));
+    CHECK_EQ(reader.timestamp(1), 333666);
+    CHECK(reader.frame(3).y == nullptr);
+}
+
+TEST(y4m_tolerates_runs_of_spaces_and_crlf)
+{
+    auto dir = TempDirectory {};
+    auto headers = {
+        "W5  H3 F25:1",
+        "  W5 H3   F25:1  ",
+        "W5 H3 F25:1 XCOLORRANGE=FULL\r",
+        "W5 H3 F25:1 XCOLORRANGE=FULL \r",
+        "W5 H3 \r F25:1 XCOLORRANGE=FULL",
+    };
+    for (auto header : headers)
+    {
+        auto reader = raw::Y4mReader {};
+        CHECK(reader.open(dir.write("a.y4m", y4m(header, 2))));
+        CHECK_EQ(reader.width(), WIDTH);
+        CHECK_EQ(reader.height(), HEIGHT);
+        CHECK_EQ(reader.fps(), 25.0);
+        CHECK_EQ(reader.frame_count(), 2u);
+        CHECK_EQ(reader.full_range(), std::string(header).find("FULL") != std::string::npos);
+    }
+
+    // Only spaces is no parameters at all
+    auto reader = raw::Y4mReader {};
+    CHECK(!reader.open(dir.write("a.y4m", y4m("   ", 1))));
+}
+
+TEST(y4m_refuses_colourspaces_it_cannot_show)
+{
+    auto dir = TempDirectory {};
+    for (auto tag : {"C420", "C420jpeg", "C420mpeg2", "C420paldv"})
+    {
+        auto reader = raw::Y4mReader {};
+        CHECK(reader.open(dir.write("a.y4m", y4m(std::string("W5 H3 F25:1 ") + tag, 1))));
+    }
+    for (auto tag : {"C420p9", "C420p10", "C420p12", "C420p14", "C420p16", "C422", "C444", "Cmono"})
+    {
+        auto reader = raw::Y4mReader {};
+        CHECK(!reader.open(dir.write("a.y4m", y4m(std::string("W5 H3 F25:1 ") + tag, 1))));
+        CHECK(reader.error().find("colourspace") != std::string::npos);
+    }
+
+    auto missing_rate = raw::Y4mReader {};
+    CHECK(!missing_rate.open(dir.write("a.y4m", y4m("W5 H3", 1))));
+    auto frame_parameters = raw::Y4mReader {};
+    auto with_parameters = y4m("W5 H3 F25:1", 1);
+    with_parameters.insert(with_parameters.begin() + (long)std::string("YUV4MPEG2 W5 H3 F25:1\nFRAME").size(), ' ');
+    CHECK(!frame_parameters.open(dir.write("a.y4m", with_parameters)));
+}
+
+TEST(y4m_hands_out_only_whole_frames_of_a_truncated_file)
+{
+    auto dir = TempDirectory {};
+
+    // A byte short of the third frame
+    auto reader = raw::Y4mReader {};
+    CHECK(reader.open(dir.write("a.y4m", y4m("W5 H3 F25:1", 3, 1))));
+    CHECK_EQ(reader.frame_count(), 2u);
+    CHECK(reader.frame(1).y != nullptr);
+    CHECK(reader.frame(2).y == nullptr);
+
+    auto source = raw::RawMediaSource(reader, nullptr);
+    auto frame = raw::VideoFrame {};
+    CHECK(source.read_video(frame) == source::VideoRead::Decoded);
+    CHECK(source.read_video(frame) == source::VideoRead::Decoded);
+    CHECK(source.read_video(frame) == source::VideoRead::Ended);
+
+    // Nothing past the first frame's header
+    auto only_header = raw::Y4mReader {};
+    CHECK(only_header.open(dir.write("b.y4m", y4m("W5 H3 F25:1", 1, PICTURE_BYTES))));
+    CHECK_EQ(only_header.frame_count(), 0u);
+    CHECK(only_header.frame(0).y == nullptr);
+
+    // A frame whose header is damaged is not handed out
+    auto bytes = y4m("W5 H3 F25:1", 3);
+    bytes[std::string("YUV4MPEG2 W5 H3 F25:1\n").size() + 6 + PICTURE_BYTES] = 'X';
+    auto damaged = raw::Y4mReader {};
+    CHECK(damaged.open(dir.write("c.y4m", bytes)));
+    CHECK(damaged.frame(0).y != nullptr);
+    CHECK(damaged.frame(1).y == nullptr);
+    CHECK(damaged.frame(2).y != nullptr);
+}
+
+TEST(wav_parses_plain_and_extensible_pcm)
+{
+    auto dir = TempDirectory {};
+    for (auto extensible : {false, true})
+    {
+        auto format = WavFormat {};
+        format.extensible = extensible;
+        auto reader = raw::WavReader {};
+        CHECK(reader.open(dir.write("a.wav", wav(format, 100))));
+        CHECK_EQ(reader.channels(), 2);
+        CHECK_EQ(reader.sample_rate(), 48000u);
+        CHECK_EQ(reader.frame_count(), 100u);
+        CHECK(samples_count_up(reader, 0, 100));
+        CHECK(samples_count_up(reader, 37, 20));
+
+        // Clamped to the end
+        size_t frames = 50;
+        reader.samples(90, frames);
+        CHECK_EQ(frames, 10u);
+        frames = 50;
+        reader.samples(200, frames);
+        CHECK_EQ(frames, 0u);
+    }
+
+    // Not 16-bit PCM, however it is said
+    auto float_extensible = WavFormat {};
+    float_extensible.format = 3;
+    float_extensible.bits = 32;
+    float_extensible.extensible = true;
+    auto eight_bit = WavFormat {};
+    eight_bit.bits = 8;
+    for (auto format : {float_extensible, eight_bit})
+    {
+        auto reader = raw::WavReader {};
+        CHECK(!reader.open(dir.write("a.wav", wav(format, 100))));
+    }
+}
+
+TEST(wav_uses_the_rest_of_the_file_when_the_data_size_is_unknown)
+{
+    auto dir = TempDirectory {};
+    auto format = WavFormat {};
+
+    // Streaming writers' sizes, and one that overruns a truncated file
+    for (int64_t size : {0ll, 0xFFFFFFFFll, 100000ll})
+    {
+        auto reader = raw::WavReader {};
+        CHECK(reader.open(dir.write("a.wav", wav(format, 100, size))));
+        CHECK_EQ(reader.frame_count(), 100u);
+        CHECK(samples_count_up(reader, 0, 100));
+    }
+
+    // A partial last frame is left out
+    auto partial = wav(format, 100);
+    partial.resize(partial.size() - 1);
+    auto truncated = raw::WavReader {};
+    CHECK(truncated.open(dir.write("b.wav", partial)));
+    CHECK_EQ(truncated.frame_count(), 99u);
+
+    // No data chunk at all, or not a WAV
+    auto no_data = wav(format, 0);
+    no_data.resize(no_data.size() - 8);
+    auto empty = raw::WavReader {};
+    CHECK(!empty.open(dir.write("c.wav", no_data)));
+
+    auto not_wav = raw::WavReader {};
+    CHECK(!not_wav.open(dir.write("d.wav", std::vector<uint8_t>(64, 0))));
+}
+
+TEST_MAIN()
@@ -0,0 +1,107 @@
+// Tests of the polyphase resampler: sine tones converted between 48 kHz and
+// 44.1 kHz at every quality preset, with every dot product kernel this CPU
+// can run, have to come out as the same tone to within a least SNR.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+#include "check.h"
+#include "resampler.h"
+
+namespace
+{
+    const double pi = 3.14159265358979323846;
+
+    /// @brief SNR of a tone at `frequency` converted from `input_rate` to
+    /// `output_rate`, against the ideal tone at the output rate, in dB
+    double tone_snr(double frequency, uint32_t input_rate, uint32_t output_rate, audio::ResamplerQuality quality, audio::DotFn dot)
+    {
+        const double amplitude = 0.5;
+        const size_t input_frames = input_rate / 2;
+
+        std::vector<float> input(input_frames * 2);
+        for (size_t i = 0; i < input_frames; i++)
+        {
+            auto value = (float)(amplitude * std::sin(2.0 * pi * frequency * (double)i / (double)input_rate));
+            input[i * 2] = value;
+            input[i * 2 + 1] = -value;
+        }
+
+        // Fed in uneven chunks, as a decoder would
+        auto resampler = audio::Resampler(input_rate, output_rate, 2, quality, dot);
+        std::vector<float> output;
+        std::vector<float> chunk(4096 * 2);
+        for (size_t fed = 0; fed < input_frames;)
+        {
+            auto frames = std::min<size_t>(input_frames - fed, 331 + fed % 977);
+            resampler.push(input.data() + fed * 2, frames);
+            fed += frames;
+            while (auto pulled = resampler.pull(chunk.data(), chunk.size() / 2))
+                output.insert(output.end(), chunk.begin(), chunk.begin() + (ptrdiff_t)pulled * 2);
+        }
+
+        // Output n is at input time n / output_rate. Leave out the start,
+        // where the filter window still reaches back into the padding.
+        double signal = 0.0, noise = 0.0;
+        auto skip = resampler.filter_length() * 2;
+        for (size_t n = skip; n < output.size() / 2; n++)
+        {
+            auto expected = amplitude * std::sin(2.0 * pi * frequency * (double)n / (double)output_rate);
+            for (int c = 0; c < 2; c++)
+            {
+                auto wanted = c == 0 ? expected : -expected;
+                auto error = (double)output[n * 2 + c] - wanted;
+                signal += wanted * wanted;
+                noise += error * error;
+            }
+        }
+
+        return 10.0 * std::log10(signal / std::max(noise, 1e-30));
+    }
+
+    void check_tones(audio::ResamplerQuality quality, const char* name, double min_snr)
+    {
+        for (auto& [level, features] : test::feature_levels())
+        {
+            auto dot = audio::select_dot(features);
+            for (auto frequency : {1000.0, 10000.0})
+            {
+                for (auto [from, to] : {std::pair<uint32_t, uint32_t> {48000, 44100}, {44100, 48000}})
+                {
+                    auto snr = tone_snr(frequency, from, to, quality, dot);
+                    if (snr < min_snr)
+                    {
+                        char what[160];
+                        snprintf(what, sizeof(what), "%s %.0f Hz %u->%u with %s: %.1f dB, want %.0f dB", name, frequency, from, to, level.c_str(), snr, min_snr);
+                        test::fail(__FILE__, __LINE__, what);
+                    }
+                }
+            }
+        }
+    }
+} // namespace
+
+TEST(resampler_fast_snr)
+{
+    check_tones(audio::ResamplerQuality::Fast, "fast", 60.0);
+}
+
+TEST(resampler_balanced_snr)
+{
+    check_tones(audio::ResamplerQuality::Balanced, "balanced", 72.0);
+}
+
+TEST(resampler_high_snr)
+{
+    check_tones(audio::ResamplerQuality::High, "high", 95.0);
+}
+
+TEST(resampler_best_snr)
+{
+    check_tones(audio::ResamplerQuality::Best, "best", 110.0);
+}
+
+TEST_MAIN()
@@ -0,0 +1,200 @@
+// Tests of the BGRA scaler and letterbox: every SIMD pass produces exactly
+// the bytes of the scalar one over odd sizes and strides, up and down, a
+// flat picture stays flat, and the letterbox centres the picture on even
+// offsets with opaque black bars around it.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "check.h"
+#include "scaler.h"
+
+namespace
+{
+    /// @brief Noise, so every tap's weight shows in the output
+    std::vector<uint8_t> noise(uint32_t width, uint32_t height, size_t stride)
+    {
+        std::vector<uint8_t> pixels(stride * height);
+        uint32_t state = width * 7919u + height;
+        for (auto& byte : pixels)
+        {
+            state = state * 1664525u + 1013904223u;
+            byte = (uint8_t)(state >> 24);
+        }
+        return pixels;
+    }
+
+    /// @brief Scale `src` with the passes of `features`, into an output whose
+    /// rows are padded past the picture with a marker byte
+    std::vector<uint8_t> scale_with(const cpu::Features& features, const std::vector<uint8_t>& src, uint32_t src_width, uint32_t src_height, size_t src_stride, uint32_t dst_width, uint32_t dst_height, scale::Filter filter)
+    {
+        auto dst_stride = (size_t)dst_width * 4 + 12;
+        std::vector<uint8_t> dst(dst_stride * dst_height, 0xa5);
+        auto scaler = scale::Scaler(src_width, src_height, dst_width, dst_height, filter, scale::select_kernels(features));
+        scaler.run(src.data(), src_stride, dst.data(), dst_stride);
+        return dst;
+    }
+
+    struct Case
+    {
+        uint32_t src_width;
+        uint32_t src_height;
+        uint32_t dst_width;
+        uint32_t dst_height;
+    };
+
+    // Odd sizes leave remainders after every vector width; tiny sources leave
+    // odd tap counts
+    const Case CASES[] = {
+        {37, 23, 17, 11},
+        {1920, 1080, 641, 359},
+        {33, 19, 101, 47},
+        {640, 360, 1279, 719},
+        {3, 3, 7, 5},
+        {1, 1, 5, 3},
+        {97, 61, 97, 61},
+        {250, 31, 3, 97},
+    };
+
+    uint32_t pixel(const uint8_t* row, uint32_t x)
+    {
+        uint32_t value;
+        memcpy(&value, row + (size_t)x * 4, sizeof(value));
+        return value;
+    }
+} // namespace
+
+TEST(scaler_passes_match_scalar_byte_for_byte)
+{
+    auto levels = test::feature_levels();
+    for (const auto& size : CASES)
+    {
+        for (auto filter : {scale::Filter::Bilinear, scale::Filter::Area})
+        {
+            // Source rows padded, as decoded pictures often are
+            auto src_stride = (size_t)size.src_width * 4 + 20;
+            auto src = noise(size.src_width, size.src_height, src_stride);
+            auto expected = scale_with(cpu::Features {}, src, size.src_width, size.src_height, src_stride, size.dst_width, size.dst_height, filter);
+
+            for (const auto& level : levels)
+            {
+                auto output = scale_with(level.second, src, size.src_width, size.src_height, src_stride, size.dst_width, size.dst_height, filter);
+                if (output != expected)
+                {
+                    printf("\n  %s, %s: %ux%u -> %ux%u differs from scalar\n", level.first.c_str(), filter == scale::Filter::Area ? "area" : "bilinear", size.src_width, size.src_height, size.dst_width, size.dst_height);
+                    CHECK(output == expected);
+                }
+            }
+
+            // Nothing past the end of each output row is written
+            auto dst_stride = (size_t)size.dst_width * 4 + 12;
+            size_t clobbered = 0;
+            for (uint32_t y = 0; y < size.dst_height; y++)
+                for (size_t i = (size_t)size.dst_width * 4; i < dst_stride; i++)
+                    clobbered += expected[y * dst_stride + i] != 0xa5;
+            CHECK_EQ(clobbered, 0u);
+        }
+    }
+}
+
+TEST(scaler_keeps_a_flat_picture_flat)
+{
+    const uint32_t colour = 0xff3c82c8;
+    for (const auto& level : test::feature_levels())
+    {
+        for (const auto& size : CASES)
+        {
+            auto src_stride = (size_t)size.src_width * 4;
+            std::vector<uint8_t> src(src_stride * size.src_height);
+            for (size_t i = 0; i < src.size(); i += 4)
+                memcpy(&src[i], &colour, sizeof(colour));
+
+            // Weights sum to exactly one, so no rounding drifts the colour
+            for (auto filter : {scale::Filter::Bilinear, scale::Filter::Area})
+            {
+                auto output = scale_with(level.second, src, size.src_width, size.src_height, src_stride, size.dst_width, size.dst_height, filter);
+                auto dst_stride = (size_t)size.dst_width * 4 + 12;
+                size_t off = 0;
+                for (uint32_t y = 0; y < size.dst_height; y++)
+                    for (uint32_t x = 0; x < size.dst_width; x++)
+                        off += pixel(output.data() + y * dst_stride, x) != colour;
+                CHECK_EQ(off, 0u);
+            }
+        }
+    }
+}
+
+TEST(letterbox_fit_centres_on_even_offsets)
+{
+    // Wider than the box: full width, bars above and below
+    auto wide = scale::fit(1920, 1080, 1280, 1024);
+    CHECK(wide == (scale::Rect {0, 152, 1280, 720}));
+
+    // Taller: full height, bars at the sides
+    auto tall = scale::fit(1080, 1920, 1280, 720);
+    CHECK(tall == (scale::Rect {438, 0, 404, 720}));
+
+    // Odd sizes round down to even ones, and so do the offsets
+    auto odd = scale::fit(101, 57, 64, 64);
+    CHECK(odd == (scale::Rect {0, 14, 64, 36}));
+
+    // A picture that fits keeps its size
+    auto small = scale::fit(640, 480, 1280, 720);
+    CHECK(small == (scale::Rect {320, 120, 640, 480}));
+}
+
+TEST(letterbox_paints_black_bars_around_the_picture)
+{
+    struct Box
+    {
+        uint32_t src_width, src_height, out_width, out_height;
+    };
+    for (const auto& box : {Box {1920, 1080, 1280, 1024}, Box {101, 57, 64, 64}, Box {640, 480, 1280, 720}})
+    {
+        auto src_stride = (size_t)box.src_width * 4;
+        auto src = noise(box.src_width, box.src_height, src_stride);
+
+        auto letterbox = scale::Letterbox(box.src_width, box.src_height, box.out_width, box.out_height);
+        auto rect = letterbox.picture();
+        CHECK(rect == scale::fit(box.src_width, box.src_height, box.out_width, box.out_height));
+        CHECK_EQ(letterbox.scales(), rect.width != box.src_width || rect.height != box.src_height);
+
+        auto out_stride = (size_t)box.out_width * 4;
+        std::vector<uint8_t> out(out_stride * box.out_height, 0x11);
+        letterbox.run(src.data(), src_stride, out.data(), out_stride);
+
+        // The picture is what the scaler makes of it (or the source itself),
+        // and everything around it opaque black
+        std::vector<uint8_t> picture;
+        if (letterbox.scales())
+        {
+            picture = scale_with(cpu::detect_features(), src, box.src_width, box.src_height, src_stride, rect.width, rect.height, scale::default_filter(box.src_width, box.src_height, rect.width, rect.height));
+        }
+        auto picture_stride = (size_t)rect.width * 4 + 12;
+
+        size_t wrong_bars = 0, wrong_picture = 0;
+        for (uint32_t y = 0; y < box.out_height; y++)
+        {
+            auto row = out.data() + y * out_stride;
+            for (uint32_t x = 0; x < box.out_width; x++)
+            {
+                auto inside = x >= rect.x && x < rect.x + rect.width && y >= rect.y && y < rect.y + rect.height;
+                if (!inside)
+                {
+                    wrong_bars += pixel(row, x) != 0xff000000;
+                    continue;
+                }
+
+                auto px = x - rect.x, py = y - rect.y;
+                auto expected = letterbox.scales() ? pixel(picture.data() + py * picture_stride, px) : pixel(src.data() + py * src_stride, px);
+                wrong_picture += pixel(row, x) != expected;
+            }
+        }
+        CHECK_EQ(wrong_bars, 0u);
+        CHECK_EQ(wrong_picture, 0u);
+    }
+}
+
+TEST_MAIN()
@@ -0,0 +1,319 @@
+// Tests of the seek index and the seeking source: a timestamp maps to the
+// keyframe at or before it, an index saved alongside its media loads back
+// until the media changes, and the source starts part way in, seeks and
+// loops with video timestamps that only increase and audio that stays in
+// step with them.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "check.h"
+#include "seek_index.h"
+
+namespace
+{
+    namespace fs = std::filesystem;
+
+    struct Frame
+    {
+        int64_t timestamp = 0;
+        uint64_t index = 0;
+    };
+
+    using Source = source::SyntheticSource<Frame>;
+
+    /// @brief 30fps with 48kHz audio: a frame is exactly 1600 audio frames,
+    /// and the audio's samples count its position in the media
+    Source synthetic(uint64_t frames, uint32_t keyframe_interval)
+    {
+        return Source(frames, 30, 48000, [](Frame& frame, uint64_t index) { frame.index = index; }, keyframe_interval);
+    }
+
+    seek::SeekIndex index_of(const Source& media, uint64_t frames, uint32_t keyframe_interval)
+    {
+        return seek::SeekIndex::every(frames, keyframe_interval, media.timestamp(frames), [&](uint64_t frame) { return media.timestamp(frame); });
+    }
+
+    seek::SeekingConfig seeking_config()
+    {
+        auto config = seek::SeekingConfig {};
+        config.sample_rate = 48000;
+        config.channels = 2;
+        return config;
+    }
+
+    /// @brief Read up to `frames` of audio from `media`, appending the first
+    /// channel's samples to `samples`
+    /// @return How many were read
+    size_t read_audio(source::FrameSource<Frame>& media, std::vector<int16_t>& samples, size_t frames)
+    {
+        auto ring = audio::PcmRing(4096, 2);
+        size_t read = 0;
+        while (read < frames)
+        {
+            media.read_audio(ring, std::min<size_t>(2048, frames - read));
+            auto n = ring.readable_frames();
+            if (n == 0)
+                break;
+
+            for (size_t i = 0; i < n; i++)
+            {
+                int16_t frame[2];
+                ring.read(frame, 1);
+                samples.push_back(frame[0]);
+            }
+            read += n;
+        }
+        return read;
+    }
+
+    /// @brief 100ns ticks to 48kHz audio frames, rounded as the source does
+    uint64_t audio_frames(int64_t timestamp) { return ((uint64_t)timestamp * 48000 + 5000000) / 10000000; }
+
+    struct TempDirectory
+    {
+        TempDirectory()
+        {
+            auto suffix = std::to_string(std::random_device {}());
+            path = fs::temp_directory_path() / ("rainway-seek-test-" + suffix);
+            fs::create_directories(path);
+        }
+
+        ~TempDirectory()
+        {
+            std::error_code error;
+            fs::remove_all(path, error);
+        }
+
+        fs::path path;
+    };
+
+    void write_file(const fs::path& path, const std::string& contents)
+    {
+        std::ofstream(path, std::ios::binary) << contents;
+    }
+} // namespace
+
+TEST(seek_index_finds_the_keyframe_at_or_before_a_time)
+{
+    auto media = synthetic(300, 30);
+    auto index = index_of(media, 300, 30);
+    CHECK_EQ(index.keyframes.size(), 10u);
+    CHECK_EQ(index.frame_interval(), 333333);
+
+    // Exactly on a keyframe, just before the next, and between
+    CHECK_EQ(index.keyframe_before(media.timestamp(60))->frame, 60u);
+    CHECK_EQ(index.keyframe_before(media.timestamp(90) - 1)->frame, 60u);
+    CHECK_EQ(index.keyframe_before(media.timestamp(75))->frame, 60u);
+
+    // Before the first is the first; past the end is the last
+    CHECK_EQ(index.keyframe_before(-1)->frame, 0u);
+    CHECK_EQ(index.keyframe_before(index.duration * 2)->frame, 270u);
+    CHECK_EQ(index.keyframe_before(index.duration * 2)->timestamp, media.timestamp(270));
+
+    // A last group shorter than the rest still has its keyframe
+    auto uneven = index_of(media, 95, 30);
+    CHECK_EQ(uneven.keyframes.size(), 4u);
+    CHECK_EQ(uneven.keyframe_before(uneven.duration)->frame, 90u);
+
+    CHECK(seek::SeekIndex {}.keyframe_before(0) == nullptr);
+}
+
+TEST(seek_index_saved_loads_back_only_for_its_key)
+{
+    auto directory = TempDirectory {};
+    auto path = directory.path / "media.rwsi";
+    auto media = synthetic(300, 30);
+    auto index = index_of(media, 300, 30);
+
+    CHECK(seek::save(index, path, 0x1234));
+    CHECK(!fs::exists(directory.path / "media.rwsi.tmp"));
+
+    auto loaded = seek::SeekIndex {};
+    CHECK(seek::load(loaded, path, 0x1234));
+    CHECK_EQ(loaded.frame_count, 300u);
+    CHECK_EQ(loaded.duration, index.duration);
+    CHECK_EQ(loaded.keyframes.size(), index.keyframes.size());
+    for (size_t i = 0; i < loaded.keyframes.size() && i < index.keyframes.size(); i++)
+    {
+        CHECK_EQ(loaded.keyframes[i].frame, index.keyframes[i].frame);
+        CHECK_EQ(loaded.keyframes[i].timestamp, index.keyframes[i].timestamp);
+    }
+
+    // Another media's key, a cut short file and a foreign one are all refused
+    CHECK(!seek::load(loaded, path, 0x4321));
+    fs::resize_file(path, fs::file_size(path) - 1);
+    CHECK(!seek::load(loaded, path, 0x1234));
+    write_file(path, std::string(256, 'x'));
+    CHECK(!seek::load(loaded, path, 0x1234));
+    CHECK(!seek::load(loaded, directory.path / "missing.rwsi", 0x1234));
+}
+
+TEST(seek_index_is_built_once_and_again_when_the_media_changes)
+{
+    auto directory = TempDirectory {};
+    auto media_path = (directory.path / "media.y4m").string();
+    write_file(media_path, "first");
+
+    auto media = synthetic(300, 30);
+    auto builds = 0;
+    auto build = [&](seek::SeekIndex& index) {
+        builds++;
+        index = index_of(media, 300, 30);
+        return true;
+    };
+
+    auto index = seek::SeekIndex {};
+    CHECK(seek::load_or_build(media_path, index, build));
+    CHECK(fs::exists(seek::index_path(media_path)));
+    CHECK(seek::load_or_build(media_path, index, build));
+    CHECK_EQ(builds, 1);
+    CHECK_EQ(index.keyframes.size(), 10u);
+
+    // A different size makes a different key
+    write_file(media_path, "second, longer");
+    CHECK(seek::load_or_build(media_path, index, build));
+    CHECK_EQ(builds, 2);
+
+    // Nothing to index is a failure, and nothing is cached for it
+    auto other_path = (directory.path / "other.y4m").string();
+    write_file(other_path, "other");
+    CHECK(!seek::load_or_build(other_path, index, [](seek::SeekIndex&) { return true; }));
+    CHECK(!fs::exists(seek::index_path(other_path)));
+}
+
+TEST(seeking_source_starts_part_way_in_from_the_keyframe_before)
+{
+    auto media = synthetic(300, 30);
+    auto index = index_of(media, 300, 30);
+    auto config = seeking_config();
+    config.start_at = media.timestamp(75);
+    auto seeking = seek::SeekingSource<Frame>(media, index, config);
+
+    // Decoded from frame 60 and shown from 75, at time 0
+    auto frame = Frame {};
+    CHECK(seeking.read_video(frame) == source::VideoRead::Decoded);
+    CHECK_EQ(frame.index, 75u);
+    CHECK_EQ(frame.timestamp, 0);
+    CHECK(seeking.read_video(frame) == source::VideoRead::Decoded);
+    CHECK_EQ(frame.index, 76u);
+    CHECK_EQ(frame.timestamp, media.timestamp(76) - media.timestamp(75));
+
+    // The audio starts where frame 75's does
+    std::vector<int16_t> samples;
+    CHECK_EQ(read_audio(seeking, samples, 100), 100u);
+    CHECK_EQ(samples[0], (int16_t)(75 * 1600));
+    CHECK_EQ(samples[99], (int16_t)(75 * 1600 + 99));
+
+    auto stats = seeking.stats();
+    CHECK_EQ(stats.seeks, 1u);
+    CHECK_EQ(stats.frames_skipped, 15u);
+    CHECK_EQ(stats.audio_frames_trimmed, 15u * 1600);
+}
+
+TEST(seeking_source_seeks_on_request_with_audio_in_step)
+{
+    auto media = synthetic(300, 30);
+    auto index = index_of(media, 300, 30);
+    auto seeking = seek::SeekingSource<Frame>(media, index, seeking_config());
+
+    // Ten frames in, with their audio and no more
+    auto frame = Frame {};
+    std::vector<int64_t> timestamps;
+    for (int i = 0; i < 10; i++)
+    {
+        seeking.read_video(frame);
+        timestamps.push_back(frame.timestamp);
+    }
+    std::vector<int16_t> samples;
+    auto before = audio_frames(timestamps.back() + index.frame_interval());
+    CHECK_EQ(read_audio(seeking, samples, (size_t)before), (size_t)before);
+
+    // To 8.1s: decoded from the keyframe at 8s, shown from frame 243, at the
+    // time the eleventh frame was due
+    seeking.request_seek(media.timestamp(243));
+    for (int i = 0; i < 10; i++)
+    {
+        CHECK(seeking.read_video(frame) == source::VideoRead::Decoded);
+        CHECK_EQ(frame.index, 243u + i);
+        timestamps.push_back(frame.timestamp);
+    }
+    for (size_t i = 1; i < timestamps.size(); i++)
+        CHECK(timestamps[i] > timestamps[i - 1]);
+    CHECK_EQ(timestamps[10] - timestamps[9], index.frame_interval());
+
+    // The audio after the seek carries on from frame 243's, at the output
+    // position where that frame is shown
+    read_audio(seeking, samples, 16000);
+    CHECK_EQ(samples.size(), (size_t)before + 16000);
+    size_t wrong = 0;
+    for (size_t p = 0; p < samples.size(); p++)
+    {
+        auto media_position = p < before ? p : 243 * 1600 + (p - before);
+        wrong += samples[p] != (int16_t)media_position;
+    }
+    CHECK_EQ(wrong, 0u);
+    CHECK_EQ(seeking.stats().frames_skipped, 3u);
+}
+
+TEST(seeking_source_loops_with_increasing_timestamps_and_continuous_audio)
+{
+    // Two seconds: exactly 96000 audio frames a pass
+    auto media = synthetic(60, 30);
+    auto index = index_of(media, 60, 30);
+    auto config = seeking_config();
+    config.loop = true;
+    auto seeking = seek::SeekingSource<Frame>(media, index, config);
+
+    auto frame = Frame {};
+    std::vector<int16_t> samples;
+    int64_t last = -1;
+    for (uint64_t i = 0; i < 150; i++)
+    {
+        CHECK(seeking.read_video(frame) == source::VideoRead::Decoded);
+        CHECK_EQ(frame.index, i % 60);
+        CHECK(frame.timestamp > last);
+        last = frame.timestamp;
+
+        // Keep the audio up with the frame just read
+        auto due = audio_frames(frame.timestamp + index.frame_interval());
+        if (due > samples.size())
+            read_audio(seeking, samples, (size_t)(due - samples.size()));
+    }
+
+    // Each pass takes exactly the file's length, so the audio of every pass
+    // starts where the video does
+    CHECK_EQ(last, 2 * index.duration + media.timestamp(29));
+    CHECK(samples.size() >= 149u * 1600);
+    size_t wrong = 0;
+    for (size_t p = 0; p < samples.size(); p++)
+        wrong += samples[p] != (int16_t)(p % 96000);
+    CHECK_EQ(wrong, 0u);
+
+    auto stats = seeking.stats();
+    CHECK_EQ(stats.loops, 2u);
+    CHECK_EQ(stats.audio_frames_padded, 0u);
+}
+
+TEST(seeking_source_without_an_index_plays_once)
+{
+    auto media = synthetic(5, 1);
+    auto index = seek::SeekIndex {};
+    auto config = seeking_config();
+    config.loop = true;
+    auto seeking = seek::SeekingSource<Frame>(media, index, config);
+
+    auto frame = Frame {};
+    for (int i = 0; i < 5; i++)
+        CHECK(seeking.read_video(frame) == source::VideoRead::Decoded);
+    CHECK(seeking.read_video(frame) == source::VideoRead::Ended);
+    CHECK_EQ(seeking.stats().failed_seeks, 1u);
+}
+
+TEST_MAIN()
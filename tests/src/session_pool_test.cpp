@@ -0,0 +1,185 @@
+// Tests of the session pool, with a stub factory: the pool fills itself in
+// the background and refills after each checkout, a checkout that finds it
+// empty opens a session on the calling thread, a factory that fails is
+// retried only after the retry interval, and sessions left idle are closed
+// with the pool.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "check.h"
+#include "session_pool.h"
+
+namespace
+{
+    using namespace std::chrono_literals;
+
+    struct Session
+    {
+        Session(uint64_t id, std::atomic<int>& open)
+            : id(id)
+            , opened_on(std::this_thread::get_id())
+            , open(open)
+        {
+            open++;
+        }
+
+        ~Session() { open--; }
+
+        uint64_t id;
+        std::thread::id opened_on;
+        std::atomic<int>& open;
+    };
+
+    using Pool = pool::SessionPool<Session>;
+
+    /// @brief Makes sessions numbered in order, failing the first `failures`
+    /// times, and holding the pool's thread back while `hold` is set
+    struct StubFactory
+    {
+        Pool::Create create()
+        {
+            return [this]() -> std::unique_ptr<Session> {
+                while (hold && std::this_thread::get_id() != caller)
+                    std::this_thread::sleep_for(1ms);
+                calls++;
+                if (failures > 0)
+                {
+                    failures--;
+                    return nullptr;
+                }
+                return std::make_unique<Session>(next_id++, open);
+            };
+        }
+
+        std::thread::id caller = std::this_thread::get_id();
+        std::atomic<bool> hold {false};
+        std::atomic<int> failures {0};
+        std::atomic<int> calls {0};
+        std::atomic<uint64_t> next_id {0};
+        std::atomic<int> open {0};
+    };
+
+    pool::SessionPoolConfig pool_config(size_t size, std::chrono::milliseconds retry_interval = 1000ms)
+    {
+        auto config = pool::SessionPoolConfig {};
+        config.size = size;
+        config.retry_interval = retry_interval;
+        return config;
+    }
+} // namespace
+
+TEST(session_pool_fills_in_the_background_and_refills_after_checkout)
+{
+    auto factory = StubFactory {};
+    auto sessions = Pool(factory.create(), pool_config(2));
+    CHECK(sessions.wait_full(5s));
+    CHECK_EQ(sessions.stats().idle, 2u);
+    CHECK_EQ(sessions.stats().created, 2u);
+
+    // Served from the pool, in the order opened, and opened on its thread
+    auto first = sessions.checkout();
+    CHECK(first != nullptr && first->id == 0);
+    CHECK(first && first->opened_on != factory.caller);
+
+    // A replacement is opened while the checked out session plays
+    CHECK(sessions.wait_full(5s));
+    auto stats = sessions.stats();
+    CHECK_EQ(stats.warm_checkouts, 1u);
+    CHECK_EQ(stats.cold_checkouts, 0u);
+    CHECK_EQ(stats.created, 3u);
+    CHECK_EQ(stats.idle, 2u);
+
+    auto second = sessions.checkout();
+    CHECK(second != nullptr && second->id == 1);
+}
+
+TEST(session_pool_opens_a_session_on_checkout_when_empty)
+{
+    auto factory = StubFactory {};
+    factory.hold = true;
+    auto sessions = Pool(factory.create(), pool_config(1));
+
+    // The pool's own session is held back, so the checkout opens one itself
+    auto session = sessions.checkout();
+    CHECK(session != nullptr);
+    CHECK(session && session->opened_on == factory.caller);
+    auto stats = sessions.stats();
+    CHECK_EQ(stats.cold_checkouts, 1u);
+    CHECK_EQ(stats.warm_checkouts, 0u);
+
+    factory.hold = false;
+    CHECK(sessions.wait_full(5s));
+    auto pooled = sessions.checkout();
+    CHECK(pooled && pooled->opened_on != factory.caller);
+    CHECK_EQ(sessions.stats().warm_checkouts, 1u);
+}
+
+TEST(session_pool_of_size_zero_opens_every_session_on_checkout)
+{
+    auto factory = StubFactory {};
+    auto sessions = Pool(factory.create(), pool_config(0));
+
+    std::this_thread::sleep_for(10ms);
+    CHECK_EQ(factory.calls.load(), 0);
+
+    auto a = sessions.checkout();
+    auto b = sessions.checkout();
+    CHECK(a && b && a->opened_on == factory.caller && b->opened_on == factory.caller);
+
+    auto stats = sessions.stats();
+    CHECK_EQ(stats.cold_checkouts, 2u);
+    CHECK_EQ(stats.created, 2u);
+    CHECK_EQ(stats.idle, 0u);
+}
+
+TEST(session_pool_waits_the_retry_interval_after_a_failure)
+{
+    auto factory = StubFactory {};
+    factory.failures = 1000;
+    {
+        auto sessions = Pool(factory.create(), pool_config(1, 1h));
+
+        // One try, then nothing until the interval is up
+        CHECK(test::eventually([&] { return sessions.stats().failed == 1; }));
+        std::this_thread::sleep_for(20ms);
+        CHECK_EQ(factory.calls.load(), 1);
+
+        // A cold checkout the factory fails gets nothing
+        CHECK(sessions.checkout() == nullptr);
+        CHECK_EQ(sessions.stats().failed, 2u);
+    }
+    // Shutting down doesn't wait out the interval either, or it would take an hour
+
+    factory.failures = 2;
+    factory.calls = 0;
+    auto sessions = Pool(factory.create(), pool_config(1, 5ms));
+    CHECK(sessions.wait_full(5s));
+    CHECK_EQ(factory.calls.load(), 3);
+    CHECK_EQ(sessions.stats().failed, 2u);
+    CHECK_EQ(sessions.stats().created, 1u);
+}
+
+TEST(session_pool_closes_idle_sessions_with_it)
+{
+    auto factory = StubFactory {};
+    std::unique_ptr<Session> kept;
+    {
+        auto sessions = Pool(factory.create(), pool_config(3));
+        CHECK(sessions.wait_full(5s));
+        kept = sessions.checkout();
+        CHECK(sessions.wait_full(5s));
+        CHECK_EQ(factory.open.load(), 4);
+    }
+
+    // Only the checked out session outlives the pool
+    CHECK_EQ(factory.open.load(), 1);
+    kept.reset();
+    CHECK_EQ(factory.open.load(), 0);
+}
+
+TEST_MAIN()
@@ -0,0 +1,281 @@
+// Tests of the session table: ids that collide on a slot are all found, an
+// id erased from the middle of a probe run (one that wraps past the end of
+// the slots too) leaves every other id findable, an erased id opens a new
+// session, the table grows past its load factor without losing anyone, and
+// threads opening, visiting and closing at once each close a session
+// exactly once.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+#include "session_table.h"
+
+namespace
+{
+    using session::PeerSession;
+    using session::SessionTable;
+
+    // A single shard starts with 16 slots and grows on its 12th session
+    constexpr size_t SLOTS = 16;
+    constexpr size_t MOST_BEFORE_GROWING = 11;
+
+    /// @brief The table's hash, to pick ids that land on a given slot
+    uint64_t mix(uint64_t x)
+    {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebull;
+        x ^= x >> 31;
+        return x;
+    }
+
+    /// @brief `count` ids whose home is `slot` in a table of SLOTS slots,
+    /// skipping any in `taken`
+    std::vector<uint64_t> ids_at(size_t slot, size_t count, std::vector<uint64_t>& taken)
+    {
+        std::vector<uint64_t> ids;
+        for (uint64_t id = 1; ids.size() < count; id++)
+        {
+            if ((mix(id) & (SLOTS - 1)) == slot && std::find(taken.begin(), taken.end(), id) == taken.end())
+            {
+                ids.push_back(id);
+                taken.push_back(id);
+            }
+        }
+        return ids;
+    }
+
+    /// @brief The ids in the order they sit in the slots
+    std::vector<uint64_t> slot_order(const SessionTable& table)
+    {
+        std::vector<uint64_t> ids;
+        table.for_each([&](const PeerSession& session) { ids.push_back(session.id); });
+        return ids;
+    }
+
+    bool all_found(const SessionTable& table, const std::vector<uint64_t>& ids)
+    {
+        for (auto id : ids)
+        {
+            auto session = table.find(id);
+            if (!session || session->id != id)
+                return false;
+        }
+        return true;
+    }
+} // namespace
+
+TEST(session_table_finds_every_id_that_collides_on_a_slot)
+{
+    auto table = SessionTable(1);
+    std::vector<uint64_t> taken;
+    auto ids = ids_at(3, 6, taken);
+
+    std::vector<std::shared_ptr<PeerSession>> sessions;
+    for (auto id : ids)
+        sessions.push_back(table.open(id));
+    CHECK_EQ(table.size(), 6u);
+
+    // In the order opened, in the slots from their home on
+    CHECK(slot_order(table) == ids);
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        CHECK(table.find(ids[i]) == sessions[i]);
+        CHECK(table.open(ids[i]) == sessions[i]);
+    }
+    CHECK_EQ(table.size(), 6u);
+    CHECK(table.find(ids_at(3, 1, taken)[0]) == nullptr);
+}
+
+TEST(session_table_erases_from_the_middle_of_a_run_that_wraps)
+{
+    auto table = SessionTable(1);
+    std::vector<uint64_t> taken;
+
+    // Three at home in the last slot wrap round to the first two; two more
+    // whose home is the first slot and one whose home is the second follow
+    // them, then one at its home and one pushed past it
+    auto last = ids_at(SLOTS - 1, 3, taken);
+    auto first = ids_at(0, 2, taken);
+    auto second = ids_at(1, 1, taken);
+    auto settled = ids_at(5, 1, taken);
+    auto pushed = ids_at(4, 1, taken);
+
+    std::vector<uint64_t> ids;
+    for (auto group : {last, first, second, settled, pushed})
+        ids.insert(ids.end(), group.begin(), group.end());
+    for (auto id : ids)
+        table.open(id);
+
+    // Slots 15, 0, 1 hold the last slot's; 2, 3 the first's; 4 the second's;
+    // 5 is at home and 6 belongs in 4
+    CHECK(slot_order(table) == (std::vector<uint64_t> {last[1], last[2], first[0], first[1], second[0], settled[0], pushed[0], last[0]}));
+
+    // Out of slot 0, in the middle of the run: everything after it moves back
+    // one, the one at its home stays, and the one past it moves to its home
+    auto closed = table.close(last[1]);
+    CHECK(closed && closed->id == last[1]);
+    CHECK(slot_order(table) == (std::vector<uint64_t> {last[2], first[0], first[1], second[0], pushed[0], settled[0], last[0]}));
+
+    ids.erase(std::find(ids.begin(), ids.end(), last[1]));
+    CHECK(all_found(table, ids));
+    CHECK(table.find(last[1]) == nullptr);
+    CHECK_EQ(table.size(), ids.size());
+
+    // And from the run's start, in the last slot, which it wraps from
+    CHECK(table.close(last[0]) != nullptr);
+    ids.erase(std::find(ids.begin(), ids.end(), last[0]));
+    CHECK(all_found(table, ids));
+    CHECK_EQ(slot_order(table).size(), ids.size());
+}
+
+TEST(session_table_opens_a_new_session_for_an_erased_id)
+{
+    auto table = SessionTable(1);
+    auto before = table.open(42);
+    before->touch(10);
+
+    auto closed = table.close(42);
+    CHECK(closed == before);
+    CHECK(table.close(42) == nullptr);
+    CHECK(table.find(42) == nullptr);
+    CHECK(!table.visit(42, [](PeerSession&) {}));
+
+    // A fresh session, not the closed one
+    auto after = table.open(42);
+    CHECK(after != before);
+    CHECK_EQ(after->messages(), 0u);
+    CHECK(after->add_channel("data", nullptr));
+    CHECK(!before->add_channel("data", nullptr));
+    CHECK_EQ(table.size(), 1u);
+}
+
+TEST(session_table_keeps_every_session_as_it_grows_and_churns)
+{
+    // Up to the load factor the slots stay as they are; one more grows them
+    auto table = SessionTable(1);
+    std::vector<uint64_t> ids;
+    for (uint64_t id = 1; id <= MOST_BEFORE_GROWING + 1; id++)
+    {
+        table.open(id);
+        ids.push_back(id);
+        CHECK(all_found(table, ids));
+    }
+
+    // Thousands more, with sessions closing at random among them, against a
+    // plain map of what should be there
+    std::map<uint64_t, std::shared_ptr<PeerSession>> expected;
+    for (auto id : ids)
+        expected[id] = table.find(id);
+
+    std::mt19937_64 random(7);
+    for (int step = 0; step < 20000; step++)
+    {
+        auto id = random() % 4000 + 1;
+        if (random() % 3 == 0)
+        {
+            auto closed = table.close(id);
+            auto found = expected.find(id);
+            CHECK(closed == (found != expected.end() ? found->second : nullptr));
+            if (found != expected.end())
+                expected.erase(found);
+        }
+        else
+        {
+            auto session = table.open(id);
+            auto found = expected.find(id);
+            if (found != expected.end())
+                CHECK(session == found->second);
+            expected[id] = session;
+        }
+    }
+
+    CHECK_EQ(table.size(), expected.size());
+    size_t wrong = 0;
+    for (uint64_t id = 1; id <= 4000; id++)
+    {
+        auto found = expected.find(id);
+        wrong += table.find(id) != (found != expected.end() ? found->second : nullptr);
+    }
+    CHECK_EQ(wrong, 0u);
+    CHECK_EQ(slot_order(table).size(), expected.size());
+}
+
+TEST(session_table_closes_each_session_once_across_threads)
+{
+    constexpr uint64_t IDS = 2000;
+    constexpr int THREADS = 4;
+    auto table = SessionTable(4);
+
+    std::vector<std::vector<std::shared_ptr<PeerSession>>> opened(THREADS);
+    std::vector<std::vector<std::shared_ptr<PeerSession>>> closed(THREADS);
+    std::atomic<uint64_t> channels_closed {0};
+
+    // Every thread opens, visits and closes every id, in its own order, so
+    // each id is opened and closed by several threads at once
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; t++)
+    {
+        threads.emplace_back([&, t]() {
+            std::vector<uint64_t> order(IDS);
+            for (uint64_t i = 0; i < IDS; i++)
+                order[i] = i;
+            std::shuffle(order.begin(), order.end(), std::mt19937_64(t));
+
+            for (auto id : order)
+            {
+                auto session = table.open(id);
+                opened[t].push_back(session);
+                session->add_channel("data", [&]() { channels_closed++; });
+                table.visit(id, [](PeerSession& peer) { peer.touch(1); });
+                if (auto closing = table.close(id))
+                    closed[t].push_back(std::move(closing));
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    CHECK_EQ(table.size(), 0u);
+    CHECK(slot_order(table).empty());
+
+    // Every session opened was returned by exactly one close
+    std::map<PeerSession*, int> closes;
+    for (auto& sessions : opened)
+    {
+        for (auto& session : sessions)
+            closes[session.get()] = 0;
+    }
+    size_t unopened = 0;
+    for (auto& sessions : closed)
+    {
+        for (auto& session : sessions)
+        {
+            auto found = closes.find(session.get());
+            if (found == closes.end())
+                unopened++;
+            else
+                found->second++;
+        }
+    }
+    size_t not_once = 0;
+    for (auto& entry : closes)
+        not_once += entry.second != 1;
+    CHECK_EQ(unopened, 0u);
+    CHECK_EQ(not_once, 0u);
+    CHECK(closes.size() >= IDS);
+
+    // And every channel closed once, whether added before its session closed
+    // or after
+    CHECK_EQ(channels_closed.load(), IDS * THREADS);
+}
+
+TEST_MAIN()
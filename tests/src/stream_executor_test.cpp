@@ -0,0 +1,256 @@
+// Tests of the stream executor: tasks run in deadline order, a wake runs a
+// task now and leaves the entry at its old deadline stale, a stream closed
+// through its cancellation token exits at once, shutdown cancels what is
+// left, and a worker with nothing due steals from one that is busy.
+
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+#include "stream_executor.h"
+
+namespace
+{
+    using namespace std::chrono_literals;
+
+    using Executor = exec::StreamExecutor<pacing::FakeClock>;
+    using time_point = Executor::time_point;
+
+    exec::ExecutorConfig one_worker()
+    {
+        auto config = exec::ExecutorConfig {};
+        config.workers = 1;
+        return config;
+    }
+} // namespace
+
+TEST(executor_runs_tasks_in_deadline_order)
+{
+    auto clock = pacing::FakeClock {};
+    auto executor = Executor {clock, one_worker()};
+    auto start = clock.now();
+
+    std::vector<std::string> ran;
+    auto once = [&](std::string name) {
+        return [&ran, name](time_point) -> std::optional<time_point> {
+            ran.push_back(name);
+            return std::nullopt;
+        };
+    };
+
+    // Ties run in the order they were queued
+    executor.spawn(once("c"), start + 30ms);
+    executor.spawn(once("a"), start + 10ms);
+    executor.spawn(once("d"), start + 40ms);
+    executor.spawn(once("b"), start + 10ms);
+
+    CHECK_EQ(executor.run_due(), 0u);
+    CHECK(executor.next_deadline() == start + 10ms);
+
+    clock.advance(30ms);
+    CHECK_EQ(executor.run_due(), 3u);
+    CHECK(ran == (std::vector<std::string> {"a", "b", "c"}));
+
+    clock.advance(15ms);
+    CHECK_EQ(executor.run_due(), 1u);
+    CHECK_EQ(ran.back(), std::string("d"));
+
+    auto stats = executor.stats();
+    CHECK_EQ(stats.finished, 4u);
+    CHECK(stats.max_lateness == 20ms);
+    CHECK_EQ(executor.task_count(), 0u);
+}
+
+TEST(executor_reschedules_a_task_at_the_deadline_it_returns)
+{
+    auto clock = pacing::FakeClock {};
+    auto executor = Executor {clock, one_worker()};
+    auto start = clock.now();
+
+    // Every 10ms, five times
+    std::vector<time_point> steps;
+    auto finished = false;
+    executor.spawn(
+        [&](time_point now) -> std::optional<time_point> {
+            steps.push_back(now);
+            if (steps.size() == 5)
+                return std::nullopt;
+            return start + 10ms * (int64_t)steps.size();
+        },
+        start,
+        [&](bool completed) { finished = completed; });
+
+    for (int i = 0; i < 10; i++)
+    {
+        executor.run_due();
+        clock.advance(5ms);
+    }
+
+    CHECK_EQ(steps.size(), 5u);
+    for (size_t i = 0; i < steps.size(); i++)
+        CHECK(steps[i] == start + 10ms * (int64_t)i);
+    CHECK(finished);
+}
+
+TEST(executor_wake_runs_now_and_leaves_the_old_entry_stale)
+{
+    auto clock = pacing::FakeClock {};
+    auto executor = Executor {clock, one_worker()};
+    auto start = clock.now();
+
+    // A task that sleeps an hour at a time
+    auto steps = 0;
+    auto task = executor.spawn(
+        [&](time_point now) -> std::optional<time_point> {
+            steps++;
+            return now + 1h;
+        },
+        start + 1h);
+
+    clock.advance(1ms);
+    CHECK(executor.wake(task));
+    CHECK_EQ(executor.run_due(), 1u);
+    CHECK_EQ(steps, 1);
+
+    // The entry queued at start + 1h belongs to an older generation: when it
+    // comes due it's skipped, and the task next runs an hour after the wake
+    clock.current = start + 1h;
+    CHECK_EQ(executor.run_due(), 0u);
+    CHECK(executor.next_deadline() == start + 1ms + 1h);
+
+    clock.current = start + 1ms + 1h;
+    CHECK_EQ(executor.run_due(), 1u);
+    CHECK_EQ(steps, 2);
+    CHECK_EQ(executor.stats().wakes, 1u);
+}
+
+TEST(executor_wake_while_running_runs_again_straight_after)
+{
+    auto clock = pacing::FakeClock {};
+    auto executor = Executor {clock, one_worker()};
+
+    auto steps = 0;
+    Executor::TaskHandle self;
+    self = executor.spawn(
+        [&](time_point now) -> std::optional<time_point> {
+            // Woken from inside its own step, as a close on another thread might
+            if (++steps == 1)
+                CHECK(executor.wake(self));
+            return now + 1h;
+        },
+        clock.now());
+
+    CHECK_EQ(executor.run_due(), 2u);
+    CHECK_EQ(steps, 2);
+    CHECK_EQ(executor.run_due(), 0u);
+}
+
+TEST(executor_closed_stream_exits_without_waiting_for_its_deadline)
+{
+    auto clock = pacing::FakeClock {};
+    auto executor = Executor {clock, one_worker()};
+
+    auto stop = lifecycle::CancellationToken {};
+    std::optional<bool> done;
+    auto task = executor.spawn(
+        [&](time_point now) -> std::optional<time_point> {
+            if (stop.cancelled())
+                return std::nullopt;
+            return now + 1h;
+        },
+        clock.now(),
+        [&](bool finished) { done = finished; });
+    stop.on_cancel([&executor, task]() { executor.wake(task); });
+
+    CHECK_EQ(executor.run_due(), 1u);
+    CHECK(!done);
+
+    // Closing wakes the task, which sees the token and finishes by itself
+    clock.advance(1ms);
+    stop.cancel();
+    CHECK_EQ(executor.run_due(), 1u);
+    CHECK(done && *done);
+    CHECK_EQ(executor.task_count(), 0u);
+
+    // Its stale entry never runs, and there's nothing left to wake
+    clock.advance(2h);
+    CHECK_EQ(executor.run_due(), 0u);
+    CHECK(!executor.wake(task));
+}
+
+TEST(executor_shutdown_cancels_every_task_left)
+{
+    auto clock = pacing::FakeClock {};
+    auto executor = Executor {clock, exec::ExecutorConfig {2}};
+
+    std::atomic<int> cancelled {0};
+    std::vector<Executor::TaskHandle> tasks;
+    for (int i = 0; i < 4; i++)
+    {
+        tasks.push_back(executor.spawn(
+            [](time_point now) -> std::optional<time_point> { return now + 1h; },
+            clock.now() + 1h,
+            [&](bool finished) { cancelled += finished ? 0 : 1; }));
+    }
+
+    // A woken task has two entries queued; it's still only cancelled once
+    CHECK(executor.wake(tasks[0]));
+
+    executor.shutdown();
+    CHECK_EQ(cancelled.load(), 4);
+    CHECK_EQ(executor.stats().cancelled, 4u);
+    CHECK_EQ(executor.task_count(), 0u);
+
+    // Nothing is taken once it has shut down
+    CHECK(executor.spawn([](time_point) { return std::optional<time_point> {}; }, clock.now()).expired());
+    CHECK(!executor.wake(tasks[1]));
+}
+
+TEST(executor_idle_worker_steals_a_due_task)
+{
+    auto clock = pacing::SteadyClock {};
+    auto config = exec::ExecutorConfig {};
+    config.workers = 2;
+    auto executor = exec::StreamExecutor<> {clock, config};
+    using steady_point = exec::StreamExecutor<>::time_point;
+
+    // The first and third tasks go to the first worker, which the first then
+    // blocks; the third is due, so the second worker takes it
+    std::atomic<bool> release {false};
+    std::atomic<bool> blocked {false};
+    std::thread::id blocker, thief;
+    executor.spawn(
+        [&](steady_point) -> std::optional<steady_point> {
+            blocker = std::this_thread::get_id();
+            blocked = true;
+            while (!release)
+                std::this_thread::sleep_for(1ms);
+            return std::nullopt;
+        },
+        clock.now());
+    executor.spawn([](steady_point) { return std::optional<steady_point> {}; }, clock.now());
+
+    std::atomic<bool> stolen {false};
+    executor.spawn(
+        [&](steady_point) -> std::optional<steady_point> {
+            thief = std::this_thread::get_id();
+            stolen = true;
+            return std::nullopt;
+        },
+        clock.now());
+
+    executor.start();
+    CHECK(test::eventually([&] { return blocked && stolen; }));
+    release = true;
+    CHECK(test::eventually([&] { return executor.task_count() == 0; }));
+    executor.shutdown();
+
+    CHECK(blocker != thief);
+    CHECK(executor.stats().steals >= 1);
+}
+
+TEST_MAIN()
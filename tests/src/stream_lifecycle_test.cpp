@@ -0,0 +1,186 @@
+// Tests of the stream lifecycle: a stream moves from Starting through
+// Running and Draining to Closed, a close requested from another thread
+// wakes whatever the stream sleeps on and races `close` one way or the
+// other, a close arriving after the stream has exited is ignored, and close
+// latencies are recorded.
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+#include "stream_lifecycle.h"
+
+using lifecycle::StreamState;
+
+TEST(lifecycle_moves_through_every_state_in_order)
+{
+    auto life = lifecycle::StreamLifecycle {};
+    CHECK(life.state() == StreamState::Starting);
+
+    // Starting again while running is harmless
+    CHECK(life.start());
+    CHECK(life.state() == StreamState::Running);
+    CHECK(life.start());
+
+    CHECK(life.request_close());
+    CHECK(life.state() == StreamState::Draining);
+    CHECK(life.token().cancelled());
+
+    // Only the first request starts draining, and a draining stream can't restart
+    CHECK(!life.request_close());
+    CHECK(!life.start());
+    CHECK(!life.latency());
+
+    auto latency = life.close();
+    CHECK(latency.has_value());
+    CHECK(life.state() == StreamState::Closed);
+    CHECK(life.latency() == latency);
+    CHECK(!life.start());
+    CHECK(!life.request_close());
+}
+
+TEST(lifecycle_close_before_the_first_step_drains_without_running)
+{
+    auto life = lifecycle::StreamLifecycle {};
+    CHECK(life.request_close());
+    CHECK(life.state() == StreamState::Draining);
+
+    // The first step finds it already draining
+    CHECK(!life.start());
+    CHECK(life.close().has_value());
+    CHECK(life.state() == StreamState::Closed);
+}
+
+TEST(lifecycle_close_after_the_stream_exited_is_ignored)
+{
+    auto life = lifecycle::StreamLifecycle {};
+    CHECK(life.start());
+
+    // The media ended and the task exited without being asked
+    CHECK(!life.close());
+    CHECK(life.state() == StreamState::Closed);
+
+    // The viewer's close arrives late: nothing to cancel or time
+    CHECK(!life.request_close());
+    CHECK(!life.token().cancelled());
+    CHECK(life.state() == StreamState::Closed);
+    CHECK(!life.latency());
+}
+
+TEST(lifecycle_close_latency_runs_from_request_to_exit)
+{
+    using namespace std::chrono_literals;
+    auto life = lifecycle::StreamLifecycle {};
+    life.start();
+    life.request_close();
+    std::this_thread::sleep_for(20ms);
+
+    auto latency = life.close();
+    CHECK(latency.has_value() && *latency >= 20ms);
+}
+
+TEST(lifecycle_concurrent_close_wakes_the_stream_at_once)
+{
+    using namespace std::chrono_literals;
+    auto life = lifecycle::StreamLifecycle {};
+    std::atomic<bool> woken {false};
+    std::atomic<bool> callback_ran {false};
+    life.token().on_cancel([&] { callback_ran = true; });
+
+    // The stream sleeps on its token for far longer than the test takes
+    std::chrono::steady_clock::duration slept {};
+    auto stream = std::thread {[&] {
+        life.start();
+        auto from = std::chrono::steady_clock::now();
+        woken = life.token().wait_until(from + 10s);
+        slept = std::chrono::steady_clock::now() - from;
+        life.close();
+    }};
+
+    CHECK(test::eventually([&] { return life.state() == StreamState::Running; }));
+    std::this_thread::sleep_for(5ms);
+    CHECK(life.request_close());
+    stream.join();
+
+    CHECK(woken);
+    CHECK(callback_ran);
+    CHECK(slept < 5s);
+    CHECK(life.state() == StreamState::Closed);
+    CHECK(life.latency().has_value());
+
+    // Registered after the close, a callback runs straight away
+    auto late = false;
+    life.token().on_cancel([&] { late = true; });
+    CHECK(late);
+}
+
+TEST(lifecycle_only_one_of_many_concurrent_requests_starts_draining)
+{
+    for (int round = 0; round < 50; round++)
+    {
+        auto life = lifecycle::StreamLifecycle {};
+        life.start();
+
+        std::atomic<int> started {0};
+        std::atomic<int> cancels {0};
+        life.token().on_cancel([&] { cancels++; });
+
+        std::vector<std::thread> closers;
+        for (int i = 0; i < 4; i++)
+            closers.emplace_back([&] { started += life.request_close() ? 1 : 0; });
+        for (auto& closer : closers)
+            closer.join();
+
+        CHECK_EQ(started.load(), 1);
+        CHECK_EQ(cancels.load(), 1);
+        CHECK(life.state() == StreamState::Draining);
+    }
+}
+
+TEST(lifecycle_request_racing_close_resolves_one_way)
+{
+    for (int round = 0; round < 200; round++)
+    {
+        auto life = lifecycle::StreamLifecycle {};
+        life.start();
+
+        // The media ends just as the viewer closes the stream
+        std::atomic<bool> go {false};
+        auto requested = false;
+        auto requester = std::thread {[&] {
+            while (!go)
+                std::this_thread::yield();
+            requested = life.request_close();
+        }};
+        go = true;
+        auto latency = life.close();
+        requester.join();
+
+        // Either the request got in first and its latency was recorded, or
+        // the stream had already closed and the request was ignored
+        CHECK(life.state() == StreamState::Closed);
+        CHECK_EQ(requested, latency.has_value());
+        CHECK_EQ(requested, life.latency().has_value());
+        CHECK_EQ(requested, life.token().cancelled());
+    }
+}
+
+TEST(close_recorder_keeps_count_mean_and_max)
+{
+    using namespace std::chrono_literals;
+    auto recorder = lifecycle::CloseRecorder {};
+    CHECK_EQ(recorder.snapshot().closes, 0u);
+    CHECK(recorder.snapshot().mean_latency() == 0ns);
+
+    recorder.record(1ms);
+    recorder.record(3ms);
+    auto stats = recorder.snapshot();
+    CHECK_EQ(stats.closes, 2u);
+    CHECK(stats.total_latency == 4ms);
+    CHECK(stats.mean_latency() == 2ms);
+    CHECK(stats.max_latency == 3ms);
+}
+
+TEST_MAIN()
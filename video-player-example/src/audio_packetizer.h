@@ -0,0 +1,176 @@
+// Fixed-duration audio packets.
+//
+// The producer publishes PCM in whatever chunk sizes its drain loop happens
+// to collect. A `Packetizer` sits between those chunks and a stream's
+// SubmitAudio, re-cutting the PCM into packets of a fixed duration (10, 20 or
+// 40 ms are typical), so every submit carries the same amount of audio and
+// the receiver sees a steady cadence.
+//
+// Packet boundaries and timestamps come from the sample position in the
+// stream, not from decoder times, so rates that don't divide evenly into
+// packets (e.g. 20 ms at 22050 Hz) alternate between two sizes without
+// drifting.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace audio
+{
+    class Packetizer
+    {
+    public:
+        /// @param packet_ms Duration of every packet
+        Packetizer(uint32_t sample_rate, uint16_t channels, uint32_t packet_ms)
+            : rate(sample_rate)
+            , channel_count(channels)
+            , packet_ms(std::max(1u, packet_ms))
+        {
+            pending.reserve((size_t)(max_packet_frames() * channel_count));
+        }
+
+        uint32_t sample_rate() const { return rate; }
+        uint16_t channels() const { return channel_count; }
+        uint32_t packet_duration_ms() const { return packet_ms; }
+
+        /// @brief Longest a packet can be, in frames
+        uint64_t max_packet_frames() const { return ((uint64_t)rate * packet_ms + 999) / 1000; }
+
+        /// @brief Append PCM and emit every packet it completes
+        /// @param samples Interleaved PCM
+        /// @param frames Frames in `samples`
+        /// @param timestamp Stream position of the first frame in 100ns units.
+        /// The first push starts the packet grid there; a later push that
+        /// doesn't continue where the previous one ended (e.g. chunks were
+        /// skipped) finishes the pending packet and restarts the grid.
+        /// @param emit Called as `emit(const int16_t* samples, size_t frames,
+        /// int64_t timestamp)` for each complete packet
+        /// @return Packets emitted
+        template <typename Emit>
+        size_t push(const int16_t* samples, size_t frames, int64_t timestamp, Emit&& emit)
+        {
+            size_t emitted = 0;
+            if (frames == 0)
+                return emitted;
+
+            // Timestamps are truncated from sample positions, so round back up
+            auto position = (uint64_t)((timestamp * (int64_t)rate + 9999999) / 10000000);
+            if (started && position != next_position)
+            {
+                emitted += flush(emit);
+                discontinuities++;
+            }
+            if (!started)
+                restart(position);
+
+            size_t consumed = 0;
+            while (consumed < frames)
+            {
+                auto packet_frames = (size_t)(packet_end - packet_start);
+                auto buffered = pending_frames();
+                auto n = std::min(packet_frames - buffered, frames - consumed);
+                auto input = samples + consumed * channel_count;
+                consumed += n;
+
+                if (buffered == 0 && n == packet_frames)
+                {
+                    // A whole packet straight out of the caller's buffer
+                    emit(input, n, timestamp_of(packet_start));
+                }
+                else
+                {
+                    pending.insert(pending.end(), input, input + n * channel_count);
+                    if (pending_frames() < packet_frames)
+                        break;
+
+                    emit(pending.data(), packet_frames, timestamp_of(packet_start));
+                    pending.clear();
+                }
+
+                next_packet();
+                emitted++;
+            }
+
+            next_position = position + frames;
+            frames_in += frames;
+            return emitted;
+        }
+
+        /// @brief Emit the pending partial packet padded with silence to its full
+        /// length, as at the end of the stream. The next push starts a new grid.
+        /// @return Packets emitted (0 or 1)
+        template <typename Emit>
+        size_t flush(Emit&& emit)
+        {
+            started = false;
+            if (pending.empty())
+                return 0;
+
+            padding_frames += (packet_end - packet_start) - pending_frames();
+            pending.resize((size_t)(packet_end - packet_start) * channel_count, 0);
+            emit(pending.data(), pending_frames(), timestamp_of(packet_start));
+            pending.clear();
+
+            next_packet();
+            return 1;
+        }
+
+        /// @brief Frames pushed in
+        uint64_t input_frames() const { return frames_in; }
+        /// @brief Frames emitted, including padding
+        uint64_t output_frames() const { return frames_out; }
+        uint64_t packets() const { return packet_count; }
+        /// @brief Silence added by `flush` to fill out packets
+        uint64_t padded_frames() const { return padding_frames; }
+        /// @brief Times the input jumped and the packet grid restarted
+        uint64_t discontinuity_count() const { return discontinuities; }
+
+    private:
+        size_t pending_frames() const { return pending.size() / channel_count; }
+
+        int64_t timestamp_of(uint64_t position) const { return (int64_t)(position * 10000000 / rate); }
+
+        // Packet k of the grid covers [floor(k * rate * ms / 1000), floor((k + 1) * rate * ms / 1000))
+        uint64_t grid_position(uint64_t index) const { return grid_origin + index * rate * packet_ms / 1000; }
+
+        void restart(uint64_t position)
+        {
+            started = true;
+            grid_origin = position;
+            packet_index = 0;
+            packet_start = grid_position(0);
+            packet_end = grid_position(1);
+            next_position = position;
+        }
+
+        void next_packet()
+        {
+            frames_out += packet_end - packet_start;
+            packet_count++;
+            packet_index++;
+            packet_start = packet_end;
+            packet_end = grid_position(packet_index + 1);
+        }
+
+        uint32_t rate;
+        uint16_t channel_count;
+        uint32_t packet_ms;
+
+        std::vector<int16_t> pending;
+
+        bool started = false;
+        uint64_t grid_origin = 0;
+        uint64_t packet_index = 0;
+        uint64_t packet_start = 0;
+        uint64_t packet_end = 0;
+        uint64_t next_position = 0;
+
+        uint64_t frames_in = 0;
+        uint64_t frames_out = 0;
+        uint64_t packet_count = 0;
+        uint64_t padding_frames = 0;
+        uint64_t discontinuities = 0;
+    };
+} // namespace audio
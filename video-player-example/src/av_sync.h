@@ -0,0 +1,219 @@
+// Keeps a producer's audio and video in step.
+//
+// The producer publishes video by each frame's timestamp and audio by how
+// many frames of it have gone out, both against the same media clock. That
+// only keeps them in step while the audio plays exactly the media time its
+// length says it does. A source whose audio timestamps jump (a gap or an
+// overlap in the file) or whose resampling doesn't quite match its clock
+// plays audio that creeps away from the video, and on a stream that plays
+// for hours the creep becomes visible.
+//
+// A `SyncController` is told, at each published frame, the media time of the
+// audio going out and of the frame, and smooths the difference so one late
+// wake isn't mistaken for drift. Once the offset leaves the tolerance it
+// corrects it, either on video, by dropping a frame (when the audio is
+// ahead) or repeating one (when it is behind), at most one frame per step
+// interval, or on audio, by asking for the audio to be resampled slightly
+// faster or slower until the offset is back well inside the tolerance.
+// When the source lines its audio up with the video again (a seek, a loop,
+// the next item of a playlist) the controller is reset and the correction
+// made so far is undone at once, rather than unwound a frame at a time.
+//
+// The controller only does arithmetic on the times it is given, so it can be
+// driven by any clock, real or simulated.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+namespace avsync
+{
+    enum class Correction
+    {
+        /// @brief Measure the offset, but leave it
+        None,
+        /// @brief Drop or repeat video frames
+        Video,
+        /// @brief Resample the audio slightly faster or slower, and fall back
+        /// to video for offsets too large to resample away in good time, or
+        /// while the audio can't be resampled
+        Resample,
+    };
+
+    struct SyncConfig
+    {
+        Correction correction = Correction::Video;
+        /// @brief Offset left alone either way, in 100ns units
+        int64_t tolerance = 200000;
+        /// @brief Time constant of the smoothing of measured offsets, in 100ns units
+        int64_t smoothing = 10000000;
+        /// @brief Least media time between two frames dropped or repeated, in 100ns units
+        int64_t step_interval = 5000000;
+        /// @brief Most the audio is sped up or slowed down by when resampling,
+        /// as a fraction of its rate
+        double max_rate_adjust = 0.001;
+        /// @brief Offset beyond which resampling corrects on video too, in 100ns units
+        int64_t resample_limit = 1000000;
+    };
+
+    /// @brief What to do to the video after a measurement
+    enum class Action
+    {
+        None,
+        /// @brief Pass over the next frame, moving the video one frame on
+        DropFrame,
+        /// @brief Hold the frame just published for one more frame interval
+        RepeatFrame,
+    };
+
+    struct SyncStats
+    {
+        uint64_t measurements = 0;
+        /// @brief Smoothed offset, audio ahead of video when positive, in 100ns units
+        int64_t offset = 0;
+        /// @brief Extremes of the measured offset
+        int64_t offset_min = 0;
+        int64_t offset_max = 0;
+        /// @brief Sum of the measured offsets' magnitudes, for the mean
+        uint64_t offset_abs_total = 0;
+        uint64_t frames_dropped = 0;
+        uint64_t frames_repeated = 0;
+        /// @brief Measurements made while the audio rate was adjusted
+        uint64_t rate_adjusted = 0;
+        /// @brief Audio rate asked for, 1 when not adjusted
+        double audio_rate = 1.0;
+        /// @brief Times the measurements started over
+        uint64_t resyncs = 0;
+
+        double mean_abs_offset() const
+        {
+            return measurements ? (double)offset_abs_total / (double)measurements : 0.0;
+        }
+    };
+
+    class SyncController
+    {
+    public:
+        explicit SyncController(SyncConfig config = {})
+            : config(config)
+        {
+        }
+
+        /// @brief Measure the offset at a published frame, and decide what to do
+        /// about it
+        /// @param now Media time of the measurement, in 100ns units
+        /// @param audio_time Media time of the audio going out at `now`
+        /// @param video_time Timestamp of the frame published at `now`
+        /// @param frame_interval Timestamp difference between that frame and the
+        /// one before it, or 0 if not known yet
+        /// @return What the caller should do to the video. A frame dropped or
+        /// repeated is assumed to move the offset by `frame_interval` at once.
+        Action update(int64_t now, int64_t audio_time, int64_t video_time, int64_t frame_interval)
+        {
+            auto measured = audio_time - video_time;
+            if (!measuring)
+            {
+                smoothed = (double)measured;
+                last_step = now - config.step_interval;
+                measuring = true;
+            }
+            else
+            {
+                // Exponential smoothing over time rather than over measurements,
+                // so it doesn't depend on the frame rate
+                auto elapsed = (double)std::max<int64_t>(0, now - last_measured);
+                auto weight = elapsed / (elapsed + (double)std::max<int64_t>(1, config.smoothing));
+                smoothed += ((double)measured - smoothed) * weight;
+            }
+
+            counters.offset_min = counters.measurements ? std::min(counters.offset_min, measured) : measured;
+            counters.offset_max = counters.measurements ? std::max(counters.offset_max, measured) : measured;
+            last_measured = now;
+            counters.measurements++;
+            counters.offset_abs_total += (uint64_t)(measured < 0 ? -measured : measured);
+
+            auto action = decide(now, frame_interval);
+            counters.offset = (int64_t)smoothed;
+            counters.audio_rate = rate;
+            counters.rate_adjusted += rate != 1.0 ? 1 : 0;
+            return action;
+        }
+
+        /// @brief Forget the offset measured so far, once the audio has been lined
+        /// up with the video again; the next measurement starts afresh, and the
+        /// audio goes back to its nominal rate
+        void reset()
+        {
+            measuring = false;
+            smoothed = 0.0;
+            rate = 1.0;
+            counters.offset = 0;
+            counters.audio_rate = 1.0;
+            counters.resyncs++;
+        }
+
+        /// @brief Smoothed offset, audio ahead of video when positive, in 100ns units
+        int64_t offset() const { return (int64_t)smoothed; }
+
+        /// @brief How fast the audio should play against its nominal rate
+        double audio_rate() const { return rate; }
+
+        /// @brief Say whether the audio going out can be resampled; while it
+        /// can't, Resample corrects on video alone
+        void set_resamplable(bool can_resample) { resamplable = can_resample; }
+
+        const SyncConfig& configuration() const { return config; }
+
+        SyncStats stats() const { return counters; }
+
+    private:
+        Action decide(int64_t now, int64_t frame_interval)
+        {
+            if (config.correction == Correction::None)
+                return Action::None;
+
+            auto magnitude = smoothed < 0 ? -smoothed : smoothed;
+            if (config.correction == Correction::Resample && resamplable && magnitude <= (double)config.resample_limit)
+            {
+                // Start once the offset leaves the tolerance, and carry on until
+                // it is back within half of it, so the rate doesn't flap at the edge
+                if (magnitude > (double)config.tolerance)
+                    rate = 1.0 - (smoothed > 0 ? config.max_rate_adjust : -config.max_rate_adjust);
+                else if (magnitude < (double)config.tolerance / 2)
+                    rate = 1.0;
+                return Action::None;
+            }
+
+            rate = 1.0;
+
+            // A frame moves the offset by a whole interval, so stepping is only
+            // worth it once that brings it closer to zero
+            auto threshold = (double)std::max(config.tolerance, frame_interval / 2);
+            if (frame_interval <= 0 || magnitude <= threshold || now - last_step < config.step_interval)
+                return Action::None;
+
+            last_step = now;
+            if (smoothed > 0)
+            {
+                // Audio is ahead: move the video on a frame
+                smoothed -= (double)frame_interval;
+                counters.frames_dropped++;
+                return Action::DropFrame;
+            }
+
+            smoothed += (double)frame_interval;
+            counters.frames_repeated++;
+            return Action::RepeatFrame;
+        }
+
+        SyncConfig config;
+        bool resamplable = true;
+        bool measuring = false;
+        double smoothed = 0.0;
+        double rate = 1.0;
+        int64_t last_measured = 0;
+        int64_t last_step = 0;
+        SyncStats counters;
+    };
+} // namespace avsync
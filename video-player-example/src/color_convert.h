@@ -0,0 +1,345 @@
+// YUV 4:2:0 to BGRA colour conversion on the CPU.
+//
+// Converts I420 (three planes) and NV12 (luma plus interleaved chroma) to
+// 32-bit BGRA with BT.601 or BT.709 coefficients, in limited (studio) or full
+// range. Chroma is upsampled by repeating each sample over its 2x2 block.
+//
+// All kernels use the same 13-bit fixed-point arithmetic, so the AVX2,
+// SSE4.1 and NEON rows produce exactly the bytes the scalar reference does.
+
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "cpu_features.h"
+
+namespace color
+{
+    enum class Matrix
+    {
+        Bt601,
+        Bt709,
+    };
+
+    enum class Range
+    {
+        /// @brief Luma in [16, 235], chroma in [16, 240]
+        Limited,
+        /// @brief Every component uses [0, 255]
+        Full,
+    };
+
+    /// @brief The usual matrix for video of this height when it doesn't say:
+    /// BT.709 for HD, BT.601 for SD
+    inline Matrix default_matrix(uint32_t height)
+    {
+        return height >= 720 ? Matrix::Bt709 : Matrix::Bt601;
+    }
+
+    constexpr int FIXED_SHIFT = 13;
+    constexpr int32_t FIXED_ROUND = 1 << (FIXED_SHIFT - 1);
+
+    /// @brief Conversion coefficients in FIXED_SHIFT fixed point.
+    ///
+    ///     R = ((Y - y_offset) * y_mul + (V - 128) * r_v) >> FIXED_SHIFT
+    ///     G = ((Y - y_offset) * y_mul - (U - 128) * g_u - (V - 128) * g_v) >> FIXED_SHIFT
+    ///     B = ((Y - y_offset) * y_mul + (U - 128) * b_u) >> FIXED_SHIFT
+    ///
+    /// Every coefficient fits an int16, which the SIMD kernels rely on.
+    struct Coefficients
+    {
+        int16_t y_offset;
+        int16_t y_mul;
+        int16_t r_v;
+        int16_t g_u;
+        int16_t g_v;
+        int16_t b_u;
+    };
+
+    inline Coefficients coefficients(Matrix matrix, Range range)
+    {
+        auto kr = matrix == Matrix::Bt709 ? 0.2126 : 0.299;
+        auto kb = matrix == Matrix::Bt709 ? 0.0722 : 0.114;
+        auto kg = 1.0 - kr - kb;
+
+        auto y_scale = range == Range::Limited ? 255.0 / 219.0 : 1.0;
+        auto c_scale = range == Range::Limited ? 255.0 / 224.0 : 1.0;
+
+        auto fixed = [](double value) { return (int16_t)std::lround(value * (1 << FIXED_SHIFT)); };
+
+        return Coefficients {
+            (int16_t)(range == Range::Limited ? 16 : 0),
+            fixed(y_scale),
+            fixed(2.0 * (1.0 - kr) * c_scale),
+            fixed(2.0 * kb * (1.0 - kb) / kg * c_scale),
+            fixed(2.0 * kr * (1.0 - kr) / kg * c_scale),
+            fixed(2.0 * (1.0 - kb) * c_scale),
+        };
+    }
+
+    /// @brief Convert one row of pixels
+    /// @param y Luma row
+    /// @param u Chroma row: the U plane's for I420, the interleaved UV plane's for NV12
+    /// @param v The V plane's row for I420; unused for NV12
+    /// @param dst BGRA output row, 4 * width bytes
+    using RowFn = void (*)(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, uint32_t width, const Coefficients& k);
+
+    inline uint8_t clamp_u8(int32_t value)
+    {
+        return (uint8_t)(value < 0 ? 0 : value > 255 ? 255 : value);
+    }
+
+    /// @brief One pixel at a time; the reference the SIMD kernels are checked against
+    template <bool Nv12>
+    inline void row_scalar(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, uint32_t width, const Coefficients& k)
+    {
+        for (uint32_t x = 0; x < width; x++)
+        {
+            auto cb = (int32_t)(Nv12 ? u[x / 2 * 2] : u[x / 2]) - 128;
+            auto cr = (int32_t)(Nv12 ? u[x / 2 * 2 + 1] : v[x / 2]) - 128;
+            auto luma = ((int32_t)y[x] - k.y_offset) * k.y_mul + FIXED_ROUND;
+
+            dst[x * 4 + 0] = clamp_u8((luma + cb * k.b_u) >> FIXED_SHIFT);
+            dst[x * 4 + 1] = clamp_u8((luma - cb * k.g_u - cr * k.g_v) >> FIXED_SHIFT);
+            dst[x * 4 + 2] = clamp_u8((luma + cr * k.r_v) >> FIXED_SHIFT);
+            dst[x * 4 + 3] = 255;
+        }
+    }
+
+#if defined(CPU_X86)
+    /// @brief Chroma for 8 pixels starting at `x`, as 16 bytes of (U, V)
+    /// pairs with each pair repeated for the two pixels it covers
+    template <bool Nv12>
+    CPU_TARGET_SSE41 inline __m128i load_chroma8(const uint8_t* u, const uint8_t* v, uint32_t x)
+    {
+        __m128i pairs;
+        if (Nv12)
+        {
+            pairs = _mm_loadl_epi64((const __m128i*)(u + x));
+        }
+        else
+        {
+            int32_t u4, v4;
+            memcpy(&u4, u + x / 2, sizeof(u4));
+            memcpy(&v4, v + x / 2, sizeof(v4));
+            pairs = _mm_unpacklo_epi8(_mm_cvtsi32_si128(u4), _mm_cvtsi32_si128(v4));
+        }
+        return _mm_unpacklo_epi16(pairs, pairs);
+    }
+
+    /// @brief Convert 4 pixels, given their luma as int32s and their
+    /// chroma as (U - 128, V - 128) int16 pairs
+    CPU_TARGET_SSE41 inline __m128i bgra4_sse41(__m128i luma, __m128i chroma, const Coefficients& k)
+    {
+        const auto zero = _mm_setzero_si128();
+        const auto max = _mm_set1_epi32(255);
+
+        luma = _mm_sub_epi32(luma, _mm_set1_epi32(k.y_offset));
+        luma = _mm_add_epi32(_mm_mullo_epi32(luma, _mm_set1_epi32(k.y_mul)), _mm_set1_epi32(FIXED_ROUND));
+
+        // Each coefficient pair multiplies (U, V) in one madd
+        auto r = _mm_add_epi32(luma, _mm_madd_epi16(chroma, _mm_set1_epi32((int32_t)((uint32_t)(uint16_t)k.r_v << 16))));
+        auto g = _mm_add_epi32(luma, _mm_madd_epi16(chroma, _mm_set1_epi32((int32_t)((uint32_t)(uint16_t)-k.g_v << 16 | (uint16_t)-k.g_u))));
+        auto b = _mm_add_epi32(luma, _mm_madd_epi16(chroma, _mm_set1_epi32((int32_t)(uint16_t)k.b_u)));
+
+        r = _mm_min_epi32(_mm_max_epi32(_mm_srai_epi32(r, FIXED_SHIFT), zero), max);
+        g = _mm_min_epi32(_mm_max_epi32(_mm_srai_epi32(g, FIXED_SHIFT), zero), max);
+        b = _mm_min_epi32(_mm_max_epi32(_mm_srai_epi32(b, FIXED_SHIFT), zero), max);
+
+        auto bgra = _mm_or_si128(b, _mm_slli_epi32(g, 8));
+        bgra = _mm_or_si128(bgra, _mm_slli_epi32(r, 16));
+        return _mm_or_si128(bgra, _mm_set1_epi32((int32_t)0xff000000));
+    }
+
+    template <bool Nv12>
+    CPU_TARGET_SSE41 inline void row_sse41(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, uint32_t width, const Coefficients& k)
+    {
+        const auto bias = _mm_set1_epi16(128);
+
+        uint32_t x = 0;
+        for (; x + 8 <= width; x += 8)
+        {
+            auto luma = _mm_loadl_epi64((const __m128i*)(y + x));
+            auto chroma = load_chroma8<Nv12>(u, v, x);
+
+            auto lo = bgra4_sse41(_mm_cvtepu8_epi32(luma), _mm_sub_epi16(_mm_cvtepu8_epi16(chroma), bias), k);
+            auto hi = bgra4_sse41(_mm_cvtepu8_epi32(_mm_srli_si128(luma, 4)), _mm_sub_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(chroma, 8)), bias), k);
+
+            _mm_storeu_si128((__m128i*)(dst + x * 4), lo);
+            _mm_storeu_si128((__m128i*)(dst + x * 4 + 16), hi);
+        }
+        row_scalar<Nv12>(y + x, Nv12 ? u + x : u + x / 2, Nv12 ? v : v + x / 2, dst + x * 4, width - x, k);
+    }
+
+    template <bool Nv12>
+    CPU_TARGET_AVX2 inline void row_avx2(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, uint32_t width, const Coefficients& k)
+    {
+        const auto zero = _mm256_setzero_si256();
+        const auto max = _mm256_set1_epi32(255);
+        const auto bias = _mm256_set1_epi16(128);
+        const auto y_offset = _mm256_set1_epi32(k.y_offset);
+        const auto y_mul = _mm256_set1_epi32(k.y_mul);
+        const auto round = _mm256_set1_epi32(FIXED_ROUND);
+        const auto alpha = _mm256_set1_epi32((int32_t)0xff000000);
+
+        // Each coefficient pair multiplies (U, V) in one madd
+        const auto r_uv = _mm256_set1_epi32((int32_t)((uint32_t)(uint16_t)k.r_v << 16));
+        const auto g_uv = _mm256_set1_epi32((int32_t)((uint32_t)(uint16_t)-k.g_v << 16 | (uint16_t)-k.g_u));
+        const auto b_uv = _mm256_set1_epi32((int32_t)(uint16_t)k.b_u);
+
+        uint32_t x = 0;
+        for (; x + 8 <= width; x += 8)
+        {
+            auto luma = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(y + x)));
+            luma = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(luma, y_offset), y_mul), round);
+
+            auto chroma = _mm256_sub_epi16(_mm256_cvtepu8_epi16(load_chroma8<Nv12>(u, v, x)), bias);
+
+            auto r = _mm256_add_epi32(luma, _mm256_madd_epi16(chroma, r_uv));
+            auto g = _mm256_add_epi32(luma, _mm256_madd_epi16(chroma, g_uv));
+            auto b = _mm256_add_epi32(luma, _mm256_madd_epi16(chroma, b_uv));
+
+            r = _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(r, FIXED_SHIFT), zero), max);
+            g = _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(g, FIXED_SHIFT), zero), max);
+            b = _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(b, FIXED_SHIFT), zero), max);
+
+            auto bgra = _mm256_or_si256(b, _mm256_slli_epi32(g, 8));
+            bgra = _mm256_or_si256(bgra, _mm256_slli_epi32(r, 16));
+            _mm256_storeu_si256((__m256i*)(dst + x * 4), _mm256_or_si256(bgra, alpha));
+        }
+        row_scalar<Nv12>(y + x, Nv12 ? u + x : u + x / 2, Nv12 ? v : v + x / 2, dst + x * 4, width - x, k);
+    }
+#endif
+
+#if defined(CPU_NEON)
+    template <bool Nv12>
+    inline void row_neon(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, uint32_t width, const Coefficients& k)
+    {
+        const auto round = vdupq_n_s32(FIXED_ROUND);
+        const auto y_offset = vdupq_n_s16(k.y_offset);
+        const auto bias = vdupq_n_s16(128);
+
+        uint32_t x = 0;
+        for (; x + 16 <= width; x += 16)
+        {
+            auto luma = vld1q_u8(y + x);
+
+            uint8x8_t cb, cr;
+            if (Nv12)
+            {
+                auto pairs = vld2_u8(u + x);
+                cb = pairs.val[0];
+                cr = pairs.val[1];
+            }
+            else
+            {
+                cb = vld1_u8(u + x / 2);
+                cr = vld1_u8(v + x / 2);
+            }
+
+            // Repeat each chroma sample for the two pixels it covers
+            auto cb2 = vzip_u8(cb, cb);
+            auto cr2 = vzip_u8(cr, cr);
+
+            for (int half = 0; half < 2; half++)
+            {
+                auto y16 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(half ? vget_high_u8(luma) : vget_low_u8(luma))), y_offset);
+                auto u16 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(cb2.val[half])), bias);
+                auto v16 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(cr2.val[half])), bias);
+
+                auto y_lo = vmlal_n_s16(round, vget_low_s16(y16), k.y_mul);
+                auto y_hi = vmlal_n_s16(round, vget_high_s16(y16), k.y_mul);
+
+                auto r_lo = vmlal_n_s16(y_lo, vget_low_s16(v16), k.r_v);
+                auto r_hi = vmlal_n_s16(y_hi, vget_high_s16(v16), k.r_v);
+                auto g_lo = vmlsl_n_s16(vmlsl_n_s16(y_lo, vget_low_s16(u16), k.g_u), vget_low_s16(v16), k.g_v);
+                auto g_hi = vmlsl_n_s16(vmlsl_n_s16(y_hi, vget_high_s16(u16), k.g_u), vget_high_s16(v16), k.g_v);
+                auto b_lo = vmlal_n_s16(y_lo, vget_low_s16(u16), k.b_u);
+                auto b_hi = vmlal_n_s16(y_hi, vget_high_s16(u16), k.b_u);
+
+                // Shift, then saturate to [0, 255] in two narrowing steps
+                uint8x8x4_t pixels;
+                pixels.val[0] = vqmovn_u16(vcombine_u16(vqshrun_n_s32(b_lo, FIXED_SHIFT), vqshrun_n_s32(b_hi, FIXED_SHIFT)));
+                pixels.val[1] = vqmovn_u16(vcombine_u16(vqshrun_n_s32(g_lo, FIXED_SHIFT), vqshrun_n_s32(g_hi, FIXED_SHIFT)));
+                pixels.val[2] = vqmovn_u16(vcombine_u16(vqshrun_n_s32(r_lo, FIXED_SHIFT), vqshrun_n_s32(r_hi, FIXED_SHIFT)));
+                pixels.val[3] = vdup_n_u8(255);
+                vst4_u8(dst + (x + half * 8) * 4, pixels);
+            }
+        }
+        row_scalar<Nv12>(y + x, Nv12 ? u + x : u + x / 2, Nv12 ? v : v + x / 2, dst + x * 4, width - x, k);
+    }
+#endif
+
+    /// @brief Row kernels for one instruction set
+    struct Kernels
+    {
+        RowFn i420;
+        RowFn nv12;
+    };
+
+    /// @brief The fastest kernels `features` allows
+    inline Kernels select_kernels(const cpu::Features& features)
+    {
+#if defined(CPU_X86)
+        if (features.avx2)
+            return Kernels {row_avx2<false>, row_avx2<true>};
+        if (features.sse41)
+            return Kernels {row_sse41<false>, row_sse41<true>};
+#elif defined(CPU_NEON)
+        if (features.neon)
+            return Kernels {row_neon<false>, row_neon<true>};
+#endif
+        (void)features;
+        return Kernels {row_scalar<false>, row_scalar<true>};
+    }
+
+    /// @brief The fastest kernels this CPU supports
+    inline const Kernels& kernels()
+    {
+        static const auto selected = select_kernels(cpu::features());
+        return selected;
+    }
+
+    /// @brief Convert an I420 picture to BGRA
+    /// @param uv_stride Stride of both the U and the V plane
+    inline void i420_to_bgra(
+        const uint8_t* y,
+        size_t y_stride,
+        const uint8_t* u,
+        const uint8_t* v,
+        size_t uv_stride,
+        uint8_t* bgra,
+        size_t bgra_stride,
+        uint32_t width,
+        uint32_t height,
+        Matrix matrix = Matrix::Bt709,
+        Range range = Range::Limited)
+    {
+        auto row = kernels().i420;
+        auto k = coefficients(matrix, range);
+        for (uint32_t line = 0; line < height; line++)
+            row(y + line * y_stride, u + line / 2 * uv_stride, v + line / 2 * uv_stride, bgra + line * bgra_stride, width, k);
+    }
+
+    /// @brief Convert an NV12 picture to BGRA
+    inline void nv12_to_bgra(
+        const uint8_t* y,
+        size_t y_stride,
+        const uint8_t* uv,
+        size_t uv_stride,
+        uint8_t* bgra,
+        size_t bgra_stride,
+        uint32_t width,
+        uint32_t height,
+        Matrix matrix = Matrix::Bt709,
+        Range range = Range::Limited)
+    {
+        auto row = kernels().nv12;
+        auto k = coefficients(matrix, range);
+        for (uint32_t line = 0; line < height; line++)
+            row(y + line * y_stride, uv + line / 2 * uv_stride, nullptr, bgra + line * bgra_stride, width, k);
+    }
+} // namespace color
@@ -0,0 +1,716 @@
+// Persistent cache of decoded media.
+//
+// The first time a file is played its decoded frames and resampled PCM are
+// written, as they are produced, to a container in a cache directory. Later
+// plays map that container and read frames straight out of it instead of
+// decoding. Entries are keyed by the media's path, size and modification
+// time plus the output format, so an edited file or a different output
+// format never hits a stale entry. The directory is kept under a size budget
+// by evicting the least recently used entries.
+//
+// Container layout (little endian):
+//
+//     FileHeader                        128 bytes, written last
+//     records                           video frames and audio chunks in decode
+//                                       order, each aligned to RECORD_ALIGNMENT
+//     VideoIndexEntry[video_count]
+//     AudioIndexEntry[audio_count]
+//
+// Containers are written under a temporary name of their own and renamed
+// into place once complete, so a reader never sees a partial one and two
+// writers of the same entry never write into the same file. A reader checks
+// that every index entry lies inside the file before serving any of it.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "frame_source.h"
+#include "pcm_ring.h"
+#include "raw_media.h"
+
+namespace cache
+{
+    constexpr uint32_t FILE_VERSION = 1;
+    constexpr uint64_t RECORD_ALIGNMENT = 64;
+    constexpr const char* FILE_EXTENSION = ".rwfc";
+
+    /// @brief Pixel formats, as FOURCCs
+    constexpr uint32_t PIXEL_FORMAT_BGRA = 0x41524742; // 'BGRA'
+    constexpr uint32_t PIXEL_FORMAT_I420 = 0x30323449; // 'I420'
+
+    /// @brief The output format a cache entry was decoded to
+    struct Format
+    {
+        /// @brief Output size, or 0 x 0 when looking up media played at its
+        /// own size (which isn't known until it's opened)
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t pixel_format = PIXEL_FORMAT_BGRA;
+        uint32_t sample_rate = 0;
+        uint16_t channels = 0;
+
+        std::string describe() const
+        {
+            char text[96];
+            snprintf(text, sizeof(text), "%ux%u:%08x:%u:%u", width, height, pixel_format, sample_rate, channels);
+            return text;
+        }
+    };
+
+    struct FileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_size;
+        uint32_t width;
+        uint32_t height;
+        uint32_t pixel_format;
+        uint32_t sample_rate;
+        uint32_t channels;
+        uint32_t reserved;
+        uint64_t key_hash;
+        uint64_t video_count;
+        uint64_t audio_count;
+        uint64_t audio_frames;
+        uint64_t video_index_offset;
+        uint64_t audio_index_offset;
+        uint64_t reserved2[5];
+    };
+    static_assert(sizeof(FileHeader) == 128, "cache header layout changed");
+
+    struct VideoIndexEntry
+    {
+        uint64_t offset;
+        int64_t timestamp;
+        uint32_t size;
+        uint32_t reserved;
+    };
+    static_assert(sizeof(VideoIndexEntry) == 24, "cache index layout changed");
+
+    struct AudioIndexEntry
+    {
+        uint64_t offset;
+        uint64_t first_frame;
+        uint32_t frames;
+        uint32_t reserved;
+    };
+    static_assert(sizeof(AudioIndexEntry) == 24, "cache index layout changed");
+
+    constexpr char FILE_MAGIC[8] = {'R', 'W', 'F', 'C', 'A', 'C', 'H', 'E'};
+
+    /// @brief 64-bit FNV-1a
+    inline uint64_t hash(const std::string& text)
+    {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (auto c : text)
+        {
+            h ^= (uint8_t)c;
+            h *= 0x100000001b3ull;
+        }
+        return h;
+    }
+
+    /// @brief Identity of a cache entry
+    struct Key
+    {
+        uint64_t hash = 0;
+        std::string file_name;
+    };
+
+    /// @brief Key for `media_path` decoded to `format`
+    /// @return An empty file name if the media can't be stat'ed
+    inline Key make_key(const std::string& media_path, const Format& format)
+    {
+        std::error_code error;
+        auto path = std::filesystem::absolute(media_path, error);
+        auto size = std::filesystem::file_size(path, error);
+        if (error)
+            return Key {};
+        auto modified = std::filesystem::last_write_time(path, error);
+        if (error)
+            return Key {};
+
+        auto identity = path.string() + "|" + std::to_string(size) + "|" + std::to_string(modified.time_since_epoch().count()) + "|" + format.describe();
+
+        Key key;
+        key.hash = hash(identity);
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx", (unsigned long long)key.hash);
+        key.file_name = std::string(name) + FILE_EXTENSION;
+        return key;
+    }
+
+    /// @brief A decoded frame inside a mapped container
+    struct FrameView
+    {
+        const uint8_t* data = nullptr;
+        uint32_t size = 0;
+        int64_t timestamp = 0;
+    };
+
+    /// @brief Writes a container, one record at a time
+    class Writer
+    {
+    public:
+        Writer() = default;
+        Writer(const Writer&) = delete;
+        Writer& operator=(const Writer&) = delete;
+        Writer(Writer&& other) noexcept { *this = std::move(other); }
+        Writer& operator=(Writer&& other) noexcept
+        {
+            std::swap(file, other.file);
+            std::swap(temp_path, other.temp_path);
+            std::swap(final_path, other.final_path);
+            std::swap(header, other.header);
+            std::swap(position, other.position);
+            std::swap(video_index, other.video_index);
+            std::swap(audio_index, other.audio_index);
+            std::swap(failed, other.failed);
+            return *this;
+        }
+
+        /// @brief Discards the container unless `finish` succeeded
+        ~Writer() { abandon(); }
+
+        /// @brief Start writing the container that will be published at `path`
+        bool open(const std::filesystem::path& path, const Format& format, uint64_t key_hash)
+        {
+            abandon();
+
+            // Unique to this writer, in this process and among any sharing the directory
+            static const auto process_tag = std::random_device {}();
+            static std::atomic<uint64_t> writers {0};
+            char suffix[48];
+            snprintf(suffix, sizeof(suffix), ".%08x.%llu.tmp", process_tag, (unsigned long long)writers++);
+
+            final_path = path;
+            temp_path = path;
+            temp_path += suffix;
+
+            file = fopen(temp_path.string().c_str(), "wb");
+            if (file == nullptr)
+                return false;
+
+            header = FileHeader {};
+            memcpy(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+            header.version = FILE_VERSION;
+            header.header_size = sizeof(FileHeader);
+            header.width = format.width;
+            header.height = format.height;
+            header.pixel_format = format.pixel_format;
+            header.sample_rate = format.sample_rate;
+            header.channels = format.channels;
+            header.key_hash = key_hash;
+
+            // Reserve the header; it is filled in by finish()
+            position = 0;
+            failed = false;
+            write(&header, sizeof(header));
+            return !failed;
+        }
+
+        bool is_open() const { return file != nullptr; }
+
+        /// @brief Append a decoded frame
+        void add_video(const uint8_t* data, size_t size, int64_t timestamp)
+        {
+            if (!file)
+                return;
+
+            align();
+            video_index.push_back(VideoIndexEntry {position, timestamp, (uint32_t)size, 0});
+            write(data, size);
+        }
+
+        /// @brief Append `frames` frames of interleaved PCM
+        void add_audio(const int16_t* samples, size_t frames)
+        {
+            if (!file || frames == 0)
+                return;
+
+            align();
+            audio_index.push_back(AudioIndexEntry {position, header.audio_frames, (uint32_t)frames, 0});
+            write(samples, frames * header.channels * sizeof(int16_t));
+            header.audio_frames += frames;
+        }
+
+        /// @brief Write the indices and header and publish the container
+        /// @return Whether the container was published
+        bool finish()
+        {
+            if (!file)
+                return false;
+
+            align();
+            header.video_index_offset = position;
+            header.video_count = video_index.size();
+            write(video_index.data(), video_index.size() * sizeof(VideoIndexEntry));
+
+            header.audio_index_offset = position;
+            header.audio_count = audio_index.size();
+            write(audio_index.data(), audio_index.size() * sizeof(AudioIndexEntry));
+
+            if (!failed && fseek(file, 0, SEEK_SET) == 0)
+                write(&header, sizeof(header));
+
+            auto ok = fclose(file) == 0 && !failed;
+            file = nullptr;
+
+            std::error_code error;
+            if (ok)
+                std::filesystem::rename(temp_path, final_path, error);
+            if (!ok || error)
+            {
+                std::filesystem::remove(temp_path, error);
+                return false;
+            }
+            return true;
+        }
+
+        /// @brief Stop writing and delete the partial container
+        void abandon()
+        {
+            if (!file)
+                return;
+
+            fclose(file);
+            file = nullptr;
+
+            std::error_code error;
+            std::filesystem::remove(temp_path, error);
+        }
+
+    private:
+        void write(const void* data, size_t size)
+        {
+            if (failed || size == 0)
+                return;
+            if (fwrite(data, 1, size, file) != size)
+                failed = true;
+            position += size;
+        }
+
+        void align()
+        {
+            static const uint8_t zeros[RECORD_ALIGNMENT] = {};
+            write(zeros, (size_t)((RECORD_ALIGNMENT - position % RECORD_ALIGNMENT) % RECORD_ALIGNMENT));
+        }
+
+        FILE* file = nullptr;
+        std::filesystem::path temp_path;
+        std::filesystem::path final_path;
+        FileHeader header = {};
+        uint64_t position = 0;
+        std::vector<VideoIndexEntry> video_index;
+        std::vector<AudioIndexEntry> audio_index;
+        bool failed = false;
+    };
+
+    /// @brief Maps a finished container and serves views into it
+    class Reader
+    {
+    public:
+        /// @brief Map `path`, checking it is a complete container for `key_hash` in
+        /// `format`. A 0 x 0 format accepts frames of any size.
+        bool open(const std::filesystem::path& path, const Format& format, uint64_t key_hash)
+        {
+            if (!file.open(path.string()) || file.size() < sizeof(FileHeader))
+                return false;
+
+            memcpy(&header, file.data(), sizeof(header));
+            if (memcmp(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0 || header.version != FILE_VERSION || header.key_hash != key_hash)
+                return fail();
+            auto any_size = format.width == 0 && format.height == 0;
+            if ((!any_size && (header.width != format.width || header.height != format.height)) || header.pixel_format != format.pixel_format || header.sample_rate != format.sample_rate || header.channels != format.channels)
+                return fail();
+
+            if (header.video_count == 0 || !fits(header.video_index_offset, header.video_count, sizeof(VideoIndexEntry)) || !fits(header.audio_index_offset, header.audio_count, sizeof(AudioIndexEntry)))
+                return fail();
+            if (header.video_index_offset % alignof(VideoIndexEntry) != 0 || header.audio_index_offset % alignof(AudioIndexEntry) != 0)
+                return fail();
+
+            video_index = (const VideoIndexEntry*)(file.data() + header.video_index_offset);
+            audio_index = (const AudioIndexEntry*)(file.data() + header.audio_index_offset);
+
+            // A damaged index would have frames and audio read from outside the file
+            for (uint64_t i = 0; i < header.video_count; i++)
+            {
+                if (!fits(video_index[i].offset, video_index[i].size, 1))
+                    return fail();
+            }
+            auto frame_bytes = (uint64_t)header.channels * sizeof(int16_t);
+            for (uint64_t i = 0; i < header.audio_count; i++)
+            {
+                if (!fits(audio_index[i].offset, audio_index[i].frames, frame_bytes) || audio_index[i].offset % alignof(int16_t) != 0)
+                    return fail();
+            }
+            return true;
+        }
+
+        uint32_t width() const { return header.width; }
+        uint32_t height() const { return header.height; }
+        uint64_t frame_count() const { return header.video_count; }
+        uint64_t audio_chunk_count() const { return header.audio_count; }
+        uint64_t audio_frame_count() const { return header.audio_frames; }
+        uint16_t channels() const { return (uint16_t)header.channels; }
+        uint32_t sample_rate() const { return header.sample_rate; }
+
+        /// @brief Presentation time of frame `index` in 100ns units
+        int64_t timestamp(uint64_t index) const { return video_index[index].timestamp; }
+
+        /// @brief Length in 100ns units: to the end of the last frame, taken to
+        /// last as long as the one before it, or of the audio if that's longer
+        int64_t duration() const
+        {
+            auto count = header.video_count;
+            auto last = timestamp(count - 1);
+            auto end = count > 1 ? last + (last - timestamp(count - 2)) : last;
+            auto audio = header.sample_rate ? (int64_t)(header.audio_frames * 10000000 / header.sample_rate) : 0;
+            return std::max(end, audio);
+        }
+
+        /// @brief View decoded frame `index`, hinting the next ones for read-ahead
+        FrameView frame(uint64_t index) const
+        {
+            const auto& entry = video_index[index];
+            file.will_need((size_t)entry.offset + entry.size, 4 * (size_t)entry.size);
+            return FrameView {file.data() + entry.offset, entry.size, entry.timestamp};
+        }
+
+        /// @brief Interleaved PCM of audio chunk `index`
+        const int16_t* audio_chunk(uint64_t index, size_t& frames) const
+        {
+            const auto& entry = audio_index[index];
+            frames = entry.frames;
+            return (const int16_t*)(file.data() + entry.offset);
+        }
+
+        /// @brief The audio chunk holding audio frame `position`, and how far
+        /// into it that frame is; `audio_chunk_count()` past the end
+        uint64_t audio_chunk_at(uint64_t position, size_t& offset) const
+        {
+            auto end = audio_index + header.audio_count;
+            auto after = std::upper_bound(audio_index, end, position, [](uint64_t frame, const AudioIndexEntry& entry) {
+                return frame < entry.first_frame;
+            });
+
+            offset = 0;
+            if (after == audio_index)
+                return 0;
+
+            auto chunk = after - 1;
+            if (position - chunk->first_frame >= chunk->frames)
+                return (uint64_t)(after - audio_index);
+            offset = (size_t)(position - chunk->first_frame);
+            return (uint64_t)(chunk - audio_index);
+        }
+
+    private:
+        // Whether `count` items of `size` bytes at `offset` lie inside the
+        // file, without the sum or product overflowing
+        bool fits(uint64_t offset, uint64_t count, uint64_t size) const
+        {
+            if (offset > file.size())
+                return false;
+            return count == 0 || (size != 0 && count <= (file.size() - offset) / size);
+        }
+
+        bool fail()
+        {
+            file.close();
+            return false;
+        }
+
+        raw::MappedFile file;
+        FileHeader header = {};
+        const VideoIndexEntry* video_index = nullptr;
+        const AudioIndexEntry* audio_index = nullptr;
+    };
+
+    /// @brief A cache directory with a least-recently-used size budget. Use is
+    /// tracked through each entry's modification time, which opening refreshes.
+    class Directory
+    {
+    public:
+        Directory(std::filesystem::path root, uint64_t budget_bytes)
+            : root(std::move(root))
+            , budget(budget_bytes)
+        {
+            std::error_code error;
+            std::filesystem::create_directories(this->root, error);
+        }
+
+        std::filesystem::path path_for(const Key& key) const { return root / key.file_name; }
+
+        /// @brief Open the entry for `key` if there is a valid one, marking it used.
+        /// Invalid entries (old versions, a different format) are removed.
+        bool open(const Key& key, const Format& format, Reader& reader)
+        {
+            if (key.file_name.empty())
+                return false;
+
+            auto path = path_for(key);
+            std::error_code error;
+            if (!std::filesystem::exists(path, error))
+                return false;
+
+            if (!reader.open(path, format, key.hash))
+            {
+                std::filesystem::remove(path, error);
+                return false;
+            }
+
+            std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), error);
+            return true;
+        }
+
+        /// @brief Start writing the entry for `key`
+        bool create(const Key& key, const Format& format, Writer& writer)
+        {
+            return !key.file_name.empty() && writer.open(path_for(key), format, key.hash);
+        }
+
+        /// @brief Remove least recently used entries until the directory fits the budget
+        void enforce_budget()
+        {
+            struct Entry
+            {
+                std::filesystem::path path;
+                std::filesystem::file_time_type used;
+                uint64_t size;
+            };
+
+            std::vector<Entry> entries;
+            uint64_t total = 0;
+
+            std::error_code error;
+            for (const auto& item : std::filesystem::directory_iterator(root, error))
+            {
+                if (item.path().extension() != FILE_EXTENSION)
+                    continue;
+
+                std::error_code item_error;
+                auto size = item.file_size(item_error);
+                auto used = item.last_write_time(item_error);
+                if (item_error)
+                    continue;
+
+                entries.push_back(Entry {item.path(), used, size});
+                total += size;
+            }
+
+            std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.used < b.used; });
+
+            // An entry that is mapped elsewhere may refuse removal (on Windows); skip it
+            for (const auto& entry : entries)
+            {
+                if (total <= budget)
+                    break;
+                if (std::filesystem::remove(entry.path, error))
+                    total -= entry.size;
+            }
+        }
+
+    private:
+        std::filesystem::path root;
+        uint64_t budget;
+    };
+
+    /// @brief Serves video and audio out of a cache entry instead of decoding
+    template <typename Video>
+    class CachedSource : public source::FrameSource<Video>
+    {
+    public:
+        /// @brief Fills a frame from its cached bytes; false if the frame can't
+        /// be written right now, which leaves the cached frame to read next
+        using Load = std::function<bool(Video&, const FrameView&)>;
+
+        CachedSource(const Reader& reader, Load load)
+            : reader(reader)
+            , load(std::move(load))
+        {
+        }
+
+        source::VideoRead read_video(Video& frame) override
+        {
+            if (next_frame >= reader.frame_count())
+                return source::VideoRead::Ended;
+
+            auto view = reader.frame(next_frame);
+            if (!load(frame, view))
+                return source::VideoRead::Busy;
+
+            next_frame++;
+            frame.timestamp = (decltype(frame.timestamp))view.timestamp;
+            return source::VideoRead::Decoded;
+        }
+
+        bool skip_video() override
+        {
+            if (next_frame >= reader.frame_count())
+                return false;
+            next_frame++;
+            return true;
+        }
+
+        bool read_audio(audio::PcmRing& output, size_t max_frames) override
+        {
+            while (max_frames > 0 && next_chunk < reader.audio_chunk_count())
+            {
+                size_t frames = 0;
+                auto samples = reader.audio_chunk(next_chunk, frames);
+
+                auto n = std::min(max_frames, frames - chunk_offset);
+                output.write(samples + chunk_offset * reader.channels(), n);
+                max_frames -= n;
+                chunk_offset += n;
+
+                if (chunk_offset == frames)
+                {
+                    next_chunk++;
+                    chunk_offset = 0;
+                }
+            }
+
+            return next_chunk < reader.audio_chunk_count();
+        }
+
+        bool seek(const source::SeekPoint& keyframe) override
+        {
+            if (keyframe.frame >= reader.frame_count())
+                return false;
+
+            // Every cached frame is already decoded, so any frame will do
+            next_frame = keyframe.frame;
+            auto timestamp = reader.timestamp(keyframe.frame);
+            auto position = timestamp > 0 ? ((uint64_t)timestamp * reader.sample_rate() + 5000000) / 10000000 : 0;
+            next_chunk = reader.audio_chunk_at(position, chunk_offset);
+            return true;
+        }
+
+    private:
+        const Reader& reader;
+        Load load;
+        uint64_t next_frame = 0;
+        uint64_t next_chunk = 0;
+        size_t chunk_offset = 0;
+    };
+
+    /// @brief Passes another source through while writing everything it
+    /// produces to a cache entry, published once both streams have ended.
+    /// Stopping before the end abandons the entry.
+    template <typename Video>
+    class RecordingSource : public source::FrameSource<Video>
+    {
+    public:
+        /// @brief Serialises a decoded frame into bytes
+        using Store = std::function<void(const Video&, std::vector<uint8_t>&)>;
+
+        RecordingSource(source::FrameSource<Video>& inner, Writer writer, Store store, std::function<void()> on_published = nullptr)
+            : inner(inner)
+            , writer(std::move(writer))
+            , store(std::move(store))
+            , on_published(std::move(on_published))
+        {
+        }
+
+        void on_decode_thread() override { inner.on_decode_thread(); }
+
+        source::VideoRead read_video(Video& frame) override
+        {
+            auto read = inner.read_video(frame);
+            if (read == source::VideoRead::Busy)
+                return read;
+
+            if (read == source::VideoRead::Decoded && writer.is_open())
+            {
+                store(frame, frame_bytes);
+                writer.add_video(frame_bytes.data(), frame_bytes.size(), (int64_t)frame.timestamp);
+            }
+
+            video_done = read == source::VideoRead::Ended;
+            maybe_publish();
+            return read;
+        }
+
+        bool skip_video() override
+        {
+            // The entry would have a hole in it, so don't publish it
+            writer.abandon();
+
+            auto more = inner.skip_video();
+            video_done = !more;
+            return more;
+        }
+
+        bool read_audio(audio::PcmRing& output, size_t max_frames) override
+        {
+            // Let the inner source write into a scratch ring so the PCM can be
+            // recorded on its way through
+            if (!scratch || scratch->capacity() < max_frames || scratch->channels() != output.channels())
+                scratch = std::make_unique<audio::PcmRing>(max_frames, output.channels());
+
+            auto more = inner.read_audio(*scratch, max_frames);
+            for (auto span = scratch->readable(); span.frames > 0; span = scratch->readable())
+            {
+                writer.add_audio(span.samples, span.frames);
+                output.write(span.samples, span.frames);
+                scratch->consume(span.frames);
+            }
+
+            audio_done = !more;
+            maybe_publish();
+            return more;
+        }
+
+        bool seek(const source::SeekPoint& keyframe) override
+        {
+            // An entry published at the end (before a loop) is kept; one still
+            // being written would have its frames out of order
+            writer.abandon();
+
+            if (!inner.seek(keyframe))
+                return false;
+            video_done = false;
+            audio_done = false;
+            return true;
+        }
+
+        int64_t audio_drift() const override { return inner.audio_drift(); }
+        uint64_t audio_resyncs() const override { return inner.audio_resyncs(); }
+        void adjust_audio_rate(double ratio) override { inner.adjust_audio_rate(ratio); }
+        bool audio_resamplable() const override { return inner.audio_resamplable(); }
+
+    private:
+        void maybe_publish()
+        {
+            if (!video_done || !audio_done || !writer.is_open())
+                return;
+
+            if (writer.finish() && on_published)
+                on_published();
+        }
+
+        source::FrameSource<Video>& inner;
+        Writer writer;
+        Store store;
+        std::function<void()> on_published;
+
+        std::vector<uint8_t> frame_bytes;
+        std::unique_ptr<audio::PcmRing> scratch;
+        bool video_done = false;
+        bool audio_done = false;
+    };
+} // namespace cache
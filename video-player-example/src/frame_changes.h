@@ -0,0 +1,418 @@
+// Which parts of a frame changed since the one before it.
+//
+// A `TileDetector` compares each frame with a copy of the last one, in tiles
+// of `tile_size` x `tile_size` pixels, and keeps a map of the tiles that
+// differ. Only changed tiles are copied into the reference, so a frame that
+// hasn't changed (a slide, a paused picture) costs one read of each buffer
+// and no writes. Each band of tiles is compared a row at a time (with
+// memcmp on x86, a NEON kernel on ARM), and a tile already found changed isn't compared any further. Every
+// picture that differs from the last gets a new content id, so frames showing
+// the same pixels can be recognised downstream without comparing them again.
+//
+// Only pictures read on the CPU are compared: Y4M files and the frame cache.
+// MediaFoundation decodes straight to GPU textures, whose frames carry a
+// content id of 0 and are always submitted.
+//
+// A `SubmitFilter` is what each stream does with those ids: a frame whose
+// content the stream last submitted is skipped, unless the keep-alive
+// interval has passed since, so the encoder and the uplink only spend on
+// frames that show something new. Ids are unique across every detector, so
+// a stream that switches media, falls behind or joins late never mistakes a
+// new picture for the one it sent.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include "cpu_features.h"
+#include "frame_source.h"
+
+namespace change
+{
+    /// @brief A fresh content id, never handed out before; 0 is never used
+    inline uint64_t new_content_id()
+    {
+        static std::atomic<uint64_t> next {1};
+        return next.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /// @brief Whether `bytes` bytes are the same in `a` and `b`
+    using RowEqualFn = bool (*)(const uint8_t* a, const uint8_t* b, size_t bytes);
+
+    /// @brief memcmp; what x86 uses, and the reference the NEON kernel is
+    /// checked against
+    inline bool row_equal_scalar(const uint8_t* a, const uint8_t* b, size_t bytes)
+    {
+        return memcmp(a, b, bytes) == 0;
+    }
+
+#if defined(CPU_NEON)
+    inline bool row_equal_neon(const uint8_t* a, const uint8_t* b, size_t bytes)
+    {
+        size_t i = 0;
+        while (i + 16 <= bytes)
+        {
+            auto diff = vdupq_n_u8(0);
+            for (auto end = std::min(bytes & ~(size_t)15, i + 256); i < end; i += 16)
+                diff = vorrq_u8(diff, veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+            if (vmaxvq_u8(diff) != 0)
+                return false;
+        }
+        return memcmp(a + i, b + i, bytes - i) == 0;
+    }
+#endif
+
+    /// @brief The fastest row comparison `features` allows
+    inline RowEqualFn select_row_equal(const cpu::Features& features)
+    {
+        // No x86 kernel: SSE2 at 16 bytes a step, and AVX2 at 32, were both
+        // slower than memcmp, which already uses wide loads
+#if defined(CPU_NEON)
+        if (features.neon)
+            return row_equal_neon;
+#endif
+        (void)features;
+        return row_equal_scalar;
+    }
+
+    /// @brief The row comparison for this CPU, selected once
+    inline RowEqualFn row_equal()
+    {
+        static const auto selected = select_row_equal(cpu::features());
+        return selected;
+    }
+
+    /// @brief One plane of a picture, with how much of it falls in a tile
+    struct Plane
+    {
+        const uint8_t* data = nullptr;
+        size_t stride = 0;
+        /// @brief Bytes in a row, and rows
+        size_t row_bytes = 0;
+        uint32_t rows = 0;
+        /// @brief Bytes and rows of this plane in one tile
+        size_t tile_bytes = 0;
+        uint32_t tile_rows = 0;
+    };
+
+    /// @brief The planes of a picture; none for one that can't be read on the CPU
+    struct Picture
+    {
+        std::array<Plane, 3> planes;
+        size_t count = 0;
+    };
+
+    /// @brief Tiles of this many pixels square are what a change is tracked in
+    constexpr uint32_t DEFAULT_TILE_SIZE = 32;
+
+    /// @brief A 32-bit BGRA picture
+    inline Picture bgra_picture(const uint8_t* data, size_t stride, uint32_t width, uint32_t height, uint32_t tile_size = DEFAULT_TILE_SIZE)
+    {
+        return Picture {{Plane {data, stride, (size_t)width * 4, height, (size_t)tile_size * 4, tile_size}}, 1};
+    }
+
+    /// @brief The three planes of an 8-bit 4:2:0 picture, tiled alike, so a
+    /// tile covers the same pixels in each; `tile_size` must be even
+    inline Picture i420_picture(
+        const uint8_t* y,
+        const uint8_t* u,
+        const uint8_t* v,
+        size_t y_stride,
+        size_t uv_stride,
+        uint32_t width,
+        uint32_t height,
+        uint32_t tile_size = DEFAULT_TILE_SIZE)
+    {
+        auto chroma_width = (size_t)(width + 1) / 2;
+        auto chroma_height = (height + 1) / 2;
+        return Picture {
+            {
+                Plane {y, y_stride, width, height, tile_size, tile_size},
+                Plane {u, uv_stride, chroma_width, chroma_height, (size_t)tile_size / 2, tile_size / 2},
+                Plane {v, uv_stride, chroma_width, chroma_height, (size_t)tile_size / 2, tile_size / 2},
+            },
+            3};
+    }
+
+    /// @brief Which tiles of the last frame changed, row by row
+    struct DirtyMap
+    {
+        uint32_t columns = 0;
+        uint32_t rows = 0;
+        /// @brief 1 for each tile that changed, `columns` to a row
+        std::vector<uint8_t> tiles;
+        size_t dirty_count = 0;
+
+        bool dirty(uint32_t column, uint32_t row) const { return tiles[(size_t)row * columns + column] != 0; }
+    };
+
+    struct DetectorStats
+    {
+        uint64_t frames = 0;
+        /// @brief Frames with no tile changed
+        uint64_t unchanged_frames = 0;
+        uint64_t dirty_tiles = 0;
+        uint64_t tiles = 0;
+    };
+
+    class TileDetector
+    {
+    public:
+        /// @param compare Row comparison kernel; the one for this CPU by default
+        explicit TileDetector(RowEqualFn compare = nullptr)
+            : compare(compare ? compare : row_equal())
+        {
+        }
+
+        /// @brief Compare a picture with the last one, and remember it. The
+        /// first picture, and one whose planes differ in size from the last,
+        /// is dirty all over.
+        /// @return The number of tiles that changed
+        size_t update(const Picture& picture)
+        {
+            auto planes = picture.planes.data();
+            auto count = picture.count;
+            if (count == 0)
+                return 0;
+
+            if (!same_layout(planes, count))
+                reset(planes, count);
+
+            auto changed = size_t {0};
+            for (uint32_t band = 0; band < map.rows; band++)
+            {
+                auto dirty = map.tiles.data() + (size_t)band * map.columns;
+                memset(dirty, all_dirty ? 1 : 0, map.columns);
+                auto clean = all_dirty ? 0 : (size_t)map.columns;
+
+                // Row by row through the band, so memory is read in order: a
+                // row that matches whole clears every tile it crosses at once
+                for (size_t p = 0; p < count && clean > 0; p++)
+                {
+                    auto& plane = planes[p];
+                    auto& reference = references[p];
+                    auto first = (size_t)band * plane.tile_rows;
+                    auto last = std::min<size_t>(first + plane.tile_rows, plane.rows);
+                    for (auto y = first; y < last && clean > 0; y++)
+                    {
+                        auto a = plane.data + y * plane.stride;
+                        auto b = reference.bytes.data() + y * plane.row_bytes;
+                        if (compare(a, b, plane.row_bytes))
+                            continue;
+
+                        for (uint32_t column = 0; column < map.columns; column++)
+                        {
+                            auto x = (size_t)column * plane.tile_bytes;
+                            if (dirty[column] || x >= plane.row_bytes)
+                                continue;
+                            if (!compare(a + x, b + x, std::min(plane.tile_bytes, plane.row_bytes - x)))
+                            {
+                                dirty[column] = 1;
+                                clean--;
+                            }
+                        }
+                    }
+                }
+
+                auto band_changed = map.columns - clean;
+                if (band_changed > 0)
+                {
+                    for (size_t p = 0; p < count; p++)
+                        copy_band(planes[p], references[p], band, dirty, map.columns, band_changed);
+                }
+                changed += band_changed;
+            }
+
+            all_dirty = false;
+            map.dirty_count = changed;
+            if (changed > 0)
+                content = new_content_id();
+
+            counters.frames++;
+            counters.tiles += map.tiles.size();
+            counters.dirty_tiles += changed;
+            if (changed == 0)
+                counters.unchanged_frames++;
+            return changed;
+        }
+
+        /// @brief Forget the last picture, so the next one is dirty all over
+        void invalidate() { all_dirty = true; }
+
+        /// @brief Tiles that changed in the last picture
+        const DirtyMap& dirty() const { return map; }
+
+        /// @brief Id of the last picture's content
+        uint64_t content_id() const { return content; }
+
+        DetectorStats stats() const { return counters; }
+
+    private:
+        struct Reference
+        {
+            std::vector<uint8_t> bytes;
+            Plane layout;
+        };
+
+        bool same_layout(const Plane* planes, size_t count) const
+        {
+            if (count != references.size())
+                return false;
+            for (size_t p = 0; p < count; p++)
+            {
+                auto& a = planes[p];
+                auto& b = references[p].layout;
+                if (a.row_bytes != b.row_bytes || a.rows != b.rows || a.tile_bytes != b.tile_bytes || a.tile_rows != b.tile_rows)
+                    return false;
+            }
+            return true;
+        }
+
+        void reset(const Plane* planes, size_t count)
+        {
+            references.resize(count);
+            for (size_t p = 0; p < count; p++)
+            {
+                references[p].layout = planes[p];
+                references[p].layout.data = nullptr;
+                references[p].bytes.assign(planes[p].row_bytes * planes[p].rows, 0);
+            }
+
+            // The first plane sets the grid; the others are tiled to match it
+            map.columns = (uint32_t)((planes[0].row_bytes + planes[0].tile_bytes - 1) / planes[0].tile_bytes);
+            map.rows = (planes[0].rows + planes[0].tile_rows - 1) / planes[0].tile_rows;
+            map.tiles.assign((size_t)map.columns * map.rows, 1);
+            all_dirty = true;
+        }
+
+        /// @brief Copy the `dirty` tiles of one band of `plane` into the reference,
+        /// a row at a time; one copy per row when the whole band changed
+        static void copy_band(const Plane& plane, Reference& reference, uint32_t band, const uint8_t* dirty, uint32_t columns, size_t changed)
+        {
+            auto first = (size_t)band * plane.tile_rows;
+            auto last = std::min<size_t>(first + plane.tile_rows, plane.rows);
+            for (auto y = first; y < last; y++)
+            {
+                auto from = plane.data + y * plane.stride;
+                auto to = reference.bytes.data() + y * plane.row_bytes;
+                if (changed == columns)
+                {
+                    memcpy(to, from, plane.row_bytes);
+                    continue;
+                }
+
+                for (uint32_t column = 0; column < columns; column++)
+                {
+                    auto x = (size_t)column * plane.tile_bytes;
+                    if (dirty[column] && x < plane.row_bytes)
+                        memcpy(to + x, from + x, std::min(plane.tile_bytes, plane.row_bytes - x));
+                }
+            }
+        }
+
+        RowEqualFn compare;
+        std::vector<Reference> references;
+        DirtyMap map;
+        bool all_dirty = true;
+        uint64_t content = 0;
+        DetectorStats counters;
+    };
+
+    /// @brief Gives each frame of another source the content id of its
+    /// picture. `Video` needs a `content` member; `describe` gives a frame's
+    /// planes, or none for a frame that can't be read on the CPU, which is
+    /// then treated as changed.
+    template <typename Video>
+    class DetectingSource : public source::FrameSource<Video>
+    {
+    public:
+        using Describe = std::function<Picture(const Video&)>;
+
+        DetectingSource(source::FrameSource<Video>& inner, Describe describe)
+            : inner(inner)
+            , describe(std::move(describe))
+        {
+        }
+
+        void on_decode_thread() override { inner.on_decode_thread(); }
+
+        source::VideoRead read_video(Video& frame) override
+        {
+            auto read = inner.read_video(frame);
+            if (read != source::VideoRead::Decoded)
+                return read;
+
+            auto picture = describe(frame);
+            if (picture.count == 0)
+            {
+                detector.invalidate();
+                frame.content = new_content_id();
+                return read;
+            }
+
+            detector.update(picture);
+            frame.content = detector.content_id();
+            return read;
+        }
+
+        bool skip_video() override { return inner.skip_video(); }
+        bool read_audio(audio::PcmRing& output, size_t max_frames) override { return inner.read_audio(output, max_frames); }
+        bool seek(const source::SeekPoint& keyframe) override { return inner.seek(keyframe); }
+        int64_t audio_drift() const override { return inner.audio_drift(); }
+        uint64_t audio_resyncs() const override { return inner.audio_resyncs(); }
+        void adjust_audio_rate(double ratio) override { inner.adjust_audio_rate(ratio); }
+        bool audio_resamplable() const override { return inner.audio_resamplable(); }
+
+        /// @brief Only read on the decode thread, or once it has stopped
+        const TileDetector& changes() const { return detector; }
+
+    private:
+        source::FrameSource<Video>& inner;
+        Describe describe;
+        TileDetector detector;
+    };
+
+    /// @brief Decides, for one stream, which frames are worth submitting
+    class SubmitFilter
+    {
+    public:
+        /// @param keep_alive Longest time, in 100ns units, to go without
+        /// submitting a frame; 0 submits every frame
+        explicit SubmitFilter(int64_t keep_alive)
+            : keep_alive(keep_alive)
+        {
+        }
+
+        /// @brief Whether to submit a frame showing `content` at `timestamp`.
+        /// A content id of 0 (unknown) is always submitted.
+        bool should_submit(uint64_t content, int64_t timestamp)
+        {
+            auto since = timestamp - last_submitted;
+            if (content != 0 && content == last_content && since >= 0 && since < keep_alive)
+            {
+                skipped_frames++;
+                return false;
+            }
+
+            last_content = content;
+            last_submitted = timestamp;
+            return true;
+        }
+
+        /// @brief Frames skipped because the stream had already submitted their content
+        uint64_t skipped() const { return skipped_frames; }
+
+    private:
+        int64_t keep_alive;
+        uint64_t last_content = 0;
+        int64_t last_submitted = 0;
+        uint64_t skipped_frames = 0;
+    };
+} // namespace change
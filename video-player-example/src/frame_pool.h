@@ -0,0 +1,134 @@
+// A fixed set of reusable output frames.
+//
+// Every decoded frame lives in a buffer from the pool. A buffer is free once
+// nothing references it any more (it has left the decode queue, the fanout
+// ring and every stream) *and* its backend says it is done with it; a GPU
+// texture, for example, can still be held by the encoder through its keyed
+// mutex after the last stream let go of it. `try_acquire` checks both
+// without waiting, so a busy encoder shows up as contention in the counters
+// instead of stalling the thread that decodes.
+//
+// The pool works the same over CPU frames (where only references count) and
+// GPU textures, so its behaviour can be exercised anywhere.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace pool
+{
+    /// @brief What a producer should give up, once it is running late, when
+    /// every buffer is busy
+    enum class ExhaustedPolicy
+    {
+        /// @brief Reuse the oldest frame that was decoded but not yet shown
+        DropOldest,
+        /// @brief Skip the frame about to be decoded
+        SkipNewest,
+    };
+
+    struct FramePoolStats
+    {
+        uint64_t acquired = 0;
+        uint64_t allocated = 0;
+        /// @brief Unreferenced buffers passed over because their backend was still using them
+        uint64_t contended = 0;
+        /// @brief `try_acquire` calls that found no free buffer
+        uint64_t exhausted = 0;
+    };
+
+    template <typename Frame>
+    class FramePool
+    {
+    public:
+        using Allocate = std::function<std::shared_ptr<Frame>()>;
+        /// @brief Whether the backend is done with an unreferenced frame. Must not block.
+        using Available = std::function<bool(const Frame&)>;
+
+        /// @param capacity Most buffers the pool will allocate
+        /// @param allocate Creates a buffer; called lazily, at most `capacity` times
+        /// @param available Backend check; by default an unreferenced frame is free
+        FramePool(size_t capacity, Allocate allocate, Available available = nullptr)
+            : limit(capacity)
+            , allocate(std::move(allocate))
+            , available(std::move(available))
+        {
+            frames.reserve(capacity);
+        }
+
+        FramePool(const FramePool&) = delete;
+        FramePool& operator=(const FramePool&) = delete;
+
+        /// @brief A free buffer, or nullptr if all are busy. Never blocks. Only
+        /// one thread may acquire.
+        std::shared_ptr<Frame> try_acquire()
+        {
+            for (size_t i = 0; i < frames.size(); i++)
+            {
+                // Start after the last buffer handed out, so buffers are reused
+                // round-robin and the backend has the longest to finish with each
+                auto& frame = frames[(next + i) % frames.size()];
+                if (frame.use_count() != 1)
+                    continue;
+
+                // Pairs with the release in whichever thread dropped the last other reference
+                std::atomic_thread_fence(std::memory_order_acquire);
+
+                if (available && !available(*frame))
+                {
+                    contended++;
+                    continue;
+                }
+
+                next = (next + i + 1) % frames.size();
+                acquired++;
+                return frame;
+            }
+
+            if (frames.size() < limit)
+            {
+                auto frame = allocate();
+                if (frame)
+                {
+                    frames.push_back(frame);
+                    allocated++;
+                    acquired++;
+                    return frame;
+                }
+            }
+
+            exhausted++;
+            return nullptr;
+        }
+
+        size_t capacity() const { return limit; }
+
+        FramePoolStats stats() const
+        {
+            FramePoolStats result;
+            result.acquired = acquired;
+            result.allocated = allocated;
+            result.contended = contended;
+            result.exhausted = exhausted;
+            return result;
+        }
+
+    private:
+        size_t limit;
+        Allocate allocate;
+        Available available;
+
+        // Only touched by the acquiring thread
+        std::vector<std::shared_ptr<Frame>> frames;
+        size_t next = 0;
+
+        std::atomic<uint64_t> acquired {0};
+        std::atomic<uint64_t> allocated {0};
+        std::atomic<uint64_t> contended {0};
+        std::atomic<uint64_t> exhausted {0};
+    };
+} // namespace pool
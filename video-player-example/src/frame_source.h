@@ -0,0 +1,620 @@
+// Decode-ahead behind a FrameSource interface.
+//
+// A `FrameSource` decodes video frames and audio on demand. `DecodeAhead`
+// runs one on a background worker that keeps a bounded queue of decoded
+// video frames and a PCM ring of audio topped up, blocking when both are
+// full, so the thread that paces and submits only ever dequeues and a slow
+// decode is absorbed by the queue rather than delaying a submit.
+//
+// `Video` is whatever the source decodes into; it must have an integer
+// `timestamp` member in 100ns units. Frames come from a `pool::FramePool`, so
+// the worker only allocates while the pipeline fills up. When every frame is
+// busy it waits for one to come back, and only drops or skips a frame, as
+// the configured policy says, once the consumer's media clock has passed it:
+// a slow release then costs the frames it made late rather than running the
+// video ahead of the clock. A source that finds the frame it was given still
+// in use when it comes to write it (an encoder took its texture after the
+// pool let it go) hands it back, and the same applies to the picture it
+// keeps. Changes in how far the source's audio
+// has drifted from its timestamps, and the points where it was lined up
+// with the video again, are queued with the audio, so the consumer sees
+// each one when it reaches the audio it applies to.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "frame_pool.h"
+#include "pcm_ring.h"
+
+namespace source
+{
+    /// @brief A keyframe: somewhere a source can start decoding from
+    struct SeekPoint
+    {
+        /// @brief Presentation time in 100ns units
+        int64_t timestamp = 0;
+        /// @brief Position in the video stream, counting from 0
+        uint64_t frame = 0;
+    };
+
+    /// @brief What became of a `FrameSource::read_video`
+    enum class VideoRead
+    {
+        /// @brief The next frame was decoded into the frame given
+        Decoded,
+        /// @brief The frame given was still in use elsewhere (e.g. an encoder
+        /// holds its texture), so nothing was written to it. The source keeps
+        /// the frame it decoded for the next read or skip.
+        Busy,
+        /// @brief The video stream has ended
+        Ended,
+    };
+
+    template <typename Video>
+    class FrameSource
+    {
+    public:
+        virtual ~FrameSource() = default;
+
+        /// @brief Called on the decode thread before anything is read from it
+        virtual void on_decode_thread() {}
+
+        /// @brief Decode the next video frame
+        /// @param frame Frame to decode into (a reused one when available)
+        /// @return Ended at the end of the video stream and Busy if `frame` can't
+        /// be written right now, in both cases without decoding into `frame`
+        virtual VideoRead read_video(Video& frame) = 0;
+
+        /// @brief Move past the next video frame without producing it, for when
+        /// there is no frame to decode into; after a Busy read, that is the
+        /// frame kept
+        /// @return false at the end of the video stream
+        virtual bool skip_video() = 0;
+
+        /// @brief Decode some audio into `output`, which has room for at least
+        /// `max_frames` frames
+        /// @return false at the end of the audio stream
+        virtual bool read_audio(audio::PcmRing& output, size_t max_frames) = 0;
+
+        /// @brief Reposition both streams at `keyframe`: the next video read
+        /// decodes it, and audio carries on from its timestamp
+        /// @return false if the source can't seek (there) and hasn't moved
+        virtual bool seek(const SeekPoint& keyframe)
+        {
+            (void)keyframe;
+            return false;
+        }
+
+        /// @brief How far the audio read so far plays ahead of the media time
+        /// its length says it reaches (behind when negative), from gaps and
+        /// overlaps in the source's own timestamps or a rate adjustment, in
+        /// 100ns units. Back to 0 after a seek. Called on the decode thread.
+        virtual int64_t audio_drift() const { return 0; }
+
+        /// @brief How many times the audio read so far has been lined up with
+        /// the video again, as a seek or the next item of a playlist does.
+        /// Whatever corrected for the drift before starts over when this
+        /// changes. Called on the decode thread.
+        virtual uint64_t audio_resyncs() const { return 0; }
+
+        /// @brief Play the audio read from now on `ratio` times as fast as its
+        /// rate says, to pull it back in step with the video. Sources that
+        /// can't leave it as it is. Called on the decode thread.
+        virtual void adjust_audio_rate(double ratio) { (void)ratio; }
+
+        /// @brief Whether `adjust_audio_rate` has any effect on the audio read
+        /// from now on. Only changes where `audio_resyncs` does, as at the next
+        /// item of a playlist. Called on the decode thread.
+        virtual bool audio_resamplable() const { return false; }
+    };
+
+    struct DecodeAheadConfig
+    {
+        /// @brief Decoded video frames to keep queued
+        size_t video_frames = 4;
+        /// @brief Most video frames in existence: queued, published, or still
+        /// held by a stream or encoder
+        size_t pool_frames = 16;
+        /// @brief What to do with a frame the consumer's clock has passed when
+        /// every pooled frame is busy
+        pool::ExhaustedPolicy exhausted_policy = pool::ExhaustedPolicy::DropOldest;
+        /// @brief Audio the ring holds, in frames
+        size_t audio_frames = 22050;
+        /// @brief Most audio frames asked of the source per read
+        size_t audio_read_frames = 1024;
+        /// @brief How often a worker blocked on a full queue rechecks the audio
+        /// ring, which the consumer drains without notifying
+        std::chrono::milliseconds idle_poll {5};
+    };
+
+    struct DecodeAheadStats
+    {
+        uint64_t video_decoded = 0;
+        uint64_t video_dequeued = 0;
+        /// @brief Dequeues that found the queue empty before the end of the stream
+        uint64_t video_starved = 0;
+        /// @brief Times the worker had nothing to do because both queues were full
+        uint64_t backpressure_waits = 0;
+        /// @brief Queued frames reused before being shown, under DropOldest
+        uint64_t video_dropped = 0;
+        /// @brief Frames never decoded for lack of a free frame
+        uint64_t video_skipped = 0;
+        /// @brief Times the worker found no free frame and nothing the clock
+        /// had passed, so waited for a frame to be released
+        uint64_t video_pool_waits = 0;
+        /// @brief Pooled frames the source found busy when it came to write
+        /// them, each handed back before the exhausted policy was applied
+        uint64_t video_busy = 0;
+        pool::FramePoolStats pool;
+        size_t video_depth = 0;
+        size_t video_depth_high_water = 0;
+        /// @brief Sum of queue depths seen at each dequeue, for mean occupancy
+        uint64_t video_depth_total = 0;
+
+        double mean_video_occupancy() const
+        {
+            return video_dequeued ? (double)video_depth_total / (double)video_dequeued : 0.0;
+        }
+    };
+
+    template <typename Video>
+    class DecodeAhead
+    {
+    public:
+        using Allocate = typename pool::FramePool<Video>::Allocate;
+        using Available = typename pool::FramePool<Video>::Available;
+
+        /// @param source Source to decode from; must outlive this
+        /// @param allocate Creates a frame while the pool is below its capacity
+        /// @param available Whether a frame nothing references is free to decode
+        /// into again (e.g. the encoder has released its texture)
+        DecodeAhead(FrameSource<Video>& source, Allocate allocate, DecodeAheadConfig config = {}, Available available = nullptr)
+            : source(source)
+            , config(config)
+            , frames(std::max(config.pool_frames, config.video_frames), std::move(allocate), std::move(available))
+            , pcm(config.audio_frames)
+        {
+            worker = std::thread {[this]() { run(); }};
+        }
+
+        ~DecodeAhead()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            changed.notify_all();
+            worker.join();
+        }
+
+        DecodeAhead(const DecodeAhead&) = delete;
+        DecodeAhead& operator=(const DecodeAhead&) = delete;
+
+        /// @brief The next decoded frame without dequeuing it, or nullptr
+        std::shared_ptr<Video> peek_video()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return queue.empty() ? nullptr : queue.front();
+        }
+
+        /// @brief Dequeue the next decoded frame, or nullptr if none is ready
+        std::shared_ptr<Video> pop_video()
+        {
+            std::shared_ptr<Video> frame;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (queue.empty())
+                {
+                    if (!video_done)
+                        counters.video_starved++;
+                    return nullptr;
+                }
+
+                counters.video_depth_total += queue.size();
+                counters.video_dequeued++;
+                frame = std::move(queue.front());
+                queue.pop_front();
+                counters.video_depth = queue.size();
+            }
+            changed.notify_all();
+            return frame;
+        }
+
+        /// @brief Decoded audio; the caller is its only consumer
+        audio::PcmRing& audio() { return pcm; }
+
+        /// @brief Whether the source's video has ended and the queue is drained
+        bool video_finished()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return video_done && queue.empty();
+        }
+
+        /// @brief Whether the source's audio has ended and the ring is drained.
+        /// Only the ring's consumer may call this.
+        bool audio_finished()
+        {
+            return audio_done && pcm.readable_frames() == 0;
+        }
+
+        /// @brief The source's audio drift as of the audio up to `consumed`
+        /// frames into the ring, rather than as of what has been decoded ahead
+        /// of it. Only the ring's consumer may call this.
+        int64_t audio_drift(uint64_t consumed)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            consume_marks(consumed);
+            return drift_consumed;
+        }
+
+        /// @brief The source's count of audio resyncs as of the audio up to
+        /// `consumed` frames into the ring. Only the ring's consumer may call this.
+        uint64_t audio_resyncs(uint64_t consumed)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            consume_marks(consumed);
+            return resyncs_consumed;
+        }
+
+        /// @brief Whether the source could resample the audio up to `consumed`
+        /// frames into the ring. Only the ring's consumer may call this.
+        bool audio_resamplable(uint64_t consumed)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            consume_marks(consumed);
+            return resamplable_consumed;
+        }
+
+        /// @brief Tell the worker how far the consumer's media clock has got, in
+        /// 100ns units: frames before it would only be shown late, so they are
+        /// the ones dropped or skipped when every pooled frame is busy. Until
+        /// this is first called, the worker always waits for a frame instead.
+        void set_media_time(int64_t now) { media_time.store(now, std::memory_order_relaxed); }
+
+        /// @brief Have the source play its audio `ratio` times as fast, from its
+        /// next read on
+        void adjust_audio_rate(double ratio) { audio_rate.store(ratio, std::memory_order_relaxed); }
+
+        DecodeAheadStats stats()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto result = counters;
+            result.pool = frames.stats();
+            return result;
+        }
+
+    private:
+        void run()
+        {
+            source.on_decode_thread();
+
+            // A source that resamples from the start says so before its first audio
+            note_drift();
+
+            while (true)
+            {
+                auto worked = false;
+
+                video_waiting = false;
+                if (wants_video())
+                {
+                    worked = decode_video();
+                    video_waiting = !worked;
+                }
+
+                if (!audio_done && pcm.writable_frames(config.audio_read_frames) >= config.audio_read_frames)
+                {
+                    auto rate = audio_rate.load(std::memory_order_relaxed);
+                    if (rate != rate_applied)
+                    {
+                        source.adjust_audio_rate(rate);
+                        rate_applied = rate;
+                    }
+
+                    // A read that produced nothing (a source holding audio back
+                    // until its video catches up) doesn't count as work
+                    auto written = pcm.written_frames();
+                    audio_done = !source.read_audio(pcm, config.audio_read_frames);
+                    worked = worked || audio_done || pcm.written_frames() != written;
+                    note_drift();
+                }
+
+                std::unique_lock<std::mutex> lock(mutex);
+                if (stopping)
+                    return;
+
+                if (!worked)
+                {
+                    // Nothing says when a pooled frame is released, so a worker
+                    // waiting for one sleeps out the poll and tries again
+                    if (!video_waiting && (!video_done || !audio_done))
+                        counters.backpressure_waits++;
+                    changed.wait_for(lock, config.idle_poll, [&] { return stopping || (!video_waiting && !video_done && queue.size() < config.video_frames); });
+                }
+            }
+        }
+
+        // Mark where in the ring the source's drift, resync count or ability to
+        // resample changed, so the consumer sees each change when it reaches
+        // that audio
+        void note_drift()
+        {
+            auto drift = source.audio_drift();
+            auto resyncs = source.audio_resyncs();
+            auto resamplable = source.audio_resamplable();
+            if (drift == drift_written && resyncs == resyncs_written && resamplable == resamplable_written)
+                return;
+
+            // Marks a whole ring behind have been consumed, whether or not the
+            // consumer asked, so there are never more than a ring's worth
+            auto written = pcm.written_frames();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (written >= pcm.capacity())
+                consume_marks(written - pcm.capacity());
+            drift_marks.push_back(DriftMark {written, drift, resyncs, resamplable});
+            drift_written = drift;
+            resyncs_written = resyncs;
+            resamplable_written = resamplable;
+        }
+
+        // Apply the marks up to `position`; the mutex must be held
+        void consume_marks(uint64_t position)
+        {
+            while (!drift_marks.empty() && drift_marks.front().position <= position)
+            {
+                drift_consumed = drift_marks.front().drift;
+                resyncs_consumed = drift_marks.front().resyncs;
+                resamplable_consumed = drift_marks.front().resamplable;
+                drift_marks.pop_front();
+            }
+        }
+
+        bool wants_video()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return !video_done && queue.size() < config.video_frames;
+        }
+
+        // Decode the next frame into a free one, or with none free make way by
+        // dropping or skipping a frame the consumer's clock has passed
+        // @return false if there was no way: the worker waits for a frame
+        bool decode_video()
+        {
+            auto frame = frames.try_acquire();
+            auto reused = !frame;
+            if (!frame && !(frame = take_late()))
+                return skip_late();
+
+            auto read = source.read_video(*frame);
+            if (read == VideoRead::Busy && !reused)
+            {
+                // Taken again after the pool found it free: it goes back to the
+                // pool, and the picture kept goes into another frame, or
+                // wherever it would with none free
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    counters.video_busy++;
+                }
+                frame = frames.try_acquire();
+                reused = !frame;
+                if (!frame && !(frame = take_late()))
+                    return skip_late();
+                read = source.read_video(*frame);
+            }
+
+            if (read != VideoRead::Decoded)
+            {
+                {
+                    // Nothing replaced the frame taken back from the queue, so
+                    // it can still be shown
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (reused)
+                    {
+                        queue.push_front(std::move(frame));
+                        counters.video_dropped--;
+                    }
+                    if (read == VideoRead::Ended)
+                        video_done = true;
+                }
+
+                // The frame tried instead was busy too
+                if (read == VideoRead::Busy)
+                    return skip_late();
+                return true;
+            }
+
+            // The next frame is expected an interval on, for judging whether
+            // the clock has passed one that was never decoded
+            if (last_video_time != NO_TIME && frame->timestamp > last_video_time)
+                video_interval = (int64_t)frame->timestamp - last_video_time;
+            last_video_time = (int64_t)frame->timestamp;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(std::move(frame));
+            counters.video_decoded++;
+            counters.video_depth = queue.size();
+            counters.video_depth_high_water = std::max(counters.video_depth_high_water, queue.size());
+            return true;
+        }
+
+        // Under DropOldest, the oldest queued frame to decode into instead of
+        // a pooled one, if the consumer's clock has passed it; nullptr if not
+        std::shared_ptr<Video> take_late()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (config.exhausted_policy != pool::ExhaustedPolicy::DropOldest || queue.empty())
+                return nullptr;
+            if ((int64_t)queue.front()->timestamp >= media_time.load(std::memory_order_relaxed))
+                return nullptr;
+
+            // Nothing outside the queue has seen this frame, so it's ours to reuse
+            auto frame = std::move(queue.front());
+            queue.pop_front();
+            counters.video_dropped++;
+            return frame;
+        }
+
+        // Skip the next frame if the consumer's clock has passed it
+        // @return false, having skipped nothing, if it hasn't
+        bool skip_late()
+        {
+            if (last_video_time == NO_TIME || last_video_time + video_interval >= media_time.load(std::memory_order_relaxed))
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                counters.video_pool_waits++;
+                return false;
+            }
+
+            auto more = source.skip_video();
+            last_video_time += video_interval;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (more)
+                counters.video_skipped++;
+            else
+                video_done = true;
+            return true;
+        }
+
+        static constexpr int64_t NO_TIME = std::numeric_limits<int64_t>::min();
+
+        FrameSource<Video>& source;
+        DecodeAheadConfig config;
+        pool::FramePool<Video> frames;
+        audio::PcmRing pcm;
+
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::deque<std::shared_ptr<Video>> queue;
+        DecodeAheadStats counters;
+        bool video_done = false;
+        bool stopping = false;
+
+        struct DriftMark
+        {
+            uint64_t position;
+            int64_t drift;
+            uint64_t resyncs;
+            bool resamplable;
+        };
+        std::deque<DriftMark> drift_marks;
+        int64_t drift_consumed = 0;
+        uint64_t resyncs_consumed = 0;
+        bool resamplable_consumed = false;
+
+        // Only written by the worker
+        std::atomic<bool> audio_done {false};
+        int64_t drift_written = 0;
+        uint64_t resyncs_written = 0;
+        bool resamplable_written = false;
+        double rate_applied = 1.0;
+        bool video_waiting = false;
+        int64_t last_video_time = NO_TIME;
+        int64_t video_interval = 0;
+
+        std::atomic<double> audio_rate {1.0};
+        std::atomic<int64_t> media_time {NO_TIME};
+
+        std::thread worker;
+    };
+
+    /// @brief A deterministic source: `frame_count` video frames at `fps`, and a
+    /// matching length of audio in which every sample is its frame position
+    /// (truncated to 16 bits), so a consumer can check for gaps and reordering.
+    /// Every `keyframe_interval`th frame is a keyframe it can seek to.
+    template <typename Video>
+    class SyntheticSource : public FrameSource<Video>
+    {
+    public:
+        using Paint = std::function<void(Video&, uint64_t index)>;
+
+        SyntheticSource(uint64_t frame_count, uint32_t fps, uint32_t sample_rate, Paint paint = nullptr, uint32_t keyframe_interval = 1)
+            : frame_count(frame_count)
+            , fps(fps)
+            , sample_rate(sample_rate)
+            , audio_total((uint64_t)frame_count * sample_rate / fps)
+            , paint(std::move(paint))
+            , keyframe_interval(std::max(1u, keyframe_interval))
+        {
+        }
+
+        /// @brief Presentation time of frame `index` in 100ns units
+        int64_t timestamp(uint64_t index) const { return (int64_t)(index * 10000000 / fps); }
+
+        bool is_keyframe(uint64_t index) const { return index % keyframe_interval == 0; }
+
+        VideoRead read_video(Video& frame) override
+        {
+            if (next_frame >= frame_count)
+                return VideoRead::Ended;
+
+            frame.timestamp = (decltype(frame.timestamp))timestamp(next_frame);
+            if (paint)
+                paint(frame, next_frame);
+
+            next_frame++;
+            return VideoRead::Decoded;
+        }
+
+        bool skip_video() override
+        {
+            if (next_frame >= frame_count)
+                return false;
+            next_frame++;
+            return true;
+        }
+
+        bool read_audio(audio::PcmRing& output, size_t max_frames) override
+        {
+            auto frames = (size_t)std::min<uint64_t>(max_frames, audio_total - audio_written);
+            while (frames > 0)
+            {
+                auto span = output.writable();
+                if (span.frames == 0)
+                    break;
+
+                auto n = std::min(span.frames, frames);
+                for (size_t i = 0; i < n * output.channels(); i++)
+                    span.samples[i] = (int16_t)(audio_written + i / output.channels());
+                output.commit(n);
+                audio_written += n;
+                frames -= n;
+            }
+
+            return audio_written < audio_total;
+        }
+
+        bool seek(const SeekPoint& keyframe) override
+        {
+            if (keyframe.frame >= frame_count || !is_keyframe(keyframe.frame))
+                return false;
+
+            next_frame = keyframe.frame;
+            audio_written = keyframe.frame * sample_rate / fps;
+            return true;
+        }
+
+    private:
+        uint64_t frame_count;
+        uint32_t fps;
+        uint32_t sample_rate;
+        uint64_t audio_total;
+        Paint paint;
+        uint32_t keyframe_interval;
+
+        uint64_t next_frame = 0;
+        uint64_t audio_written = 0;
+    };
+} // namespace source
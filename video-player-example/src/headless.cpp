@@ -0,0 +1,497 @@
+// A headless build of the video player. It streams an uncompressed Y4M file
+// (and optionally a 16-bit PCM WAV file) through the same decode-ahead,
+// pacing and fanout path as the real player, to simulated streams that
+// record what they would have submitted. Use it as:
+//
+//     video-player-headless media.y4m|playlist.m3u [audio.wav] [streams] [seconds] [packet ms] [workers] [loop] [start seconds] [keep-alive ms]
+//
+// There is no decoder and no Rainway SDK involved, so the numbers it prints
+// are the pure submission and pacing overhead per stream. At the end every
+// stream is closed the way a viewer leaving would close it, and the time to
+// tear the streams and the producer down is printed too. With loop set to 1
+// the media plays round until the time is up, through the same seek path as
+// the player's looping, so the audio gap count covers the loop points. A
+// playlist plays its Y4M files back to back, each with the WAV of the same
+// name beside it if there is one, and prints how long each switch took.
+// Frames whose picture hasn't changed are skipped by each stream, as in the
+// player, except once every keep-alive interval (0 submits every frame).
+// With audio, the producer measures how far apart audio and video are, and
+// keeps them in step as the player does.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "audio_packetizer.h"
+#include "av_sync.h"
+#include "frame_changes.h"
+#include "frame_source.h"
+#include "media_fanout.h"
+#include "metrics.h"
+#include "pacer.h"
+#include "player_loop.h"
+#include "player_metrics.h"
+#include "playlist.h"
+#include "raw_media.h"
+#include "seek_index.h"
+#include "stream_executor.h"
+#include "stream_lifecycle.h"
+
+/// @brief A chunk of interleaved 16-bit PCM shared between simulated streams
+struct AudioChunk
+{
+    std::vector<uint8_t> pcm;
+    int64_t timestamp = 0;
+};
+
+/// @brief A Y4M file and the WAV of the same name beside it, as a playlist item
+struct RawFile : source::FrameSource<raw::VideoFrame>
+{
+    raw::Y4mReader video;
+    raw::WavReader audio;
+    std::unique_ptr<raw::RawMediaSource> media;
+    std::string error;
+
+    /// @brief Open `path`, and its WAV if there is one at `sample_rate`; a
+    /// `sample_rate` of 0 leaves the audio out
+    bool open(const std::string& path, uint32_t sample_rate)
+    {
+        if (!video.open(path))
+        {
+            error = video.error();
+            return false;
+        }
+
+        auto has_audio = false;
+        auto audio_path = std::filesystem::path(path).replace_extension(".wav");
+        std::error_code exists_error;
+        if (sample_rate > 0 && std::filesystem::exists(audio_path, exists_error))
+        {
+            has_audio = audio.open(audio_path.string()) && audio.sample_rate() == sample_rate;
+            if (!has_audio)
+                printf("Warning. Playing %s silent: its WAV isn't 16-bit PCM at %u Hz\n", path.c_str(), sample_rate);
+        }
+
+        media = std::make_unique<raw::RawMediaSource>(video, has_audio ? &audio : nullptr);
+        return true;
+    }
+
+    source::VideoRead read_video(raw::VideoFrame& frame) override { return media->read_video(frame); }
+    bool skip_video() override { return media->skip_video(); }
+    bool read_audio(audio::PcmRing& output, size_t max_frames) override { return media->read_audio(output, max_frames); }
+};
+
+using HeadlessFanout = fanout::MediaFanout<raw::VideoFrame, AudioChunk>;
+using HeadlessProducer = fanout::SharedProducer<raw::VideoFrame, AudioChunk>;
+
+/// @brief Stands in for an OutboundStream, measuring how evenly frames arrive
+/// and checking the audio packets it would have submitted
+struct HeadlessSink
+{
+    audio::Packetizer packets;
+    std::shared_ptr<player::StreamMetrics> measured;
+    change::SubmitFilter unchanged;
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+    uint64_t video_frames = 0;
+    uint64_t audio_frames = 0;
+    uint64_t checksum = 0;
+
+    // Packets whose timestamp doesn't follow on from the previous packet's end
+    uint64_t audio_gaps = 0;
+    uint64_t next_audio_position = 0;
+
+    std::chrono::steady_clock::time_point last_arrival {};
+    int64_t last_timestamp = 0;
+    uint64_t intervals = 0;
+    std::chrono::nanoseconds total_interval_error {0};
+    std::chrono::nanoseconds max_interval_error {0};
+    // Frames that arrived more than half an interval late: a frame interval was missed
+    uint64_t missed_intervals = 0;
+
+    void submit_video(const raw::VideoFrame& frame)
+    {
+        if (!unchanged.should_submit(frame.content, frame.timestamp))
+        {
+            measured->video_unchanged.add();
+            return;
+        }
+
+        auto timer = metrics::ScopedTimer {&measured->submit_video};
+        measured->frame_submitted(started);
+        auto now = std::chrono::steady_clock::now();
+
+        // Compare the wall clock gap between submissions with the media gap
+        if (video_frames > 0)
+        {
+            auto wall = now - last_arrival;
+            auto media = std::chrono::nanoseconds {(frame.timestamp - last_timestamp) * 100};
+            auto error = wall > media ? wall - media : media - wall;
+            total_interval_error += error;
+            max_interval_error = std::max(max_interval_error, std::chrono::duration_cast<std::chrono::nanoseconds>(error));
+            intervals++;
+            if (wall > media * 3 / 2)
+                missed_intervals++;
+        }
+
+        last_arrival = now;
+        last_timestamp = frame.timestamp;
+        video_frames++;
+
+        // Touch the frame like an encoder would start to, so an unmapped page still costs
+        checksum += frame.y[0] + frame.u[0] + frame.v[0];
+    }
+
+    void submit_audio(const AudioChunk& chunk)
+    {
+        auto rate = (int64_t)packets.sample_rate();
+        auto frames = chunk.pcm.size() / (sizeof(int16_t) * packets.channels());
+        packets.push((const int16_t*)chunk.pcm.data(), frames, chunk.timestamp, [&](const int16_t*, size_t packet_frames, int64_t timestamp) {
+            auto position = (uint64_t)((timestamp * rate + 9999999) / 10000000);
+            if (audio_frames > 0 && position != next_audio_position)
+                audio_gaps++;
+
+            next_audio_position = position + packet_frames;
+            audio_frames += packet_frames;
+            measured->audio_packets.add();
+            measured->audio_frames.add(packet_frames);
+        });
+    }
+};
+
+int main(int argc, const char* argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <media.y4m or playlist.m3u> [audio.wav, or - for none] [streams] [seconds] [packet ms] [workers] [loop] [start seconds] [keep-alive ms]\n", argv[0]);
+        exit(1);
+    }
+
+    auto video_path = std::string(argv[1]);
+    auto audio_path = argc > 2 ? std::string(argv[2]) : std::string();
+    const auto stream_count = argc > 3 ? std::max(1, atoi(argv[3])) : 1;
+    const auto seconds = argc > 4 ? std::max(1, atoi(argv[4])) : 10;
+    const auto packet_ms = argc > 5 ? std::max(1, atoi(argv[5])) : 20;
+    const auto worker_count = argc > 6 ? std::max(0, atoi(argv[6])) : 0;
+    const auto loop = argc > 7 && atoi(argv[7]) != 0;
+    const auto start_seconds = argc > 8 ? std::max(0.0, atof(argv[8])) : 0.0;
+    const auto keep_alive_ms = argc > 9 ? std::max(0, atoi(argv[9])) : 1000;
+
+    // A playlist's first item stands in for the media below; its WAV sets the audio format
+    std::vector<std::string> items;
+    if (playlist::is_playlist(video_path))
+    {
+        items = playlist::read_m3u(video_path);
+        if (items.empty())
+        {
+            printf("Error. %s lists no media\n", video_path.c_str());
+            return 1;
+        }
+
+        printf("Playlist: %zu items\n", items.size());
+        video_path = items[0];
+        audio_path = std::filesystem::path(video_path).replace_extension(".wav").string();
+        std::error_code error;
+        if (!std::filesystem::exists(audio_path, error))
+            audio_path.clear();
+    }
+
+    raw::Y4mReader video;
+    if (!video.open(video_path))
+    {
+        printf("Error. Failed to open %s: %s\n", video_path.c_str(), video.error().c_str());
+        return 1;
+    }
+
+    raw::WavReader audio;
+    auto has_audio = !audio_path.empty() && audio_path != "-";
+    if (has_audio && !audio.open(audio_path))
+    {
+        printf("Error. Failed to open %s: %s\n", audio_path.c_str(), audio.error().c_str());
+        return 1;
+    }
+
+    printf("VO: %ux%u (@ %f fps), %llu frames\n", video.width(), video.height(), video.fps(), (unsigned long long)video.frame_count());
+    if (has_audio)
+        printf("AO: c:%u sps:%u, %llu frames\n", audio.channels(), audio.sample_rate(), (unsigned long long)audio.frame_count());
+
+    auto config = player::ProducerConfig {};
+    config.sample_rate = has_audio ? audio.sample_rate() : 44100;
+    config.channels = 2;
+    config.stop_at_end = true;
+
+    // Every frame of a Y4M is a keyframe, so there is nothing to index
+    auto seek_index = seek::SeekIndex::every(video.frame_count(), 1, video.timestamp(video.frame_count()), [&](uint64_t frame) {
+        return video.timestamp(frame);
+    });
+    auto seeking_config = seek::SeekingConfig {};
+    seeking_config.loop = loop;
+    seeking_config.start_at = (int64_t)(start_seconds * 10000000);
+    seeking_config.sample_rate = config.sample_rate;
+    seeking_config.channels = config.channels;
+    seek::SeekingStats seeking_stats;
+
+    auto playlist_config = playlist::PlaylistConfig {};
+    playlist_config.loop = loop;
+    playlist_config.audio = has_audio;
+    playlist_config.sample_rate = config.sample_rate;
+    playlist_config.channels = config.channels;
+    playlist::PlaylistStats playlist_stats;
+
+    pacing::PacerStats pacer_stats;
+    source::DecodeAheadStats decode_stats;
+    change::DetectorStats change_stats;
+    avsync::SyncStats sync_stats;
+
+    // The same metrics the player keeps, exported if RAINWAY_EXAMPLES_METRICS is set
+    metrics::Registry registry;
+    auto exporter = metrics::export_from_env(registry);
+    auto producer_metrics = player::ProducerMetrics {registry.create("media=\"" + player::label_value(video_path) + "\"")};
+
+    auto cpu_start = std::clock();
+    auto wall_start = std::chrono::steady_clock::now();
+
+    auto producer = std::make_shared<HeadlessProducer>(
+        8,
+        64,
+        [&](HeadlessFanout& out, const lifecycle::CancellationToken& stop) {
+            auto raw_source = raw::RawMediaSource {video, has_audio ? &audio : nullptr};
+            auto seeking = seek::SeekingSource<raw::VideoFrame> {raw_source, seek_index, seeking_config};
+            source::FrameSource<raw::VideoFrame>* played = &seeking;
+
+            // Items are opened on the playlist's own thread, one ahead of the one playing
+            std::unique_ptr<playlist::PlaylistSource<raw::VideoFrame>> items_played;
+            if (!items.empty())
+            {
+                auto open_item = [&](size_t index, playlist::Item<raw::VideoFrame>& item) {
+                    auto file = std::make_unique<RawFile>();
+                    if (!file->open(items[index], has_audio ? config.sample_rate : 0))
+                    {
+                        printf("Warning. Skipping %s: %s\n", items[index].c_str(), file->error.c_str());
+                        return false;
+                    }
+
+                    item.duration = file->video.timestamp(file->video.frame_count());
+                    item.source = std::move(file);
+                    return true;
+                };
+                items_played = std::make_unique<playlist::PlaylistSource<raw::VideoFrame>>(items.size(), open_item, playlist_config);
+                played = items_played.get();
+            }
+
+            // Each picture is compared with the last once, for every stream
+            auto detecting = change::DetectingSource<raw::VideoFrame> {*played, [](const raw::VideoFrame& frame) {
+                return change::i420_picture(frame.y, frame.u, frame.v, frame.y_stride, frame.uv_stride, frame.width, frame.height);
+            }};
+            auto source = player::InstrumentedSource<raw::VideoFrame> {detecting, producer_metrics};
+
+            auto decode_config = source::DecodeAheadConfig {};
+            decode_config.audio_frames = config.sample_rate / 2;
+
+            auto decoder = source::DecodeAhead<raw::VideoFrame> {
+                source,
+                []() { return std::make_shared<raw::VideoFrame>(); },
+                decode_config};
+
+            // WAV audio has no timestamps to drift from, so this measures how
+            // far pacing and underruns alone put audio and video apart
+            auto sync = avsync::SyncController {};
+
+            auto clock = pacing::SteadyClock {};
+            pacer_stats = player::run_producer(out, decoder, clock, stop, config, &producer_metrics, &sync);
+            decode_stats = decoder.stats();
+            sync_stats = sync.stats();
+            change_stats = detecting.changes().stats();
+            seeking_stats = seeking.stats();
+            if (items_played)
+                playlist_stats = items_played->stats();
+        });
+
+    std::vector<HeadlessSink> sinks;
+    for (auto i = 0; i < stream_count; i++)
+    {
+        auto measured = std::make_shared<player::StreamMetrics>(registry.create("stream=\"" + std::to_string(i) + "\""));
+        sinks.push_back(HeadlessSink {
+            audio::Packetizer {config.sample_rate, config.channels, (uint32_t)packet_ms},
+            measured,
+            change::SubmitFilter {(int64_t)keep_alive_ms * 10000}});
+    }
+
+    // Every stream runs on a small pool of workers rather than a thread each
+    using Consumer = exec::ConsumerTask<raw::VideoFrame, AudioChunk, HeadlessSink>;
+    auto executor_clock = pacing::SteadyClock {};
+    auto executor_config = exec::ExecutorConfig {};
+    executor_config.workers = (size_t)worker_count;
+    auto executor = exec::StreamExecutor<> {executor_clock, executor_config};
+    executor.start();
+
+    lifecycle::CloseRecorder closes;
+    std::vector<std::unique_ptr<lifecycle::StreamLifecycle>> lives;
+    std::vector<std::unique_ptr<Consumer>> consumers;
+    for (auto& sink : sinks)
+    {
+        auto life = lives.emplace_back(std::make_unique<lifecycle::StreamLifecycle>()).get();
+        auto consumer = consumers.emplace_back(std::make_unique<Consumer>(producer->media(), sink, life->token())).get();
+        auto task = executor.spawn(
+            [life, consumer](auto now) {
+                life->start();
+                return (*consumer)(now);
+            },
+            executor_clock.now(),
+            [life, &closes](bool) {
+                if (auto latency = life->close())
+                    closes.record(*latency);
+            });
+        life->token().on_cancel([&executor, task]() { executor.wake(task); });
+    }
+
+    auto deadline = wall_start + std::chrono::seconds(seconds);
+    while (std::chrono::steady_clock::now() < deadline && executor.task_count() > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    auto wall_end = std::chrono::steady_clock::now();
+
+    // Close every stream still playing, as its viewer leaving would
+    for (auto& life : lives)
+        life->request_close();
+    while (executor.task_count() > 0)
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    executor.shutdown();
+
+    auto producer_stop = std::chrono::steady_clock::now();
+    producer.reset();
+    auto producer_latency = std::chrono::steady_clock::now() - producer_stop;
+
+    auto wall = std::chrono::duration<double>(wall_end - wall_start).count();
+    auto cpu = (double)(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+
+    for (size_t i = 0; i < sinks.size(); i++)
+    {
+        const auto& sink = sinks[i];
+        auto mean_error = sink.intervals ? sink.total_interval_error.count() / (int64_t)sink.intervals : 0;
+        printf(
+            "Stream %zu: %llu video frames (%.2f fps, %llu unchanged skipped), %llu audio frames in %llu packets (%llu gaps), interval error mean %.3fms max %.3fms, %llu missed intervals\n",
+            i,
+            (unsigned long long)sink.video_frames,
+            sink.video_frames / wall,
+            (unsigned long long)sink.unchanged.skipped(),
+            (unsigned long long)sink.audio_frames,
+            (unsigned long long)sink.packets.packets(),
+            (unsigned long long)sink.audio_gaps,
+            mean_error / 1e6,
+            sink.max_interval_error.count() / 1e6,
+            (unsigned long long)sink.missed_intervals);
+    }
+
+    printf(
+        "Producer: %llu waits, %llu late, wake error mean %.3fms, p50 %.3fms, p99 %.3fms, max %.3fms, %llu re-anchors\n",
+        (unsigned long long)pacer_stats.waits,
+        (unsigned long long)pacer_stats.late,
+        pacer_stats.mean_abs_error().count() / 1e6,
+        pacer_stats.error_percentile(0.5).count() / 1e6,
+        pacer_stats.error_percentile(0.99).count() / 1e6,
+        pacer_stats.max_abs_error.count() / 1e6,
+        (unsigned long long)pacer_stats.reanchors);
+    printf(
+        "Decode-ahead: %llu frames, mean queue %.2f, %llu starved dequeues\n",
+        (unsigned long long)decode_stats.video_decoded,
+        decode_stats.mean_video_occupancy(),
+        (unsigned long long)decode_stats.video_starved);
+    printf(
+        "Output pool: %llu frames allocated, %llu acquires found none free, %llu waits for a release, %llu dropped, %llu skipped\n",
+        (unsigned long long)decode_stats.pool.allocated,
+        (unsigned long long)decode_stats.pool.exhausted,
+        (unsigned long long)decode_stats.video_pool_waits,
+        (unsigned long long)decode_stats.video_dropped,
+        (unsigned long long)decode_stats.video_skipped);
+    printf(
+        "Changes: %llu of %llu frames unchanged, %.1f%% of tiles dirty\n",
+        (unsigned long long)change_stats.unchanged_frames,
+        (unsigned long long)change_stats.frames,
+        change_stats.tiles ? 100.0 * change_stats.dirty_tiles / change_stats.tiles : 0.0);
+    if (has_audio)
+    {
+        printf(
+            "A/V sync: offset %.3fms either way on average, min %.3fms, max %.3fms, %llu frames dropped, %llu repeated\n",
+            sync_stats.mean_abs_offset() / 1e4,
+            sync_stats.offset_min / 1e4,
+            sync_stats.offset_max / 1e4,
+            (unsigned long long)sync_stats.frames_dropped,
+            (unsigned long long)sync_stats.frames_repeated);
+    }
+    if (!items.empty())
+    {
+        printf(
+            "Playlist: %llu items played (%llu failed), %llu switches (%llu waited for priming), switch mean %.3fms max %.3fms, timestamp gap max %.3fms, %llu audio frames padded, %llu trimmed\n",
+            (unsigned long long)playlist_stats.items,
+            (unsigned long long)playlist_stats.failed_opens,
+            (unsigned long long)playlist_stats.switches,
+            (unsigned long long)playlist_stats.switch_waits,
+            playlist_stats.switches ? playlist_stats.switch_time_total / (double)playlist_stats.switches / 1e6 : 0.0,
+            playlist_stats.switch_time_max / 1e6,
+            playlist_stats.timestamp_gap_max / 1e4,
+            (unsigned long long)playlist_stats.audio_frames_padded,
+            (unsigned long long)playlist_stats.audio_frames_trimmed);
+    }
+    else if (loop || seeking_config.start_at > 0)
+    {
+        printf(
+            "Seeking: %llu seeks (%llu loops, %llu failed), %llu frames skipped, %llu audio frames trimmed, %llu padded\n",
+            (unsigned long long)seeking_stats.seeks,
+            (unsigned long long)seeking_stats.loops,
+            (unsigned long long)seeking_stats.failed_seeks,
+            (unsigned long long)seeking_stats.frames_skipped,
+            (unsigned long long)seeking_stats.audio_frames_trimmed,
+            (unsigned long long)seeking_stats.audio_frames_padded);
+    }
+    auto executor_stats = executor.stats();
+    printf(
+        "Executor: %zu workers, %llu steps, %llu stolen, mean lateness %.3fms, max %.3fms\n",
+        executor.worker_count(),
+        (unsigned long long)executor_stats.steps,
+        (unsigned long long)executor_stats.steals,
+        executor_stats.mean_lateness().count() / 1e6,
+        executor_stats.max_lateness.count() / 1e6);
+    auto close_stats = closes.snapshot();
+    printf(
+        "Close: %llu streams closed, mean %.3fms, max %.3fms; producer stopped in %.3fms\n",
+        (unsigned long long)close_stats.closes,
+        close_stats.mean_latency().count() / 1e6,
+        close_stats.max_latency.count() / 1e6,
+        std::chrono::duration<double, std::milli>(producer_latency).count());
+    auto pacing = producer_metrics.pacing_error.snapshot();
+    auto reads = producer_metrics.read_video.snapshot();
+    metrics::HistogramSnapshot submits;
+    metrics::HistogramSnapshot first_frames;
+    for (auto& sink : sinks)
+    {
+        submits.merge(sink.measured->submit_video.snapshot());
+        first_frames.merge(sink.measured->first_frame.snapshot());
+    }
+    printf(
+        "Latency p50/p99/p99.9: pacing error %.3f/%.3f/%.3fms, frame read %.3f/%.3f/%.3fms, submit %.1f/%.1f/%.1fus, first frame %.3f/%.3f/%.3fms\n",
+        pacing.percentile(0.5) / 1e6,
+        pacing.percentile(0.99) / 1e6,
+        pacing.percentile(0.999) / 1e6,
+        reads.percentile(0.5) / 1e6,
+        reads.percentile(0.99) / 1e6,
+        reads.percentile(0.999) / 1e6,
+        submits.percentile(0.5) / 1e3,
+        submits.percentile(0.99) / 1e3,
+        submits.percentile(0.999) / 1e3,
+        first_frames.percentile(0.5) / 1e6,
+        first_frames.percentile(0.99) / 1e6,
+        first_frames.percentile(0.999) / 1e6);
+    printf("CPU: %.3fs over %.3fs wall, %.2f%% of a core per stream\n", cpu, wall, 100.0 * cpu / wall / stream_count);
+
+    return 0;
+}
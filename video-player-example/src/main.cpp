@@ -18,20 +18,40 @@
 #include <mferror.h>
 #include <mfplay.h>
 #include <mfreadwrite.h>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <unordered_set>
-#include <wmcodecdsp.h>
 
 #include <d3d11.h>
 #include <d3d11_4.h>
 
+#include "async_log.h"
+#include "audio_packetizer.h"
+#include "av_sync.h"
+#include "color_convert.h"
+#include "frame_cache.h"
+#include "frame_changes.h"
+#include "frame_source.h"
+#include "metrics.h"
+#include "pacer.h"
+#include "pcm_ring.h"
+#include "player_loop.h"
+#include "player_metrics.h"
+#include "playlist.h"
+#include "raw_media.h"
+#include "resampler.h"
+#include "scaler.h"
+#include "seek_index.h"
+#include "session_pool.h"
+#include "stream_executor.h"
+#include "stream_lifecycle.h"
+
 #pragma comment(lib, "mf.lib")
 #pragma comment(lib, "mfplat.lib")
 #pragma comment(lib, "mfplay.lib")
 #pragma comment(lib, "mfreadwrite.lib")
 #pragma comment(lib, "mfuuid.lib")
-#pragma comment(lib, "wmcodecdspuuid.lib")
 
 #pragma comment(lib, "d3d11")
 #pragma comment(lib, "d3dcompiler")
@@ -42,6 +62,46 @@ DEFINE_ENUM_FLAG_OPERATORS(D3D11_CREATE_DEVICE_FLAG);
 
 constexpr auto AUDIO_SAMPLE_RATE = 44100u;
 
+// Most stereo frames resampled per audio_frame call
+constexpr auto RESAMPLED_CHUNK_FRAMES = 1024u;
+
+// Filter length of the resampler; Best is comparable to the resampler MFT this replaced
+constexpr auto AUDIO_RESAMPLER_QUALITY = audio::ResamplerQuality::Best;
+
+// How far ahead of the stream audio is resampled (half a second)
+constexpr auto AUDIO_RING_FRAMES = AUDIO_SAMPLE_RATE / 2;
+
+// Decoded video frames kept queued ahead of the producer
+constexpr auto DECODE_AHEAD_FRAMES = 4u;
+
+// Longest the producer waits between audio submissions, in 100ns units (10ms)
+constexpr LONGLONG AUDIO_DRAIN_INTERVAL = 100000;
+
+// Duration of every audio packet submitted to a stream
+constexpr auto AUDIO_PACKET_MS = 20u;
+
+// Most disk the frame cache may use before evicting least recently played media
+constexpr uint64_t FRAME_CACHE_BUDGET = 16ull << 30;
+
+// Longest a stream goes without a frame while the picture doesn't change, in
+// 100ns units (1s); unchanged frames in between aren't submitted
+constexpr LONGLONG FRAME_KEEP_ALIVE = 10000000;
+
+/// @brief Join the calling thread to COM's multithreaded apartment, once.
+/// Threads that open media may call this more than once; the thread-local
+/// guard only skips the repeated CoInitializeEx calls on the same thread.
+/// (A repeat would return S_FALSE, which SUCCEEDED accepts but this file's
+/// WI_VERIFY_SUCCEEDED, a check for S_OK exactly, does not.)
+inline void initialize_com()
+{
+    thread_local auto initialized = false;
+    if (!initialized)
+    {
+        WI_VERIFY_SUCCEEDED(CoInitializeEx(nullptr, COINIT_DISABLE_OLE1DDE));
+        initialized = true;
+    }
+}
+
 namespace dx
 {
     winrt::com_ptr<ID3D11Device> create_device()
@@ -120,6 +180,91 @@ namespace dx
 
         return texture;
     }
+
+    /// @brief Copy a BGRA texture into CPU memory, rows tightly packed
+    /// @param texture Keyed mutex texture to read
+    /// @param staging CPU readable copy of the texture, created on first use
+    /// @param output Receives width * height * 4 bytes
+    void read_texture(
+        const winrt::com_ptr<ID3D11Texture2D>& texture,
+        winrt::com_ptr<ID3D11Texture2D>& staging,
+        std::vector<uint8_t>& output)
+    {
+        D3D11_TEXTURE2D_DESC desc = {};
+        texture->GetDesc(&desc);
+
+        winrt::com_ptr<ID3D11Device> device;
+        winrt::com_ptr<ID3D11DeviceContext> context;
+        texture->GetDevice(device.put());
+        device->GetImmediateContext(context.put());
+
+        if (!staging)
+        {
+            auto staging_desc = desc;
+            staging_desc.Usage = D3D11_USAGE_STAGING;
+            staging_desc.BindFlags = 0;
+            staging_desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+            staging_desc.MiscFlags = 0;
+            WI_VERIFY_SUCCEEDED(device->CreateTexture2D(&staging_desc, nullptr, staging.put()));
+        }
+
+        winrt::com_ptr<IDXGIKeyedMutex> mutex;
+        WI_VERIFY_SUCCEEDED(texture->QueryInterface(IID_PPV_ARGS(mutex.put())));
+        WI_VERIFY_SUCCEEDED(mutex->AcquireSync(0, INFINITE));
+        context->CopyResource(staging.get(), texture.get());
+        WI_VERIFY_SUCCEEDED(mutex->ReleaseSync(0));
+
+        D3D11_MAPPED_SUBRESOURCE mapped = {};
+        WI_VERIFY_SUCCEEDED(context->Map(staging.get(), 0, D3D11_MAP_READ, 0, &mapped));
+
+        auto row_bytes = (size_t)desc.Width * 4;
+        output.resize(row_bytes * desc.Height);
+        for (uint32_t y = 0; y < desc.Height; y++)
+            memcpy(output.data() + y * row_bytes, (const uint8_t*)mapped.pData + (size_t)y * mapped.RowPitch, row_bytes);
+
+        context->Unmap(staging.get(), 0);
+    }
+
+    /// @brief Upload tightly packed BGRA pixels into a texture, unless
+    /// something (e.g. an encoder) holds it. Doesn't wait.
+    /// @param texture Keyed mutex texture to write
+    /// @param pixels width * height * 4 bytes
+    /// @return false, without writing, if the texture's keyed mutex is held
+    bool write_texture(const winrt::com_ptr<ID3D11Texture2D>& texture, const uint8_t* pixels)
+    {
+        D3D11_TEXTURE2D_DESC desc = {};
+        texture->GetDesc(&desc);
+
+        winrt::com_ptr<ID3D11Device> device;
+        winrt::com_ptr<ID3D11DeviceContext> context;
+        texture->GetDevice(device.put());
+        device->GetImmediateContext(context.put());
+
+        winrt::com_ptr<IDXGIKeyedMutex> mutex;
+        WI_VERIFY_SUCCEEDED(texture->QueryInterface(IID_PPV_ARGS(mutex.put())));
+        auto acquired = mutex->AcquireSync(0, 0);
+        if (acquired == (HRESULT)WAIT_TIMEOUT)
+            return false;
+        WI_VERIFY_SUCCEEDED(acquired);
+
+        context->UpdateSubresource(texture.get(), 0, nullptr, pixels, desc.Width * 4, 0);
+        WI_VERIFY_SUCCEEDED(mutex->ReleaseSync(0));
+        return true;
+    }
+
+    /// @brief Whether nothing (e.g. an encoder) holds a texture's keyed mutex
+    /// right now. Doesn't wait. Only a hint: the texture can be taken again
+    /// before it is written, which the write finds out for itself.
+    bool texture_available(const winrt::com_ptr<ID3D11Texture2D>& texture)
+    {
+        winrt::com_ptr<IDXGIKeyedMutex> mutex;
+        WI_VERIFY_SUCCEEDED(texture->QueryInterface(IID_PPV_ARGS(mutex.put())));
+        if (mutex->AcquireSync(0, 0) != S_OK)
+            return false;
+
+        WI_VERIFY_SUCCEEDED(mutex->ReleaseSync(0));
+        return true;
+    }
 } // namespace dx
 
 namespace mf
@@ -157,7 +302,7 @@ namespace mf
     /// @param resampler Resampler
     void debug_audio_format(
         winrt::com_ptr<IMFSourceReader>& source_reader,
-        winrt::com_ptr<IMFTransform>& resampler)
+        const audio::Resampler& resampler)
     {
         winrt::com_ptr<IMFMediaType> native_type = nullptr;
         winrt::com_ptr<IMFMediaType> first_output = nullptr;
@@ -195,35 +340,12 @@ namespace mf
 
         printf("AO: c:%d sps:%d bps:%d ba:%d aps:%d\n", channels, samples_per_sec, bits_per_sample, block_align, avg_per_sec);
 
-        winrt::com_ptr<IMFMediaType> resampler_input = nullptr;
-        winrt::com_ptr<IMFMediaType> resamper_output = nullptr;
-
-        WI_VERIFY_SUCCEEDED(
-            resampler->GetInputCurrentType(0, resampler_input.put()));
-
-        WI_VERIFY_SUCCEEDED(
-            resampler->GetOutputCurrentType(0, resamper_output.put()));
-
-        WI_VERIFY_SUCCEEDED(resampler_input->GetUINT32(MF_MT_AUDIO_NUM_CHANNELS, &channels));
-        WI_VERIFY_SUCCEEDED(resampler_input->GetUINT32(MF_MT_AUDIO_SAMPLES_PER_SECOND, &samples_per_sec));
-        WI_VERIFY_SUCCEEDED(resampler_input->GetUINT32(MF_MT_AUDIO_BITS_PER_SAMPLE, &bits_per_sample));
-        WI_VERIFY_SUCCEEDED(resampler_input->GetUINT32(MF_MT_AUDIO_BLOCK_ALIGNMENT, &block_align));
-        WI_VERIFY_SUCCEEDED(resampler_input->GetUINT32(MF_MT_AUDIO_AVG_BYTES_PER_SECOND, &avg_per_sec));
-
-        printf("RI: c:%d sps:%d bps:%d ba:%d aps:%d\n", channels, samples_per_sec, bits_per_sample, block_align, avg_per_sec);
-
-        WI_VERIFY_SUCCEEDED(resamper_output->GetUINT32(MF_MT_AUDIO_NUM_CHANNELS, &channels));
-        WI_VERIFY_SUCCEEDED(resamper_output->GetUINT32(MF_MT_AUDIO_SAMPLES_PER_SECOND, &samples_per_sec));
-        WI_VERIFY_SUCCEEDED(resamper_output->GetUINT32(MF_MT_AUDIO_BITS_PER_SAMPLE, &bits_per_sample));
-        WI_VERIFY_SUCCEEDED(resamper_output->GetUINT32(MF_MT_AUDIO_BLOCK_ALIGNMENT, &block_align));
-        WI_VERIFY_SUCCEEDED(resamper_output->GetUINT32(MF_MT_AUDIO_AVG_BYTES_PER_SECOND, &avg_per_sec));
-
-        printf("RO: c:%d sps:%d bps:%d ba:%d aps:%d\n", channels, samples_per_sec, bits_per_sample, block_align, avg_per_sec);
+        printf("RO: c:%d sps:%d taps:%zu\n", resampler.channels(), resampler.output_rate(), resampler.filter_length());
     }
 
     void debug_media_format(
         winrt::com_ptr<IMFSourceReader>& source_reader,
-        winrt::com_ptr<IMFTransform>& resampler)
+        const audio::Resampler& resampler)
     {
         debug_video_format(source_reader);
         debug_audio_format(source_reader, resampler);
@@ -233,15 +355,26 @@ namespace mf
     {
         winrt::com_ptr<IMFMediaSource> source;
         winrt::com_ptr<IMFSourceReader> source_reader;
-        winrt::com_ptr<IMFTransform> resampler;
         winrt::com_ptr<IMFDXGIDeviceManager> device_manager;
+        /// @brief Rate and channel count of the 16-bit PCM the source reader outputs
+        uint32_t audio_rate;
+        uint16_t audio_channels;
+        /// @brief Size of the output frames
+        uint32_t width;
+        uint32_t height;
+        /// @brief Where the decoded picture goes in each output frame
+        scale::Rect picture;
+        /// @brief Length of the media in 100ns units, or 0 if the source doesn't say
+        int64_t duration;
     };
 
     /// @brief Open a media file (.mp4)
     /// @param device Device to initialise media foundation source reader with
     /// @param utf8_filename filename to open
+    /// @param output_width Width of the output frames, or 0 for the source's own size
+    /// @param output_height Height of the output frames, or 0 for the source's own size
     /// @return result of opening the media file
-    OpenMediaResult open_media(winrt::com_ptr<ID3D11Device>& device, const char* utf8_filename)
+    OpenMediaResult open_media(winrt::com_ptr<ID3D11Device>& device, const char* utf8_filename, uint32_t output_width, uint32_t output_height)
     {
         // Make sure that MF is loaded
         WI_VERIFY_SUCCEEDED(MFStartup(MF_VERSION, MFSTARTUP_NOSOCKET));
@@ -294,10 +427,33 @@ namespace mf
         winrt::com_ptr<IMFSourceReader> source_reader = nullptr;
         WI_VERIFY_SUCCEEDED(MFCreateSourceReaderFromMediaSource(source.get(), source_attributes.get(), source_reader.put()));
 
+        // Negotiate the output from the source's frame size: sources that don't fit
+        // the requested output are shrunk by the video processor to fit inside it,
+        // and the rest of the output is letterboxed
+        winrt::com_ptr<IMFMediaType> native_video_type = nullptr;
+        WI_VERIFY_SUCCEEDED(
+            source_reader->GetNativeMediaType(
+                (DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM,
+                MF_SOURCE_READER_CURRENT_TYPE_INDEX,
+                native_video_type.put()));
+
+        uint32_t source_width = 0, source_height = 0;
+        WI_VERIFY_SUCCEEDED(MFGetAttributeSize(native_video_type.get(), MF_MT_FRAME_SIZE, &source_width, &source_height));
+        if (output_width == 0 || output_height == 0)
+        {
+            output_width = source_width;
+            output_height = source_height;
+        }
+        auto picture = scale::fit(source_width, source_height, output_width, output_height);
+
         winrt::com_ptr<IMFMediaType> video_type = nullptr;
         WI_VERIFY_SUCCEEDED(MFCreateMediaType(video_type.put()));
         WI_VERIFY_SUCCEEDED(video_type->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video));
         WI_VERIFY_SUCCEEDED(video_type->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_ARGB32));
+        if (picture.width != source_width || picture.height != source_height)
+        {
+            WI_VERIFY_SUCCEEDED(MFSetAttributeSize(video_type.get(), MF_MT_FRAME_SIZE, picture.width, picture.height));
+        }
 
         WI_VERIFY_SUCCEEDED(
             source_reader->SetCurrentMediaType(
@@ -311,91 +467,188 @@ namespace mf
 
         WI_VERIFY_SUCCEEDED(source_output_audio_type->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Audio));
         WI_VERIFY_SUCCEEDED(source_output_audio_type->SetGUID(MF_MT_SUBTYPE, MFAudioFormat_PCM));
-
-        WI_VERIFY_SUCCEEDED(source_reader->SetCurrentMediaType(MF_SOURCE_READER_FIRST_AUDIO_STREAM, nullptr, source_output_audio_type.get()));
+        WI_VERIFY_SUCCEEDED(source_output_audio_type->SetUINT32(MF_MT_AUDIO_BITS_PER_SAMPLE, 16));
+
+        // Stereo is all a stream carries, so have the decoder downmix to it
+        // (as the resampler MFT this replaced was asked to) rather than
+        // resample channels that are then dropped. A decoder that can't keeps
+        // its own channels, and all but the first two are dropped before resampling.
+        WI_VERIFY_SUCCEEDED(source_output_audio_type->SetUINT32(MF_MT_AUDIO_NUM_CHANNELS, 2));
+        if (FAILED(source_reader->SetCurrentMediaType(MF_SOURCE_READER_FIRST_AUDIO_STREAM, nullptr, source_output_audio_type.get())))
+        {
+            WI_VERIFY_SUCCEEDED(source_output_audio_type->DeleteItem(MF_MT_AUDIO_NUM_CHANNELS));
+            WI_VERIFY_SUCCEEDED(source_reader->SetCurrentMediaType(MF_SOURCE_READER_FIRST_AUDIO_STREAM, nullptr, source_output_audio_type.get()));
+        }
         // we grab the type back out of the output so that it populates the other properties that we want
         source_output_audio_type = nullptr;
         WI_VERIFY_SUCCEEDED(source_reader->GetCurrentMediaType(MF_SOURCE_READER_FIRST_AUDIO_STREAM, source_output_audio_type.put()));
 
-        // Set up resamplers' output type
-        winrt::com_ptr<IMFMediaType> resampler_output_type = nullptr;
-        WI_VERIFY_SUCCEEDED(MFCreateMediaType(resampler_output_type.put()));
-
-        WI_VERIFY_SUCCEEDED(resampler_output_type->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Audio));
-        WI_VERIFY_SUCCEEDED(resampler_output_type->SetGUID(MF_MT_SUBTYPE, MFAudioFormat_PCM));
-        WI_VERIFY_SUCCEEDED(resampler_output_type->SetUINT32(MF_MT_AUDIO_NUM_CHANNELS, 2));
-        WI_VERIFY_SUCCEEDED(resampler_output_type->SetUINT32(MF_MT_AUDIO_SAMPLES_PER_SECOND, AUDIO_SAMPLE_RATE));
-        WI_VERIFY_SUCCEEDED(resampler_output_type->SetUINT32(MF_MT_AUDIO_BLOCK_ALIGNMENT, 4));
-        WI_VERIFY_SUCCEEDED(resampler_output_type->SetUINT32(MF_MT_AUDIO_AVG_BYTES_PER_SECOND, AUDIO_SAMPLE_RATE * 4));
-        WI_VERIFY_SUCCEEDED(resampler_output_type->SetUINT32(MF_MT_AUDIO_BITS_PER_SAMPLE, 16));
-        WI_VERIFY_SUCCEEDED(resampler_output_type->SetUINT32(MF_MT_ALL_SAMPLES_INDEPENDENT, TRUE));
-
-        // Create our resampler (takes audio in arbitrary formats and converts to AUDIO_SAMPLE_RATEhz PCM)
-        winrt::com_ptr<IUnknown> resampler_unknown = nullptr;
-        winrt::com_ptr<IMFTransform> resampler = nullptr;
-        WI_VERIFY_SUCCEEDED(CoCreateInstance(CLSID_CResamplerMediaObject, nullptr, CLSCTX_INPROC_SERVER, IID_IUnknown, (void**)resampler_unknown.put()));
-        WI_VERIFY_SUCCEEDED(resampler_unknown->QueryInterface(IID_PPV_ARGS(resampler.put())));
-        winrt::com_ptr<IWMResamplerProps> resampler_props = nullptr;
-        WI_VERIFY_SUCCEEDED(resampler_unknown->QueryInterface(IID_PPV_ARGS(resampler_props.put())));
-        resampler_props->SetHalfFilterLength(60);
-
-        // Setup the resamplers input and output types to match our source on one end
-        // and desktopcapture on the other
-        resampler->SetInputType(0, source_output_audio_type.get(), 0);
-        resampler->SetOutputType(0, resampler_output_type.get(), 0);
-
-        WI_VERIFY_SUCCEEDED(resampler->ProcessMessage(MFT_MESSAGE_COMMAND_FLUSH, 0));
-        WI_VERIFY_SUCCEEDED(resampler->ProcessMessage(MFT_MESSAGE_NOTIFY_BEGIN_STREAMING, 0));
-        WI_VERIFY_SUCCEEDED(resampler->ProcessMessage(MFT_MESSAGE_NOTIFY_START_OF_STREAM, 0));
+        // The decoded PCM is resampled to AUDIO_SAMPLE_RATEhz by our own resampler
+        uint32_t audio_rate = 0;
+        uint32_t audio_channels = 0;
+        WI_VERIFY_SUCCEEDED(source_output_audio_type->GetUINT32(MF_MT_AUDIO_SAMPLES_PER_SECOND, &audio_rate));
+        WI_VERIFY_SUCCEEDED(source_output_audio_type->GetUINT32(MF_MT_AUDIO_NUM_CHANNELS, &audio_channels));
+
+        int64_t duration = 0;
+        PROPVARIANT duration_value;
+        PropVariantInit(&duration_value);
+        if (SUCCEEDED(source_reader->GetPresentationAttribute((DWORD)MF_SOURCE_READER_MEDIASOURCE, MF_PD_DURATION, &duration_value)) && duration_value.vt == VT_UI8)
+            duration = (int64_t)duration_value.uhVal.QuadPart;
+        PropVariantClear(&duration_value);
 
         return OpenMediaResult {
             source,
             source_reader,
-            resampler,
             device_manager,
+            audio_rate,
+            (uint16_t)audio_channels,
+            output_width,
+            output_height,
+            picture,
+            duration,
         };
     }
+
+    /// @brief Find the keyframes of a media file by reading its compressed
+    /// video samples, without decoding any of them
+    /// @param utf8_filename filename to index
+    /// @param index index to fill
+    /// @return false if the file has no video keyframes
+    bool build_seek_index(const char* utf8_filename, seek::SeekIndex& index)
+    {
+        WI_VERIFY_SUCCEEDED(MFStartup(MF_VERSION, MFSTARTUP_NOSOCKET));
+
+        wchar_t filename[256];
+        mbstowcs(filename, utf8_filename, sizeof(filename) / sizeof(wchar_t));
+
+        winrt::com_ptr<IMFSourceReader> source_reader = nullptr;
+        if (FAILED(MFCreateSourceReaderFromURL(filename, nullptr, source_reader.put())))
+            return false;
+
+        // Only the video stream, left in its native type so nothing is decoded
+        WI_VERIFY_SUCCEEDED(source_reader->SetStreamSelection((DWORD)MF_SOURCE_READER_ALL_STREAMS, FALSE));
+        WI_VERIFY_SUCCEEDED(source_reader->SetStreamSelection((DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM, TRUE));
+
+        std::vector<int64_t> timestamps;
+        std::vector<int64_t> clean_points;
+        while (true)
+        {
+            DWORD flags = 0;
+            LONGLONG timestamp = 0;
+            winrt::com_ptr<IMFSample> sample = nullptr;
+            WI_VERIFY_SUCCEEDED(
+                source_reader->ReadSample(
+                    (DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM,
+                    0,
+                    nullptr,
+                    &flags,
+                    &timestamp,
+                    sample.put()));
+
+            if (sample)
+            {
+                LONGLONG duration = 0;
+                sample->GetSampleDuration(&duration);
+                index.duration = std::max<int64_t>(index.duration, timestamp + duration);
+
+                timestamps.push_back(timestamp);
+                if (MFGetAttributeUINT32(sample.get(), MFSampleExtension_CleanPoint, FALSE))
+                    clean_points.push_back(timestamp);
+            }
+
+            if (flags & MF_SOURCE_READERF_ENDOFSTREAM)
+                break;
+        }
+
+        // Compressed samples arrive in decode order; a keyframe's frame number
+        // is its place in presentation order, which is the order they play in
+        std::sort(timestamps.begin(), timestamps.end());
+        std::sort(clean_points.begin(), clean_points.end());
+        for (auto timestamp : clean_points)
+        {
+            auto frame = std::lower_bound(timestamps.begin(), timestamps.end(), timestamp) - timestamps.begin();
+            index.keyframes.push_back(source::SeekPoint {timestamp, (uint64_t)frame});
+        }
+        index.frame_count = timestamps.size();
+        return !index.keyframes.empty();
+    }
 } // namespace mf
 
 struct Media
 {
-    // winrt::com_ptr<IUnknown> unknown_resampler;
-    winrt::com_ptr<IMFTransform> resampler;
+    // Converts the decoded PCM to AUDIO_SAMPLE_RATEhz, in at most two channels
+    audio::Resampler resampler;
     winrt::com_ptr<IMFSourceReader> source_reader;
 
     winrt::com_ptr<IMFDXGIDeviceManager> device_manager;
     HANDLE device_handle;
 
-    LONGLONG cur_time = 0;
+    // Channels of the decoded PCM; more than the resampler's when the decoder
+    // couldn't downmix, and the rest are dropped before resampling
+    uint16_t audio_channels = 2;
+
+    // Where decoded pictures are copied to in the output textures
+    scale::Rect picture;
+
+    // Times ReadSample and the copy out, when set
+    player::ProducerMetrics* measured = nullptr;
+
     LONGLONG video_timestamp = 0;
     LONGLONG audio_timestamp = 0;
-
-    /// @brief Maybe get a video frame
+    bool video_ended = false;
+    bool audio_ended = false;
+
+    // A decoded sample whose output texture was busy, copied by the next
+    // video_frame call instead of reading another
+    winrt::com_ptr<IMFSample> held_video;
+
+    // After a seek, audio before this time is dropped: the source reader
+    // restarts audio at the sample holding the seek position, not at it
+    LONGLONG audio_seek_to = -1;
+
+    // Gaps (positive) and overlaps in the audio's sample times since the last
+    // seek. Audio after a gap plays that much ahead of where its position
+    // puts it, as nothing fills the gap.
+    LONGLONG audio_gaps = 0;
+    // Where the current unbroken run of audio started, and its length so far
+    // in input frames, to tell where the next sample should start
+    LONGLONG audio_run_start = -1;
+    uint64_t audio_run_frames = 0;
+
+    // Reused by every audio_frame call so audio doesn't allocate
+    std::vector<int16_t> resampled;
+    std::vector<int16_t> stereo;
+
+    /// @brief Decode the next video frame
     /// @param output texture to copy frame into
-    /// @return whether a sample was copied
+    /// @return whether a sample was copied; when `output` was busy, the sample
+    /// is left in `held_video`. False with neither a sample held nor the
+    /// stream ended when the read gave no sample (a stream tick).
     bool video_frame(winrt::com_ptr<ID3D11Texture2D>& output)
     {
-        if (cur_time < video_timestamp)
-            return false;
-
         DWORD flags = 0;
-        winrt::com_ptr<IMFSample> sample = nullptr;
-
-        WI_VERIFY_SUCCEEDED(
-            source_reader->ReadSample(
-                MF_SOURCE_READER_FIRST_VIDEO_STREAM,
-                0,
-                nullptr,
-                &flags,
-                &video_timestamp,
-                sample.put()));
-
-        // Not sure we have to care about flags...
+        winrt::com_ptr<IMFSample> sample = std::move(held_video);
 
         if (!sample)
-            return false;
-
-        WI_VERIFY_SUCCEEDED(sample->SetSampleTime(video_timestamp));
+        {
+            auto timer = metrics::ScopedTimer {measured ? &measured->read_sample : nullptr};
+            WI_VERIFY_SUCCEEDED(
+                source_reader->ReadSample(
+                    MF_SOURCE_READER_FIRST_VIDEO_STREAM,
+                    0,
+                    nullptr,
+                    &flags,
+                    &video_timestamp,
+                    sample.put()));
+
+            if (flags & MF_SOURCE_READERF_ENDOFSTREAM)
+                video_ended = true;
+
+            if (!sample)
+                return false;
+
+            WI_VERIFY_SUCCEEDED(sample->SetSampleTime(video_timestamp));
+        }
 
         // Extract the texture and subresource from the media buffer.
         winrt::com_ptr<IMFMediaBuffer> media_buffer = nullptr;
@@ -424,24 +677,39 @@ struct Media
         winrt::com_ptr<IDXGIKeyedMutex> input_mutex;
         winrt::com_ptr<IDXGIKeyedMutex> output_mutex;
 
+        // The output is taken without waiting, right where it is written: an
+        // encoder can still hold it however free it looked when it was handed
+        // out, and then the sample is kept for another texture
+        if (out_desc.MiscFlags & D3D11_RESOURCE_MISC_SHARED_KEYEDMUTEX)
+        {
+            WI_VERIFY_SUCCEEDED(output->QueryInterface(IID_PPV_ARGS(output_mutex.put())));
+            auto acquired = output_mutex->AcquireSync(0, 0);
+            if (acquired == (HRESULT)WAIT_TIMEOUT)
+            {
+                held_video = std::move(sample);
+                return false;
+            }
+            WI_VERIFY_SUCCEEDED(acquired);
+        }
         if (in_desc.MiscFlags & D3D11_RESOURCE_MISC_SHARED_KEYEDMUTEX)
         {
             WI_VERIFY_SUCCEEDED(texture->QueryInterface(IID_PPV_ARGS(input_mutex.put())));
             WI_VERIFY_SUCCEEDED(input_mutex->AcquireSync(0, INFINITE));
         }
-        if (out_desc.MiscFlags & D3D11_RESOURCE_MISC_SHARED_KEYEDMUTEX)
-        {
-            WI_VERIFY_SUCCEEDED(output->QueryInterface(IID_PPV_ARGS(output_mutex.put())));
-            WI_VERIFY_SUCCEEDED(output_mutex->AcquireSync(0, INFINITE));
-        }
 
         winrt::com_ptr<ID3D11Device> device;
         winrt::com_ptr<ID3D11DeviceContext> context;
         texture->GetDevice(device.put());
         device->GetImmediateContext(context.put());
 
-        auto box = D3D11_BOX {0, 0, 0, out_desc.Width, out_desc.Height, 1};
-        context->CopySubresourceRegion(output.get(), 0, 0, 0, 0, texture.get(), subresource_index, &box);
+        // Copy the picture (never more than the decoder produced) to its place in
+        // the output; decoded textures are often padded past the picture
+        auto box = D3D11_BOX {0, 0, 0, std::min(in_desc.Width, picture.width), std::min(in_desc.Height, picture.height), 1};
+        {
+            // Only the submission of the copy; the GPU does it later
+            auto timer = metrics::ScopedTimer {measured ? &measured->copy : nullptr};
+            context->CopySubresourceRegion(output.get(), 0, picture.x, picture.y, 0, texture.get(), subresource_index, &box);
+        }
 
         if (input_mutex)
         {
@@ -454,6 +722,36 @@ struct Media
         return true;
     }
 
+    /// @brief Decode the next video frame and throw it away, for when there is
+    /// no texture free to copy it into
+    /// @return whether a sample was read
+    bool skip_video_frame()
+    {
+        // One held back for a busy texture is the next frame
+        if (held_video)
+        {
+            held_video = nullptr;
+            return true;
+        }
+
+        DWORD flags = 0;
+        winrt::com_ptr<IMFSample> sample = nullptr;
+
+        WI_VERIFY_SUCCEEDED(
+            source_reader->ReadSample(
+                MF_SOURCE_READER_FIRST_VIDEO_STREAM,
+                0,
+                nullptr,
+                &flags,
+                &video_timestamp,
+                sample.put()));
+
+        if (flags & MF_SOURCE_READERF_ENDOFSTREAM)
+            video_ended = true;
+
+        return sample != nullptr;
+    }
+
     struct AudioSampleResult
     {
         winrt::com_ptr<IMFSample> sample;
@@ -477,6 +775,9 @@ struct Media
                 &result.time,
                 sample.put()));
 
+        if (flags & MF_SOURCE_READERF_ENDOFSTREAM)
+            audio_ended = true;
+
         if (sample)
         {
             WI_VERIFY_SUCCEEDED(sample->SetSampleTime(result.time));
@@ -487,175 +788,980 @@ struct Media
         return result;
     }
 
-    /// @brief Get an audio frame
-    /// @param output buffer to copy frame into
-    void audio_frame(std::vector<uint8_t>& output)
+    /// @brief Resample the next chunk of audio into a ring
+    /// @param output ring to write the resampled PCM into, which must have room
+    /// for at least RESAMPLED_CHUNK_FRAMES frames
+    /// @return whether any audio was produced
+    bool audio_frame(audio::PcmRing& output)
     {
-        if (cur_time < audio_timestamp)
-            return;
+        auto channels = resampler.channels();
+        resampled.resize((size_t)RESAMPLED_CHUNK_FRAMES * channels);
 
-        // Feed resampler with samples until it will no longer accept data
+        // Feed the resampler a sample at a time until it has a whole chunk of
+        // output, or the source has ended and its tail has been flushed out
+        size_t produced = 0;
         while (true)
         {
-            DWORD status = 0;
-            // Make sure the resampler can take more input before we read and throw away a sample
-            resampler->GetInputStatus(0, &status);
-            if (status != MFT_INPUT_STATUS_ACCEPT_DATA)
+            produced += resampler.pull(resampled.data() + produced * channels, RESAMPLED_CHUNK_FRAMES - produced);
+            if (produced == RESAMPLED_CHUNK_FRAMES || audio_ended)
                 break;
 
             auto sample = audio_sample();
-            if (sample.sample == nullptr)
-                break;
-
-            WI_VERIFY_SUCCEEDED(resampler->ProcessInput(0, sample.sample.get(), 0));
+            if (sample.sample != nullptr)
+            {
+                winrt::com_ptr<IMFMediaBuffer> buffer = nullptr;
+                WI_VERIFY_SUCCEEDED(sample.sample->ConvertToContiguousBuffer(buffer.put()));
+
+                uint8_t* begin = nullptr;
+                DWORD len = 0;
+                WI_VERIFY_SUCCEEDED(buffer->Lock(&begin, nullptr, &len));
+                auto frames = (size_t)(len / sizeof(int16_t) / audio_channels);
+                size_t early = 0;
+                if (audio_seek_to > sample.time)
+                    early = std::min(frames, (size_t)((audio_seek_to - sample.time) * resampler.input_rate() / 10000000));
+                audio_seek_to = -1;
+
+                auto pcm = (const int16_t*)begin + early * audio_channels;
+                if (audio_channels > channels)
+                {
+                    stereo.resize((frames - early) * channels);
+                    for (size_t i = 0; i < frames - early; i++)
+                        for (uint16_t c = 0; c < channels; c++)
+                            stereo[i * channels + c] = pcm[i * audio_channels + c];
+                    pcm = stereo.data();
+                }
+                resampler.push(pcm, frames - early);
+                buffer->Unlock();
+
+                note_audio_run(sample.time, early, frames);
+                audio_timestamp = sample.time;
+            }
+
+            if (audio_ended)
+                resampler.flush();
         }
 
-        // Create a media buffer and a sample for the resampler
-        // to output data into
-        winrt::com_ptr<IMFMediaBuffer> buffer;
-        auto output_buffer = MFT_OUTPUT_DATA_BUFFER {};
-        memset(&output_buffer, 0, sizeof(MFT_OUTPUT_DATA_BUFFER));
-        WI_VERIFY_SUCCEEDED(MFCreateSample(&output_buffer.pSample));
-        WI_VERIFY_SUCCEEDED(MFCreateMemoryBuffer(1024, buffer.put()));
-        WI_VERIFY_SUCCEEDED(output_buffer.pSample->AddBuffer(buffer.get()));
-        output_buffer.dwStreamID = 0;
-        output_buffer.pEvents = nullptr;
-        output_buffer.dwStatus = 0;
-
-        DWORD status = 0;
-        WI_VERIFY_SUCCEEDED(resampler->ProcessOutput(0, 1, &output_buffer, &status));
-        auto sample = output_buffer.pSample;
-
-        // Use the resampled output time as the new timestamp
-        WI_VERIFY_SUCCEEDED(sample->GetSampleTime(&audio_timestamp));
+        output.write(resampled.data(), produced, channels);
+        return produced > 0;
+    }
 
-        winrt::com_ptr<IMFMediaBuffer> media_buffer = nullptr;
-        WI_VERIFY_SUCCEEDED(sample->ConvertToContiguousBuffer(media_buffer.put()));
-        sample->Release();
-
-        uint8_t* begin = nullptr;
-        DWORD len = 0;
-        WI_VERIFY_SUCCEEDED(media_buffer->Lock(&begin, nullptr, &len));
-        output.resize(len, 0);
-        memcpy(output.data(), begin, len);
-        media_buffer->Unlock();
-    }
-
-    /// @brief Get media frames if they are ready
-    /// @param elapsed How much time has elapsed since the last frame
-    /// @param output_audio Output buffer for audio
-    /// @param output_texture Output texture for video
-    /// @param produced_audio Whether a texture has been produced
-    void frame(
-        LONGLONG elapsed,
-        std::vector<uint8_t>& output_audio,
-        winrt::com_ptr<ID3D11Texture2D>& output_texture,
-        bool& produced_video)
-    {
-        cur_time += elapsed;
-        produced_video = video_frame(output_texture);
-        audio_frame(output_audio);
+    /// @brief Move both streams to `timestamp`, which should be a keyframe's
+    /// @return whether the source reader could seek
+    bool seek(LONGLONG timestamp)
+    {
+        PROPVARIANT position;
+        PropVariantInit(&position);
+        position.vt = VT_I8;
+        position.hVal.QuadPart = timestamp;
+        auto hr = source_reader->SetCurrentPosition(GUID_NULL, position);
+        PropVariantClear(&position);
+        if (FAILED(hr))
+            return false;
+
+        held_video = nullptr;
+        video_ended = false;
+        audio_ended = false;
+        audio_seek_to = timestamp;
+        audio_gaps = 0;
+        audio_run_start = -1;
+        resampler.reset();
+        return true;
+    }
+
+    /// @brief How far the audio resampled so far plays ahead of (or behind,
+    /// when negative) the media time its length says it reaches: gaps in its
+    /// sample times, and the resampler's rate adjustment
+    LONGLONG audio_drift() const { return audio_gaps + resampler.skew(); }
+
+    /// @brief Follow an audio sample of `frames` frames at `time`, the first
+    /// `early` of which were dropped, on from the samples before it
+    void note_audio_run(LONGLONG time, size_t early, size_t frames)
+    {
+        auto rate = (LONGLONG)resampler.input_rate();
+        if (audio_run_start < 0)
+        {
+            audio_run_start = time + (LONGLONG)early * 10000000 / rate;
+            audio_run_frames = frames - early;
+            return;
+        }
+
+        // Sample times are rounded to 100ns, so a sample within a frame of
+        // where the last one ended follows on from it
+        auto expected = audio_run_start + (LONGLONG)(audio_run_frames * 10000000 / rate);
+        auto gap = time - expected;
+        if ((gap < 0 ? -gap : gap) * rate > 10000000)
+        {
+            audio_gaps += gap;
+            audio_run_start = time;
+            audio_run_frames = 0;
+        }
+        audio_run_frames += frames - early;
     }
 };
 
+#include <atomic>
 #include <chrono>
+#include <memory>
 #include <mutex>
 
 #include <cstdio>
+#include <cstring>
 
 #include <rainwaysdk.h>
 
+#include "media_fanout.h"
+
 using namespace rainway;
 
+// The SDK logs at debug level from its media threads, so its messages are
+// handed to a background writer rather than printed where they're logged
+static logging::Logger sdk_log {
+    logging::LoggerConfig {logging::Level::Debug},
+    [](std::string& line, const logging::Record& record) {
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "[RW] (%8s) ", logging::to_string(record.level));
+        line += prefix;
+        line += record.target();
+        line += ": ";
+        line += record.message();
+        line += record.truncated ? "...\n" : "\n";
+    }};
+
 static void log_sink(LogLevel level, const char* target, const char* message)
 {
-    const char* LOG_LEVELS[] = {
-        "silent",
-        "error",
-        "warn",
-        "info",
-        "debug",
-        "trace",
-    };
-    printf("[RW] (%8s) %s: %s\n", LOG_LEVELS[level], target, message);
+    sdk_log.write((logging::Level)level, target, message);
 }
 
-void on_stream_start(
-    rainway::OutboundStream stream,
-    std::string media_path)
+/// @brief A decoded video frame shared between every stream playing the same media
+struct SharedVideoFrame
+{
+    winrt::com_ptr<ID3D11Texture2D> texture;
+    LONGLONG timestamp = 0;
+    // Where MediaFoundation last copied a picture into the texture, with black
+    // around it; empty once anything else has drawn over the whole texture
+    scale::Rect picture;
+    // Id of the picture, the same for frames that show the same pixels; 0 for
+    // decoded frames, which aren't compared
+    uint64_t content = 0;
+};
+
+/// @brief A resampled chunk of AUDIO_SAMPLE_RATE stereo PCM shared between every
+/// stream playing the same media
+struct SharedAudioChunk
 {
-    bool stopped = false;
-    stream.SetCloseHandler([&stopped]() { stopped = true; });
+    std::vector<uint8_t> pcm;
+    LONGLONG timestamp = 0;
+};
 
-    WI_VERIFY_SUCCEEDED(CoInitializeEx(nullptr, COINIT_DISABLE_OLE1DDE));
+using MediaFanout = fanout::MediaFanout<SharedVideoFrame, SharedAudioChunk>;
+using MediaProducer = fanout::SharedProducer<SharedVideoFrame, SharedAudioChunk>;
 
-    auto device = dx::create_device();
-    auto result = mf::open_media(device, media_path.c_str());
-    mf::debug_media_format(result.source_reader, result.resampler);
+// How many decoded items each producer keeps around for slow consumers
+constexpr auto FANOUT_VIDEO_FRAMES = 8u;
+constexpr auto FANOUT_AUDIO_CHUNKS = 64u;
 
-    auto media = Media {
-        result.resampler,
-        result.source_reader,
-        result.device_manager,
-    };
+// Most output textures a producer decodes into: enough for the decode-ahead
+// queue, the fanout ring and a few more still being encoded by streams
+constexpr auto OUTPUT_POOL_FRAMES = DECODE_AHEAD_FRAMES + FANOUT_VIDEO_FRAMES + 4u;
+
+// Joins producers' decode threads once their last stream has gone, so the
+// executor worker that released one carries on with its other streams
+static fanout::Reaper producer_reaper;
+
+// One producer per media path, shared by every stream playing it
+static fanout::ProducerRegistry<SharedVideoFrame, SharedAudioChunk> media_producers;
+
+// Directory decoded media is cached in, or empty to always decode
+static std::string frame_cache_path;
+
+/// @brief Size of the frames sent to a stream
+struct OutputSize
+{
+    uint32_t width = 0;
+    uint32_t height = 0;
+};
+
+// Size of the frames streams are sent; 0 x 0 sends media at its own size
+static OutputSize stream_output;
+
+// Whether media loops and where in it playback starts; both seek through the
+// media's keyframe index
+static seek::SeekingConfig playback;
+
+// Counters and timings of every producer and stream, exported when
+// RAINWAY_EXAMPLES_METRICS is set
+static metrics::Registry metric_registry;
+
+/// @brief Decodes through MediaFoundation for a `source::DecodeAhead` worker
+struct MediaFoundationSource : source::FrameSource<SharedVideoFrame>
+{
+    Media& media;
+
+    // Opaque black for the bars around a letterboxed picture, or empty if it fills the output
+    std::vector<uint32_t> black;
+
+    MediaFoundationSource(Media& media, uint32_t width, uint32_t height)
+        : media(media)
+    {
+        if (media.picture.width != width || media.picture.height != height)
+            black.assign((size_t)width * height, 0xff000000);
+    }
+
+    void on_decode_thread() override { initialize_com(); }
+
+    source::VideoRead read_video(SharedVideoFrame& frame) override
+    {
+        // Decoding never draws over the bars, so they are painted once per
+        // texture, and again only if another picture (or file) has been there
+        if (!black.empty() && frame.picture != media.picture)
+        {
+            if (!dx::write_texture(frame.texture, (const uint8_t*)black.data()))
+                return source::VideoRead::Busy;
+        }
+        frame.picture = media.picture;
+        // The picture stays on the GPU, so it isn't compared (change
+        // detection only covers Y4M and the frame cache): unknown content
+        frame.content = 0;
+
+        // A read can give no sample without the stream ending (a stream tick
+        // at a gap), and then nothing was written: read again rather than hand
+        // back a frame still holding its last picture and timestamp
+        while (!media.video_frame(frame.texture))
+        {
+            if (media.held_video)
+                return source::VideoRead::Busy;
+            if (media.video_ended)
+                return source::VideoRead::Ended;
+        }
+
+        frame.timestamp = media.video_timestamp;
+        return source::VideoRead::Decoded;
+    }
+
+    bool skip_video() override
+    {
+        // Past stream ticks too, so a frame is really skipped
+        while (!media.skip_video_frame())
+        {
+            if (media.video_ended)
+                return false;
+        }
+        return true;
+    }
+
+    bool read_audio(audio::PcmRing& output, size_t) override
+    {
+        // The resampler still holds output for a while after the source has ended
+        auto produced = media.audio_frame(output);
+        return produced || !media.audio_ended;
+    }
+
+    bool seek(const source::SeekPoint& keyframe) override { return media.seek(keyframe.timestamp); }
+    int64_t audio_drift() const override { return media.audio_drift(); }
+    void adjust_audio_rate(double ratio) override { media.resampler.adjust_rate(ratio); }
+    bool audio_resamplable() const override { return true; }
+};
+
+/// @brief Plays an uncompressed Y4M file (and no audio), converting each frame
+/// to BGRA on the CPU and uploading it, with no MediaFoundation involved.
+/// Frames that don't match the output size are letterboxed (and shrunk if
+/// they're too big) on the CPU too.
+struct Y4mSource : source::FrameSource<SharedVideoFrame>
+{
+    raw::RawMediaSource pictures;
+    color::Matrix matrix;
+    color::Range range;
+    std::vector<uint8_t> bgra;
+
+    std::unique_ptr<scale::Letterbox> letterbox;
+    std::vector<uint8_t> boxed;
+
+    // Compares each picture with the last, before it is converted
+    change::TileDetector changes;
+
+    // The last picture read, converted but not yet uploaded for want of a free texture
+    raw::VideoFrame held;
+    bool holding = false;
+
+    Y4mSource(const raw::Y4mReader& video, uint32_t output_width, uint32_t output_height)
+        : pictures(video, nullptr)
+        , matrix(color::default_matrix(video.height()))
+        , range(video.full_range() ? color::Range::Full : color::Range::Limited)
+        , bgra((size_t)video.width() * video.height() * 4)
+    {
+        if (output_width != video.width() || output_height != video.height())
+        {
+            letterbox = std::make_unique<scale::Letterbox>(video.width(), video.height(), output_width, output_height);
+            boxed.resize((size_t)output_width * output_height * 4);
+        }
+    }
+
+    source::VideoRead read_video(SharedVideoFrame& frame) override
+    {
+        if (!holding)
+        {
+            auto read = pictures.read_video(held);
+            if (read != source::VideoRead::Decoded)
+                return read;
+
+            // A picture that hasn't changed is still converted in `bgra` (and `boxed`)
+            auto changed = changes.update(change::i420_picture(
+                held.y,
+                held.u,
+                held.v,
+                held.y_stride,
+                held.uv_stride,
+                held.width,
+                held.height));
+            if (changed > 0)
+                convert(held);
+            holding = true;
+        }
+
+        // Nor does a texture that already holds this picture need it uploaded again
+        if (frame.content != changes.content_id() && !dx::write_texture(frame.texture, letterbox ? boxed.data() : bgra.data()))
+            return source::VideoRead::Busy;
+        frame.content = changes.content_id();
+        holding = false;
+
+        frame.picture = scale::Rect {};
+        frame.timestamp = held.timestamp;
+        return source::VideoRead::Decoded;
+    }
+
+    void convert(const raw::VideoFrame& picture)
+    {
+        color::i420_to_bgra(
+            picture.y,
+            picture.y_stride,
+            picture.u,
+            picture.v,
+            picture.uv_stride,
+            bgra.data(),
+            (size_t)picture.width * 4,
+            picture.width,
+            picture.height,
+            matrix,
+            range);
+
+        if (letterbox)
+            letterbox->run(bgra.data(), (size_t)picture.width * 4, boxed.data(), (size_t)letterbox->width() * 4);
+    }
+
+    bool skip_video() override
+    {
+        if (holding)
+        {
+            holding = false;
+            return true;
+        }
+        return pictures.skip_video();
+    }
+
+    bool read_audio(audio::PcmRing& output, size_t max_frames) override
+    {
+        return pictures.read_audio(output, max_frames);
+    }
+
+    bool seek(const source::SeekPoint& keyframe) override
+    {
+        if (!pictures.seek(keyframe))
+            return false;
+        holding = false;
+        return true;
+    }
+};
+
+/// @brief One media file opened for playing, together with whatever its frames
+/// come from: the Y4M reader, the frame cache, or MediaFoundation (recording
+/// into the cache once it plays)
+struct OpenedMedia : source::FrameSource<SharedVideoFrame>
+{
+    raw::Y4mReader y4m;
+    cache::Reader cached;
+    std::unique_ptr<Media> media;
+    std::unique_ptr<MediaFoundationSource> decoded;
+    std::unique_ptr<source::FrameSource<SharedVideoFrame>> owned_source;
+    source::FrameSource<SharedVideoFrame>* source = nullptr;
+
+    // Textures read back for the cache go through here
+    winrt::com_ptr<ID3D11Texture2D> staging;
+
+    // Compares each cached picture with the last
+    change::TileDetector changes;
+
+    bool is_y4m = false;
+    /// @brief Size of the frames produced
+    uint32_t width = 0;
+    uint32_t height = 0;
+    /// @brief Length in 100ns units
+    int64_t duration = 0;
+
+    // The cache entry this decode would be recorded as: found by the requested
+    // size, but recording the actual one
+    cache::Key key;
+    cache::Format recorded;
+
+    /// @brief Record what MediaFoundation decodes into `frame_cache`, so the
+    /// next play of the file can skip decoding. Only done once the media is
+    /// about to play, so media opened ahead of time doesn't hold an entry open.
+    /// @return false if the media isn't decoded or the entry can't be created
+    bool record(cache::Directory& frame_cache)
+    {
+        cache::Writer writer;
+        if (!decoded || owned_source || !frame_cache.create(key, recorded, writer))
+            return false;
+
+        auto staging = &this->staging;
+        auto directory = &frame_cache;
+        owned_source = std::make_unique<cache::RecordingSource<SharedVideoFrame>>(
+            *decoded,
+            std::move(writer),
+            [staging](const SharedVideoFrame& frame, std::vector<uint8_t>& bytes) {
+                dx::read_texture(frame.texture, *staging, bytes);
+            },
+            [directory]() { directory->enforce_budget(); });
+        source = owned_source.get();
+        return true;
+    }
+
+    void on_decode_thread() override { source->on_decode_thread(); }
+    source::VideoRead read_video(SharedVideoFrame& frame) override { return source->read_video(frame); }
+    bool skip_video() override { return source->skip_video(); }
+    bool read_audio(audio::PcmRing& output, size_t max_frames) override { return source->read_audio(output, max_frames); }
+    bool seek(const source::SeekPoint& keyframe) override { return source->seek(keyframe); }
+    int64_t audio_drift() const override { return source->audio_drift(); }
+    uint64_t audio_resyncs() const override { return source->audio_resyncs(); }
+    void adjust_audio_rate(double ratio) override { source->adjust_audio_rate(ratio); }
+    bool audio_resamplable() const override { return source->audio_resamplable(); }
+};
+
+/// @brief Open `media_path` to be played at `width` x `height`. When a frame
+/// cache is given, a file in it is served from it without decoding; any other
+/// (but a Y4M) can be recorded into it with `OpenedMedia::record`. Y4M files
+/// skip the decoder and are converted to BGRA on the CPU instead.
+/// @param width Width of the frames to produce, or 0 for the media's own
+/// @param height Height of the frames to produce, or 0 for the media's own
+/// @param frame_cache Frame cache to use, if any; must outlive the result
+/// @return The opened media, or null if it can't be played
+std::unique_ptr<OpenedMedia> open_for_playing(
+    winrt::com_ptr<ID3D11Device>& device,
+    const std::string& media_path,
+    uint32_t width,
+    uint32_t height,
+    cache::Directory* frame_cache)
+{
+    auto opened = std::make_unique<OpenedMedia>();
+    auto& y4m = opened->y4m;
+    opened->is_y4m = media_path.size() > 4 && media_path.compare(media_path.size() - 4, 4, ".y4m") == 0;
+    if (opened->is_y4m && !y4m.open(media_path))
+    {
+        printf("Error. Failed to open %s: %s\n", media_path.c_str(), y4m.error().c_str());
+        return nullptr;
+    }
 
-    auto prev = std::chrono::high_resolution_clock::now();
+    // Frames are output at the requested size, or the media's own. An MP4's
+    // size isn't known until it is opened (or found in the cache).
+    if (opened->is_y4m && (width == 0 || height == 0))
+    {
+        width = y4m.width();
+        height = y4m.height();
+    }
 
-    std::vector<uint8_t> audio = {};
-    winrt::com_ptr<ID3D11Texture2D> texture = dx::create_texture(device, 1920, 1080, DXGI_FORMAT_B8G8R8A8_UNORM);
+    auto format = cache::Format {width, height, cache::PIXEL_FORMAT_BGRA, AUDIO_SAMPLE_RATE, 2};
+    auto key = cache::make_key(media_path, format);
+    if (opened->is_y4m)
+    {
+        printf("VO: %ux%u (@ %f fps), %llu frames, converted on the CPU\n", width, height, y4m.fps(), y4m.frame_count());
 
-    LONGLONG deadline = 0;
+        opened->owned_source = std::make_unique<Y4mSource>(y4m, width, height);
+        opened->source = opened->owned_source.get();
+        opened->duration = y4m.timestamp(y4m.frame_count());
+    }
+    else if (frame_cache && frame_cache->open(key, format, opened->cached))
+    {
+        const auto& cached = opened->cached;
+        printf("Playing %s from the frame cache (%llu frames)\n", media_path.c_str(), cached.frame_count());
+        width = cached.width();
+        height = cached.height();
+
+        auto changes = &opened->changes;
+        opened->owned_source = std::make_unique<cache::CachedSource<SharedVideoFrame>>(
+            cached,
+            [changes, width, height](SharedVideoFrame& frame, const cache::FrameView& view) {
+                // A texture that already holds this picture needn't be uploaded
+                // again. One found busy is retried with the same picture, which
+                // the detector then sees as unchanged.
+                changes->update(change::bgra_picture(view.data, (size_t)width * 4, width, height));
+                if (frame.content != changes->content_id() && !dx::write_texture(frame.texture, view.data))
+                    return false;
+                frame.content = changes->content_id();
+                frame.picture = scale::Rect {};
+                return true;
+            });
+        opened->source = opened->owned_source.get();
+        opened->duration = cached.duration();
+    }
+    else
+    {
+        auto result = mf::open_media(device, media_path.c_str(), width, height);
+        width = result.width;
+        height = result.height;
+
+        auto& media = opened->media = std::make_unique<Media>(Media {
+            audio::Resampler {result.audio_rate, AUDIO_SAMPLE_RATE, std::min<uint16_t>(result.audio_channels, 2), AUDIO_RESAMPLER_QUALITY},
+            result.source_reader,
+            result.device_manager,
+        });
+        media->audio_channels = result.audio_channels;
+        media->picture = result.picture;
+        mf::debug_media_format(result.source_reader, media->resampler);
+        if (result.picture.width != width || result.picture.height != height)
+            printf("VO: letterboxed to %ux%u at (%u, %u) in %ux%u\n", result.picture.width, result.picture.height, result.picture.x, result.picture.y, width, height);
+        opened->decoded = std::make_unique<MediaFoundationSource>(*media, width, height);
+        opened->source = opened->decoded.get();
+        opened->duration = result.duration;
+
+        opened->key = key;
+        opened->recorded = format;
+        opened->recorded.width = width;
+        opened->recorded.height = height;
+    }
 
-    while (!stopped)
+    opened->width = width;
+    opened->height = height;
+    return opened;
+}
+
+/// @brief What a producer opens before its first frame can go out: a device,
+/// the playlist if the media is one, and the (first) media, with its decoder
+/// and resampler built
+struct MediaSession
+{
+    winrt::com_ptr<ID3D11Device> device;
+    std::unique_ptr<cache::Directory> frame_cache;
+    std::vector<std::string> items;
+    std::unique_ptr<OpenedMedia> opened;
+};
+
+/// @brief Open a session for playing `media_path` (or the playlist it names)
+/// at `output`, on the calling thread
+/// @return The session, or null if the media can't be played
+std::unique_ptr<MediaSession> open_session(const std::string& media_path, const OutputSize& output)
+{
+    initialize_com();
+
+    auto session = std::make_unique<MediaSession>();
+    session->device = dx::create_device();
+
+    // A playlist's items play one after another, at the size of the first
+    if (playlist::is_playlist(media_path))
     {
-        // This deadline is when we need to get the next samples from the media
-        // Since the media is at 30 FPS, we often dont have anything new to submit. This
-        // deadline allows us to not spin the thread, and allow other threads to be scheduled
-        // whilst we are not doing anything. It also significantly reduces contention on
-        // the texture keyed mutexes.
-        if (deadline != 0)
+        session->items = playlist::read_m3u(media_path);
+        if (session->items.empty())
         {
-            using namespace std::chrono_literals;
-            auto wake_point = std::chrono::time_point<std::chrono::high_resolution_clock> {100ns * deadline};
-            std::this_thread::sleep_until(wake_point);
+            printf("Error. %s lists no media\n", media_path.c_str());
+            return nullptr;
         }
+    }
 
-        auto now = std::chrono::high_resolution_clock::now();
-        auto elapsed_nanos = (now - prev).count();
-        prev = now;
+    if (!frame_cache_path.empty())
+        session->frame_cache = std::make_unique<cache::Directory>(frame_cache_path, FRAME_CACHE_BUDGET);
+
+    const auto& first = session->items.empty() ? media_path : session->items[0];
+    session->opened = open_for_playing(session->device, first, output.width, output.height, session->frame_cache.get());
+    if (!session->opened)
+        return nullptr;
+    return session;
+}
 
-        audio.resize(0);
+// Sessions for the configured media at the configured size, opened before any
+// stream asks for them; null when there is no pool
+static std::unique_ptr<pool::SessionPool<MediaSession>> media_sessions;
+
+/// @brief Decode `media_path` once, in real time, publishing every video frame
+/// and audio chunk to `out` until `stop` is cancelled. When a frame cache is
+/// configured the first play of a file is recorded into it, and later plays are
+/// served from it without decoding. Y4M files skip the decoder (and the
+/// cache) and are converted to BGRA on the CPU instead. Playback starts and
+/// loops as `playback` says, seeking through the media's keyframe index. An
+/// M3U playlist plays its items back to back, and loops back to the first.
+/// The device, decoder and resampler come ready opened from `media_sessions`
+/// when there is a pool.
+/// @param out Fanout that streams consume from
+/// @param media_path Path of the media (or playlist) to decode
+/// @param output Size of the frames to produce, or 0 x 0 for the media's own
+/// size; media that doesn't match is letterboxed, and shrunk if it doesn't fit
+/// @param stop Cancelled when the last stream playing this media goes away
+void produce_media(MediaFanout& out, const std::string& media_path, const OutputSize& output, const lifecycle::CancellationToken& stop)
+{
+    initialize_com();
+
+    // Whichever source is in use outlives the decoder, which is declared after
+    // it. The session comes ready opened from the pool unless it's empty.
+    auto session = media_sessions ? media_sessions->checkout() : open_session(media_path, output);
+    if (!session)
+        return;
+    if (media_sessions)
+    {
+        auto sessions = media_sessions->stats();
+        printf(
+            "Media session: %llu warm and %llu cold checkouts, %zu ready, opened in %.1fms on average\n",
+            sessions.warm_checkouts,
+            sessions.cold_checkouts,
+            sessions.idle,
+            sessions.mean_create_time() / 1e6);
+    }
 
-        bool produced_video = false;
-        media.frame(elapsed_nanos / 100, audio, texture, produced_video);
+    auto& device = session->device;
+    auto& items = session->items;
+    auto frame_cache = session->frame_cache.get();
+    auto& opened = session->opened;
+    if (frame_cache)
+        opened->record(*frame_cache);
+
+    auto width = opened->width;
+    auto height = opened->height;
+    source::FrameSource<SharedVideoFrame>* source = opened.get();
+
+    // Audio MediaFoundation decodes is resampled anyway, so small drift is
+    // taken out of it; other media is kept in step by dropping and repeating
+    // frames. Each source says which it is, so a playlist that mixes them
+    // changes over at each item.
+    auto sync_config = avsync::SyncConfig {};
+    sync_config.correction = avsync::Correction::Resample;
+    auto sync = avsync::SyncController {sync_config};
+
+    auto measured = player::ProducerMetrics {metric_registry.create(
+        "media=\"" + player::label_value(media_path) + "\",size=\"" + std::to_string(width) + "x" + std::to_string(height) + "\"")};
+    if (opened->media)
+        opened->media->measured = &measured;
+
+    // Each item after the first is opened and primed on the playlist's own
+    // thread while the one before it plays
+    std::unique_ptr<playlist::PlaylistSource<SharedVideoFrame>> items_played;
+
+    // Only built (or loaded from beside the media) when playback has to seek
+    seek::SeekIndex seek_index;
+    std::unique_ptr<seek::SeekingSource<SharedVideoFrame>> seeking;
+
+    if (!items.empty())
+    {
+        auto playlist_config = playlist::PlaylistConfig {};
+        playlist_config.loop = playback.loop;
+        playlist_config.sample_rate = AUDIO_SAMPLE_RATE;
+        playlist_config.channels = 2;
+        playlist_config.audio_read_frames = RESAMPLED_CHUNK_FRAMES;
+
+        items_played = std::make_unique<playlist::PlaylistSource<SharedVideoFrame>>(
+            items.size(),
+            [&](size_t index, playlist::Item<SharedVideoFrame>& item) {
+                // The first item was opened above to find the output size
+                auto next = index == 0 ? std::move(opened) : nullptr;
+                if (!next)
+                {
+                    initialize_com();
+                    next = open_for_playing(device, items[index], width, height, frame_cache);
+                    if (!next)
+                        return false;
+                    if (frame_cache)
+                        next->record(*frame_cache);
+                }
+
+                if (next->media)
+                    next->media->measured = &measured;
+                item.duration = next->duration;
+                item.source = std::move(next);
+                return true;
+            },
+            playlist_config,
+            [&]() {
+                auto frame = SharedVideoFrame {};
+                frame.texture = dx::create_texture(device, width, height, DXGI_FORMAT_B8G8R8A8_UNORM);
+                return frame;
+            });
+        source = items_played.get();
+    }
+    else if (playback.loop || playback.start_at > 0)
+    {
+        auto indexed = true;
+        if (opened->is_y4m)
+        {
+            const auto& y4m = opened->y4m;
+            seek_index = seek::SeekIndex::every(y4m.frame_count(), 1, y4m.timestamp(y4m.frame_count()), [&](uint64_t frame) {
+                return y4m.timestamp(frame);
+            });
+        }
+        else
+        {
+            indexed = seek::load_or_build(media_path, seek_index, [&](seek::SeekIndex& index) {
+                return mf::build_seek_index(media_path.c_str(), index);
+            });
+        }
 
-        if (produced_video && texture)
+        if (indexed)
         {
-            stream.SubmitVideo(rainway::VideoBuffer {
-                rainway::internal::RAINWAY_OUTBOUND_STREAM_VIDEO_BUFFER_DIRECT_X,
-                rainway::internal::RainwayDirectX_Body {texture.get()}});
+            auto seeking_config = playback;
+            seeking_config.sample_rate = AUDIO_SAMPLE_RATE;
+            seeking_config.channels = 2;
+            seeking_config.audio_read_frames = RESAMPLED_CHUNK_FRAMES;
+            seeking = std::make_unique<seek::SeekingSource<SharedVideoFrame>>(*source, seek_index, seeking_config);
+            source = seeking.get();
         }
+        else
+        {
+            printf("Warning. Found no keyframes in %s; playing it once from the start\n", media_path.c_str());
+        }
+    }
 
-        deadline = media.video_timestamp;
+    auto instrumented = player::InstrumentedSource<SharedVideoFrame> {*source, measured};
+
+    // Decoding and resampling happen ahead of time on a worker, into a few
+    // queued frames and a ring of PCM, so this loop only ever dequeues and a
+    // slow ReadSample doesn't delay a submit. Frames are decoded into a pool of
+    // textures shared by every stream; a texture an encoder still holds, when
+    // it's handed out or when the copy comes to write it, is passed over rather
+    // than waited on. If none is free the worker waits for one, dropping the
+    // oldest queued frame only once the media clock has passed it.
+    auto decode_config = source::DecodeAheadConfig {};
+    decode_config.video_frames = DECODE_AHEAD_FRAMES;
+    decode_config.pool_frames = OUTPUT_POOL_FRAMES;
+    decode_config.exhausted_policy = pool::ExhaustedPolicy::DropOldest;
+    decode_config.audio_frames = AUDIO_RING_FRAMES;
+    decode_config.audio_read_frames = RESAMPLED_CHUNK_FRAMES;
+
+    auto decoder = source::DecodeAhead<SharedVideoFrame> {
+        instrumented,
+        [&]() {
+            auto frame = std::make_shared<SharedVideoFrame>();
+            frame->texture = dx::create_texture(device, width, height, DXGI_FORMAT_B8G8R8A8_UNORM);
+            return frame;
+        },
+        decode_config,
+        [](const SharedVideoFrame& frame) { return dx::texture_available(frame.texture); }};
+
+    auto clock = pacing::SteadyClock {};
+    auto config = player::ProducerConfig {};
+    config.sample_rate = AUDIO_SAMPLE_RATE;
+    config.audio_drain_interval = AUDIO_DRAIN_INTERVAL;
+    // Media that doesn't loop finishes the fanout when it ends, so its viewers
+    // stop and the next one to join starts it again
+    config.stop_at_end = true;
+    player::run_producer(out, decoder, clock, stop, config, &measured, &sync);
+
+    auto stats = decoder.stats();
+    printf(
+        "Decode-ahead: %llu frames decoded, mean queue %.2f/%zu, %llu starved dequeues, %llu audio underrun frames\n",
+        stats.video_decoded,
+        stats.mean_video_occupancy(),
+        (size_t)DECODE_AHEAD_FRAMES,
+        stats.video_starved,
+        decoder.audio().underrun_frames());
+    printf(
+        "Output pool: %llu/%zu textures, %llu busy in the encoder (%llu taken back at the copy), %llu waits for a release, %llu frames dropped, %llu skipped\n",
+        stats.pool.allocated,
+        (size_t)OUTPUT_POOL_FRAMES,
+        stats.pool.contended,
+        stats.video_busy,
+        stats.video_pool_waits,
+        stats.video_dropped,
+        stats.video_skipped);
+    auto synced = sync.stats();
+    printf(
+        "A/V sync: offset %.3fms either way on average, min %.3fms, max %.3fms, %llu frames dropped, %llu repeated, audio rate adjusted at %llu of %llu frames\n",
+        synced.mean_abs_offset() / 1e4,
+        synced.offset_min / 1e4,
+        synced.offset_max / 1e4,
+        synced.frames_dropped,
+        synced.frames_repeated,
+        synced.rate_adjusted,
+        synced.measurements);
+    if (items_played)
+    {
+        auto played = items_played->stats();
+        printf(
+            "Playlist: %llu items played (%llu failed), %llu switches (%llu waited for priming), switch max %.3fms, timestamp gap max %.3fms, %llu audio frames padded, %llu trimmed\n",
+            played.items,
+            played.failed_opens,
+            played.switches,
+            played.switch_waits,
+            played.switch_time_max / 1e6,
+            played.timestamp_gap_max / 1e4,
+            played.audio_frames_padded,
+            played.audio_frames_trimmed);
+    }
+    if (seeking)
+    {
+        auto seeks = seeking->stats();
+        printf(
+            "Seeking: %llu seeks (%llu loops, %llu failed), %llu frames skipped, %llu audio frames trimmed, %llu padded\n",
+            seeks.seeks,
+            seeks.loops,
+            seeks.failed_seeks,
+            seeks.frames_skipped,
+            seeks.audio_frames_trimmed,
+            seeks.audio_frames_padded);
+    }
+}
 
-        if (audio.size() > 0)
+/// @brief Submits frames and chunks from a `MediaFanout` to a Rainway stream,
+/// re-cutting the audio into fixed-duration packets
+struct StreamSink
+{
+    rainway::OutboundStream stream;
+    audio::Packetizer packets {AUDIO_SAMPLE_RATE, 2, AUDIO_PACKET_MS};
+    player::StreamMetrics measured;
+    // When the stream was accepted, for its time to first frame
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    // Skips frames showing the picture this stream last submitted
+    change::SubmitFilter unchanged {FRAME_KEEP_ALIVE};
+
+    StreamSink(rainway::OutboundStream stream, std::shared_ptr<metrics::MetricSet> metric_set)
+        : stream(std::move(stream))
+        , measured(std::move(metric_set))
+    {
+    }
+
+    void submit_video(const SharedVideoFrame& frame)
+    {
+        if (!unchanged.should_submit(frame.content, frame.timestamp))
         {
-            auto audio_buffer = rainway::AudioBuffer {rainway::internal::RAINWAY_AUDIO_BUFFER_PCM, (int16_t*)audio.data()};
-            // Convert from byte length to samples
-            // 2 bytes per sample, 1 sample per n channels
-            auto sample_count = audio.size() / 2 / 2;
+            measured.video_unchanged.add();
+            return;
+        }
 
+        auto timer = metrics::ScopedTimer {&measured.submit_video};
+        stream.SubmitVideo(rainway::VideoBuffer {
+            rainway::internal::RAINWAY_OUTBOUND_STREAM_VIDEO_BUFFER_DIRECT_X,
+            rainway::internal::RainwayDirectX_Body {frame.texture.get()}});
+        measured.frame_submitted(started);
+    }
+
+    void submit_audio(const SharedAudioChunk& chunk)
+    {
+        // Convert from byte length to frames
+        // 2 bytes per sample, 1 sample per n channels
+        auto frames = chunk.pcm.size() / 2 / 2;
+
+        packets.push((const int16_t*)chunk.pcm.data(), frames, chunk.timestamp, [&](const int16_t* samples, size_t sample_count, int64_t) {
+            auto audio_buffer = rainway::AudioBuffer {rainway::internal::RAINWAY_AUDIO_BUFFER_PCM, (int16_t*)samples};
             auto submission = rainway::AudioOptions {
                 AUDIO_SAMPLE_RATE,
                 (uint16_t)2,
                 (uint32_t)sample_count,
                 audio_buffer};
+            auto timer = metrics::ScopedTimer {&measured.submit_audio};
             stream.SubmitAudio(submission);
-        }
+            measured.audio_packets.add();
+            measured.audio_frames.add(sample_count);
+        });
+    }
+};
 
-        // Use the closest deadline
-        deadline = std::min(deadline, media.audio_timestamp);
+/// @brief A stream being played, kept alive by its executor task
+struct StreamSession
+{
+    std::shared_ptr<MediaProducer> producer;
+    StreamSink sink;
+    lifecycle::StreamLifecycle life;
+    exec::ConsumerTask<SharedVideoFrame, SharedAudioChunk, StreamSink> consumer;
+
+    StreamSession(std::shared_ptr<MediaProducer> producer, rainway::OutboundStream stream, std::shared_ptr<metrics::MetricSet> metric_set)
+        : producer(std::move(producer))
+        , sink {std::move(stream), std::move(metric_set)}
+        , consumer(this->producer->media(), sink, life.token())
+    {
     }
+};
+
+// Every stream's submits run on this fixed pool of workers, each woken when
+// its stream's next frame or audio chunk is due
+static pacing::SteadyClock stream_clock;
+static exec::StreamExecutor<> stream_executor {stream_clock};
+
+// How long streams take to stop once their viewer closes them
+static lifecycle::CloseRecorder stream_closes;
+
+// Every stream started, held weakly so a stream that ends goes away by
+// itself; the ones still playing are closed when the player exits
+static std::mutex live_streams_mutex;
+static std::vector<std::weak_ptr<StreamSession>> live_streams;
+
+/// @brief Ask every stream still playing to close
+/// @return How many were asked
+size_t close_streams()
+{
+    std::lock_guard<std::mutex> lock(live_streams_mutex);
+    size_t closing = 0;
+    for (auto& weak : live_streams)
+    {
+        if (auto session = weak.lock())
+            closing += session->life.request_close() ? 1 : 0;
+    }
+    live_streams.clear();
+    return closing;
+}
+
+/// @brief Start playing `media_path` to a stream, on the stream executor
+/// @param output Size of the frames to send this stream
+void on_stream_start(
+    rainway::OutboundStream stream,
+    std::string media_path,
+    OutputSize output)
+{
+    // Join (or start) the single producer decoding this media at this size
+    auto key = media_path + "@" + std::to_string(output.width) + "x" + std::to_string(output.height);
+    auto producer = media_producers.acquire(key, [&]() {
+        return std::make_shared<MediaProducer>(
+            FANOUT_VIDEO_FRAMES,
+            FANOUT_AUDIO_CHUNKS,
+            [media_path, output](MediaFanout& out, const lifecycle::CancellationToken& stop) {
+                produce_media(out, media_path, output, stop);
+            },
+            &producer_reaper);
+    });
+
+    auto labels = "stream=\"" + std::to_string(stream.Id()) + "\",media=\"" + player::label_value(media_path) + "\"";
+    auto session = std::make_shared<StreamSession>(std::move(producer), stream, metric_registry.create(labels));
+
+    auto task = stream_executor.spawn(
+        [session](auto now) {
+            session->life.start();
+            return session->consumer(now);
+        },
+        stream_clock.now(),
+        [session](bool) {
+            auto latency = session->life.close();
+            if (!latency)
+                return;
+
+            stream_closes.record(*latency);
+            auto closes = stream_closes.snapshot();
+            printf(
+                "Stream closed in %.3fms (%llu closed, mean %.3fms, max %.3fms)\n",
+                latency->count() / 1e6,
+                (unsigned long long)closes.closes,
+                closes.mean_latency().count() / 1e6,
+                closes.max_latency.count() / 1e6);
+        });
+
+    // Closing wakes the task at once rather than at its next frame
+    session->life.token().on_cancel([task]() { stream_executor.wake(task); });
+
+    {
+        std::lock_guard<std::mutex> lock(live_streams_mutex);
+        live_streams.erase(
+            std::remove_if(live_streams.begin(), live_streams.end(), [](const auto& weak) { return weak.expired(); }),
+            live_streams.end());
+        live_streams.push_back(session);
+    }
+
+    // The handler only holds the session weakly, so the stream doesn't keep
+    // itself alive. It runs on an SDK thread, possibly after the task is gone.
+    stream.SetCloseHandler([weak = std::weak_ptr<StreamSession>(session)]() {
+        if (auto session = weak.lock())
+            session->life.request_close();
+    });
 }
 
 void on_peer_connected(
@@ -684,14 +1790,7 @@ void on_peer_connected(
                 config,
                 rainway::OutboundStreamStartCallback {
                     [=](rainway::OutboundStream stream) {
-                        // Spawn thread for this stream
-                        auto thread = std::thread {
-                            [media_path, stream]() {
-                                on_stream_start(stream, media_path);
-                            },
-                        };
-
-                        thread.detach();
+                        on_stream_start(stream, media_path, stream_output);
                     },
                     // on failure
                     [](rainway::Error err) {
@@ -704,12 +1803,32 @@ int main(int argc, const char* argv[])
 {
     if (argc < 3)
     {
-        printf("Usage: %s <api_key> <path to media>\n", argv[0]);
+        printf("Usage: %s <api_key> <path to media or .m3u playlist> [frame cache directory, or - for none] [output size, e.g. 1280x720, or - for the media's own] [loop, 0 or 1] [start seconds] [sessions to open ahead, 1 by default]\n", argv[0]);
         exit(1);
     }
 
     const auto api_key = argv[1];
     const auto media_path = std::string(argv[2]);
+    if (argc > 3 && strcmp(argv[3], "-") != 0)
+        frame_cache_path = argv[3];
+    if (argc > 4 && strcmp(argv[4], "-") != 0 && sscanf(argv[4], "%ux%u", &stream_output.width, &stream_output.height) != 2)
+    {
+        printf("Error. Output size must look like 1280x720, not %s\n", argv[4]);
+        exit(1);
+    }
+    playback.loop = argc > 5 && atoi(argv[5]) != 0;
+    playback.start_at = argc > 6 ? (int64_t)(std::max(0.0, atof(argv[6])) * 10000000) : 0;
+
+    // Open the media ahead of the first stream, and again after each one takes
+    // a session, so streams start without waiting for it to open
+    auto session_config = pool::SessionPoolConfig {};
+    session_config.size = argc > 7 ? (size_t)std::max(0, atoi(argv[7])) : 1;
+    if (session_config.size > 0)
+    {
+        media_sessions = std::make_unique<pool::SessionPool<MediaSession>>(
+            [media_path]() { return open_session(media_path, stream_output); },
+            session_config);
+    }
 
     auto hr = rainway::Initialize();
     if (hr != rainway::Error::RAINWAY_ERROR_SUCCESS)
@@ -720,8 +1839,13 @@ int main(int argc, const char* argv[])
 
     // install the log handlers
     rainway::SetLogLevel(rainway::LogLevel::RAINWAY_LOG_LEVEL_DEBUG, nullptr);
+    sdk_log.start();
     rainway::SetLogSink(log_sink);
 
+    auto metrics_exporter = metrics::export_from_env(metric_registry);
+
+    stream_executor.start();
+
     rainway::Connection::CreateOptions config;
     config.apiKey = api_key;
     config.externalId = "video-player";
@@ -754,6 +1878,22 @@ int main(int argc, const char* argv[])
                 printf("Failed to connect to rainway: %d", err);
             }});
 
+    printf("Press enter to exit.\n");
+
+    // wait for user input, if received, shutdown
+    getchar();
+
+    // Streams close as their viewers' would, waking their tasks to exit; any
+    // still running after a while are cancelled by the executor's shutdown
+    printf("Input received. Closing %zu streams...\n", close_streams());
     using namespace std::chrono_literals;
-    std::this_thread::sleep_for(10000h);
+    auto deadline = std::chrono::steady_clock::now() + 2s;
+    while (stream_executor.task_count() > 0 && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(5ms);
+    stream_executor.shutdown();
+    producer_reaper.drain();
+
+    printf("Shutting down Rainway...\n");
+    rainway::Shutdown();
+    return 0;
 }
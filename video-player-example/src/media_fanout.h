@@ -0,0 +1,413 @@
+// Decode-once, stream-many plumbing for the video player.
+//
+// A single producer per media file decodes video frames and audio chunks into
+// a pair of fixed capacity rings of reference counted items. Every outbound
+// stream subscribes with its own cursor, starting at the live head, and
+// submits whatever the producer publishes. Decode cost therefore scales with
+// the number of files being played rather than the number of viewers.
+//
+// Nothing in here depends on MediaFoundation, D3D11 or the Rainway SDK, so it
+// can be driven by a synthetic frame source and a stub stream sink.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "stream_lifecycle.h"
+
+namespace fanout
+{
+    /// @brief A fixed capacity ring of shared items addressed by a monotonically
+    /// increasing sequence number. Not synchronised; `MediaFanout` owns the lock.
+    template <typename T>
+    class FrameRing
+    {
+    public:
+        explicit FrameRing(size_t capacity)
+            : slots(capacity)
+        {
+        }
+
+        /// @brief Store an item at the head of the ring
+        /// @param item Item to store
+        /// @return The item evicted to make room (if any), so the producer can recycle
+        /// it once no consumer holds a reference to it any more
+        std::shared_ptr<T> push(std::shared_ptr<T> item)
+        {
+            auto& slot = slots[head % slots.size()];
+            auto evicted = std::move(slot);
+            slot = std::move(item);
+            head++;
+            return evicted;
+        }
+
+        /// @brief Read the item at `cursor`, advancing it
+        /// @param cursor Sequence number of the next item this reader wants
+        /// @param skipped Incremented by the number of items the reader lost by lagging
+        /// more than `capacity` items behind the head
+        /// @return The item, or nullptr if the reader is already at the head
+        std::shared_ptr<const T> read(uint64_t& cursor, uint64_t& skipped) const
+        {
+            if (cursor >= head)
+                return nullptr;
+
+            auto oldest = head > slots.size() ? head - slots.size() : 0;
+            if (cursor < oldest)
+            {
+                skipped += oldest - cursor;
+                cursor = oldest;
+            }
+
+            return slots[cursor++ % slots.size()];
+        }
+
+        /// @brief Sequence number the next pushed item will receive
+        uint64_t head_sequence() const { return head; }
+
+    private:
+        std::vector<std::shared_ptr<T>> slots;
+        uint64_t head = 0;
+    };
+
+    /// @brief Per-consumer read position into a `MediaFanout`
+    struct Cursor
+    {
+        uint64_t video = 0;
+        uint64_t audio = 0;
+        uint64_t skipped_video = 0;
+        uint64_t skipped_audio = 0;
+    };
+
+    /// @brief One producer publishing video and audio to many consumers
+    template <typename Video, typename Audio>
+    class MediaFanout
+    {
+    public:
+        MediaFanout(size_t video_capacity, size_t audio_capacity)
+            : video(video_capacity)
+            , audio(audio_capacity)
+        {
+        }
+
+        /// @brief Publish a decoded video frame
+        /// @return The evicted frame, for recycling
+        std::shared_ptr<Video> publish_video(std::shared_ptr<Video> frame)
+        {
+            std::shared_ptr<Video> evicted;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                evicted = video.push(std::move(frame));
+            }
+            published.notify_all();
+            return evicted;
+        }
+
+        /// @brief Publish a resampled audio chunk
+        /// @return The evicted chunk, for recycling
+        std::shared_ptr<Audio> publish_audio(std::shared_ptr<Audio> chunk)
+        {
+            std::shared_ptr<Audio> evicted;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                evicted = audio.push(std::move(chunk));
+            }
+            published.notify_all();
+            return evicted;
+        }
+
+        /// @brief Mark the media as finished, waking every waiting consumer
+        void finish()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                finished = true;
+            }
+            published.notify_all();
+        }
+
+        /// @brief Create a cursor positioned at the live head, so a late joiner
+        /// sees the next published items rather than a backlog
+        Cursor subscribe() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            Cursor cursor;
+            cursor.video = video.head_sequence();
+            cursor.audio = audio.head_sequence();
+            return cursor;
+        }
+
+        /// @brief Block until something new is available for `cursor`, the media
+        /// finishes or `timeout` expires
+        /// @return Whether anything is available to read
+        template <typename Rep, typename Period>
+        bool wait(const Cursor& cursor, std::chrono::duration<Rep, Period> timeout) const
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            published.wait_for(lock, timeout, [&] { return finished || has_pending(cursor); });
+            return has_pending(cursor);
+        }
+
+        /// @brief Read the next video frame for `cursor`, or nullptr if none is pending
+        std::shared_ptr<const Video> next_video(Cursor& cursor) const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return video.read(cursor.video, cursor.skipped_video);
+        }
+
+        /// @brief Read the next audio chunk for `cursor`, or nullptr if none is pending
+        std::shared_ptr<const Audio> next_audio(Cursor& cursor) const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return audio.read(cursor.audio, cursor.skipped_audio);
+        }
+
+        bool is_finished() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return finished;
+        }
+
+    private:
+        bool has_pending(const Cursor& cursor) const
+        {
+            return cursor.video < video.head_sequence() || cursor.audio < audio.head_sequence();
+        }
+
+        mutable std::mutex mutex;
+        mutable std::condition_variable published;
+        FrameRing<Video> video;
+        FrameRing<Audio> audio;
+        bool finished = false;
+    };
+
+    /// @brief Joins the threads handed to it on a thread of its own, so that
+    /// letting go of a thread never waits for it to finish
+    class Reaper
+    {
+    public:
+        Reaper()
+            : thread {[this]() { run(); }}
+        {
+        }
+
+        /// @brief Joins every thread handed over, however long they take
+        ~Reaper()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            changed.notify_all();
+            thread.join();
+        }
+
+        Reaper(const Reaper&) = delete;
+        Reaper& operator=(const Reaper&) = delete;
+
+        /// @brief Join `finishing` in the background
+        void reap(std::thread finishing)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending.push_back(std::move(finishing));
+            }
+            changed.notify_all();
+        }
+
+        /// @brief Block until every thread handed over so far has been joined
+        void drain()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&] { return pending.empty() && !joining; });
+        }
+
+    private:
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true)
+            {
+                changed.wait(lock, [&] { return stopping || !pending.empty(); });
+                if (pending.empty())
+                    return;
+
+                auto finishing = std::move(pending.front());
+                pending.pop_front();
+                joining = true;
+                lock.unlock();
+                if (finishing.joinable())
+                    finishing.join();
+                lock.lock();
+                joining = false;
+                changed.notify_all();
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::deque<std::thread> pending;
+        bool joining = false;
+        bool stopping = false;
+        std::thread thread;
+    };
+
+    /// @brief Owns a `MediaFanout` and the thread that fills it. The thread's
+    /// token is cancelled when the last consumer releases the producer, and
+    /// the thread joined there, or by a `Reaper` if one was given: a
+    /// consumer running on a shared worker then doesn't hold up that worker
+    /// while the body winds down.
+    template <typename Video, typename Audio>
+    class SharedProducer
+    {
+    public:
+        using Fanout = MediaFanout<Video, Audio>;
+        using Body = std::function<void(Fanout&, const lifecycle::CancellationToken& stop)>;
+
+        /// @param reaper Where to join the thread once released, if not on the
+        /// releasing thread; must outlive this
+        SharedProducer(size_t video_capacity, size_t audio_capacity, Body body, Reaper* reaper = nullptr)
+            : state(std::make_shared<State>(video_capacity, audio_capacity))
+            , reaper(reaper)
+        {
+            // The thread keeps the fanout and token alive for as long as it runs,
+            // which may be after this is gone
+            thread = std::thread {[state = state, body = std::move(body)]() {
+                body(state->fanout, state->stop);
+                state->fanout.finish();
+            }};
+        }
+
+        ~SharedProducer()
+        {
+            state->stop.cancel();
+            if (reaper)
+                reaper->reap(std::move(thread));
+            else if (thread.joinable())
+                thread.join();
+        }
+
+        SharedProducer(const SharedProducer&) = delete;
+        SharedProducer& operator=(const SharedProducer&) = delete;
+
+        Fanout& media() { return state->fanout; }
+
+    private:
+        struct State
+        {
+            State(size_t video_capacity, size_t audio_capacity)
+                : fanout(video_capacity, audio_capacity)
+            {
+            }
+
+            Fanout fanout;
+            lifecycle::CancellationToken stop;
+        };
+
+        std::shared_ptr<State> state;
+        Reaper* reaper;
+        std::thread thread;
+    };
+
+    /// @brief Hands out one `SharedProducer` per key (typically the media path),
+    /// creating it on first use and letting it die with its last consumer
+    template <typename Video, typename Audio>
+    class ProducerRegistry
+    {
+    public:
+        using Producer = SharedProducer<Video, Audio>;
+
+        /// @brief Get the live producer for `key`, or start one if there is
+        /// none or its media has finished (its consumers keep it until they let go)
+        /// @param key Identity of the media being produced
+        /// @param create Called (under the registry lock) to build a new producer
+        std::shared_ptr<Producer> acquire(const std::string& key, const std::function<std::shared_ptr<Producer>()>& create)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            auto& entry = producers[key];
+            if (auto existing = entry.lock(); existing && !existing->media().is_finished())
+                return existing;
+
+            // Forget producers that have died, so keys that come and go (a
+            // path at each output size, say) don't pile up
+            for (auto it = producers.begin(); it != producers.end();)
+            {
+                if (it->first != key && it->second.expired())
+                    it = producers.erase(it);
+                else
+                    it++;
+            }
+
+            auto created = create();
+            entry = created;
+            return created;
+        }
+
+        /// @brief Keys with an entry, live or not yet forgotten
+        size_t size()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return producers.size();
+        }
+
+    private:
+        std::mutex mutex;
+        std::map<std::string, std::weak_ptr<Producer>> producers;
+    };
+
+    /// @brief Forward everything pending for `cursor` to `sink`, without waiting.
+    /// `Sink` needs `submit_video(const Video&)` and `submit_audio(const Audio&)`.
+    /// @return Whether anything was forwarded
+    template <typename Video, typename Audio, typename Sink>
+    bool drain(MediaFanout<Video, Audio>& fanout, Cursor& cursor, Sink& sink)
+    {
+        auto forwarded = false;
+
+        while (auto chunk = fanout.next_audio(cursor))
+        {
+            sink.submit_audio(*chunk);
+            forwarded = true;
+        }
+
+        while (auto frame = fanout.next_video(cursor))
+        {
+            sink.submit_video(*frame);
+            forwarded = true;
+        }
+
+        return forwarded;
+    }
+
+    /// @brief Forward everything published on `fanout` to `sink` until `stopped`
+    /// is set or the media finishes, on the calling thread
+    template <typename Video, typename Audio, typename Sink>
+    void run_consumer(MediaFanout<Video, Audio>& fanout, Sink& sink, const std::atomic<bool>& stopped)
+    {
+        using namespace std::chrono_literals;
+
+        auto cursor = fanout.subscribe();
+
+        while (!stopped)
+        {
+            if (!fanout.wait(cursor, 50ms))
+            {
+                if (fanout.is_finished())
+                    break;
+                continue;
+            }
+
+            drain(fanout, cursor, sink);
+        }
+    }
+} // namespace fanout
@@ -0,0 +1,256 @@
+// Media clock and frame pacing.
+//
+// `FramePacer` anchors media time to a steady clock when a stream starts and
+// waits for each frame's absolute deadline (anchor + timestamp), so errors
+// never accumulate from frame to frame. Waits sleep until shortly before the
+// deadline and spin the rest of the way; the spin margin adapts to how much
+// the OS oversleeps. If the loop falls too far behind (a decode stall, a
+// debugger) the anchor is moved forward instead of bursting to catch up.
+//
+// A wake counts as late only past a threshold (1ms by default): the few
+// microseconds of every wake are reported as a distribution instead.
+//
+// The clock is a template parameter: `SteadyClock` for real use and
+// `FakeClock` for deterministic pacing error measurements.
+//
+// A wait can be given a cancellation token, in which case its sleep ends the
+// moment the token is cancelled instead of at the deadline.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+#include <type_traits>
+
+#include "stream_lifecycle.h"
+
+namespace pacing
+{
+    /// @brief MediaFoundation's 100ns time unit
+    using MediaDuration = std::chrono::duration<int64_t, std::ratio<1, 10000000>>;
+
+    /// @brief The real clock: std::chrono::steady_clock and the OS scheduler
+    struct SteadyClock
+    {
+        using time_point = std::chrono::steady_clock::time_point;
+
+        time_point now() const { return std::chrono::steady_clock::now(); }
+        void sleep_until(time_point t) { std::this_thread::sleep_until(t); }
+        void relax() { std::this_thread::yield(); }
+    };
+
+    /// @brief A manually driven clock. Sleeping jumps to the requested time plus
+    /// `sleep_overshoot` (to model OS wake latency) and each spin iteration
+    /// advances by `spin_step`.
+    struct FakeClock
+    {
+        using time_point = std::chrono::steady_clock::time_point;
+
+        time_point now() const { return current; }
+
+        void sleep_until(time_point t)
+        {
+            current = std::max(current, t) + sleep_overshoot;
+            sleeps++;
+        }
+
+        void relax()
+        {
+            current += spin_step;
+            spins++;
+        }
+
+        void advance(std::chrono::nanoseconds d) { current += d; }
+
+        time_point current {};
+        std::chrono::nanoseconds sleep_overshoot {0};
+        std::chrono::nanoseconds spin_step {std::chrono::microseconds(1)};
+        uint64_t sleeps = 0;
+        uint64_t spins = 0;
+    };
+
+    struct PacerConfig
+    {
+        /// @brief Spin margin before any oversleep has been observed
+        std::chrono::nanoseconds initial_spin {std::chrono::microseconds(500)};
+        /// @brief Bounds on the adaptive spin margin; the upper bound caps CPU spent spinning
+        std::chrono::nanoseconds min_spin {std::chrono::microseconds(100)};
+        std::chrono::nanoseconds max_spin {std::chrono::milliseconds(2)};
+        /// @brief Lateness beyond which the media clock is re-anchored rather
+        /// than letting the loop burst frames to catch up
+        std::chrono::nanoseconds max_lateness {std::chrono::milliseconds(100)};
+        /// @brief Wake error beyond which a wait counts as late. Below it is the
+        /// ordinary cost of waking up, which the error distribution shows.
+        std::chrono::nanoseconds late_threshold {std::chrono::milliseconds(1)};
+    };
+
+    /// @brief Upper bounds of the wake error distribution's buckets, in
+    /// microseconds. One more bucket holds everything above the last.
+    constexpr int64_t WAKE_ERROR_BOUNDS_US[] = {10, 50, 100, 250, 500, 1000, 2000, 5000, 10000};
+    constexpr size_t WAKE_ERROR_BUCKETS = sizeof(WAKE_ERROR_BOUNDS_US) / sizeof(WAKE_ERROR_BOUNDS_US[0]) + 1;
+
+    struct PacerStats
+    {
+        uint64_t waits = 0;
+        /// @brief Waits that woke more than `PacerConfig::late_threshold` late
+        uint64_t late = 0;
+        uint64_t reanchors = 0;
+        std::chrono::nanoseconds total_abs_error {0};
+        std::chrono::nanoseconds max_abs_error {0};
+        /// @brief Waits by wake error: bucket i counts errors up to
+        /// `WAKE_ERROR_BOUNDS_US[i]` and above the bound before; the last, the rest
+        std::array<uint64_t, WAKE_ERROR_BUCKETS> error_distribution {};
+
+        std::chrono::nanoseconds mean_abs_error() const
+        {
+            return waits ? total_abs_error / (int64_t)waits : std::chrono::nanoseconds {0};
+        }
+
+        /// @brief The wake error that `p` (0 to 1) of waits were within, to the
+        /// bound of its bucket; the largest error past the last bound
+        std::chrono::nanoseconds error_percentile(double p) const
+        {
+            auto wanted = (uint64_t)std::ceil(p * (double)waits);
+            uint64_t seen = 0;
+            for (size_t i = 0; i + 1 < WAKE_ERROR_BUCKETS; i++)
+            {
+                seen += error_distribution[i];
+                if (seen >= wanted)
+                    return std::chrono::microseconds(WAKE_ERROR_BOUNDS_US[i]);
+            }
+            return max_abs_error;
+        }
+    };
+
+    template <typename Clock = SteadyClock>
+    class FramePacer
+    {
+    public:
+        using time_point = typename Clock::time_point;
+
+        explicit FramePacer(Clock& clock, PacerConfig config = {})
+            : clock(clock)
+            , config(config)
+            , spin_margin(config.initial_spin)
+            , oversleep_ewma(config.initial_spin / 2)
+        {
+        }
+
+        /// @brief Anchor the media clock so that `media_start` is now
+        void start(MediaDuration media_start = MediaDuration {0})
+        {
+            anchor = clock.now() - std::chrono::duration_cast<std::chrono::nanoseconds>(media_start);
+        }
+
+        /// @brief Media time elapsed since the anchor
+        MediaDuration media_now() const
+        {
+            return std::chrono::duration_cast<MediaDuration>(clock.now() - anchor);
+        }
+
+        /// @brief When a media timestamp is due on the clock
+        time_point due_at(MediaDuration timestamp) const
+        {
+            return anchor + std::chrono::duration_cast<std::chrono::nanoseconds>(timestamp);
+        }
+
+        /// @brief Wait until `timestamp` is due, or until `cancel` is cancelled
+        /// @return How late the wake was (negative never happens; zero is
+        /// perfect). Zero, and not counted, if cancelled.
+        std::chrono::nanoseconds wait_until(MediaDuration timestamp, const lifecycle::CancellationToken* cancel = nullptr)
+        {
+            auto target = due_at(timestamp);
+            auto now = clock.now();
+
+            if (now < target)
+            {
+                if (target - now > spin_margin)
+                {
+                    auto sleep_target = target - spin_margin;
+                    if (!sleep_until(sleep_target, cancel))
+                        return std::chrono::nanoseconds {0};
+                    now = clock.now();
+                    learn_oversleep(now - std::min(now, sleep_target));
+                }
+
+                while (now < target)
+                {
+                    clock.relax();
+                    now = clock.now();
+                }
+            }
+
+            auto error = std::chrono::duration_cast<std::chrono::nanoseconds>(now - target);
+            record(error);
+
+            if (error > config.max_lateness)
+            {
+                // Treat the stall as a pause: shift media time so this frame is on time
+                anchor += error;
+                stats.reanchors++;
+            }
+
+            return error;
+        }
+
+        const PacerStats& statistics() const { return stats; }
+        std::chrono::nanoseconds current_spin_margin() const { return spin_margin; }
+
+    private:
+        /// @return false if cancelled
+        bool sleep_until(time_point t, const lifecycle::CancellationToken* cancel)
+        {
+            if (!cancel)
+            {
+                clock.sleep_until(t);
+                return true;
+            }
+
+            if (cancel->cancelled())
+                return false;
+
+            // Only the real clock can be woken early; a fake one just checks afterwards
+            if constexpr (std::is_same<Clock, SteadyClock>::value)
+            {
+                return !cancel->wait_until(t);
+            }
+            else
+            {
+                clock.sleep_until(t);
+                return !cancel->cancelled();
+            }
+        }
+
+        void learn_oversleep(std::chrono::nanoseconds oversleep)
+        {
+            // Keep the spin margin at roughly twice the smoothed oversleep
+            oversleep_ewma = oversleep_ewma + (oversleep - oversleep_ewma) / 8;
+            spin_margin = std::clamp(oversleep_ewma * 2, config.min_spin, config.max_spin);
+        }
+
+        void record(std::chrono::nanoseconds error)
+        {
+            stats.waits++;
+            if (error > config.late_threshold)
+                stats.late++;
+            stats.total_abs_error += error;
+            stats.max_abs_error = std::max(stats.max_abs_error, error);
+
+            size_t bucket = 0;
+            while (bucket + 1 < WAKE_ERROR_BUCKETS && error > std::chrono::microseconds(WAKE_ERROR_BOUNDS_US[bucket]))
+                bucket++;
+            stats.error_distribution[bucket]++;
+        }
+
+        Clock& clock;
+        PacerConfig config;
+        time_point anchor {};
+        std::chrono::nanoseconds spin_margin;
+        std::chrono::nanoseconds oversleep_ewma;
+        PacerStats stats;
+    };
+} // namespace pacing
@@ -0,0 +1,218 @@
+// Lock-free single-producer/single-consumer ring of interleaved int16 PCM.
+//
+// The audio thread resamples straight into the ring and the submit loop
+// reads contiguous spans out of it. Storage is allocated once up front; the
+// producer and consumer indices live on separate cache lines, and each side
+// keeps a cached copy of the other's index so the shared lines are only
+// touched when the cached view runs out.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace audio
+{
+    // Destructive interference size; std::hardware_destructive_interference_size
+    // isn't reliably available on the compilers we build with
+    constexpr size_t CACHE_LINE_SIZE = 64;
+
+    class PcmRing
+    {
+    public:
+        /// @brief A contiguous run of writable frames
+        struct WriteSpan
+        {
+            int16_t* samples;
+            size_t frames;
+        };
+
+        /// @brief A contiguous run of readable frames
+        struct ReadSpan
+        {
+            const int16_t* samples;
+            size_t frames;
+        };
+
+        /// @param capacity_frames How many frames (one sample per channel) the ring holds
+        /// @param channels Interleaved channel count
+        explicit PcmRing(size_t capacity_frames, uint16_t channels = 2)
+            : channel_count(channels)
+            , capacity_frames(capacity_frames)
+            , buffer(capacity_frames * channels)
+        {
+        }
+
+        PcmRing(const PcmRing&) = delete;
+        PcmRing& operator=(const PcmRing&) = delete;
+
+        uint16_t channels() const { return channel_count; }
+        size_t capacity() const { return capacity_frames; }
+
+        // Producer side
+
+        /// @brief Free frames as seen by the producer. The consumer's index is only
+        /// reloaded when the cached view has fewer than `wanted` free frames.
+        size_t writable_frames(size_t wanted = 1)
+        {
+            auto write = write_pos.load(std::memory_order_relaxed);
+            if (capacity_frames - (size_t)(write - cached_read_pos) < wanted)
+                cached_read_pos = read_pos.load(std::memory_order_acquire);
+            return capacity_frames - (size_t)(write - cached_read_pos);
+        }
+
+        /// @brief The next contiguous writable region; may be shorter than
+        /// `writable_frames()` when the free space wraps
+        WriteSpan writable()
+        {
+            auto free = writable_frames();
+            auto index = (size_t)(write_pos.load(std::memory_order_relaxed) % capacity_frames);
+            auto frames = std::min(free, capacity_frames - index);
+            return WriteSpan {buffer.data() + index * channel_count, frames};
+        }
+
+        /// @brief Publish `frames` frames written into the region from `writable()`
+        void commit(size_t frames)
+        {
+            write_pos.store(write_pos.load(std::memory_order_relaxed) + frames, std::memory_order_release);
+        }
+
+        /// @brief Frames written since the ring was created, as seen by the producer
+        uint64_t written_frames() const { return write_pos.load(std::memory_order_relaxed); }
+
+        /// @brief Copy in as many of `frames` as fit; the rest are dropped and counted
+        /// as an overrun
+        /// @return Frames written
+        size_t write(const int16_t* samples, size_t frames)
+        {
+            size_t written = 0;
+            while (written < frames)
+            {
+                auto span = writable();
+                if (span.frames == 0)
+                    break;
+
+                auto n = std::min(span.frames, frames - written);
+                memcpy(span.samples, samples + written * channel_count, n * channel_count * sizeof(int16_t));
+                commit(n);
+                written += n;
+            }
+
+            if (written < frames)
+                overruns.fetch_add(frames - written, std::memory_order_relaxed);
+
+            return written;
+        }
+
+        /// @brief As `write`, from PCM with `source_channels` channels: mono is
+        /// upmixed, and extra channels beyond the ring's are dropped
+        size_t write(const int16_t* samples, size_t frames, uint16_t source_channels)
+        {
+            if (source_channels == channel_count)
+                return write(samples, frames);
+
+            size_t written = 0;
+            while (written < frames)
+            {
+                auto span = writable();
+                if (span.frames == 0)
+                    break;
+
+                auto n = std::min(span.frames, frames - written);
+                for (size_t i = 0; i < n; i++)
+                    for (uint16_t c = 0; c < channel_count; c++)
+                        span.samples[i * channel_count + c] = samples[(written + i) * source_channels + std::min<uint16_t>(c, source_channels - 1)];
+                commit(n);
+                written += n;
+            }
+
+            if (written < frames)
+                overruns.fetch_add(frames - written, std::memory_order_relaxed);
+
+            return written;
+        }
+
+        // Consumer side
+
+        /// @brief Buffered frames as seen by the consumer. The producer's index is
+        /// only reloaded when the cached view has fewer than `wanted` frames.
+        size_t readable_frames(size_t wanted = 1)
+        {
+            auto read = read_pos.load(std::memory_order_relaxed);
+            if ((size_t)(cached_write_pos - read) < wanted)
+                cached_write_pos = write_pos.load(std::memory_order_acquire);
+            return (size_t)(cached_write_pos - read);
+        }
+
+        /// @brief The next contiguous readable region; may be shorter than
+        /// `readable_frames()` when the data wraps
+        ReadSpan readable()
+        {
+            auto available = readable_frames();
+            auto index = (size_t)(read_pos.load(std::memory_order_relaxed) % capacity_frames);
+            auto frames = std::min(available, capacity_frames - index);
+            return ReadSpan {buffer.data() + index * channel_count, frames};
+        }
+
+        /// @brief Release `frames` frames read from the region from `readable()`
+        void consume(size_t frames)
+        {
+            read_pos.store(read_pos.load(std::memory_order_relaxed) + frames, std::memory_order_release);
+        }
+
+        /// @brief Copy out up to `frames` frames; a short read is counted as an underrun
+        /// @return Frames read
+        size_t read(int16_t* samples, size_t frames)
+        {
+            size_t done = 0;
+            while (done < frames)
+            {
+                auto span = readable();
+                if (span.frames == 0)
+                    break;
+
+                auto n = std::min(span.frames, frames - done);
+                memcpy(samples + done * channel_count, span.samples, n * channel_count * sizeof(int16_t));
+                consume(n);
+                done += n;
+            }
+
+            if (done < frames)
+                note_underrun(frames - done);
+
+            return done;
+        }
+
+        /// @brief Record that the consumer wanted `frames` more frames than were buffered
+        void note_underrun(size_t frames)
+        {
+            underruns.fetch_add(frames, std::memory_order_relaxed);
+        }
+
+        /// @brief Frames the producer had to drop because the ring was full
+        uint64_t overrun_frames() const { return overruns.load(std::memory_order_relaxed); }
+
+        /// @brief Frames the consumer asked for that weren't there yet
+        uint64_t underrun_frames() const { return underruns.load(std::memory_order_relaxed); }
+
+    private:
+        const uint16_t channel_count;
+        const size_t capacity_frames;
+        std::vector<int16_t> buffer;
+
+        // Written by the producer. Positions are frame counts since creation; at
+        // 64 bits they never wrap in practice, so (write - read) is always the fill.
+        alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> write_pos {0};
+        uint64_t cached_read_pos = 0;
+
+        // Written by the consumer
+        alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> read_pos {0};
+        uint64_t cached_write_pos = 0;
+
+        alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> overruns {0};
+        std::atomic<uint64_t> underruns {0};
+    };
+} // namespace audio
@@ -0,0 +1,229 @@
+// The producer loop shared by every media backend.
+//
+// Paces decoded frames from a `source::DecodeAhead` against the media clock
+// and publishes them, together with the audio that has become due, to a
+// `fanout::MediaFanout`. MediaFoundation (Windows) and the raw Y4M/WAV reader
+// (everywhere) both run through here, so the headless player measures the
+// same submission and pacing path the real one uses. Given an
+// `avsync::SyncController`, the loop measures how far the audio it publishes
+// is from the video at every frame, and drops or repeats frames, or adjusts
+// the decoder's audio rate, as the controller decides; once the source lines
+// its audio up with the video again, that correction is undone.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+#include "av_sync.h"
+#include "frame_source.h"
+#include "media_fanout.h"
+#include "pacer.h"
+#include "player_metrics.h"
+#include "stream_lifecycle.h"
+
+namespace player
+{
+    struct ProducerConfig
+    {
+        /// @brief Rate and layout of the PCM in the decoder's ring
+        uint32_t sample_rate = 44100;
+        uint16_t channels = 2;
+        /// @brief Longest the loop waits between audio submissions, in 100ns units
+        int64_t audio_drain_interval = 100000;
+        /// @brief Return once both video and audio have run out, rather than
+        /// idling until stopped
+        bool stop_at_end = false;
+    };
+
+    /// @brief Publish frames and audio from `decoder` to `out` in real time
+    /// until `stop` is cancelled (or the media ends, if so configured). A
+    /// cancel wakes the loop from its pacing sleep at once.
+    /// @tparam Audio Chunk type with a `std::vector<uint8_t> pcm` and a `timestamp`
+    /// @param metrics Where to count and time the run, if anywhere
+    /// @param sync What keeps audio and video in step, if anything
+    /// @return Pacing statistics for the run
+    template <typename Video, typename Audio, typename Clock>
+    pacing::PacerStats run_producer(
+        fanout::MediaFanout<Video, Audio>& out,
+        source::DecodeAhead<Video>& decoder,
+        Clock& clock,
+        const lifecycle::CancellationToken& stop,
+        const ProducerConfig& config = {},
+        ProducerMetrics* metrics = nullptr,
+        avsync::SyncController* sync = nullptr)
+    {
+        auto& pcm = decoder.audio();
+        auto frame_bytes = (size_t)config.channels * sizeof(int16_t);
+
+        // Media time starts now; every deadline below is relative to this anchor
+        auto pacer = pacing::FramePacer<Clock> {clock};
+        pacer.start();
+        uint64_t audio_frames_sent = 0;
+
+        // Chunks that no stream references any more are recycled here, so in
+        // steady state we don't grow audio buffers
+        std::shared_ptr<Audio> audio = nullptr;
+
+        int64_t deadline = 0;
+
+        // Added to media time to find the frame that is due. Dropping a frame
+        // moves it on an interval and repeating one moves it back.
+        int64_t video_shift = 0;
+        uint64_t audio_resyncs = 0;
+        int64_t last_published = -1;
+        int64_t frame_interval = 0;
+        double audio_rate = 1.0;
+
+        while (!stop.cancelled())
+        {
+            // Sleep until the next frame (or audio) is due, rather than spinning
+            auto lateness = pacer.wait_until(pacing::MediaDuration {deadline}, &stop);
+            if (stop.cancelled())
+                break;
+            if (metrics)
+                metrics->pacing_error.record(lateness);
+
+            auto now = pacer.media_now().count();
+
+            // The audio gone out is in step with the video again, so the frames
+            // dropped or repeated for the drift before no longer apply; and
+            // it may come from a source that resamples where the last didn't
+            if (sync)
+            {
+                sync->set_resamplable(decoder.audio_resamplable(audio_frames_sent));
+                auto resyncs = decoder.audio_resyncs(audio_frames_sent);
+                if (resyncs != audio_resyncs)
+                {
+                    audio_resyncs = resyncs;
+                    video_shift = 0;
+                    sync->reset();
+                }
+            }
+
+            // Frames the decoder can't make room for are only given up once
+            // they're behind this
+            decoder.set_media_time(now + video_shift);
+
+            // Publish the newest frame that is due; any older due frames were too
+            // late to show. Dropped frames go back to the decoder's pool once
+            // nothing references them.
+            std::shared_ptr<Video> due = nullptr;
+            uint64_t late = 0;
+            while (auto next = decoder.peek_video())
+            {
+                if (next->timestamp > now + video_shift)
+                    break;
+
+                late += due ? 1 : 0;
+                due = decoder.pop_video();
+            }
+
+            if (metrics)
+            {
+                metrics->frames_late.add(late);
+                metrics->frames_published.add(due ? 1 : 0);
+            }
+
+            auto published = due ? (int64_t)due->timestamp : -1;
+            if (due)
+            {
+                if (last_published >= 0 && published > last_published)
+                    frame_interval = published - last_published;
+                last_published = published;
+                out.publish_video(std::move(due));
+            }
+
+            if (!audio)
+                audio = std::make_shared<Audio>();
+
+            // Drain the audio that has become due since stream start, one contiguous span at a time
+            auto audio_due = (uint64_t)now * config.sample_rate / 10000000;
+            auto wanted = (size_t)(audio_due - std::min(audio_due, audio_frames_sent));
+            size_t drained = 0;
+
+            audio->pcm.resize(0);
+            while (drained < wanted)
+            {
+                auto span = pcm.readable();
+                if (span.frames == 0)
+                {
+                    if (!decoder.audio_finished())
+                    {
+                        pcm.note_underrun(wanted - drained);
+                        if (metrics)
+                            metrics->audio_underrun_frames.add(wanted - drained);
+                    }
+                    break;
+                }
+
+                auto frames = std::min(span.frames, wanted - drained);
+                auto bytes = (const uint8_t*)span.samples;
+                audio->pcm.insert(audio->pcm.end(), bytes, bytes + frames * frame_bytes);
+                pcm.consume(frames);
+                drained += frames;
+            }
+
+            if (drained > 0)
+            {
+                // Timestamp chunks by their position in the stream rather than by decoder time
+                audio->timestamp = (decltype(audio->timestamp))(audio_frames_sent * 10000000 / config.sample_rate);
+                audio_frames_sent += drained;
+
+                auto evicted = out.publish_audio(std::move(audio));
+                if (evicted && evicted.use_count() == 1)
+                    audio = std::move(evicted);
+            }
+
+            // Compare the frame just published with the audio that has gone out
+            // with it, while there is audio to compare with
+            if (sync && published >= 0 && audio_frames_sent > 0 && !decoder.audio_finished())
+            {
+                auto audio_time = (int64_t)(audio_frames_sent * 10000000 / config.sample_rate) + decoder.audio_drift(audio_frames_sent);
+                auto action = sync->update(now, audio_time, published, frame_interval);
+                if (metrics)
+                {
+                    auto offset = audio_time - published;
+                    metrics->av_offset.record(std::chrono::nanoseconds {(offset < 0 ? -offset : offset) * 100});
+                }
+
+                if (action == avsync::Action::DropFrame)
+                {
+                    // The next frame is due now; pass over it here rather than
+                    // count it late at the next wake
+                    video_shift += frame_interval;
+                    auto next = decoder.peek_video();
+                    if (next && next->timestamp <= now + video_shift)
+                        decoder.pop_video();
+                    if (metrics)
+                        metrics->av_frames_dropped.add();
+                }
+                else if (action == avsync::Action::RepeatFrame)
+                {
+                    video_shift -= frame_interval;
+                    if (metrics)
+                        metrics->av_frames_repeated.add();
+                }
+
+                if (sync->audio_rate() != audio_rate)
+                {
+                    audio_rate = sync->audio_rate();
+                    decoder.adjust_audio_rate(audio_rate);
+                }
+            }
+
+            // Wake for the next video frame, or to drain audio, whichever is sooner
+            auto next_audio = now + config.audio_drain_interval;
+            auto next_video = decoder.peek_video();
+            deadline = next_video ? std::min<int64_t>(next_video->timestamp - video_shift, next_audio) : next_audio;
+
+            if (config.stop_at_end && decoder.video_finished() && decoder.audio_finished())
+                break;
+        }
+
+        return pacer.statistics();
+    }
+} // namespace player
@@ -0,0 +1,140 @@
+// What the player measures about itself, for capacity planning.
+//
+// Each decoded media (one producer, however many streams watch it) gets a
+// `ProducerMetrics` set and each stream a `StreamMetrics` set, both in a
+// `metrics::Registry` that is exported as Prometheus text (see
+// common/metrics.h). Counting and timing are relaxed atomic adds on the
+// thread doing the work; none of it locks.
+
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include "frame_source.h"
+#include "metrics.h"
+
+namespace player
+{
+    /// @brief Escape `value` for use inside a Prometheus label's quotes
+    inline std::string label_value(const std::string& value)
+    {
+        std::string escaped;
+        for (auto c : value)
+        {
+            if (c == '\\' || c == '"')
+                escaped += '\\';
+            if (c == '\n')
+            {
+                escaped += "\\n";
+                continue;
+            }
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    struct ProducerMetrics
+    {
+        explicit ProducerMetrics(std::shared_ptr<metrics::MetricSet> set)
+            : set(set)
+            , frames_read(set->counter("rainway_media_frames_read_total", "Video frames read from the source"))
+            , frames_published(set->counter("rainway_media_frames_published_total", "Video frames published to streams"))
+            , frames_late(set->counter("rainway_media_frames_late_total", "Decoded frames passed over because a later one was already due"))
+            , audio_underrun_frames(set->counter("rainway_media_audio_underrun_frames_total", "Audio frames that weren't decoded in time"))
+            , read_video(set->latency("rainway_media_read_video_seconds", "Time to read (decode, convert and copy) one video frame"))
+            , read_sample(set->latency("rainway_media_read_sample_seconds", "Time spent in ReadSample per video frame"))
+            , copy(set->latency("rainway_media_copy_seconds", "Time spent issuing the copy into an output texture"))
+            , pacing_error(set->latency("rainway_media_pacing_error_seconds", "How late the producer woke for each deadline"))
+            , av_offset(set->latency("rainway_media_av_offset_seconds", "How far apart audio and video were, either way, at each published frame"))
+            , av_frames_dropped(set->counter("rainway_media_av_frames_dropped_total", "Video frames dropped to catch up with the audio"))
+            , av_frames_repeated(set->counter("rainway_media_av_frames_repeated_total", "Video frames repeated to wait for the audio"))
+        {
+        }
+
+        std::shared_ptr<metrics::MetricSet> set;
+        metrics::Counter& frames_read;
+        metrics::Counter& frames_published;
+        metrics::Counter& frames_late;
+        metrics::Counter& audio_underrun_frames;
+        metrics::Histogram& read_video;
+        metrics::Histogram& read_sample;
+        metrics::Histogram& copy;
+        metrics::Histogram& pacing_error;
+        metrics::Histogram& av_offset;
+        metrics::Counter& av_frames_dropped;
+        metrics::Counter& av_frames_repeated;
+    };
+
+    struct StreamMetrics
+    {
+        explicit StreamMetrics(std::shared_ptr<metrics::MetricSet> set)
+            : set(set)
+            , video_submitted(set->counter("rainway_stream_video_frames_submitted_total", "Video frames submitted to the stream"))
+            , video_unchanged(set->counter("rainway_stream_video_frames_unchanged_total", "Video frames not submitted because the stream had already submitted the same picture"))
+            , audio_packets(set->counter("rainway_stream_audio_packets_submitted_total", "Audio packets submitted to the stream"))
+            , audio_frames(set->counter("rainway_stream_audio_frames_submitted_total", "Audio frames submitted to the stream"))
+            , submit_video(set->latency("rainway_stream_submit_video_seconds", "Time spent in SubmitVideo"))
+            , submit_audio(set->latency("rainway_stream_submit_audio_seconds", "Time spent in SubmitAudio"))
+            , first_frame(set->latency("rainway_stream_first_frame_seconds", "Time from the stream starting to its first video frame being submitted"))
+        {
+        }
+
+        /// @brief Note a video frame submitted, and the time to the first one
+        /// since `started`
+        void frame_submitted(std::chrono::steady_clock::time_point started)
+        {
+            if (video_submitted.value() == 0)
+                first_frame.record(std::chrono::steady_clock::now() - started);
+            video_submitted.add();
+        }
+
+        std::shared_ptr<metrics::MetricSet> set;
+        metrics::Counter& video_submitted;
+        metrics::Counter& video_unchanged;
+        metrics::Counter& audio_packets;
+        metrics::Counter& audio_frames;
+        metrics::Histogram& submit_video;
+        metrics::Histogram& submit_audio;
+        metrics::Histogram& first_frame;
+    };
+
+    /// @brief Counts and times the video reads of another source
+    template <typename Video>
+    class InstrumentedSource : public source::FrameSource<Video>
+    {
+    public:
+        InstrumentedSource(source::FrameSource<Video>& inner, ProducerMetrics& measured)
+            : inner(inner)
+            , measured(measured)
+        {
+        }
+
+        void on_decode_thread() override { inner.on_decode_thread(); }
+
+        source::VideoRead read_video(Video& frame) override
+        {
+            auto timer = metrics::ScopedTimer {&measured.read_video};
+            measured.frames_read.add();
+            return inner.read_video(frame);
+        }
+
+        bool skip_video() override { return inner.skip_video(); }
+
+        bool read_audio(audio::PcmRing& output, size_t max_frames) override
+        {
+            return inner.read_audio(output, max_frames);
+        }
+
+        bool seek(const source::SeekPoint& keyframe) override { return inner.seek(keyframe); }
+        int64_t audio_drift() const override { return inner.audio_drift(); }
+        uint64_t audio_resyncs() const override { return inner.audio_resyncs(); }
+        void adjust_audio_rate(double ratio) override { inner.adjust_audio_rate(ratio); }
+        bool audio_resamplable() const override { return inner.audio_resamplable(); }
+
+    private:
+        source::FrameSource<Video>& inner;
+        ProducerMetrics& measured;
+    };
+} // namespace player
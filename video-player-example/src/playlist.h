@@ -0,0 +1,605 @@
+// Gapless playback of a playlist.
+//
+// `PlaylistSource` plays a list of media one after another through a single
+// `FrameSource`, so one decode-ahead worker and one producer carry on from
+// item to item. While an item plays, the next one is opened on a background
+// thread and primed: its first few frames are decoded and its first audio is
+// read (which warms up a resampler), so moving on to it costs no more than an
+// ordinary frame read. Items change at a frame boundary, when the current
+// one's video ends. Timestamps carry on from the end of the item before, so
+// they only ever increase, and each item's audio is cut or padded with
+// silence to span exactly its video, so the audio never breaks and stays in
+// step with the video from one item to the next.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "frame_source.h"
+#include "pcm_ring.h"
+
+namespace playlist
+{
+    /// @brief Whether `path` names an M3U playlist rather than media
+    inline bool is_playlist(const std::string& path)
+    {
+        auto extension = std::filesystem::path(path).extension().string();
+        return extension == ".m3u" || extension == ".m3u8";
+    }
+
+    /// @brief The media paths an M3U playlist lists, one per line. Blank lines
+    /// and comments (#) are skipped, and relative paths are taken from the
+    /// playlist's directory.
+    inline std::vector<std::string> read_m3u(const std::string& path)
+    {
+        std::vector<std::string> items;
+        std::ifstream file(path);
+        auto directory = std::filesystem::path(path).parent_path();
+        std::string line;
+        for (auto first = true; std::getline(file, line); first = false)
+        {
+            if (first && line.compare(0, 3, "\xEF\xBB\xBF") == 0)
+                line.erase(0, 3);
+            while (!line.empty() && (line.back() == '\r' || line.back() == ' '))
+                line.pop_back();
+            if (line.empty() || line[0] == '#')
+                continue;
+
+            auto item = std::filesystem::path(line);
+            items.push_back(item.is_relative() ? (directory / item).string() : line);
+        }
+        return items;
+    }
+
+    /// @brief One opened playlist item
+    template <typename Video>
+    struct Item
+    {
+        /// @brief Plays the item, and owns whatever it reads from
+        std::unique_ptr<source::FrameSource<Video>> source;
+        /// @brief Length of the item in 100ns units, as probed when it was opened
+        int64_t duration = 0;
+    };
+
+    struct PlaylistConfig
+    {
+        /// @brief Go back to the first item after the last, rather than ending
+        bool loop = false;
+        /// @brief Produce audio; items without any of their own play silence
+        bool audio = true;
+        /// @brief Rate and channel count of the items' audio
+        uint32_t sample_rate = 44100;
+        uint16_t channels = 2;
+        /// @brief Audio read from an item at a time; must hold the most it
+        /// writes in one read
+        size_t audio_read_frames = 8192;
+        /// @brief Video frames decoded when an item is primed
+        size_t primed_frames = 2;
+    };
+
+    struct PlaylistStats
+    {
+        /// @brief Items that started playing
+        uint64_t items = 0;
+        /// @brief Items passed over because they couldn't be opened or had no video
+        uint64_t failed_opens = 0;
+        /// @brief Moves from one item to the next
+        uint64_t switches = 0;
+        /// @brief Switches that had to wait for the next item to finish priming
+        uint64_t switch_waits = 0;
+        /// @brief Time the decode thread spent switching, in nanoseconds
+        int64_t switch_time_total = 0;
+        int64_t switch_time_max = 0;
+        /// @brief Largest gap left in the timestamps at a switch, beyond one
+        /// frame interval, in 100ns units; non-zero when an item's video ends
+        /// before its probed duration
+        int64_t timestamp_gap_max = 0;
+        /// @brief Silent audio frames added where an item's audio ran short
+        uint64_t audio_frames_padded = 0;
+        /// @brief Audio frames dropped from before an item's first frame or after its end
+        uint64_t audio_frames_trimmed = 0;
+    };
+
+    /// @brief Plays the items of a playlist back to back
+    template <typename Video>
+    class PlaylistSource : public source::FrameSource<Video>
+    {
+    public:
+        /// @brief Opens item `index` of the playlist, on a background thread
+        /// @return false if the item can't be played
+        using Open = std::function<bool(size_t index, Item<Video>& item)>;
+        /// @brief Creates a frame to prime an item into. Primed frames are
+        /// swapped with the decoder's as they are read, and the decoder's are
+        /// reused for the next item, so only the first few are ever created.
+        using Allocate = std::function<Video()>;
+
+        /// @param count Items in the playlist
+        PlaylistSource(size_t count, Open open, PlaylistConfig config = {}, Allocate allocate = nullptr)
+            : count(count)
+            , open(std::move(open))
+            , config(config)
+            , allocate(std::move(allocate))
+            , silence(SILENCE_FRAMES * (size_t)config.channels, 0)
+        {
+        }
+
+        ~PlaylistSource()
+        {
+            if (preparer.joinable())
+                preparer.join();
+        }
+
+        PlaylistSource(const PlaylistSource&) = delete;
+        PlaylistSource& operator=(const PlaylistSource&) = delete;
+
+        PlaylistStats stats() const
+        {
+            auto result = PlaylistStats {};
+            result.items = counters.items.load(std::memory_order_relaxed);
+            result.failed_opens = counters.failed_opens.load(std::memory_order_relaxed);
+            result.switches = counters.switches.load(std::memory_order_relaxed);
+            result.switch_waits = counters.switch_waits.load(std::memory_order_relaxed);
+            result.switch_time_total = counters.switch_time_total.load(std::memory_order_relaxed);
+            result.switch_time_max = counters.switch_time_max.load(std::memory_order_relaxed);
+            result.timestamp_gap_max = counters.timestamp_gap_max.load(std::memory_order_relaxed);
+            result.audio_frames_padded = counters.audio_frames_padded.load(std::memory_order_relaxed);
+            result.audio_frames_trimmed = counters.audio_frames_trimmed.load(std::memory_order_relaxed);
+            return result;
+        }
+
+        /// @brief Passed on to the first item only; later items are read on
+        /// the same thread, and must not need it set up again
+        void on_decode_thread() override { decode_thread_pending = true; }
+
+        source::VideoRead read_video(Video& frame) override
+        {
+            start();
+            while (!video_finished)
+            {
+                auto& item = *playing.back();
+                auto read = read_item_video(item, frame);
+                if (read == source::VideoRead::Busy)
+                    return read;
+                if (read == source::VideoRead::Decoded)
+                {
+                    note_frame(item, (int64_t)frame.timestamp);
+                    frame.timestamp = (decltype(frame.timestamp))last_out;
+                    return read;
+                }
+                finish_video(item);
+            }
+            return source::VideoRead::Ended;
+        }
+
+        bool skip_video() override
+        {
+            start();
+            while (!video_finished)
+            {
+                auto& item = *playing.back();
+                if (skip_item_video(item))
+                {
+                    // A skipped frame's timestamp is never seen; assume it was on time
+                    note_frame(item, item.frames ? item.last_media + interval : item.first_timestamp);
+                    return true;
+                }
+                finish_video(item);
+            }
+            return false;
+        }
+
+        bool read_audio(audio::PcmRing& output, size_t max_frames) override
+        {
+            if (!config.audio)
+                return false;
+
+            start();
+            size_t written = 0;
+            while (written < max_frames && !playing.empty())
+            {
+                auto& item = *playing.front();
+                auto limit = audio_limit(item);
+                if (audio_out >= limit)
+                {
+                    // Until its video ends the item's length isn't settled
+                    if (!item.video_done)
+                        break;
+
+                    counters.audio_frames_trimmed.fetch_add(item.scratch.readable_frames(), std::memory_order_relaxed);
+                    retire_front();
+                    continue;
+                }
+
+                // The item's audio starts at media time 0, its output at its first frame
+                if (item.audio_trim > 0 && !item_audio_done(item))
+                {
+                    auto n = take(item, nullptr, (size_t)std::min<uint64_t>(item.audio_trim, item.scratch.capacity()));
+                    item.audio_trim -= n;
+                    counters.audio_frames_trimmed.fetch_add(n, std::memory_order_relaxed);
+                    if (n == 0 && !item_audio_done(item))
+                        break;
+                    continue;
+                }
+
+                auto wanted = (size_t)std::min<uint64_t>(max_frames - written, limit - audio_out);
+                if (item_audio_done(item))
+                {
+                    write_silence(output, wanted);
+                    written += wanted;
+                    continue;
+                }
+
+                auto n = take(item, &output, wanted);
+                written += n;
+                if (n == 0 && !item_audio_done(item))
+                    break;
+            }
+
+            return !playing.empty();
+        }
+
+        /// @brief The drift of the item whose audio is playing; each item's
+        /// audio is lined up with its video again when it starts
+        int64_t audio_drift() const override { return playing.empty() ? 0 : playing.front()->item.source->audio_drift(); }
+        uint64_t audio_resyncs() const override { return earlier_resyncs + (playing.empty() ? 0 : playing.front()->item.source->audio_resyncs()); }
+
+        /// @brief Passed on to each item as its audio is read
+        void adjust_audio_rate(double ratio) override { audio_rate = ratio; }
+        bool audio_resamplable() const override { return !playing.empty() && playing.front()->item.source->audio_resamplable(); }
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        static constexpr size_t SILENCE_FRAMES = 1024;
+
+        struct Playing
+        {
+            Playing(size_t audio_frames, uint16_t channels)
+                : scratch(std::max<size_t>(audio_frames, 1), channels)
+            {
+            }
+
+            Item<Video> item;
+            size_t index = 0;
+
+            // Frames decoded while priming, served before the item's own
+            std::vector<Video> primed;
+            size_t primed_read = 0;
+            bool source_video_ended = false;
+            int64_t first_timestamp = 0;
+
+            // Output time = media time + offset; the item plays from start to end
+            int64_t start = 0;
+            int64_t offset = 0;
+            int64_t end = 0;
+            bool video_done = false;
+            uint64_t frames = 0;
+            int64_t last_media = 0;
+
+            audio::PcmRing scratch;
+            bool audio_ended = false;
+            uint64_t audio_trim = 0;
+            double audio_rate = 1.0;
+        };
+
+        uint64_t audio_position(int64_t timestamp) const
+        {
+            return timestamp > 0 ? ((uint64_t)timestamp * config.sample_rate + 5000000) / 10000000 : 0;
+        }
+
+        // Where an item's audio stops: at its end once known, and its probed
+        // length until then (the end is never earlier)
+        uint64_t audio_limit(const Playing& item) const
+        {
+            return audio_position(item.video_done ? item.end : item.start + item.item.duration);
+        }
+
+        // Open the first item before the first read, waiting for it
+        void start()
+        {
+            if (started)
+                return;
+            started = true;
+
+            prepare(0);
+            if (!advance(0))
+                video_finished = true;
+        }
+
+        // Open and prime the first playable item from `index` on, on a background thread
+        void prepare(size_t index)
+        {
+            auto spares = std::move(spare_frames);
+            spare_frames.clear();
+
+            ready.store(false, std::memory_order_relaxed);
+            preparer = std::thread {[this, index, spares = std::move(spares)]() mutable {
+                prepared = open_item(index, spares);
+                ready.store(true, std::memory_order_release);
+            }};
+        }
+
+        std::unique_ptr<Playing> open_item(size_t index, std::vector<Video>& spares)
+        {
+            // Every item is tried once at most, so a playlist of bad files ends
+            for (size_t attempt = 0; attempt < count; attempt++, index++)
+            {
+                if (index >= count)
+                {
+                    if (!config.loop)
+                        break;
+                    index = 0;
+                }
+
+                auto playing = std::make_unique<Playing>(config.audio_read_frames, config.channels);
+                playing->index = index;
+                if (open(index, playing->item) && playing->item.source && prime(*playing, spares))
+                    return playing;
+                counters.failed_opens.fetch_add(1, std::memory_order_relaxed);
+            }
+            return nullptr;
+        }
+
+        bool prime(Playing& playing, std::vector<Video>& spares)
+        {
+            auto& source = *playing.item.source;
+            while (playing.primed.size() < std::max<size_t>(1, config.primed_frames))
+            {
+                auto frame = Video {};
+                if (!spares.empty())
+                {
+                    frame = std::move(spares.back());
+                    spares.pop_back();
+                }
+                else if (allocate)
+                {
+                    frame = allocate();
+                }
+
+                auto read = source.read_video(frame);
+                if (read == source::VideoRead::Busy)
+                {
+                    // A spare still in use elsewhere is let go of, and the
+                    // frame kept is read into the next one
+                    if (spares.empty() && !allocate)
+                        break;
+                    continue;
+                }
+                if (read == source::VideoRead::Ended)
+                {
+                    playing.source_video_ended = true;
+                    break;
+                }
+                playing.primed.push_back(std::move(frame));
+            }
+
+            if (playing.primed.empty())
+                return false;
+
+            playing.first_timestamp = (int64_t)playing.primed.front().timestamp;
+            if (config.audio)
+                playing.audio_ended = !source.read_audio(playing.scratch, playing.scratch.writable_frames());
+            return true;
+        }
+
+        // Start the prepared item playing at output time `at`
+        bool advance(int64_t at)
+        {
+            // The last item of a playlist that doesn't loop has nothing after it
+            if (!preparer.joinable())
+                return false;
+
+            auto began = Clock::now();
+            auto switching = counters.items.load(std::memory_order_relaxed) > 0;
+            if (switching && !ready.load(std::memory_order_acquire))
+                counters.switch_waits.fetch_add(1, std::memory_order_relaxed);
+
+            preparer.join();
+            auto next = std::move(prepared);
+            if (!next)
+                return false;
+
+            next->start = at;
+            next->offset = at - next->first_timestamp;
+            next->audio_trim = audio_position(next->first_timestamp);
+            if (decode_thread_pending)
+            {
+                decode_thread_pending = false;
+                next->item.source->on_decode_thread();
+            }
+
+            auto following = next->index + 1;
+            playing.push_back(std::move(next));
+            counters.items.fetch_add(1, std::memory_order_relaxed);
+            if (following < count || config.loop)
+                prepare(following);
+
+            if (switching)
+            {
+                auto took = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - began).count();
+                counters.switches.fetch_add(1, std::memory_order_relaxed);
+                counters.switch_time_total.fetch_add(took, std::memory_order_relaxed);
+                if (took > counters.switch_time_max.load(std::memory_order_relaxed))
+                    counters.switch_time_max.store(took, std::memory_order_relaxed);
+            }
+            return true;
+        }
+
+        source::VideoRead read_item_video(Playing& item, Video& frame)
+        {
+            if (item.primed_read < item.primed.size())
+            {
+                // The decoder's frame goes back into the spares for the next item
+                std::swap(frame, item.primed[item.primed_read++]);
+                release_primed(item);
+                return source::VideoRead::Decoded;
+            }
+            if (item.source_video_ended)
+                return source::VideoRead::Ended;
+            return item.item.source->read_video(frame);
+        }
+
+        bool skip_item_video(Playing& item)
+        {
+            if (item.primed_read < item.primed.size())
+            {
+                item.primed_read++;
+                release_primed(item);
+                return true;
+            }
+            return !item.source_video_ended && item.item.source->skip_video();
+        }
+
+        void release_primed(Playing& item)
+        {
+            if (item.primed_read < item.primed.size())
+                return;
+
+            for (auto& frame : item.primed)
+                spare_frames.push_back(std::move(frame));
+            item.primed.clear();
+            item.primed_read = 0;
+        }
+
+        void note_frame(Playing& item, int64_t media)
+        {
+            if (item.frames > 0 && media > item.last_media)
+                interval = media - item.last_media;
+            item.last_media = media;
+            item.frames++;
+
+            // Out of order timestamps are held back rather than repeated
+            last_out = std::max(media + item.offset, last_out + (have_out ? 1 : 0));
+            have_out = true;
+        }
+
+        // Settle where the item ends and move video on to the next
+        void finish_video(Playing& item)
+        {
+            item.video_done = true;
+            auto frame_end = last_out + interval;
+            item.end = std::max(item.start + item.item.duration, frame_end);
+
+            auto gap = item.end - frame_end;
+            if (gap > counters.timestamp_gap_max.load(std::memory_order_relaxed))
+                counters.timestamp_gap_max.store(gap, std::memory_order_relaxed);
+
+            if (!advance(item.end))
+                video_finished = true;
+            else if (!config.audio)
+                retire_front();
+        }
+
+        // Frames can still point into an item's buffers (views of a mapped
+        // file) while they wait to be sent, so an item is only destroyed once
+        // the one after it has finished too
+        void retire_front()
+        {
+            // The next item's audio starts in step with its video
+            earlier_resyncs += playing.front()->item.source->audio_resyncs() + 1;
+            retired = std::move(playing.front());
+            playing.pop_front();
+        }
+
+        bool item_audio_done(Playing& item) { return item.audio_ended && item.scratch.readable_frames() == 0; }
+
+        // Move up to `frames` of an item's audio to `output`, or drop them if
+        // there is no output
+        size_t take(Playing& item, audio::PcmRing* output, size_t frames)
+        {
+            if (item.scratch.readable_frames() == 0 && !item.audio_ended)
+            {
+                if (item.audio_rate != audio_rate)
+                {
+                    item.item.source->adjust_audio_rate(audio_rate);
+                    item.audio_rate = audio_rate;
+                }
+                item.audio_ended = !item.item.source->read_audio(item.scratch, item.scratch.writable_frames());
+            }
+
+            size_t moved = 0;
+            while (moved < frames)
+            {
+                auto span = item.scratch.readable();
+                if (span.frames == 0)
+                    break;
+
+                auto n = std::min(span.frames, frames - moved);
+                if (output)
+                    output->write(span.samples, n, config.channels);
+                item.scratch.consume(n);
+                moved += n;
+            }
+
+            if (output)
+                audio_out += moved;
+            return moved;
+        }
+
+        void write_silence(audio::PcmRing& output, size_t frames)
+        {
+            counters.audio_frames_padded.fetch_add(frames, std::memory_order_relaxed);
+            audio_out += frames;
+            while (frames > 0)
+            {
+                auto n = std::min(frames, SILENCE_FRAMES);
+                output.write(silence.data(), n, config.channels);
+                frames -= n;
+            }
+        }
+
+        size_t count;
+        Open open;
+        PlaylistConfig config;
+        Allocate allocate;
+        std::vector<int16_t> silence;
+
+        bool started = false;
+        bool decode_thread_pending = false;
+        bool video_finished = false;
+
+        // Items still playing: video plays the last, audio (which can lag
+        // behind by however much the decoder reads ahead) the first
+        std::deque<std::unique_ptr<Playing>> playing;
+        std::unique_ptr<Playing> retired;
+        std::vector<Video> spare_frames;
+        // Resyncs of the items whose audio has finished, and one for each start after them
+        uint64_t earlier_resyncs = 0;
+
+        std::thread preparer;
+        std::unique_ptr<Playing> prepared;
+        std::atomic<bool> ready {false};
+
+        int64_t interval = 0;
+        int64_t last_out = 0;
+        bool have_out = false;
+        uint64_t audio_out = 0;
+        double audio_rate = 1.0;
+
+        struct Counters
+        {
+            std::atomic<uint64_t> items {0};
+            std::atomic<uint64_t> failed_opens {0};
+            std::atomic<uint64_t> switches {0};
+            std::atomic<uint64_t> switch_waits {0};
+            std::atomic<int64_t> switch_time_total {0};
+            std::atomic<int64_t> switch_time_max {0};
+            std::atomic<int64_t> timestamp_gap_max {0};
+            std::atomic<uint64_t> audio_frames_padded {0};
+            std::atomic<uint64_t> audio_frames_trimmed {0};
+        };
+        Counters counters;
+    };
+} // namespace playlist
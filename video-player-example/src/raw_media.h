@@ -0,0 +1,496 @@
+// Memory-mapped raw media: uncompressed Y4M video and WAV PCM audio.
+//
+// A decode-free backend for the player. Files are mapped read-only and
+// frames and samples are handed out as views into the mapping, with
+// sequential read-ahead hints so the kernel streams pages in ahead of the
+// reader. It gives a baseline for the submission and pacing cost of a stream
+// with no decoder in the way, and runs anywhere, including headless Linux.
+
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#if defined(_WIN32)
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#include "frame_source.h"
+
+namespace raw
+{
+    /// @brief A read-only mapping of a whole file
+    class MappedFile
+    {
+    public:
+        MappedFile() = default;
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        MappedFile(MappedFile&& other) noexcept { swap(other); }
+        MappedFile& operator=(MappedFile&& other) noexcept
+        {
+            swap(other);
+            return *this;
+        }
+
+        ~MappedFile() { close(); }
+
+        /// @brief Map `path`, hinting that it will be read front to back
+        bool open(const std::string& path)
+        {
+            close();
+
+#if defined(_WIN32)
+            // FILE_FLAG_SEQUENTIAL_SCAN is Windows' read-ahead hint for the cache manager
+            file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            if (file == INVALID_HANDLE_VALUE)
+                return false;
+
+            LARGE_INTEGER file_size = {};
+            if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+            {
+                close();
+                return false;
+            }
+
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping == nullptr)
+            {
+                close();
+                return false;
+            }
+
+            bytes = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            length = (size_t)file_size.QuadPart;
+#else
+            file = ::open(path.c_str(), O_RDONLY);
+            if (file < 0)
+                return false;
+
+            struct stat info = {};
+            if (fstat(file, &info) != 0 || info.st_size == 0)
+            {
+                close();
+                return false;
+            }
+
+            length = (size_t)info.st_size;
+            auto address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, file, 0);
+            if (address == MAP_FAILED)
+            {
+                close();
+                return false;
+            }
+
+            bytes = (const uint8_t*)address;
+            madvise(address, length, MADV_SEQUENTIAL);
+#endif
+            if (bytes == nullptr)
+            {
+                close();
+                return false;
+            }
+
+            return true;
+        }
+
+        void close()
+        {
+#if defined(_WIN32)
+            if (bytes)
+                UnmapViewOfFile(bytes);
+            if (mapping)
+                CloseHandle(mapping);
+            if (file != INVALID_HANDLE_VALUE)
+                CloseHandle(file);
+            mapping = nullptr;
+            file = INVALID_HANDLE_VALUE;
+#else
+            if (bytes)
+                munmap((void*)bytes, length);
+            if (file >= 0)
+                ::close(file);
+            file = -1;
+#endif
+            bytes = nullptr;
+            length = 0;
+        }
+
+        /// @brief Ask for [offset, offset + len) to be paged in ahead of use
+        void will_need(size_t offset, size_t len) const
+        {
+#if !defined(_WIN32)
+            if (offset >= length)
+                return;
+
+            // madvise wants a page aligned start
+            auto page = (size_t)sysconf(_SC_PAGESIZE);
+            auto start = offset / page * page;
+            len = std::min(len + (offset - start), length - start);
+            madvise((void*)(bytes + start), len, MADV_WILLNEED);
+#else
+            (void)offset, (void)len;
+#endif
+        }
+
+        const uint8_t* data() const { return bytes; }
+        size_t size() const { return length; }
+
+    private:
+        void swap(MappedFile& other)
+        {
+            std::swap(file, other.file);
+#if defined(_WIN32)
+            std::swap(mapping, other.mapping);
+#endif
+            std::swap(bytes, other.bytes);
+            std::swap(length, other.length);
+        }
+
+#if defined(_WIN32)
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = nullptr;
+#else
+        int file = -1;
+#endif
+        const uint8_t* bytes = nullptr;
+        size_t length = 0;
+    };
+
+    /// @brief A view of one 8-bit I420 frame inside a mapped Y4M file
+    struct VideoFrame
+    {
+        const uint8_t* y = nullptr;
+        const uint8_t* u = nullptr;
+        const uint8_t* v = nullptr;
+        uint32_t y_stride = 0;
+        uint32_t uv_stride = 0;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        int64_t timestamp = 0;
+        /// @brief Id of the picture, the same for frames that show the same
+        /// pixels; 0 if unknown (see frame_changes.h)
+        uint64_t content = 0;
+    };
+
+    /// @brief Reads 8-bit 4:2:0 YUV4MPEG2 files
+    class Y4mReader
+    {
+    public:
+        /// @brief Map and parse `path`
+        /// @return false (with `error()` set) if the file isn't a supported Y4M
+        bool open(const std::string& path)
+        {
+            if (!file.open(path))
+                return fail("cannot open " + path);
+
+            auto data = (const char*)file.data();
+            auto end = data + file.size();
+            auto line_end = (const char*)memchr(data, '\n', file.size());
+            if (file.size() < 10 || memcmp(data, "YUV4MPEG2 ", 10) != 0 || line_end == nullptr)
+                return fail("not a YUV4MPEG2 file");
+
+            // Parse the space separated header parameters, tolerating runs of
+            // spaces and a CRLF line end
+            auto separator = [](char c) { return c == ' ' || c == '\r'; };
+            for (auto p = data + 10; p < line_end;)
+            {
+                if (separator(*p))
+                {
+                    p++;
+                    continue;
+                }
+
+                auto token_end = std::find_if(p, line_end, separator);
+                auto value = std::string(p + 1, token_end);
+                switch (*p)
+                {
+                    case 'W':
+                        frame_width = (uint32_t)strtoul(value.c_str(), nullptr, 10);
+                        break;
+                    case 'H':
+                        frame_height = (uint32_t)strtoul(value.c_str(), nullptr, 10);
+                        break;
+                    case 'F':
+                        sscanf(value.c_str(), "%u:%u", &rate_num, &rate_den);
+                        break;
+                    case 'C':
+                        // 420jpeg, 420mpeg2 and 420paldv differ only in chroma
+                        // siting; 420p9 up to 420p16 are more than 8 bits
+                        if (value.compare(0, 3, "420") != 0 || (value.size() > 4 && value[3] == 'p' && isdigit((unsigned char)value[4])))
+                            return fail("unsupported Y4M colourspace C" + value + " (only 8-bit 4:2:0 is)");
+                        break;
+                    case 'X':
+                        // ffmpeg's extension for the sample range; limited is the default
+                        if (value == "COLORRANGE=FULL")
+                            is_full_range = true;
+                        break;
+                    default:
+                        break;
+                }
+                p = token_end + 1;
+            }
+
+            if (frame_width == 0 || frame_height == 0 || rate_num == 0 || rate_den == 0)
+                return fail("Y4M header is missing W, H or F");
+
+            chroma_width = (frame_width + 1) / 2;
+            chroma_height = (frame_height + 1) / 2;
+            picture_bytes = (size_t)frame_width * frame_height + 2 * (size_t)chroma_width * chroma_height;
+            first_frame = (size_t)(line_end + 1 - data);
+
+            // Frames are "FRAME[ params]\n" followed by the picture. When the
+            // first frame has no parameters we assume none do, and index frames
+            // arithmetically; frame() still checks each header it lands on.
+            auto frame_header = (const char*)memchr(data + first_frame, '\n', std::min<size_t>(file.size() - first_frame, 256));
+            if (frame_header == nullptr || (size_t)(end - data) - first_frame < 5 || memcmp(data + first_frame, "FRAME", 5) != 0)
+                return fail("Y4M file has no frames");
+
+            header_bytes = (size_t)(frame_header + 1 - (data + first_frame));
+            if (header_bytes != 6)
+                return fail("Y4M frame parameters are not supported");
+
+            frames = (file.size() - first_frame) / (header_bytes + picture_bytes);
+            return true;
+        }
+
+        /// @brief View frame `index`, or an empty frame (null planes) if it is
+        /// out of range or malformed. Hints the following frames for read-ahead.
+        VideoFrame frame(uint64_t index) const
+        {
+            VideoFrame view;
+            if (index >= frames)
+                return view;
+
+            auto offset = first_frame + (size_t)index * (header_bytes + picture_bytes);
+            if (memcmp(file.data() + offset, "FRAME\n", 6) != 0)
+                return view;
+
+            file.will_need(offset + header_bytes + picture_bytes, READ_AHEAD_FRAMES * (header_bytes + picture_bytes));
+
+            auto picture = file.data() + offset + header_bytes;
+            view.y = picture;
+            view.u = view.y + (size_t)frame_width * frame_height;
+            view.v = view.u + (size_t)chroma_width * chroma_height;
+            view.y_stride = frame_width;
+            view.uv_stride = chroma_width;
+            view.width = frame_width;
+            view.height = frame_height;
+            view.timestamp = timestamp(index);
+            return view;
+        }
+
+        /// @brief Presentation time of frame `index` in 100ns units
+        int64_t timestamp(uint64_t index) const
+        {
+            return (int64_t)(index * 10000000ull * rate_den / rate_num);
+        }
+
+        uint64_t frame_count() const { return frames; }
+        uint32_t width() const { return frame_width; }
+        uint32_t height() const { return frame_height; }
+        double fps() const { return (double)rate_num / (double)rate_den; }
+        /// @brief Whether samples use the full [0, 255] range rather than studio range
+        bool full_range() const { return is_full_range; }
+        const std::string& error() const { return last_error; }
+
+    private:
+        // How many frames past the current one to ask the kernel to page in
+        static constexpr size_t READ_AHEAD_FRAMES = 4;
+
+        bool fail(std::string message)
+        {
+            last_error = std::move(message);
+            file.close();
+            return false;
+        }
+
+        MappedFile file;
+        uint32_t frame_width = 0;
+        uint32_t frame_height = 0;
+        bool is_full_range = false;
+        uint32_t chroma_width = 0;
+        uint32_t chroma_height = 0;
+        uint32_t rate_num = 0;
+        uint32_t rate_den = 0;
+        size_t first_frame = 0;
+        size_t header_bytes = 0;
+        size_t picture_bytes = 0;
+        uint64_t frames = 0;
+        std::string last_error;
+    };
+
+    /// @brief Reads 16-bit PCM WAV files (plain or WAVE_FORMAT_EXTENSIBLE)
+    class WavReader
+    {
+    public:
+        /// @brief Map and parse `path`
+        /// @return false (with `error()` set) if the file isn't 16-bit PCM WAV
+        bool open(const std::string& path)
+        {
+            if (!file.open(path))
+                return fail("cannot open " + path);
+
+            auto data = file.data();
+            auto size = file.size();
+            if (size < 12 || memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "WAVE", 4) != 0)
+                return fail("not a RIFF/WAVE file");
+
+            auto have_format = false;
+            for (size_t offset = 12; offset + 8 <= size;)
+            {
+                auto id = data + offset;
+                auto chunk_size = (size_t)read_u32(id + 4);
+                auto body = offset + 8;
+
+                if (memcmp(id, "fmt ", 4) == 0 && chunk_size >= 16 && body + 16 <= size)
+                {
+                    auto format = read_u16(data + body);
+                    channel_count = read_u16(data + body + 2);
+                    rate = read_u32(data + body + 4);
+                    auto bits = read_u16(data + body + 14);
+
+                    // WAVE_FORMAT_EXTENSIBLE keeps the real format at the start of its sub-format GUID
+                    if (format == 0xFFFE && chunk_size >= 26 && body + 26 <= size)
+                        format = read_u16(data + body + 24);
+
+                    if (format != 1 || bits != 16 || channel_count == 0)
+                        return fail("only 16-bit PCM WAV is supported");
+                    have_format = true;
+                }
+                else if (memcmp(id, "data", 4) == 0)
+                {
+                    if (!have_format)
+                        return fail("WAV data chunk precedes fmt chunk");
+
+                    // Streaming writers leave the size as 0 or 0xFFFFFFFF; use the rest of the file
+                    if (chunk_size == 0 || body + chunk_size > size)
+                        chunk_size = size - body;
+
+                    pcm = (const int16_t*)(data + body);
+                    total_frames = chunk_size / (2 * (size_t)channel_count);
+                    return true;
+                }
+
+                // Chunks are padded to an even length
+                offset = body + chunk_size + (chunk_size & 1);
+            }
+
+            return fail("WAV file has no data chunk");
+        }
+
+        /// @brief Interleaved samples of `frames` frames starting at `first`,
+        /// clamped to the end of the file
+        const int16_t* samples(uint64_t first, size_t& frames) const
+        {
+            first = std::min<uint64_t>(first, total_frames);
+            frames = (size_t)std::min<uint64_t>(frames, total_frames - first);
+            file.will_need((size_t)((const uint8_t*)(pcm + first * channel_count) - file.data()), READ_AHEAD_BYTES);
+            return pcm + first * channel_count;
+        }
+
+        uint16_t channels() const { return channel_count; }
+        uint32_t sample_rate() const { return rate; }
+        uint64_t frame_count() const { return total_frames; }
+        const std::string& error() const { return last_error; }
+
+    private:
+        static constexpr size_t READ_AHEAD_BYTES = 256 * 1024;
+
+        static uint16_t read_u16(const uint8_t* p) { return (uint16_t)(p[0] | p[1] << 8); }
+        static uint32_t read_u32(const uint8_t* p) { return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24; }
+
+        bool fail(std::string message)
+        {
+            last_error = std::move(message);
+            file.close();
+            return false;
+        }
+
+        MappedFile file;
+        const int16_t* pcm = nullptr;
+        uint16_t channel_count = 0;
+        uint32_t rate = 0;
+        uint64_t total_frames = 0;
+        std::string last_error;
+    };
+
+    /// @brief A `FrameSource` over a mapped Y4M file and optional WAV file.
+    /// Video frames are views into the mapping; audio is copied into the ring,
+    /// upmixed from mono or reduced to the first channels as needed. The WAV
+    /// must already be at the output sample rate.
+    class RawMediaSource : public source::FrameSource<VideoFrame>
+    {
+    public:
+        RawMediaSource(const Y4mReader& video, const WavReader* audio)
+            : video(video)
+            , audio(audio)
+        {
+        }
+
+        source::VideoRead read_video(VideoFrame& frame) override
+        {
+            if (next_frame >= video.frame_count())
+                return source::VideoRead::Ended;
+
+            frame = video.frame(next_frame++);
+            return frame.y != nullptr ? source::VideoRead::Decoded : source::VideoRead::Ended;
+        }
+
+        bool skip_video() override
+        {
+            if (next_frame >= video.frame_count())
+                return false;
+            next_frame++;
+            return true;
+        }
+
+        bool read_audio(audio::PcmRing& output, size_t max_frames) override
+        {
+            if (audio == nullptr)
+                return false;
+
+            auto frames = max_frames;
+            auto samples = audio->samples(next_audio, frames);
+            if (frames == 0)
+                return false;
+
+            output.write(samples, frames, audio->channels());
+
+            next_audio += frames;
+            return next_audio < audio->frame_count();
+        }
+
+        /// @brief Every frame of an uncompressed file is a keyframe
+        bool seek(const source::SeekPoint& keyframe) override
+        {
+            if (keyframe.frame >= video.frame_count())
+                return false;
+
+            next_frame = keyframe.frame;
+            if (audio != nullptr)
+            {
+                auto timestamp = video.timestamp(keyframe.frame);
+                next_audio = ((uint64_t)timestamp * audio->sample_rate() + 5000000) / 10000000;
+            }
+            return true;
+        }
+
+    private:
+        const Y4mReader& video;
+        const WavReader* audio;
+        uint64_t next_frame = 0;
+        uint64_t next_audio = 0;
+    };
+} // namespace raw
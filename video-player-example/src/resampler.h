@@ -0,0 +1,409 @@
+// Streaming polyphase windowed-sinc sample rate conversion.
+//
+// Converts interleaved int16 or float PCM between any two rates, keeping its
+// filter state across calls so audio can be fed in whatever chunks the
+// decoder produces. The ratio is reduced to L/M and, when L is small enough
+// (every common rate pair), one Kaiser-windowed sinc filter is precomputed
+// per output phase, so converting is a dot product per sample. Larger L
+// quantizes the phase to MAX_RESAMPLER_PHASES while positions stay exact.
+//
+// The ratio can be nudged a fraction of a percent either way while running,
+// to keep audio in step with a clock it has drifted from: the position then
+// moves on one phase more (or less) every so many outputs. A ratio with few
+// phases is refined to at least MIN_ADJUSTABLE_PHASES first, so each of
+// those moves is a small fraction of a frame.
+//
+// The dot product runs in AVX2, SSE2 or NEON, selected once at runtime.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#include "cpu_features.h"
+
+namespace audio
+{
+    /// @brief Filter length against latency and cost. Latency is half the filter
+    /// length in input frames: the resampler must see that far ahead.
+    enum class ResamplerQuality
+    {
+        /// @brief 16 taps, passband to 85% of Nyquist
+        Fast,
+        /// @brief 32 taps, passband to 90% of Nyquist
+        Balanced,
+        /// @brief 64 taps, passband to 94% of Nyquist
+        High,
+        /// @brief 128 taps, passband to 96% of Nyquist; comparable to the
+        /// Windows resampler MFT at a half filter length of 60
+        Best,
+    };
+
+    struct ResamplerPreset
+    {
+        uint32_t half_taps;
+        double passband;
+        double kaiser_beta;
+    };
+
+    inline ResamplerPreset resampler_preset(ResamplerQuality quality)
+    {
+        switch (quality)
+        {
+            case ResamplerQuality::Fast:
+                return ResamplerPreset {8, 0.85, 6.0};
+            case ResamplerQuality::Balanced:
+                return ResamplerPreset {16, 0.90, 7.5};
+            case ResamplerQuality::High:
+                return ResamplerPreset {32, 0.94, 9.0};
+            case ResamplerQuality::Best:
+            default:
+                return ResamplerPreset {64, 0.96, 10.5};
+        }
+    }
+
+    /// @brief Most filter phases precomputed for a conversion
+    constexpr uint32_t MAX_RESAMPLER_PHASES = 1024;
+
+    /// @brief Fewest phases a conversion is refined to once its rate is adjusted
+    constexpr uint32_t MIN_ADJUSTABLE_PHASES = 256;
+
+    /// @brief Most a rate adjustment can speed up or slow down the input
+    constexpr double MAX_RATE_ADJUSTMENT = 0.1;
+
+    /// @brief Dot product of `n` floats. One at a time; the reference the SIMD
+    /// kernels are checked against.
+    inline float dot_scalar(const float* a, const float* b, size_t n)
+    {
+        float sum = 0.0f;
+        for (size_t i = 0; i < n; i++)
+            sum += a[i] * b[i];
+        return sum;
+    }
+
+#if defined(CPU_X86)
+    /// @pre `n` is a multiple of 8
+    CPU_TARGET_SSE2 inline float dot_sse2(const float* a, const float* b, size_t n)
+    {
+        // Two accumulators to hide the add latency
+        auto sum0 = _mm_setzero_ps();
+        auto sum1 = _mm_setzero_ps();
+        for (size_t i = 0; i < n; i += 8)
+        {
+            sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+            sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+        }
+
+        auto sum = _mm_add_ps(sum0, sum1);
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+        return _mm_cvtss_f32(sum);
+    }
+
+    /// @pre `n` is a multiple of 16
+    CPU_TARGET_AVX2 inline float dot_avx2(const float* a, const float* b, size_t n)
+    {
+        auto sum0 = _mm256_setzero_ps();
+        auto sum1 = _mm256_setzero_ps();
+        for (size_t i = 0; i < n; i += 16)
+        {
+            sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+            sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+        }
+
+        auto sum8 = _mm256_add_ps(sum0, sum1);
+        auto sum = _mm_add_ps(_mm256_castps256_ps128(sum8), _mm256_extractf128_ps(sum8, 1));
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+        return _mm_cvtss_f32(sum);
+    }
+#endif
+
+#if defined(CPU_NEON)
+    /// @pre `n` is a multiple of 8
+    inline float dot_neon(const float* a, const float* b, size_t n)
+    {
+        auto sum0 = vdupq_n_f32(0.0f);
+        auto sum1 = vdupq_n_f32(0.0f);
+        for (size_t i = 0; i < n; i += 8)
+        {
+            sum0 = vmlaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+            sum1 = vmlaq_f32(sum1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+        }
+        return vaddvq_f32(vaddq_f32(sum0, sum1));
+    }
+#endif
+
+    using DotFn = float (*)(const float*, const float*, size_t);
+
+    /// @brief The fastest dot product `features` allows, for lengths that are a
+    /// multiple of 16
+    inline DotFn select_dot(const cpu::Features& features)
+    {
+#if defined(CPU_X86)
+        if (features.avx2)
+            return dot_avx2;
+        if (features.sse2)
+            return dot_sse2;
+#elif defined(CPU_NEON)
+        if (features.neon)
+            return dot_neon;
+#endif
+        (void)features;
+        return dot_scalar;
+    }
+
+    class Resampler
+    {
+    public:
+        /// @param channels Interleaved channel count of both input and output
+        /// @param dot Dot product kernel; the fastest available by default
+        Resampler(uint32_t input_rate, uint32_t output_rate, uint16_t channels, ResamplerQuality quality = ResamplerQuality::High, DotFn dot = nullptr)
+            : in_rate(input_rate)
+            , out_rate(output_rate)
+            , channel_count(channels)
+            , preset(resampler_preset(quality))
+            , taps(2 * preset.half_taps)
+            , dot(dot ? dot : select_dot(cpu::features()))
+            , history(channels)
+        {
+            auto divisor = std::gcd(input_rate, output_rate);
+            up = output_rate / divisor;
+            down = input_rate / divisor;
+            phases = std::min(up, MAX_RESAMPLER_PHASES);
+
+            build_filters();
+            reset();
+        }
+
+        uint32_t input_rate() const { return in_rate; }
+        uint32_t output_rate() const { return out_rate; }
+        uint16_t channels() const { return channel_count; }
+        size_t filter_length() const { return taps; }
+
+        /// @brief Input frames the resampler has to see past an output frame
+        /// before it can produce it
+        size_t latency() const { return preset.half_taps; }
+
+        /// @brief Queue interleaved int16 input
+        void push(const int16_t* samples, size_t frames)
+        {
+            for (uint16_t c = 0; c < channel_count; c++)
+            {
+                auto& line = history[c];
+                auto start = line.size();
+                line.resize(start + frames);
+                for (size_t i = 0; i < frames; i++)
+                    line[start + i] = (float)samples[i * channel_count + c];
+            }
+        }
+
+        /// @brief Queue interleaved float input, nominally in [-1, 1]
+        void push(const float* samples, size_t frames)
+        {
+            for (uint16_t c = 0; c < channel_count; c++)
+            {
+                auto& line = history[c];
+                auto start = line.size();
+                line.resize(start + frames);
+                for (size_t i = 0; i < frames; i++)
+                    line[start + i] = samples[i * channel_count + c] * 32768.0f;
+            }
+        }
+
+        /// @brief Queue enough silence for all input so far to come out; call at
+        /// the end of the stream
+        void flush()
+        {
+            for (auto& line : history)
+                line.resize(line.size() + preset.half_taps, 0.0f);
+        }
+
+        /// @brief Convert queued input into up to `max_frames` interleaved int16 frames
+        /// @return Frames written
+        size_t pull(int16_t* out, size_t max_frames)
+        {
+            return convert(max_frames, [&](size_t frame, uint16_t c, float value) {
+                value = std::min(std::max(value, -32768.0f), 32767.0f);
+                out[frame * channel_count + c] = (int16_t)std::lrint(value);
+            });
+        }
+
+        /// @brief Convert queued input into up to `max_frames` interleaved float frames
+        /// @return Frames written
+        size_t pull(float* out, size_t max_frames)
+        {
+            return convert(max_frames, [&](size_t frame, uint16_t c, float value) {
+                out[frame * channel_count + c] = value * (1.0f / 32768.0f);
+            });
+        }
+
+        /// @brief Output frames that queued input is enough for
+        size_t available() const
+        {
+            auto buffered = history[0].size();
+            if (position + taps > buffered)
+                return 0;
+
+            // Output n is at input position + (phase + n * down) / up
+            return (size_t)((((uint64_t)(buffered - taps - position) * up) + up - 1 - phase) / down) + 1;
+        }
+
+        /// @brief Drop all queued input, as at the start of a stream. A rate
+        /// adjustment stays as it is.
+        void reset()
+        {
+            // The first output lines up with the first input: pad the history
+            // so that input 0 sits at the centre of the first window
+            for (auto& line : history)
+                line.assign(preset.half_taps - 1, 0.0f);
+            position = 0;
+            phase = 0;
+            adjust_carry = 0.0;
+            skew_steps = 0;
+        }
+
+        /// @brief Consume input `ratio` times as fast as the rates say, from the
+        /// next output on: above 1 to catch up, below 1 to fall back. Clamped
+        /// to within MAX_RATE_ADJUSTMENT of 1.
+        void adjust_rate(double ratio)
+        {
+            ratio = std::min(std::max(ratio, 1.0 - MAX_RATE_ADJUSTMENT), 1.0 + MAX_RATE_ADJUSTMENT);
+            if (ratio != 1.0 && up < MIN_ADJUSTABLE_PHASES)
+                refine((MIN_ADJUSTABLE_PHASES + up - 1) / up);
+
+            // Extra phase steps per output
+            adjust_step = (ratio - 1.0) * (double)down;
+        }
+
+        /// @brief Input time consumed beyond what the rates alone account for
+        /// since the last reset, in 100ns units; negative when slowed
+        int64_t skew() const
+        {
+            return skew_steps * 10000000 / ((int64_t)up * in_rate);
+        }
+
+    private:
+        static double bessel_i0(double x)
+        {
+            double sum = 1.0, term = 1.0;
+            for (int k = 1; k < 50 && term > sum * 1e-12; k++)
+            {
+                term *= (x / (2.0 * k)) * (x / (2.0 * k));
+                sum += term;
+            }
+            return sum;
+        }
+
+        // Express the same ratio in `scale` times as many phases, so the
+        // position can be moved in finer steps
+        void refine(uint32_t scale)
+        {
+            up *= scale;
+            down *= scale;
+            phase *= scale;
+            skew_steps *= scale;
+            phases = std::min(up, MAX_RESAMPLER_PHASES);
+            build_filters();
+        }
+
+        void build_filters()
+        {
+            const auto pi = 3.14159265358979323846;
+            auto cutoff = 0.5 * preset.passband * std::min(1.0, (double)out_rate / (double)in_rate);
+            auto window_scale = 1.0 / bessel_i0(preset.kaiser_beta);
+
+            filters.resize((size_t)phases * taps);
+            for (uint32_t p = 0; p < phases; p++)
+            {
+                auto fraction = (double)p / (double)phases;
+                auto filter = filters.data() + (size_t)p * taps;
+
+                double sum = 0.0;
+                std::vector<double> h(taps);
+                for (size_t j = 0; j < taps; j++)
+                {
+                    // Distance of tap j from the output position, in input frames
+                    auto t = (double)j - (double)(preset.half_taps - 1) - fraction;
+                    auto x = 2.0 * cutoff * t;
+                    auto sinc = x == 0.0 ? 1.0 : std::sin(pi * x) / (pi * x);
+                    auto r = t / (double)preset.half_taps;
+                    auto window = bessel_i0(preset.kaiser_beta * std::sqrt(std::max(0.0, 1.0 - r * r))) * window_scale;
+                    h[j] = sinc * window;
+                    sum += h[j];
+                }
+
+                // Unity gain at DC for every phase
+                for (size_t j = 0; j < taps; j++)
+                    filter[j] = (float)(h[j] / sum);
+            }
+        }
+
+        template <typename Store>
+        size_t convert(size_t max_frames, Store store)
+        {
+            auto buffered = history[0].size();
+            size_t produced = 0;
+            while (produced < max_frames && position + taps <= buffered)
+            {
+                auto filter_index = phases == up ? phase : (uint32_t)((uint64_t)phase * phases / up);
+                auto filter = filters.data() + (size_t)filter_index * taps;
+                for (uint16_t c = 0; c < channel_count; c++)
+                    store(produced, c, dot(history[c].data() + position, filter, taps));
+                produced++;
+
+                phase += down;
+                if (adjust_step != 0.0)
+                {
+                    // Whole phase steps of the adjustment so far; never more
+                    // than `down` back, so the phase can't go negative
+                    adjust_carry += adjust_step;
+                    auto steps = (int64_t)adjust_carry;
+                    adjust_carry -= (double)steps;
+                    skew_steps += steps;
+                    phase = (uint32_t)((int64_t)phase + steps);
+                }
+                position += phase / up;
+                phase %= up;
+            }
+
+            // Drop input no future window reaches
+            if (position > 0)
+            {
+                for (auto& line : history)
+                    line.erase(line.begin(), line.begin() + (ptrdiff_t)std::min(position, line.size()));
+                position -= std::min(position, buffered);
+            }
+
+            return produced;
+        }
+
+        uint32_t in_rate;
+        uint32_t out_rate;
+        uint16_t channel_count;
+        ResamplerPreset preset;
+        size_t taps;
+        DotFn dot;
+
+        uint32_t up = 1;
+        uint32_t down = 1;
+        uint32_t phases = 1;
+        std::vector<float> filters;
+
+        // Queued input, one line per channel; `position` is the first frame of the
+        // next output's window and `phase` its offset from there in 1/up frames
+        std::vector<std::vector<float>> history;
+        size_t position = 0;
+        uint32_t phase = 0;
+
+        // Extra phase steps per output of the rate adjustment, the fraction of
+        // a step carried to the next output, and the steps taken since reset
+        double adjust_step = 0.0;
+        double adjust_carry = 0.0;
+        int64_t skew_steps = 0;
+    };
+} // namespace audio
@@ -0,0 +1,561 @@
+// BGRA picture scaling and letterboxing on the CPU.
+//
+// A `Scaler` resizes 32-bit BGRA pictures with a separable filter: bilinear
+// (two taps per axis) or area averaging (every source pixel an output pixel
+// covers, weighted by how much of it is covered), which is what downscaling
+// by large factors wants. The taps for each output column and row are
+// computed once, so scaling a frame is a horizontal pass into 16-bit rows
+// followed by a vertical pass out of a small ring of them.
+//
+// Weights are 14-bit fixed point and every kernel does the same integer
+// arithmetic, so the AVX2, SSE4.1 and NEON passes produce exactly the bytes
+// the scalar reference does.
+//
+// A `Letterbox` fits a picture inside an output of a fixed size, keeping its
+// aspect ratio and filling the bars with black.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "cpu_features.h"
+
+namespace scale
+{
+    enum class Filter
+    {
+        Bilinear,
+        Area,
+    };
+
+    /// @brief Area averaging when shrinking, bilinear otherwise
+    inline Filter default_filter(uint32_t src_width, uint32_t src_height, uint32_t dst_width, uint32_t dst_height)
+    {
+        return dst_width < src_width || dst_height < src_height ? Filter::Area : Filter::Bilinear;
+    }
+
+    struct Rect
+    {
+        uint32_t x = 0;
+        uint32_t y = 0;
+        uint32_t width = 0;
+        uint32_t height = 0;
+
+        bool operator==(const Rect& other) const
+        {
+            return x == other.x && y == other.y && width == other.width && height == other.height;
+        }
+        bool operator!=(const Rect& other) const { return !(*this == other); }
+    };
+
+    /// @brief Where a `width` x `height` picture goes inside a `box_width` x
+    /// `box_height` output: shrunk to fit if it's bigger, keeping its aspect
+    /// ratio, and centred. Pictures that already fit keep their size. Sizes and
+    /// offsets are even, as 4:2:0 encoders want.
+    inline Rect fit(uint32_t width, uint32_t height, uint32_t box_width, uint32_t box_height)
+    {
+        auto fitted_width = width;
+        auto fitted_height = height;
+        if (width > box_width || height > box_height)
+        {
+            if ((uint64_t)width * box_height > (uint64_t)height * box_width)
+            {
+                fitted_width = box_width;
+                fitted_height = (uint32_t)(((uint64_t)height * box_width + width / 2) / width);
+            }
+            else
+            {
+                fitted_height = box_height;
+                fitted_width = (uint32_t)(((uint64_t)width * box_height + height / 2) / height);
+            }
+        }
+
+        Rect rect;
+        rect.width = std::min(box_width, std::max(2u, fitted_width & ~1u));
+        rect.height = std::min(box_height, std::max(2u, fitted_height & ~1u));
+        rect.x = ((box_width - rect.width) / 2) & ~1u;
+        rect.y = ((box_height - rect.height) / 2) & ~1u;
+        return rect;
+    }
+
+    constexpr int WEIGHT_SHIFT = 14;
+    // The horizontal pass keeps this many fractional bits in its 16-bit output
+    constexpr int INTERMEDIATE_BITS = 7;
+    constexpr int HORIZONTAL_SHIFT = WEIGHT_SHIFT - INTERMEDIATE_BITS;
+    constexpr int VERTICAL_SHIFT = WEIGHT_SHIFT + INTERMEDIATE_BITS;
+
+    /// @brief Where each output pixel along one axis reads from: `count` taps
+    /// per output starting at `starts[i]`, with WEIGHT_SHIFT fixed-point weights
+    /// summing to exactly 1 << WEIGHT_SHIFT
+    struct Taps
+    {
+        size_t count = 0;
+        std::vector<uint32_t> starts;
+        std::vector<int16_t> weights;
+    };
+
+    /// @brief Filter taps for resampling `src` pixels to `dst` along one axis.
+    /// The tap count is rounded up to even where the axis allows, as the SIMD
+    /// passes take taps in pairs, and every window lies inside the source.
+    inline Taps make_taps(uint32_t src, uint32_t dst, Filter filter)
+    {
+        auto ratio = (double)src / (double)dst;
+
+        // Continuous weights for every output, gathered first so the tap count is known
+        std::vector<std::vector<std::pair<uint32_t, double>>> windows(dst);
+        size_t widest = 1;
+        for (uint32_t i = 0; i < dst; i++)
+        {
+            auto& window = windows[i];
+            if (filter == Filter::Bilinear)
+            {
+                auto centre = std::max(0.0, (i + 0.5) * ratio - 0.5);
+                auto first = std::min((uint32_t)centre, src - 1);
+                auto fraction = centre - first;
+                if (first + 1 < src && fraction > 0.0)
+                {
+                    window.emplace_back(first, 1.0 - fraction);
+                    window.emplace_back(first + 1, fraction);
+                }
+                else
+                {
+                    window.emplace_back(first, 1.0);
+                }
+            }
+            else
+            {
+                auto low = i * ratio;
+                auto high = std::min((double)src, (i + 1) * ratio);
+                for (auto j = (uint32_t)low; j < src && j < high; j++)
+                {
+                    auto covered = std::min(high, j + 1.0) - std::max(low, (double)j);
+                    if (covered > 1e-9)
+                        window.emplace_back(j, covered / ratio);
+                }
+            }
+            widest = std::max(widest, (size_t)(window.back().first - window.front().first + 1));
+        }
+
+        Taps taps;
+        taps.count = std::min<size_t>(src, (widest + 1) & ~(size_t)1);
+        taps.starts.resize(dst);
+        taps.weights.assign((size_t)dst * taps.count, 0);
+
+        for (uint32_t i = 0; i < dst; i++)
+        {
+            auto& window = windows[i];
+            auto start = std::min<uint32_t>(window.front().first, src - (uint32_t)taps.count);
+            taps.starts[i] = start;
+
+            auto weights = taps.weights.data() + (size_t)i * taps.count;
+            int32_t total = 0;
+            size_t largest = 0;
+            for (auto& [index, weight] : window)
+            {
+                auto k = index - start;
+                weights[k] = (int16_t)std::lround(weight * (1 << WEIGHT_SHIFT));
+                total += weights[k];
+                if (weights[k] > weights[largest])
+                    largest = k;
+            }
+
+            // Rounding mustn't change the overall gain
+            weights[largest] = (int16_t)(weights[largest] + (1 << WEIGHT_SHIFT) - total);
+        }
+
+        return taps;
+    }
+
+    /// @brief Filter one BGRA row horizontally into `width` pixels of 16-bit
+    /// values with INTERMEDIATE_BITS fractional bits
+    using HorizontalFn = void (*)(const uint8_t* src, int16_t* dst, size_t width, const uint32_t* starts, const int16_t* weights, size_t taps);
+
+    /// @brief Filter `count` values vertically out of `taps` intermediate rows into bytes
+    using VerticalFn = void (*)(const int16_t* const* rows, const int16_t* weights, size_t taps, uint8_t* dst, size_t count);
+
+    /// @brief One tap at a time; the reference the SIMD passes are checked against
+    inline void horizontal_scalar(const uint8_t* src, int16_t* dst, size_t width, const uint32_t* starts, const int16_t* weights, size_t taps)
+    {
+        for (size_t x = 0; x < width; x++)
+        {
+            auto pixels = src + (size_t)starts[x] * 4;
+            auto w = weights + x * taps;
+            for (int c = 0; c < 4; c++)
+            {
+                int32_t sum = 0;
+                for (size_t k = 0; k < taps; k++)
+                    sum += w[k] * pixels[k * 4 + c];
+                dst[x * 4 + c] = (int16_t)((sum + (1 << (HORIZONTAL_SHIFT - 1))) >> HORIZONTAL_SHIFT);
+            }
+        }
+    }
+
+    /// @brief The vertical pass over values [begin, end), for the SIMD passes' tails
+    inline void vertical_range(const int16_t* const* rows, const int16_t* weights, size_t taps, uint8_t* dst, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            int32_t sum = 0;
+            for (size_t k = 0; k < taps; k++)
+                sum += weights[k] * rows[k][i];
+            auto value = (sum + (1 << (VERTICAL_SHIFT - 1))) >> VERTICAL_SHIFT;
+            dst[i] = (uint8_t)std::min(std::max(value, 0), 255);
+        }
+    }
+
+    inline void vertical_scalar(const int16_t* const* rows, const int16_t* weights, size_t taps, uint8_t* dst, size_t count)
+    {
+        vertical_range(rows, weights, taps, dst, 0, count);
+    }
+
+    /// @brief Two adjacent int16 weights as one int32, the layout madd wants
+    inline int32_t weight_pair(const int16_t* weights)
+    {
+        int32_t pair;
+        memcpy(&pair, weights, sizeof(pair));
+        return pair;
+    }
+
+#if defined(CPU_X86)
+    /// @pre `taps` is even
+    CPU_TARGET_SSE41 inline void horizontal_sse41(const uint8_t* src, int16_t* dst, size_t width, const uint32_t* starts, const int16_t* weights, size_t taps)
+    {
+        // Two BGRA pixels to (B0 B1 G0 G1 R0 R1 A0 A1), so madd sums each channel over the pair
+        const auto pair_channels = _mm_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+        const auto round = _mm_set1_epi32(1 << (HORIZONTAL_SHIFT - 1));
+
+        for (size_t x = 0; x < width; x++)
+        {
+            auto pixels = src + (size_t)starts[x] * 4;
+            auto w = weights + x * taps;
+            auto sum = _mm_setzero_si128();
+            for (size_t k = 0; k < taps; k += 2)
+            {
+                auto pair = _mm_loadl_epi64((const __m128i*)(pixels + k * 4));
+                pair = _mm_cvtepu8_epi16(_mm_shuffle_epi8(pair, pair_channels));
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(pair, _mm_set1_epi32(weight_pair(w + k))));
+            }
+
+            sum = _mm_srai_epi32(_mm_add_epi32(sum, round), HORIZONTAL_SHIFT);
+            _mm_storel_epi64((__m128i*)(dst + x * 4), _mm_packus_epi32(sum, sum));
+        }
+    }
+
+    /// @pre `taps` is even
+    CPU_TARGET_SSE41 inline void vertical_sse41(const int16_t* const* rows, const int16_t* weights, size_t taps, uint8_t* dst, size_t count)
+    {
+        const auto round = _mm_set1_epi32(1 << (VERTICAL_SHIFT - 1));
+
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8)
+        {
+            auto low = _mm_setzero_si128();
+            auto high = _mm_setzero_si128();
+            for (size_t k = 0; k < taps; k += 2)
+            {
+                auto a = _mm_loadu_si128((const __m128i*)(rows[k] + i));
+                auto b = _mm_loadu_si128((const __m128i*)(rows[k + 1] + i));
+                auto w = _mm_set1_epi32(weight_pair(weights + k));
+                low = _mm_add_epi32(low, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+                high = _mm_add_epi32(high, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+            }
+
+            low = _mm_srai_epi32(_mm_add_epi32(low, round), VERTICAL_SHIFT);
+            high = _mm_srai_epi32(_mm_add_epi32(high, round), VERTICAL_SHIFT);
+            auto words = _mm_packus_epi32(low, high);
+            _mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(words, words));
+        }
+
+        vertical_range(rows, weights, taps, dst, i, count);
+    }
+
+    /// @pre `taps` is even
+    CPU_TARGET_AVX2 inline void horizontal_avx2(const uint8_t* src, int16_t* dst, size_t width, const uint32_t* starts, const int16_t* weights, size_t taps)
+    {
+        // As in SSE4.1, but two output pixels at a time, one per 128-bit lane
+        const auto pair_channels = _mm_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15);
+        const auto round = _mm256_set1_epi32(1 << (HORIZONTAL_SHIFT - 1));
+
+        size_t x = 0;
+        for (; x + 2 <= width; x += 2)
+        {
+            auto first = src + (size_t)starts[x] * 4;
+            auto second = src + (size_t)starts[x + 1] * 4;
+            auto w0 = weights + x * taps;
+            auto w1 = w0 + taps;
+            auto sum = _mm256_setzero_si256();
+            for (size_t k = 0; k < taps; k += 2)
+            {
+                auto pairs = _mm_unpacklo_epi64(
+                    _mm_loadl_epi64((const __m128i*)(first + k * 4)),
+                    _mm_loadl_epi64((const __m128i*)(second + k * 4)));
+                auto widened = _mm256_cvtepu8_epi16(_mm_shuffle_epi8(pairs, pair_channels));
+                auto w = _mm256_inserti128_si256(
+                    _mm256_castsi128_si256(_mm_set1_epi32(weight_pair(w0 + k))),
+                    _mm_set1_epi32(weight_pair(w1 + k)),
+                    1);
+                sum = _mm256_add_epi32(sum, _mm256_madd_epi16(widened, w));
+            }
+
+            sum = _mm256_srai_epi32(_mm256_add_epi32(sum, round), HORIZONTAL_SHIFT);
+            auto words = _mm256_permute4x64_epi64(_mm256_packus_epi32(sum, sum), 0x08);
+            _mm_storeu_si128((__m128i*)(dst + x * 4), _mm256_castsi256_si128(words));
+        }
+
+        if (x < width)
+            horizontal_sse41(src, dst + x * 4, width - x, starts + x, weights + x * taps, taps);
+    }
+
+    /// @pre `taps` is even
+    CPU_TARGET_AVX2 inline void vertical_avx2(const int16_t* const* rows, const int16_t* weights, size_t taps, uint8_t* dst, size_t count)
+    {
+        const auto round = _mm256_set1_epi32(1 << (VERTICAL_SHIFT - 1));
+
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            auto low = _mm256_setzero_si256();
+            auto high = _mm256_setzero_si256();
+            for (size_t k = 0; k < taps; k += 2)
+            {
+                auto a = _mm256_loadu_si256((const __m256i*)(rows[k] + i));
+                auto b = _mm256_loadu_si256((const __m256i*)(rows[k + 1] + i));
+                auto w = _mm256_set1_epi32(weight_pair(weights + k));
+                low = _mm256_add_epi32(low, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+                high = _mm256_add_epi32(high, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+            }
+
+            // The unpacks and packs both work within lanes, so the order comes back out right
+            low = _mm256_srai_epi32(_mm256_add_epi32(low, round), VERTICAL_SHIFT);
+            high = _mm256_srai_epi32(_mm256_add_epi32(high, round), VERTICAL_SHIFT);
+            auto words = _mm256_packus_epi32(low, high);
+            auto bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0x08);
+            _mm_storeu_si128((__m128i*)(dst + i), _mm256_castsi256_si128(bytes));
+        }
+
+        vertical_range(rows, weights, taps, dst, i, count);
+    }
+#endif
+
+#if defined(CPU_NEON)
+    inline void horizontal_neon(const uint8_t* src, int16_t* dst, size_t width, const uint32_t* starts, const int16_t* weights, size_t taps)
+    {
+        for (size_t x = 0; x < width; x++)
+        {
+            auto pixels = src + (size_t)starts[x] * 4;
+            auto w = weights + x * taps;
+            auto sum = vdupq_n_s32(0);
+            for (size_t k = 0; k < taps; k++)
+            {
+                uint32_t pixel;
+                memcpy(&pixel, pixels + k * 4, sizeof(pixel));
+                auto channels = vreinterpret_s16_u16(vget_low_u16(vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(pixel)))));
+                sum = vmlal_n_s16(sum, channels, w[k]);
+            }
+
+            // Rounding shift, as the scalar pass's add and shift
+            auto words = vqmovun_s32(vrshrq_n_s32(sum, HORIZONTAL_SHIFT));
+            vst1_s16(dst + x * 4, vreinterpret_s16_u16(words));
+        }
+    }
+
+    inline void vertical_neon(const int16_t* const* rows, const int16_t* weights, size_t taps, uint8_t* dst, size_t count)
+    {
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8)
+        {
+            auto low = vdupq_n_s32(0);
+            auto high = vdupq_n_s32(0);
+            for (size_t k = 0; k < taps; k++)
+            {
+                auto values = vld1q_s16(rows[k] + i);
+                low = vmlal_n_s16(low, vget_low_s16(values), weights[k]);
+                high = vmlal_n_s16(high, vget_high_s16(values), weights[k]);
+            }
+
+            auto words = vcombine_u16(vqmovun_s32(vrshrq_n_s32(low, VERTICAL_SHIFT)), vqmovun_s32(vrshrq_n_s32(high, VERTICAL_SHIFT)));
+            vst1_u8(dst + i, vqmovn_u16(words));
+        }
+
+        vertical_range(rows, weights, taps, dst, i, count);
+    }
+#endif
+
+    struct Kernels
+    {
+        HorizontalFn horizontal;
+        VerticalFn vertical;
+    };
+
+    /// @brief The fastest kernels `features` allows, for even tap counts
+    inline Kernels select_kernels(const cpu::Features& features)
+    {
+#if defined(CPU_X86)
+        if (features.avx2)
+            return Kernels {horizontal_avx2, vertical_avx2};
+        if (features.sse41)
+            return Kernels {horizontal_sse41, vertical_sse41};
+#elif defined(CPU_NEON)
+        if (features.neon)
+            return Kernels {horizontal_neon, vertical_neon};
+#endif
+        (void)features;
+        return Kernels {horizontal_scalar, vertical_scalar};
+    }
+
+    /// @brief The fastest kernels this CPU supports
+    inline const Kernels& kernels()
+    {
+        static const auto selected = select_kernels(cpu::features());
+        return selected;
+    }
+
+    /// @brief Resizes BGRA pictures of one size to another. Keeps scratch rows
+    /// between calls, so use one per thread.
+    class Scaler
+    {
+    public:
+        /// @param kernels Passes to use; the fastest available by default
+        Scaler(uint32_t src_width, uint32_t src_height, uint32_t dst_width, uint32_t dst_height, Filter filter, const Kernels& kernels = scale::kernels())
+            : src_w(src_width)
+            , src_h(src_height)
+            , dst_w(dst_width)
+            , dst_h(dst_height)
+            , columns(make_taps(src_width, dst_width, filter))
+            , rows(make_taps(src_height, dst_height, filter))
+            , passes(kernels)
+        {
+            // Tiny sources can leave an odd tap count, which only the scalar passes take
+            if (columns.count % 2 != 0)
+                passes.horizontal = horizontal_scalar;
+            if (rows.count % 2 != 0)
+                passes.vertical = vertical_scalar;
+
+            window.resize(rows.count);
+            ring.resize(rows.count);
+            for (auto& line : ring)
+                line.resize((size_t)dst_w * 4);
+            ring_rows.assign(ring.size(), UINT32_MAX);
+        }
+
+        uint32_t src_width() const { return src_w; }
+        uint32_t src_height() const { return src_h; }
+        uint32_t dst_width() const { return dst_w; }
+        uint32_t dst_height() const { return dst_h; }
+
+        /// @brief Scale a whole picture
+        void run(const uint8_t* src, size_t src_stride, uint8_t* dst, size_t dst_stride)
+        {
+            for (uint32_t y = 0; y < dst_h; y++)
+            {
+                auto start = rows.starts[y];
+                for (size_t k = 0; k < rows.count; k++)
+                {
+                    // Windows only move forward, so a row evicted from the ring isn't needed again
+                    auto row = start + (uint32_t)k;
+                    auto slot = row % ring.size();
+                    if (ring_rows[slot] != row)
+                    {
+                        passes.horizontal(src + row * src_stride, ring[slot].data(), dst_w, columns.starts.data(), columns.weights.data(), columns.count);
+                        ring_rows[slot] = row;
+                    }
+                    window[k] = ring[slot].data();
+                }
+
+                passes.vertical(window.data(), rows.weights.data() + (size_t)y * rows.count, rows.count, dst + y * dst_stride, (size_t)dst_w * 4);
+            }
+
+            // The next picture's rows are new
+            std::fill(ring_rows.begin(), ring_rows.end(), UINT32_MAX);
+        }
+
+    private:
+        uint32_t src_w;
+        uint32_t src_h;
+        uint32_t dst_w;
+        uint32_t dst_h;
+        Taps columns;
+        Taps rows;
+        Kernels passes;
+
+        // Horizontally filtered source rows; `ring_rows` says which is in each slot
+        std::vector<std::vector<int16_t>> ring;
+        std::vector<uint32_t> ring_rows;
+        std::vector<const int16_t*> window;
+    };
+
+    /// @brief Puts BGRA pictures of one size into an output of another, shrunk
+    /// to fit if needed (see `fit`) with black bars around them
+    class Letterbox
+    {
+    public:
+        Letterbox(uint32_t src_width, uint32_t src_height, uint32_t out_width, uint32_t out_height)
+            : out_w(out_width)
+            , out_h(out_height)
+            , rect(fit(src_width, src_height, out_width, out_height))
+        {
+            if (rect.width != src_width || rect.height != src_height)
+                scaler = std::make_unique<Scaler>(src_width, src_height, rect.width, rect.height, default_filter(src_width, src_height, rect.width, rect.height));
+        }
+
+        uint32_t width() const { return out_w; }
+        uint32_t height() const { return out_h; }
+
+        /// @brief Where the picture lands in the output
+        const Rect& picture() const { return rect; }
+
+        /// @brief Whether the picture is resized, rather than just copied
+        bool scales() const { return scaler != nullptr; }
+
+        /// @brief Write a whole output: the bars and the (scaled) picture
+        void run(const uint8_t* src, size_t src_stride, uint8_t* dst, size_t dst_stride)
+        {
+            fill_bars(dst, dst_stride);
+
+            auto picture = dst + rect.y * dst_stride + (size_t)rect.x * 4;
+            if (scaler)
+            {
+                scaler->run(src, src_stride, picture, dst_stride);
+                return;
+            }
+
+            for (uint32_t y = 0; y < rect.height; y++)
+                memcpy(picture + y * dst_stride, src + y * src_stride, (size_t)rect.width * 4);
+        }
+
+        /// @brief Paint everything outside the picture opaque black
+        void fill_bars(uint8_t* dst, size_t dst_stride) const
+        {
+            for (uint32_t y = 0; y < out_h; y++)
+            {
+                auto row = dst + y * dst_stride;
+                if (y < rect.y || y >= rect.y + rect.height)
+                {
+                    fill_black(row, out_w);
+                    continue;
+                }
+                fill_black(row, rect.x);
+                fill_black(row + (size_t)(rect.x + rect.width) * 4, out_w - rect.x - rect.width);
+            }
+        }
+
+    private:
+        static void fill_black(uint8_t* pixels, uint32_t count)
+        {
+            const uint32_t black = 0xff000000;
+            for (uint32_t i = 0; i < count; i++)
+                memcpy(pixels + (size_t)i * 4, &black, sizeof(black));
+        }
+
+        uint32_t out_w;
+        uint32_t out_h;
+        Rect rect;
+        std::unique_ptr<Scaler> scaler;
+    };
+} // namespace scale
@@ -0,0 +1,608 @@
+// Keyframe seek index, and a source that loops and seeks through it.
+//
+// A `SeekIndex` lists where a file's keyframes are, by frame and timestamp,
+// and how long the file is. Finding the keyframes of a compressed file means
+// reading all of it once, so the index is cached in a small file alongside
+// the media (`<media>.rwsi`), keyed like the frame cache by the media's
+// path, size and modification time, and rebuilt only when that changes.
+//
+// `SeekingSource` wraps a `FrameSource` that can `seek` to those keyframes.
+// It starts part way in, loops back to the beginning at the end, and seeks
+// on request, all without reopening anything: the inner source is moved to
+// the keyframe at or before the target and decoded forward from there, and
+// frames before the target are thrown away. Video timestamps carry on from
+// where they were, so they only ever increase. Audio is cut to match: the
+// audio of the old position runs up to the point where the new one starts
+// (padded with silence if the source has none left), and audio of the new
+// position before its target is dropped, so audio and video stay in step
+// across every loop and seek.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "frame_cache.h"
+#include "frame_source.h"
+#include "pcm_ring.h"
+
+namespace seek
+{
+    constexpr uint32_t INDEX_VERSION = 1;
+    constexpr const char* INDEX_EXTENSION = ".rwsi";
+
+    // Index file layout (little endian): IndexHeader, then IndexEntry[keyframe_count]
+    struct IndexHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_size;
+        uint64_t key_hash;
+        uint64_t frame_count;
+        int64_t duration;
+        uint64_t keyframe_count;
+        uint64_t reserved[2];
+    };
+    static_assert(sizeof(IndexHeader) == 64, "seek index header layout changed");
+
+    struct IndexEntry
+    {
+        int64_t timestamp;
+        uint64_t frame;
+    };
+    static_assert(sizeof(IndexEntry) == 16, "seek index entry layout changed");
+
+    constexpr char INDEX_MAGIC[8] = {'R', 'W', 'S', 'E', 'E', 'K', 'I', 'X'};
+
+    /// @brief A file's keyframes, in order, and its length
+    struct SeekIndex
+    {
+        std::vector<source::SeekPoint> keyframes;
+        uint64_t frame_count = 0;
+        /// @brief End of the last frame, in 100ns units
+        int64_t duration = 0;
+
+        bool empty() const { return keyframes.empty(); }
+
+        /// @brief The last keyframe at or before `timestamp`, or the first
+        /// keyframe if they are all after it
+        const source::SeekPoint* keyframe_before(int64_t timestamp) const
+        {
+            if (keyframes.empty())
+                return nullptr;
+
+            auto after = std::upper_bound(keyframes.begin(), keyframes.end(), timestamp, [](int64_t time, const source::SeekPoint& point) {
+                return time < point.timestamp;
+            });
+            return after == keyframes.begin() ? &keyframes.front() : &*(after - 1);
+        }
+
+        /// @brief Mean frame duration in 100ns units
+        int64_t frame_interval() const { return frame_count ? duration / (int64_t)frame_count : 0; }
+
+        /// @brief An index of `frame_count` frames, every `keyframe_interval`th of
+        /// which is a keyframe, for sources whose layout is known up front
+        /// @param timestamp Presentation time of frame `index`
+        template <typename Timestamp>
+        static SeekIndex every(uint64_t frame_count, uint64_t keyframe_interval, int64_t duration, Timestamp&& timestamp)
+        {
+            SeekIndex index;
+            index.frame_count = frame_count;
+            index.duration = duration;
+            keyframe_interval = std::max<uint64_t>(1, keyframe_interval);
+            index.keyframes.reserve((size_t)((frame_count + keyframe_interval - 1) / keyframe_interval));
+            for (uint64_t frame = 0; frame < frame_count; frame += keyframe_interval)
+                index.keyframes.push_back(source::SeekPoint {(int64_t)timestamp(frame), frame});
+            return index;
+        }
+    };
+
+    /// @brief Where the index of `media_path` is cached
+    inline std::filesystem::path index_path(const std::string& media_path) { return media_path + INDEX_EXTENSION; }
+
+    /// @brief Write `index` to `path`, through a temporary file so a reader
+    /// never sees a partial one
+    inline bool save(const SeekIndex& index, const std::filesystem::path& path, uint64_t key_hash)
+    {
+        auto temp_path = path;
+        temp_path += ".tmp";
+        auto file = fopen(temp_path.string().c_str(), "wb");
+        if (file == nullptr)
+            return false;
+
+        auto header = IndexHeader {};
+        memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        header.version = INDEX_VERSION;
+        header.header_size = sizeof(IndexHeader);
+        header.key_hash = key_hash;
+        header.frame_count = index.frame_count;
+        header.duration = index.duration;
+        header.keyframe_count = index.keyframes.size();
+
+        auto ok = fwrite(&header, sizeof(header), 1, file) == 1;
+        for (const auto& keyframe : index.keyframes)
+        {
+            auto entry = IndexEntry {keyframe.timestamp, keyframe.frame};
+            ok = ok && fwrite(&entry, sizeof(entry), 1, file) == 1;
+        }
+        ok = fclose(file) == 0 && ok;
+
+        std::error_code error;
+        if (ok)
+            std::filesystem::rename(temp_path, path, error);
+        if (!ok || error)
+        {
+            std::filesystem::remove(temp_path, error);
+            return false;
+        }
+        return true;
+    }
+
+    /// @brief Read the index at `path`, if it is a complete one for `key_hash`
+    inline bool load(SeekIndex& index, const std::filesystem::path& path, uint64_t key_hash)
+    {
+        auto file = fopen(path.string().c_str(), "rb");
+        if (file == nullptr)
+            return false;
+
+        auto header = IndexHeader {};
+        auto ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 &&
+                  header.version == INDEX_VERSION && header.header_size == sizeof(IndexHeader) && header.key_hash == key_hash &&
+                  header.keyframe_count > 0 && header.keyframe_count <= header.frame_count;
+
+        std::vector<IndexEntry> entries;
+        if (ok)
+        {
+            entries.resize((size_t)header.keyframe_count);
+            ok = fread(entries.data(), sizeof(IndexEntry), entries.size(), file) == entries.size();
+        }
+        fclose(file);
+        if (!ok)
+            return false;
+
+        index.frame_count = header.frame_count;
+        index.duration = header.duration;
+        index.keyframes.clear();
+        index.keyframes.reserve(entries.size());
+        for (const auto& entry : entries)
+            index.keyframes.push_back(source::SeekPoint {entry.timestamp, entry.frame});
+        return true;
+    }
+
+    /// @brief Load the index cached alongside `media_path`, or build it with
+    /// `build` and try to cache it there. Media in a read-only directory is
+    /// indexed again each time.
+    /// @return false if there was no cached index and `build` failed
+    inline bool load_or_build(const std::string& media_path, SeekIndex& index, const std::function<bool(SeekIndex&)>& build)
+    {
+        // Keyframes don't depend on the output format, only on the file
+        auto key = cache::make_key(media_path, cache::Format {});
+        auto path = index_path(media_path);
+        if (!key.file_name.empty() && load(index, path, key.hash))
+            return true;
+
+        index = SeekIndex {};
+        if (!build(index) || index.empty())
+            return false;
+
+        if (!key.file_name.empty())
+            save(index, path, key.hash);
+        return true;
+    }
+
+    struct SeekingConfig
+    {
+        /// @brief Go back to the beginning at the end, rather than ending
+        bool loop = false;
+        /// @brief Media time to start playing from, in 100ns units
+        int64_t start_at = 0;
+        /// @brief Rate and channel count of the inner source's audio
+        uint32_t sample_rate = 44100;
+        uint16_t channels = 2;
+        /// @brief Audio read from the inner source at a time; must hold the
+        /// most it writes in one read
+        size_t audio_read_frames = 8192;
+    };
+
+    struct SeekingStats
+    {
+        /// @brief Seeks made, including loops and the start offset
+        uint64_t seeks = 0;
+        uint64_t loops = 0;
+        /// @brief Seeks the inner source refused
+        uint64_t failed_seeks = 0;
+        /// @brief Frames decoded on the way from a keyframe to a seek target
+        uint64_t frames_skipped = 0;
+        /// @brief Audio frames dropped before a seek target, or to resync
+        uint64_t audio_frames_trimmed = 0;
+        /// @brief Silent audio frames added where the source's audio ran short
+        uint64_t audio_frames_padded = 0;
+    };
+
+    /// @brief Starts, loops and seeks a source through its keyframe index
+    template <typename Video>
+    class SeekingSource : public source::FrameSource<Video>
+    {
+    public:
+        /// @param inner Source to play, which must be able to `seek` to every
+        /// keyframe in `index`; both must outlive this
+        SeekingSource(source::FrameSource<Video>& inner, const SeekIndex& index, SeekingConfig config = {})
+            : inner(inner)
+            , index(index)
+            , config(config)
+            , interval(std::max<int64_t>(1, index.frame_interval()))
+            , scratch(std::max<size_t>(config.audio_read_frames, 1), config.channels)
+            , silence(SILENCE_FRAMES * (size_t)config.channels, 0)
+        {
+            segment_end = config.loop ? audio_position(index.duration) : UNBOUNDED;
+        }
+
+        /// @brief Seek to media time `timestamp` before the next read. Safe to
+        /// call from any thread. Frames and audio already decoded ahead still
+        /// play first.
+        void request_seek(int64_t timestamp) { pending_seek.store(std::max<int64_t>(0, timestamp), std::memory_order_release); }
+
+        SeekingStats stats() const
+        {
+            auto result = SeekingStats {};
+            result.seeks = counters.seeks.load(std::memory_order_relaxed);
+            result.loops = counters.loops.load(std::memory_order_relaxed);
+            result.failed_seeks = counters.failed_seeks.load(std::memory_order_relaxed);
+            result.frames_skipped = counters.frames_skipped.load(std::memory_order_relaxed);
+            result.audio_frames_trimmed = counters.audio_frames_trimmed.load(std::memory_order_relaxed);
+            result.audio_frames_padded = counters.audio_frames_padded.load(std::memory_order_relaxed);
+            return result;
+        }
+
+        void on_decode_thread() override { inner.on_decode_thread(); }
+
+        source::VideoRead read_video(Video& frame) override
+        {
+            prepare();
+
+            // A source that ends straight after looping has nothing to loop
+            auto ends = 0;
+            while (true)
+            {
+                auto read = inner.read_video(frame);
+                if (read == source::VideoRead::Busy)
+                    return read;
+                if (read == source::VideoRead::Ended)
+                {
+                    if (!config.loop || ++ends > 1 || !reposition(0, true))
+                        return read;
+                    continue;
+                }
+
+                auto media = (int64_t)frame.timestamp;
+                inner_next = media + interval;
+                if (media < target)
+                {
+                    counters.frames_skipped.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+
+                frame.timestamp = (decltype(frame.timestamp))(media + offset);
+                next_out = media + offset + interval;
+                return read;
+            }
+        }
+
+        bool skip_video() override
+        {
+            prepare();
+            if (!inner.skip_video())
+            {
+                if (!config.loop || !reposition(0, true) || !inner.skip_video())
+                    return false;
+            }
+
+            // A frame skipped on the way to a seek target was never going to be shown
+            auto media = inner_next;
+            inner_next += interval;
+            if (media >= target)
+                next_out = media + offset + interval;
+            return true;
+        }
+
+        bool read_audio(audio::PcmRing& output, size_t max_frames) override
+        {
+            prepare();
+
+            size_t written = 0;
+            while (written < max_frames)
+            {
+                // Audio settled by the last seek goes first
+                if (auto carried = carried_frames())
+                {
+                    auto n = std::min(carried, max_frames - written);
+                    output.write(carry.data() + carry_read * config.channels, n, config.channels);
+                    carry_read += n;
+                    audio_out += n;
+                    written += n;
+                    continue;
+                }
+
+                if (trim > 0 && !inner_audio_done())
+                {
+                    auto n = take(nullptr, (size_t)std::min<uint64_t>(trim, scratch.capacity()));
+                    trim -= n;
+                    counters.audio_frames_trimmed.fetch_add(n, std::memory_order_relaxed);
+                    if (n == 0 && !inner_audio_done())
+                        break;
+                    continue;
+                }
+
+                // When looping, this pass's audio ends where its video does;
+                // anything after waits for the video to loop
+                if (audio_out >= segment_end)
+                    break;
+
+                auto wanted = (size_t)std::min<uint64_t>(max_frames - written, segment_end - audio_out);
+                if (inner_audio_done())
+                {
+                    // Media with no audio at all stays silent rather than padded
+                    if (segment_end == UNBOUNDED || !has_audio)
+                        break;
+
+                    write_silence(&output, wanted);
+                    written += wanted;
+                    continue;
+                }
+
+                auto n = take(&output, wanted);
+                written += n;
+                if (n == 0 && !inner_audio_done())
+                    break;
+            }
+
+            return config.loop || !inner_audio_done() || carried_frames() > 0;
+        }
+
+        // Every seek lines the audio up with the video again, as the inner
+        // source's drift goes back to 0, once the old position's audio still
+        // carried has been written
+        int64_t audio_drift() const override { return carried_frames() > 0 ? carried_drift : inner.audio_drift(); }
+        uint64_t audio_resyncs() const override { return inner.audio_resyncs() + resyncs - (carried_frames() > 0 && resyncs > 0 ? 1 : 0); }
+        void adjust_audio_rate(double ratio) override { inner.adjust_audio_rate(ratio); }
+        bool audio_resamplable() const override { return inner.audio_resamplable(); }
+
+    private:
+        static constexpr uint64_t UNBOUNDED = UINT64_MAX;
+        static constexpr size_t SILENCE_FRAMES = 1024;
+
+        // Rounded to nearest: timestamps are truncated to 100ns, so a frame's
+        // audio can start a fraction of a tick after its timestamp says
+        uint64_t audio_position(int64_t timestamp) const
+        {
+            return timestamp > 0 ? ((uint64_t)timestamp * config.sample_rate + 5000000) / 10000000 : 0;
+        }
+
+        // Apply the start offset before the first read, and any requested seek
+        void prepare()
+        {
+            if (!started)
+            {
+                started = true;
+                if (config.start_at > 0)
+                    reposition(config.start_at, false);
+            }
+
+            auto seek_to = pending_seek.exchange(-1, std::memory_order_acq_rel);
+            if (seek_to >= 0)
+                reposition(seek_to, false);
+        }
+
+        // Move the inner source to the keyframe before `to`, continuing the
+        // output timeline from the next frame due
+        bool reposition(int64_t to, bool looping)
+        {
+            if (index.empty())
+            {
+                counters.failed_seeks.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            to = std::clamp<int64_t>(to, 0, std::max<int64_t>(0, index.duration - interval));
+            auto keyframe = index.keyframe_before(to);
+
+            // Settle the old position's audio up to where the new one starts
+            // playing; a loop reads its source's audio to the end, so anything
+            // recording underneath sees the whole of it, and starts exactly a
+            // file's length after the last one, so rounding never builds up
+            auto start_out = looping ? offset + index.duration : next_out;
+            finish_audio(audio_position(start_out), looping);
+            auto drift = inner.audio_drift();
+
+            if (!inner.seek(*keyframe))
+            {
+                counters.failed_seeks.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            counters.seeks.fetch_add(1, std::memory_order_relaxed);
+            carried_drift = drift;
+            resyncs++;
+            if (looping)
+                counters.loops.fetch_add(1, std::memory_order_relaxed);
+
+            target = to;
+            offset = start_out - to;
+            inner_next = keyframe->timestamp;
+            audio_ended = false;
+
+            // The inner source's audio restarts at the keyframe, not the target
+            trim += audio_position(to) - audio_position(keyframe->timestamp);
+            segment_end = config.loop ? audio_position(start_out + index.duration - to) : UNBOUNDED;
+            return true;
+        }
+
+        // Make the audio written or carried so far end exactly at output frame
+        // `end`: fill up to it from the inner source and then silence, or,
+        // when audio has run ahead of it, drop that much of the new position's
+        void finish_audio(uint64_t end, bool drain)
+        {
+            auto queued = audio_out + carried_frames();
+            trim = 0;
+            if (queued > end)
+            {
+                // Cut what hasn't been played yet first
+                auto excess = queued - end;
+                auto uncarried = std::min<uint64_t>(excess, carried_frames());
+                carry.resize(carry.size() - (size_t)uncarried * config.channels);
+                counters.audio_frames_trimmed.fetch_add(uncarried, std::memory_order_relaxed);
+                trim = excess - uncarried;
+            }
+            else if (queued < end)
+            {
+                // Keep what hasn't been played yet
+                if (carry_read > 0)
+                {
+                    carry.erase(carry.begin(), carry.begin() + carry_read * config.channels);
+                    carry_read = 0;
+                }
+
+                auto missing = end - queued;
+                while (missing > 0 && !inner_audio_done())
+                {
+                    auto n = take_into_carry((size_t)std::min<uint64_t>(missing, scratch.capacity()));
+                    missing -= n;
+                    if (n == 0 && !inner_audio_done())
+                        break;
+                }
+
+                if (has_audio)
+                {
+                    carry.resize(carry.size() + (size_t)missing * config.channels, 0);
+                    counters.audio_frames_padded.fetch_add(missing, std::memory_order_relaxed);
+                }
+            }
+
+            while (drain && !inner_audio_done())
+            {
+                if (take(nullptr, scratch.capacity()) == 0 && !inner_audio_done())
+                    break;
+            }
+
+            // Whatever is left belongs to the old position
+            scratch.consume(scratch.readable_frames());
+        }
+
+        bool inner_audio_done() { return audio_ended && scratch.readable_frames() == 0; }
+
+        size_t carried_frames() const { return carry.size() / config.channels - carry_read; }
+
+        // Read more from the inner source once everything it gave last time is used
+        void refill()
+        {
+            if (scratch.readable_frames() == 0 && !audio_ended)
+            {
+                audio_ended = !inner.read_audio(scratch, scratch.writable_frames());
+                has_audio = has_audio || scratch.readable_frames() > 0;
+            }
+        }
+
+        // Move up to `frames` of the inner source's audio to `output`, or drop
+        // them if there is no output
+        size_t take(audio::PcmRing* output, size_t frames)
+        {
+            refill();
+            size_t moved = 0;
+            while (moved < frames)
+            {
+                auto span = scratch.readable();
+                if (span.frames == 0)
+                    break;
+
+                auto n = std::min(span.frames, frames - moved);
+                if (output)
+                    output->write(span.samples, n, config.channels);
+                scratch.consume(n);
+                moved += n;
+            }
+
+            if (output)
+                audio_out += moved;
+            return moved;
+        }
+
+        size_t take_into_carry(size_t frames)
+        {
+            refill();
+            size_t moved = 0;
+            while (moved < frames)
+            {
+                auto span = scratch.readable();
+                if (span.frames == 0)
+                    break;
+
+                auto n = std::min(span.frames, frames - moved);
+                carry.insert(carry.end(), span.samples, span.samples + n * config.channels);
+                scratch.consume(n);
+                moved += n;
+            }
+            return moved;
+        }
+
+        void write_silence(audio::PcmRing* output, size_t frames)
+        {
+            counters.audio_frames_padded.fetch_add(frames, std::memory_order_relaxed);
+            audio_out += frames;
+            while (frames > 0)
+            {
+                auto n = std::min(frames, SILENCE_FRAMES);
+                output->write(silence.data(), n, config.channels);
+                frames -= n;
+            }
+        }
+
+        source::FrameSource<Video>& inner;
+        const SeekIndex& index;
+        SeekingConfig config;
+        int64_t interval;
+
+        std::atomic<int64_t> pending_seek {-1};
+        bool started = false;
+
+        // Output time = media time + offset; frames before the target are decoded and dropped
+        int64_t offset = 0;
+        int64_t target = 0;
+        int64_t next_out = 0;
+        int64_t inner_next = 0;
+
+        // Audio, counted in output frames
+        audio::PcmRing scratch;
+        std::vector<int16_t> silence;
+        std::vector<int16_t> carry;
+        size_t carry_read = 0;
+        uint64_t audio_out = 0;
+        uint64_t segment_end = UNBOUNDED;
+        uint64_t trim = 0;
+        bool audio_ended = false;
+        bool has_audio = false;
+
+        // The drift of the old position's audio, which applies until its
+        // carried audio has been written
+        int64_t carried_drift = 0;
+        uint64_t resyncs = 0;
+
+        struct Counters
+        {
+            std::atomic<uint64_t> seeks {0};
+            std::atomic<uint64_t> loops {0};
+            std::atomic<uint64_t> failed_seeks {0};
+            std::atomic<uint64_t> frames_skipped {0};
+            std::atomic<uint64_t> audio_frames_trimmed {0};
+            std::atomic<uint64_t> audio_frames_padded {0};
+        };
+        Counters counters;
+    };
+} // namespace seek
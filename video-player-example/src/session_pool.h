@@ -0,0 +1,183 @@
+// Media sessions opened ahead of the streams that will play them.
+//
+// Opening media is slow next to streaming it: a device has to be created,
+// the file resolved and a decoder and resampler built before the first frame
+// can go out. A `SessionPool` keeps a few sessions for the configured media
+// already open, so a stream starting checks one out at once, and opens
+// replacements on a background thread while the checked out one plays. A
+// checkout that finds the pool empty opens a session on the calling thread,
+// as if there were no pool, and is counted as cold.
+//
+// Sessions are made by a factory and are otherwise opaque, so the pooling
+// can be exercised anywhere with a stub.
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace pool
+{
+    struct SessionPoolConfig
+    {
+        /// @brief Sessions to keep open ahead of time; 0 opens every session on checkout
+        size_t size = 1;
+        /// @brief How long to wait before trying again after the factory fails,
+        /// so media that can't be opened isn't retried in a tight loop
+        std::chrono::milliseconds retry_interval {1000};
+    };
+
+    struct SessionPoolStats
+    {
+        /// @brief Checkouts served from the pool
+        uint64_t warm_checkouts = 0;
+        /// @brief Checkouts that found the pool empty and opened a session themselves
+        uint64_t cold_checkouts = 0;
+        /// @brief Sessions opened, in the background or on checkout
+        uint64_t created = 0;
+        /// @brief Times the factory failed
+        uint64_t failed = 0;
+        /// @brief Sessions open and waiting to be checked out
+        size_t idle = 0;
+        /// @brief Time spent opening sessions, in nanoseconds
+        uint64_t create_time_total = 0;
+        uint64_t create_time_max = 0;
+
+        double mean_create_time() const
+        {
+            return created ? (double)create_time_total / (double)created : 0.0;
+        }
+    };
+
+    template <typename Session>
+    class SessionPool
+    {
+    public:
+        /// @brief Opens a session, or returns null if it can't. Called on the
+        /// pool's thread, and on the checking out thread when the pool is empty.
+        using Create = std::function<std::unique_ptr<Session>()>;
+
+        SessionPool(Create create, SessionPoolConfig config = {})
+            : create(std::move(create))
+            , config(config)
+        {
+            if (config.size > 0)
+                refiller = std::thread {[this]() { run(); }};
+        }
+
+        ~SessionPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            changed.notify_all();
+            if (refiller.joinable())
+                refiller.join();
+        }
+
+        SessionPool(const SessionPool&) = delete;
+        SessionPool& operator=(const SessionPool&) = delete;
+
+        /// @brief An open session: a pooled one if there is one, or else one
+        /// opened now. Either way the pool starts opening a replacement.
+        /// @return The session, or null if the factory failed
+        std::unique_ptr<Session> checkout()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!idle.empty())
+                {
+                    auto session = std::move(idle.front());
+                    idle.pop_front();
+                    counters.warm_checkouts++;
+                    changed.notify_all();
+                    return session;
+                }
+                counters.cold_checkouts++;
+            }
+
+            return timed_create();
+        }
+
+        /// @brief Wait until the pool is full, or `timeout` has passed
+        /// @return Whether it is full
+        template <typename Rep, typename Period>
+        bool wait_full(std::chrono::duration<Rep, Period> timeout)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            return changed.wait_for(lock, timeout, [&] { return idle.size() >= config.size; });
+        }
+
+        SessionPoolStats stats() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto result = counters;
+            result.idle = idle.size();
+            return result;
+        }
+
+    private:
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true)
+            {
+                changed.wait(lock, [&] { return stopping || idle.size() < config.size; });
+                if (stopping)
+                    return;
+
+                lock.unlock();
+                auto session = timed_create();
+                lock.lock();
+
+                if (session)
+                {
+                    idle.push_back(std::move(session));
+                    changed.notify_all();
+                }
+                else
+                {
+                    changed.wait_for(lock, config.retry_interval, [&] { return stopping; });
+                }
+            }
+        }
+
+        std::unique_ptr<Session> timed_create()
+        {
+            auto start = std::chrono::steady_clock::now();
+            auto session = create();
+            auto elapsed = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!session)
+            {
+                counters.failed++;
+                return nullptr;
+            }
+
+            counters.created++;
+            counters.create_time_total += elapsed;
+            counters.create_time_max = std::max(counters.create_time_max, elapsed);
+            return session;
+        }
+
+        Create create;
+        SessionPoolConfig config;
+
+        mutable std::mutex mutex;
+        std::condition_variable changed;
+        std::deque<std::unique_ptr<Session>> idle;
+        SessionPoolStats counters;
+        bool stopping = false;
+
+        std::thread refiller;
+    };
+} // namespace pool
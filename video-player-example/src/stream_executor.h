@@ -0,0 +1,596 @@
+// A fixed pool of workers that runs many streams.
+//
+// Instead of a thread per stream sleeping in its own loop, every stream is a
+// task with a deadline: when it next has something to do. Each worker keeps
+// its tasks in a min-heap on deadline, runs whichever is due, and sleeps
+// until the earliest deadline otherwise. A worker with nothing due steals a
+// due task from another, so one slow stream doesn't hold up the rest of its
+// worker's tasks. Hundreds of streams cost a handful of threads.
+//
+// A task's step returns its next deadline, or nothing once it is finished.
+// `wake` runs a task now instead of at its deadline (or straight after its
+// current step, if it is running), which is how a stream that is asked to
+// close gets to exit without waiting out its sleep. Each reschedule bumps
+// the task's generation; heap entries queued under an older one are stale
+// and skipped, so a task is only ever queued once and never runs on two
+// workers at the same time. `shutdown` lets steps in progress complete,
+// cancels every task left and joins the workers.
+//
+// The clock is a template parameter, as in pacer.h. With `FakeClock` the
+// executor is driven by hand through `run_due` rather than started, so
+// scheduling can be checked deterministically.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "media_fanout.h"
+#include "pacer.h"
+#include "stream_lifecycle.h"
+
+namespace exec
+{
+    struct ExecutorConfig
+    {
+        /// @brief Worker threads; 0 for one per core
+        size_t workers = 0;
+        /// @brief Longest an idle worker sleeps before looking for work to steal
+        std::chrono::nanoseconds max_idle {std::chrono::milliseconds(5)};
+    };
+
+    struct ExecutorStats
+    {
+        uint64_t steps = 0;
+        /// @brief Steps run by a worker other than the one the task was queued on
+        uint64_t steals = 0;
+        /// @brief Tasks that finished by themselves
+        uint64_t finished = 0;
+        /// @brief Tasks `shutdown` cancelled
+        uint64_t cancelled = 0;
+        /// @brief `wake` calls that moved a task forward
+        uint64_t wakes = 0;
+        /// @brief How long after its deadline each step started
+        std::chrono::nanoseconds total_lateness {0};
+        std::chrono::nanoseconds max_lateness {0};
+
+        std::chrono::nanoseconds mean_lateness() const
+        {
+            return steps ? total_lateness / (int64_t)steps : std::chrono::nanoseconds {0};
+        }
+    };
+
+    template <typename Clock = pacing::SteadyClock>
+    class StreamExecutor
+    {
+        struct Task;
+
+    public:
+        using time_point = typename Clock::time_point;
+
+        /// @brief Do a task's work for now
+        /// @return When to run it next, or nothing once it is finished
+        using Step = std::function<std::optional<time_point>(time_point now)>;
+
+        /// @brief Called once when a task ends: `finished` if its step said so,
+        /// otherwise it was cancelled by `shutdown`
+        using Done = std::function<void(bool finished)>;
+
+        /// @brief Refers to a spawned task without keeping it alive
+        using TaskHandle = std::weak_ptr<Task>;
+
+        explicit StreamExecutor(Clock& clock, ExecutorConfig config = {})
+            : clock(clock)
+            , config(config)
+        {
+            auto count = config.workers ? config.workers : std::max(1u, std::thread::hardware_concurrency());
+            for (size_t i = 0; i < count; i++)
+                workers.push_back(std::make_unique<Worker>());
+        }
+
+        ~StreamExecutor() { shutdown(); }
+
+        StreamExecutor(const StreamExecutor&) = delete;
+        StreamExecutor& operator=(const StreamExecutor&) = delete;
+
+        /// @brief Start the worker threads. Without this, tasks only run from `run_due`.
+        void start()
+        {
+            for (size_t i = 0; i < workers.size(); i++)
+                workers[i]->thread = std::thread {[this, i]() { run_worker(i); }};
+        }
+
+        /// @brief Add a task, first run at `first`, to the least loaded worker
+        /// @return A handle for `wake`; empty if the executor is shutting down
+        /// (the task isn't run)
+        TaskHandle spawn(Step step, time_point first, Done done = nullptr)
+        {
+            auto task = std::make_shared<Task>();
+            task->step = std::move(step);
+            task->done = std::move(done);
+            task->generation = 1;
+            TaskHandle handle = task;
+
+            auto target = workers.begin();
+            for (auto it = workers.begin(); it != workers.end(); it++)
+            {
+                if ((*it)->load.load(std::memory_order_relaxed) < (*target)->load.load(std::memory_order_relaxed))
+                    target = it;
+            }
+
+            auto& worker = **target;
+            task->home = (size_t)(target - workers.begin());
+            {
+                // Checked under the lock so `shutdown` either sees this task or we see it stopping
+                std::lock_guard<std::mutex> lock(worker.mutex);
+                if (stopping)
+                    return {};
+                worker.load.fetch_add(1, std::memory_order_relaxed);
+                tasks++;
+                push(worker, first, 1, std::move(task));
+            }
+            worker.wake.notify_one();
+            return handle;
+        }
+
+        /// @brief Run a task as soon as possible rather than at its deadline. If
+        /// its step is running, it runs again straight after. Safe from any thread.
+        /// @return false if the task has ended
+        bool wake(const TaskHandle& handle)
+        {
+            auto task = handle.lock();
+            if (!task)
+                return false;
+
+            uint64_t generation;
+            size_t home;
+            {
+                std::lock_guard<std::mutex> lock(task->mutex);
+                if (task->ended)
+                    return false;
+                if (task->running)
+                {
+                    task->woken = true;
+                    return true;
+                }
+                generation = ++task->generation;
+                home = task->home;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(stats_mutex);
+                counters.wakes++;
+            }
+
+            auto& worker = *workers[home];
+            {
+                std::lock_guard<std::mutex> lock(worker.mutex);
+                if (!stopping)
+                {
+                    push(worker, clock.now(), generation, task);
+                    task = nullptr;
+                }
+            }
+
+            // Too late to queue: `shutdown` may already have swept this worker
+            if (task)
+                cancel(*task);
+            else
+                worker.wake.notify_one();
+            return true;
+        }
+
+        /// @brief Run every task that is due, on the calling thread, for driving
+        /// an executor that hasn't been started
+        /// @return Steps run
+        size_t run_due()
+        {
+            size_t ran = 0;
+            for (size_t i = 0; i < workers.size(); i++)
+            {
+                Entry entry;
+                while (take_due(*workers[i], clock.now(), entry))
+                {
+                    run(i, std::move(entry), false);
+                    ran++;
+                }
+            }
+            return ran;
+        }
+
+        /// @brief The earliest deadline of any queued task
+        std::optional<time_point> next_deadline()
+        {
+            std::optional<time_point> earliest;
+            for (auto& worker : workers)
+            {
+                std::lock_guard<std::mutex> lock(worker->mutex);
+                if (!worker->heap.empty() && (!earliest || worker->heap.front().deadline < *earliest))
+                    earliest = worker->heap.front().deadline;
+            }
+            return earliest;
+        }
+
+        /// @brief Stop taking tasks, let steps in progress finish, cancel every
+        /// task left and join the workers. Safe to call more than once.
+        void shutdown()
+        {
+            stopping = true;
+            for (auto& worker : workers)
+            {
+                {
+                    // Under the lock, so a worker about to sleep can't miss the wake
+                    std::lock_guard<std::mutex> lock(worker->mutex);
+                }
+                worker->wake.notify_all();
+            }
+
+            for (auto& worker : workers)
+            {
+                if (worker->thread.joinable())
+                    worker->thread.join();
+            }
+
+            // Nothing else runs tasks now
+            for (auto& worker : workers)
+            {
+                std::vector<Entry> left;
+                {
+                    std::lock_guard<std::mutex> lock(worker->mutex);
+                    left.swap(worker->heap);
+                    worker->load.store(0, std::memory_order_relaxed);
+                }
+
+                // Stale entries are cancelled through their task, which only ends once
+                for (auto& entry : left)
+                    cancel(*entry.task);
+            }
+        }
+
+        size_t worker_count() const { return workers.size(); }
+
+        /// @brief Tasks that haven't ended
+        size_t task_count() const { return tasks; }
+
+        ExecutorStats stats()
+        {
+            std::lock_guard<std::mutex> lock(stats_mutex);
+            return counters;
+        }
+
+    private:
+        struct Task
+        {
+            Step step;
+            Done done;
+
+            std::mutex mutex;
+            // Only the entry queued with the current generation is live
+            uint64_t generation = 0;
+            // Worker whose heap holds the live entry
+            size_t home = 0;
+            bool running = false;
+            // Woken while running; run again straight away
+            bool woken = false;
+            bool ended = false;
+        };
+
+        struct Entry
+        {
+            time_point deadline {};
+            // Breaks deadline ties in the order tasks were queued
+            uint64_t order = 0;
+            uint64_t generation = 0;
+            std::shared_ptr<Task> task;
+        };
+
+        struct Worker
+        {
+            std::mutex mutex;
+            std::condition_variable wake;
+            // Min-heap on (deadline, order)
+            std::vector<Entry> heap;
+            // Tasks owned by this worker, queued or running; only a hint for
+            // `spawn`, which reads it without the lock
+            std::atomic<size_t> load {0};
+            std::thread thread;
+        };
+
+        static bool later(const Entry& a, const Entry& b)
+        {
+            return a.deadline != b.deadline ? a.deadline > b.deadline : a.order > b.order;
+        }
+
+        /// @pre `worker.mutex` is held
+        void push(Worker& worker, time_point deadline, uint64_t generation, std::shared_ptr<Task> task)
+        {
+            worker.heap.push_back(Entry {deadline, next_order++, generation, std::move(task)});
+            std::push_heap(worker.heap.begin(), worker.heap.end(), later);
+        }
+
+        /// @brief Pop the earliest due live entry, marking its task running
+        bool take_due(Worker& worker, time_point now, Entry& entry)
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            while (!worker.heap.empty() && worker.heap.front().deadline <= now)
+            {
+                std::pop_heap(worker.heap.begin(), worker.heap.end(), later);
+                entry = std::move(worker.heap.back());
+                worker.heap.pop_back();
+
+                // Lock order is always worker, then task
+                std::lock_guard<std::mutex> task_lock(entry.task->mutex);
+                if (entry.generation != entry.task->generation || entry.task->ended)
+                    continue;
+                entry.task->running = true;
+                return true;
+            }
+            return false;
+        }
+
+        /// @brief End a task that won't run again, unless it already has
+        void cancel(Task& task)
+        {
+            {
+                std::lock_guard<std::mutex> lock(task.mutex);
+                if (task.ended)
+                    return;
+                task.ended = true;
+            }
+
+            tasks--;
+            {
+                std::lock_guard<std::mutex> lock(stats_mutex);
+                counters.cancelled++;
+            }
+            if (task.done)
+                task.done(false);
+        }
+
+        /// @brief Take a due task from another worker, which it then belongs to
+        bool steal(size_t thief, time_point now, Entry& entry)
+        {
+            for (size_t i = 1; i < workers.size(); i++)
+            {
+                auto& victim = *workers[(thief + i) % workers.size()];
+                if (take_due(victim, now, entry))
+                {
+                    victim.load.fetch_sub(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void run(size_t index, Entry entry, bool stolen)
+        {
+            auto& worker = *workers[index];
+            if (stolen)
+                worker.load.fetch_add(1, std::memory_order_relaxed);
+
+            auto now = clock.now();
+            auto lateness = std::max(std::chrono::nanoseconds {0}, std::chrono::duration_cast<std::chrono::nanoseconds>(now - entry.deadline));
+            auto next = entry.task->step(now);
+
+            {
+                std::lock_guard<std::mutex> lock(stats_mutex);
+                counters.steps++;
+                counters.steals += stolen ? 1 : 0;
+                counters.finished += next ? 0 : 1;
+                counters.total_lateness += lateness;
+                counters.max_lateness = std::max(counters.max_lateness, lateness);
+            }
+
+            uint64_t generation = 0;
+            {
+                // In the same critical section as clearing `running`, so a wake
+                // either sees the task running or finds this entry's generation
+                std::lock_guard<std::mutex> lock(entry.task->mutex);
+                entry.task->running = false;
+                if (!next)
+                {
+                    entry.task->ended = true;
+                }
+                else
+                {
+                    if (entry.task->woken)
+                        next = now;
+                    generation = ++entry.task->generation;
+                    entry.task->home = index;
+                }
+                entry.task->woken = false;
+            }
+
+            if (next)
+            {
+                std::lock_guard<std::mutex> lock(worker.mutex);
+                push(worker, *next, generation, std::move(entry.task));
+                return;
+            }
+
+            worker.load.fetch_sub(1, std::memory_order_relaxed);
+            tasks--;
+            if (entry.task->done)
+                entry.task->done(true);
+        }
+
+        void run_worker(size_t index)
+        {
+            auto& worker = *workers[index];
+            while (!stopping)
+            {
+                auto now = clock.now();
+
+                Entry entry;
+                if (take_due(worker, now, entry))
+                {
+                    run(index, std::move(entry), false);
+                    continue;
+                }
+                if (steal(index, now, entry))
+                {
+                    run(index, std::move(entry), true);
+                    continue;
+                }
+
+                // Sleep until this worker's next deadline, but not so long that
+                // due work on another worker waits for a steal
+                std::unique_lock<std::mutex> lock(worker.mutex);
+                if (stopping)
+                    break;
+                auto wait = config.max_idle;
+                if (!worker.heap.empty())
+                    wait = std::min(wait, std::chrono::duration_cast<std::chrono::nanoseconds>(worker.heap.front().deadline - clock.now()));
+                if (wait > std::chrono::nanoseconds {0})
+                    worker.wake.wait_for(lock, wait);
+            }
+        }
+
+        Clock& clock;
+        ExecutorConfig config;
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::atomic<uint64_t> next_order {0};
+        std::atomic<size_t> tasks {0};
+        std::atomic<bool> stopping {false};
+
+        std::mutex stats_mutex;
+        ExecutorStats counters;
+    };
+
+    /// @brief Predicts when the next item of a periodic stream (frames, or
+    /// audio chunks) will be published, from the timestamps of earlier ones and
+    /// the earliest they were seen relative to them. Predictions are anchored
+    /// to media time, so a consumer that is sometimes late to look doesn't fall
+    /// further behind. Until two items have been seen, and once an item is
+    /// overdue, it falls back to polling.
+    template <typename Clock = pacing::SteadyClock>
+    class Cadence
+    {
+    public:
+        using time_point = typename Clock::time_point;
+
+        /// @param poll How often to look while there's nothing to predict from
+        explicit Cadence(std::chrono::nanoseconds poll = std::chrono::milliseconds(2))
+            : poll(poll)
+        {
+        }
+
+        /// @brief Note an item with media `timestamp` (100ns units) seen at `now`
+        void observe(time_point now, int64_t timestamp)
+        {
+            if (seen && timestamp > last_timestamp)
+            {
+                auto step = std::chrono::duration_cast<std::chrono::nanoseconds>(pacing::MediaDuration {timestamp - last_timestamp});
+                interval = std::min<std::chrono::nanoseconds>(step, std::chrono::seconds(1));
+            }
+
+            // Where media time 0 falls on the clock. Items are seen at or after
+            // they're published, so the earliest estimate is the best one, unless
+            // the producer has clearly moved on (re-anchored, or started over)
+            auto origin = now - std::chrono::duration_cast<std::chrono::nanoseconds>(pacing::MediaDuration {timestamp});
+            if (!seen || origin < media_origin || origin > media_origin + 2 * interval)
+                media_origin = origin;
+
+            seen = true;
+            last_timestamp = timestamp;
+        }
+
+        /// @brief When to next look for an item, or nothing if no item has been
+        /// seen (the stream may not have this kind of item at all)
+        std::optional<time_point> next(time_point now) const
+        {
+            if (!seen)
+                return std::nullopt;
+
+            if (interval.count() > 0)
+            {
+                auto expected = media_origin + std::chrono::duration_cast<std::chrono::nanoseconds>(pacing::MediaDuration {last_timestamp}) + interval;
+                if (expected > now)
+                    return expected;
+            }
+            return now + poll;
+        }
+
+    private:
+        std::chrono::nanoseconds poll;
+        std::chrono::nanoseconds interval {0};
+        bool seen = false;
+        int64_t last_timestamp = 0;
+        time_point media_origin {};
+    };
+
+    /// @brief A fanout consumer as an executor step: forwards whatever is
+    /// pending to the sink, then sleeps until the next frame or audio chunk is
+    /// expected. Finishes when `stop` is cancelled or the media ends; wake the
+    /// task on cancellation for it to finish without waiting for its deadline.
+    template <typename Video, typename Audio, typename Sink, typename Clock = pacing::SteadyClock>
+    class ConsumerTask
+    {
+    public:
+        using time_point = typename Clock::time_point;
+
+        ConsumerTask(fanout::MediaFanout<Video, Audio>& fanout, Sink& sink, const lifecycle::CancellationToken& stop)
+            : fanout(fanout)
+            , sink(sink)
+            , stop(stop)
+            , cursor(fanout.subscribe())
+        {
+        }
+
+        std::optional<time_point> operator()(time_point now)
+        {
+            if (stop.cancelled())
+                return std::nullopt;
+
+            auto observer = Observer {*this, now};
+            if (!fanout::drain(fanout, cursor, observer) && fanout.is_finished())
+                return std::nullopt;
+
+            auto next_video = video.next(now);
+            auto next_audio = audio.next(now);
+            if (next_video && next_audio)
+                return std::min(*next_video, *next_audio);
+            if (next_video || next_audio)
+                return next_video ? *next_video : *next_audio;
+
+            // Nothing has been published since we joined
+            return now + std::chrono::milliseconds(2);
+        }
+
+    private:
+        // Forwards to the sink, noting when each item turned up
+        struct Observer
+        {
+            ConsumerTask& task;
+            time_point now;
+
+            void submit_video(const Video& frame)
+            {
+                task.video.observe(now, (int64_t)frame.timestamp);
+                task.sink.submit_video(frame);
+            }
+
+            void submit_audio(const Audio& chunk)
+            {
+                task.audio.observe(now, (int64_t)chunk.timestamp);
+                task.sink.submit_audio(chunk);
+            }
+        };
+
+        fanout::MediaFanout<Video, Audio>& fanout;
+        Sink& sink;
+        const lifecycle::CancellationToken& stop;
+        fanout::Cursor cursor;
+        Cadence<Clock> video;
+        Cadence<Clock> audio;
+    };
+} // namespace exec
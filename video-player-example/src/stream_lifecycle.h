@@ -0,0 +1,221 @@
+// Stream lifecycle: state, cancellation and how long teardown takes.
+//
+// A stream is Starting until its first step runs, Running while it plays,
+// Draining from the moment it is asked to close until its task has exited,
+// and then Closed. A close can be asked for from any thread (typically an
+// SDK callback) at any point, including before the first step or after the
+// media has already ended; every transition is a compare-exchange, so each
+// race resolves one way and a late close is simply ignored.
+//
+// Asking to close cancels the stream's `CancellationToken`. Sleeps that take
+// the token return as soon as it is cancelled, and callbacks registered on it
+// (waking the stream's executor task, say) run straight away, so teardown
+// never waits out whatever the stream was sleeping on. The time from the
+// close request to the task's exit is kept, so leaked or slow-to-stop
+// streams show up in numbers.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace lifecycle
+{
+    /// @brief Set once to ask work to stop; wakes anything waiting on it
+    class CancellationToken
+    {
+    public:
+        CancellationToken() = default;
+        CancellationToken(const CancellationToken&) = delete;
+        CancellationToken& operator=(const CancellationToken&) = delete;
+
+        /// @brief Cancel, waking every wait and running every callback. Only the
+        /// first call does anything.
+        void cancel()
+        {
+            std::vector<std::function<void()>> callbacks;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (is_cancelled)
+                    return;
+                is_cancelled = true;
+                callbacks.swap(listeners);
+            }
+            changed.notify_all();
+
+            for (auto& callback : callbacks)
+                callback();
+        }
+
+        bool cancelled() const { return is_cancelled; }
+
+        /// @brief Sleep until `deadline` or until cancelled, whichever is first
+        /// @return Whether it was cancelled
+        bool wait_until(std::chrono::steady_clock::time_point deadline) const
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            return changed.wait_until(lock, deadline, [&] { return is_cancelled.load(); });
+        }
+
+        /// @brief Run `callback` on cancellation, on the cancelling thread; right
+        /// away if already cancelled. Must not block.
+        void on_cancel(std::function<void()> callback)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!is_cancelled)
+                {
+                    listeners.push_back(std::move(callback));
+                    return;
+                }
+            }
+            callback();
+        }
+
+    private:
+        mutable std::mutex mutex;
+        mutable std::condition_variable changed;
+        std::atomic<bool> is_cancelled {false};
+        std::vector<std::function<void()>> listeners;
+    };
+
+    enum class StreamState : uint8_t
+    {
+        Starting,
+        Running,
+        Draining,
+        Closed,
+    };
+
+    inline const char* to_string(StreamState state)
+    {
+        switch (state)
+        {
+        case StreamState::Starting:
+            return "starting";
+        case StreamState::Running:
+            return "running";
+        case StreamState::Draining:
+            return "draining";
+        case StreamState::Closed:
+            return "closed";
+        }
+        return "unknown";
+    }
+
+    class StreamLifecycle
+    {
+    public:
+        StreamLifecycle() = default;
+        StreamLifecycle(const StreamLifecycle&) = delete;
+        StreamLifecycle& operator=(const StreamLifecycle&) = delete;
+
+        StreamState state() const { return current; }
+
+        /// @brief Cancelled when a close is requested
+        CancellationToken& token() { return cancel; }
+        const CancellationToken& token() const { return cancel; }
+
+        /// @brief Note that the stream has started playing
+        /// @return false if it is already draining or closed
+        bool start()
+        {
+            auto expected = StreamState::Starting;
+            return current.compare_exchange_strong(expected, StreamState::Running) || expected == StreamState::Running;
+        }
+
+        /// @brief Ask the stream to close. Safe from any thread, any number of times.
+        /// @return true for the call that started draining
+        bool request_close()
+        {
+            // Stamped before the state changes, so whoever sees Draining sees the stamp
+            auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+            int64_t unset = 0;
+            requested_at.compare_exchange_strong(unset, now);
+
+            auto expected = current.load();
+            while (expected == StreamState::Starting || expected == StreamState::Running)
+            {
+                if (current.compare_exchange_weak(expected, StreamState::Draining))
+                {
+                    cancel.cancel();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /// @brief Note that the stream's task has exited, whether it was asked to
+        /// or the media ended
+        /// @return How long after the close request it exited, if one was made
+        std::optional<std::chrono::nanoseconds> close()
+        {
+            auto previous = current.exchange(StreamState::Closed);
+            if (previous != StreamState::Draining)
+                return std::nullopt;
+
+            auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+            auto latency = std::chrono::steady_clock::duration {now - requested_at.load()};
+            close_latency = std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count();
+            return std::chrono::nanoseconds {close_latency.load()};
+        }
+
+        /// @brief Close request to exit, once a requested close has completed
+        std::optional<std::chrono::nanoseconds> latency() const
+        {
+            auto latency = close_latency.load();
+            if (latency < 0)
+                return std::nullopt;
+            return std::chrono::nanoseconds {latency};
+        }
+
+    private:
+        std::atomic<StreamState> current {StreamState::Starting};
+        CancellationToken cancel;
+        // steady_clock ticks; 0 until a close is requested
+        std::atomic<int64_t> requested_at {0};
+        std::atomic<int64_t> close_latency {-1};
+    };
+
+    struct CloseStats
+    {
+        uint64_t closes = 0;
+        std::chrono::nanoseconds total_latency {0};
+        std::chrono::nanoseconds max_latency {0};
+
+        std::chrono::nanoseconds mean_latency() const
+        {
+            return closes ? total_latency / (int64_t)closes : std::chrono::nanoseconds {0};
+        }
+    };
+
+    /// @brief Collects close latencies across streams
+    class CloseRecorder
+    {
+    public:
+        void record(std::chrono::nanoseconds latency)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stats.closes++;
+            stats.total_latency += latency;
+            stats.max_latency = std::max(stats.max_latency, latency);
+        }
+
+        CloseStats snapshot() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return stats;
+        }
+
+    private:
+        mutable std::mutex mutex;
+        CloseStats stats;
+    };
+} // namespace lifecycle